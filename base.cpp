@@ -4,23 +4,36 @@
 #endif
 
 #include <wx/clrpicker.h>
+#include <wx/spinctrl.h>
 #include <wx/sysopt.h>
 
 #include <string>
 #include <iostream>
 #include "canvas.h"
 #include "base.h"
+#include "interpolation.h"
+#include "coverage.h"
 
 #define DATA_PATH "data"
 #define DEFAULT_WIDTH 1000
 #define DEFAULT_HEIGHT 500
 #define MAIN_FRAME_WIDTH 1400
 #define MAIN_FRAME_HEIGHT 900
+#define NAVIGATOR_WIDTH 200
+#define NAVIGATOR_HEIGHT 150
+#define HISTORY_HEIGHT 400
 
 #define wxMAC_USE_NATIVE_TOOLBAR 1
 
 BEGIN_EVENT_TABLE( MainFrame, wxFrame )
   EVT_COLOURPICKER_CHANGED(CLR_PICKER, MainApp::OnColourChanged)
+  EVT_SPINCTRL(THICC_SPIN, MainApp::OnThiccnessChanged)
+  EVT_CHECKBOX(SMOOTH_CHECK, MainApp::OnSmoothChanged)
+  EVT_SPINCTRL(SOFT_SPIN, MainApp::OnSoftnessChanged)
+  EVT_SPINCTRL(TOLERANCE_SPIN, MainApp::OnToleranceChanged)
+  EVT_CHECKBOX(EUCLIDEAN_CHECK, MainApp::OnDistanceChanged)
+  EVT_CHECKBOX(REGION_CHECK, MainApp::OnRegionIndexChanged)
+  EVT_LISTBOX(HISTORY_LIST, MainApp::OnHistorySelected)
 END_EVENT_TABLE()
 
 IMPLEMENT_APP(MainApp)
@@ -39,9 +52,45 @@ bool MainApp::OnInit()
   
   canvas = new Canvas( (wxFrame*) frame,
     DEFAULT_WIDTH, DEFAULT_HEIGHT);
+
+  /* Overview panel sits between the toolbar and the canvas */
+  wxBoxSizer* navSizer = new wxBoxSizer(wxVERTICAL);
+  navigator = new Navigator((wxWindow*) frame,
+    NAVIGATOR_WIDTH, NAVIGATOR_HEIGHT);
+  navSizer->Add(navigator, 0, wxALL, 5);
+  canvas->setNavigator(navigator);
+
+  /* Undo history below it, click a step to go back to it */
+  history = new wxListBox((wxWindow*) frame, HISTORY_LIST,
+    wxDefaultPosition, wxSize(NAVIGATOR_WIDTH, HISTORY_HEIGHT));
+  navSizer->Add(history, 0, wxALL, 5);
+  canvas->setHistoryList(history);
+
+  sizer->Add(navSizer, 0);
   sizer->Add(canvas, 1, wxEXPAND);
 
-  canvas->toolType = Pencil;
+  canvas->setTool(Pencil);
+
+  /*
+   * paint [--record <file>] [document]
+   *   --record: record the input stream for replay
+   *   document: open a saved .pdoc, or import a PNG/BMP
+   */
+  int i;
+  bool opened = false;
+  for (i=1; i < argc; i++) {
+    if (wxString(argv[i]) == wxT("--record") && i < argc - 1) {
+      wxString path(argv[++i]);
+      if (!canvas->startRecording(path.mb_str()))
+        std::cerr << "Could not open " << path.mb_str() << " for recording\n";
+    } else {
+      wxString path(argv[i]);
+      if (!(opened = canvas->open(path.mb_str())))
+        std::cerr << "Could not open document " << path.mb_str() << "\n";
+    }
+  }
+  if (!opened)
+    canvas->startAutosave();
 
   frame->SetSizer(sizer);
   frame->SetAutoLayout(true);
@@ -66,6 +115,7 @@ MainFrame::MainFrame(const wxString &title,
   std::string slctRectP = DPATH + "/slct_rect.png";
   std::string slctCircleP = DPATH + "/slct_circle.png";
   std::string lassoP = DPATH + "/lasso.png";
+  std::string wandP = DPATH + "/wand.png";
   std::string thicc1P = DPATH + "/thicc1.png";
   std::string thicc2P = DPATH + "/thicc2.png";
   std::string thicc3P = DPATH + "/thicc3.png";
@@ -80,6 +130,7 @@ MainFrame::MainFrame(const wxString &title,
   wxBitmap slctRect(wxString(slctRectP), wxBITMAP_TYPE_PNG);
   wxBitmap slctCircle(wxString(slctCircleP), wxBITMAP_TYPE_PNG);
   wxBitmap lasso(wxString(lassoP), wxBITMAP_TYPE_PNG);
+  wxBitmap wand(wxString(wandP), wxBITMAP_TYPE_PNG);
   wxBitmap thicc1(wxString(thicc1P), wxBITMAP_TYPE_PNG);
   wxBitmap thicc2(wxString(thicc2P), wxBITMAP_TYPE_PNG);
   wxBitmap thicc3(wxString(thicc3P), wxBITMAP_TYPE_PNG);
@@ -100,6 +151,7 @@ MainFrame::MainFrame(const wxString &title,
   toolBar->AddTool(BTN_Slct_rect, wxT("Select Rectangle"), slctRect);
   toolBar->AddTool(BTN_Slct_circ, wxT("Select Circle"), slctCircle);
   toolBar->AddTool(BTN_Slct_lasso, wxT("Lasso"), lasso);
+  toolBar->AddTool(BTN_Magic_wand, wxT("Magic Wand"), wand);
     
   toolBar->AddSeparator();
 
@@ -108,6 +160,35 @@ MainFrame::MainFrame(const wxString &title,
   toolBar->AddTool(THICC_2, wxT("3 pixels"), thicc2);
   toolBar->AddTool(THICC_3, wxT("5 pixels"), thicc3);
 
+  /* Any other brush size, up to the largest round stamp */
+  thiccness = new wxSpinCtrl(toolBar, THICC_SPIN, wxEmptyString,
+      wxDefaultPosition, wxSize(60, -1), wxSP_ARROW_KEYS,
+      1, BRUSH_MAX_DIAMETER, 3);
+  toolBar->AddControl(thiccness);
+
+  /* Anti-aliasing, and how far the brush edge fades in */
+  smooth = new wxCheckBox(toolBar, SMOOTH_CHECK, wxT("Smooth"));
+  toolBar->AddControl(smooth);
+  softness = new wxSpinCtrl(toolBar, SOFT_SPIN, wxEmptyString,
+      wxDefaultPosition, wxSize(60, -1), wxSP_ARROW_KEYS,
+      0, COVERAGE_SOFTNESS_MAX, 0);
+  softness->Enable(false);
+  toolBar->AddControl(softness);
+
+  /* How far from the clicked colour the fill or wand reaches */
+  tolerance = new wxSpinCtrl(toolBar, TOLERANCE_SPIN, wxEmptyString,
+      wxDefaultPosition, wxSize(60, -1), wxSP_ARROW_KEYS, 0, 255, 0);
+  tolerance->Enable(false);
+  toolBar->AddControl(tolerance);
+  euclidean = new wxCheckBox(toolBar, EUCLIDEAN_CHECK, wxT("Euclidean"));
+  euclidean->Enable(false);
+  toolBar->AddControl(euclidean);
+
+  /* Keep regions indexed between exact fills and wand clicks */
+  regionIndex = new wxCheckBox(toolBar, REGION_CHECK, wxT("Index"));
+  regionIndex->Enable(false);
+  toolBar->AddControl(regionIndex);
+
   /* Colour picker */
   wxColourPickerCtrl* colourPickerCtrl = new wxColourPickerCtrl(
       toolBar, CLR_PICKER, *wxBLACK, wxDefaultPosition, wxSize(40, 40),
@@ -117,6 +198,9 @@ MainFrame::MainFrame(const wxString &title,
   /* Render */
   toolBar->Realize();
 
+  /* Progress of background operations */
+  CreateStatusBar();
+
   /* Set event handlers for each button */
   Connect(BTN_Pencil, wxEVT_COMMAND_TOOL_CLICKED,
       wxCommandEventHandler(MainApp::SetCanvasPencil));
@@ -136,6 +220,8 @@ MainFrame::MainFrame(const wxString &title,
       wxCommandEventHandler(MainApp::SetCanvasSlctCircle));
   Connect(BTN_Slct_lasso, wxEVT_COMMAND_TOOL_CLICKED,
       wxCommandEventHandler(MainApp::SetCanvasLasso));
+  Connect(BTN_Magic_wand, wxEVT_COMMAND_TOOL_CLICKED,
+      wxCommandEventHandler(MainApp::SetCanvasMagicWand));
   Connect(THICC_1, wxEVT_COMMAND_TOOL_CLICKED,
       wxCommandEventHandler(MainApp::SetThiccness1));
   Connect(THICC_2, wxEVT_COMMAND_TOOL_CLICKED,
@@ -146,80 +232,148 @@ MainFrame::MainFrame(const wxString &title,
 
 /*********** Event handlers to handle ONCLICK events for toolbar ************/
 void MainApp::SetCanvasPencil(wxCommandEvent& WXUNUSED(event)) {
-  wxGetApp().canvas->toolType = Pencil;
+  wxGetApp().canvas->setTool(Pencil);
   enableThiccness();
 }
 
 void MainApp::SetCanvasDrawLine(wxCommandEvent& WXUNUSED(event)) {
-  wxGetApp().canvas->toolType = Line;
+  wxGetApp().canvas->setTool(Line);
   enableThiccness();
 }
 
 void MainApp::SetCanvasDrawRect(wxCommandEvent& WXUNUSED(event)) {
-  wxGetApp().canvas->toolType = DrawRect;
+  wxGetApp().canvas->setTool(DrawRect);
   enableThiccness();
 }
 
 void MainApp::SetCanvasDrawCircle(wxCommandEvent& WXUNUSED(event)) {
-  wxGetApp().canvas->toolType = DrawCircle;
+  wxGetApp().canvas->setTool(DrawCircle);
   enableThiccness();
 }
 
 void MainApp::SetCanvasEraser(wxCommandEvent& WXUNUSED(event)) {
-  wxGetApp().canvas->toolType = Eraser;
+  wxGetApp().canvas->setTool(Eraser);
   enableThiccness();
 }
 
 void MainApp::SetCanvasFill(wxCommandEvent& WXUNUSED(event)) {
-  wxGetApp().canvas->toolType = Fill;
+  wxGetApp().canvas->setTool(Fill);
   disableThiccness();
+  wxGetApp().frame->setFillTool(true);
 }
 
 void MainApp::SetCanvasSlctRect(wxCommandEvent& WXUNUSED(event)) {
-  wxGetApp().canvas->toolType = SlctRect;
+  wxGetApp().canvas->setTool(SlctRect);
   disableThiccness();
 }
 
 void MainApp::SetCanvasSlctCircle(wxCommandEvent& WXUNUSED(event)) {
-  wxGetApp().canvas->toolType = SlctCircle;
+  wxGetApp().canvas->setTool(SlctCircle);
   disableThiccness();
 }
 
 void MainApp::SetCanvasLasso(wxCommandEvent& WXUNUSED(event)) {
-  wxGetApp().canvas->toolType = Lasso;
+  wxGetApp().canvas->setTool(Lasso);
+  disableThiccness();
+}
+
+void MainApp::SetCanvasMagicWand(wxCommandEvent& WXUNUSED(event)) {
+  wxGetApp().canvas->setTool(MagicWand);
   disableThiccness();
+  wxGetApp().frame->setFillTool(true);
 }
 
 void MainApp::OnColourChanged(wxColourPickerEvent &evt) {
   wxColour clr = evt.GetColour();
-  wxGetApp().canvas->color = Color(clr.Red(),
+  wxGetApp().canvas->setColor(Color(clr.Red(),
       clr.Green(),
-      clr.Blue());
+      clr.Blue()));
 }
 
 void MainApp::SetThiccness1(wxCommandEvent& WXUNUSED(event)) {
-  wxGetApp().canvas->thiccness = 1;
+  setThiccness(1);
 }
 
 void MainApp::SetThiccness2(wxCommandEvent& WXUNUSED(event)) {
-  wxGetApp().canvas->thiccness = 3;
+  setThiccness(3);
 }
 
 void MainApp::SetThiccness3(wxCommandEvent& WXUNUSED(event)) {
-  wxGetApp().canvas->thiccness = 5;
+  setThiccness(5);
+}
+
+void MainApp::OnThiccnessChanged(wxSpinEvent &evt) {
+  wxGetApp().canvas->setThiccness(evt.GetPosition());
+}
+
+void MainApp::OnSmoothChanged(wxCommandEvent& WXUNUSED(evt)) {
+  setBrush();
+}
+
+void MainApp::OnSoftnessChanged(wxSpinEvent& WXUNUSED(evt)) {
+  setBrush();
+}
+
+void MainApp::OnToleranceChanged(wxSpinEvent& WXUNUSED(evt)) {
+  setTolerance();
+}
+
+void MainApp::OnDistanceChanged(wxCommandEvent& WXUNUSED(evt)) {
+  setTolerance();
+}
+
+void MainApp::OnRegionIndexChanged(wxCommandEvent &evt) {
+  wxGetApp().canvas->setRegionIndex(evt.IsChecked());
+}
+
+void MainApp::OnHistorySelected(wxCommandEvent &evt) {
+  if (evt.GetSelection() >= 0)
+    wxGetApp().canvas->jumpTo(evt.GetSelection());
+}
+
+/* Softness only means something for smooth brushes */
+void MainApp::setBrush() {
+  MainFrame *frame = wxGetApp().frame;
+  bool antialias = frame->smooth->GetValue();
+  frame->softness->Enable(antialias && frame->thiccness->IsEnabled());
+  wxGetApp().canvas->setBrush(antialias, frame->softness->GetValue());
+}
+
+void MainApp::setTolerance() {
+  MainFrame *frame = wxGetApp().frame;
+  wxGetApp().canvas->setTolerance(frame->tolerance->GetValue(),
+      frame->euclidean->GetValue() ? DISTANCE_EUCLIDEAN : DISTANCE_CHANNEL);
+}
+
+/* Presets also move the spin control */
+void MainApp::setThiccness(int thiccness) {
+  wxGetApp().frame->thiccness->SetValue(thiccness);
+  wxGetApp().canvas->setThiccness(thiccness);
 }
 
 void MainApp::enableThiccness() {
   wxGetApp().frame->setThiccnessTool(true);
+  wxGetApp().frame->setFillTool(false);
 }
 
 void MainApp::disableThiccness() {
   wxGetApp().frame->setThiccnessTool(false);
+  wxGetApp().frame->setFillTool(false);
 }
 
 void MainFrame::setThiccnessTool(bool enabled) {
   toolBar->EnableTool(THICC_1, enabled);
   toolBar->EnableTool(THICC_2, enabled);
   toolBar->EnableTool(THICC_3, enabled);
+  thiccness->Enable(enabled);
+  smooth->Enable(enabled);
+  softness->Enable(enabled && smooth->GetValue());
   toolBar->Realize();
 }
+
+/* Tolerance only means something to the fill and the wand */
+void MainFrame::setFillTool(bool enabled) {
+  tolerance->Enable(enabled);
+  euclidean->Enable(enabled);
+  regionIndex->Enable(enabled);
+}
@@ -8,9 +8,16 @@ public:
   MainFrame(const wxString &title, const wxPoint &pos, const wxSize &size);
   wxToolBar *toolBar;
   wxColourPickerCtrl *colorPicker;
+  wxSpinCtrl *thiccness;
+  wxCheckBox *smooth;
+  wxSpinCtrl *softness;
+  wxSpinCtrl *tolerance;
+  wxCheckBox *euclidean;
+  wxCheckBox *regionIndex;
 
   void OnColourChanged(wxColourPickerEvent &evt);
   void setThiccnessTool(bool enabled);
+  void setFillTool(bool enabled);
 
   DECLARE_EVENT_TABLE()
 };
@@ -20,6 +27,8 @@ class MainApp: public wxApp {
     virtual bool OnInit();
     MainFrame *frame;
     Canvas *canvas;
+    Navigator *navigator;
+    wxListBox *history;
 
     void OnColourChanged(wxColourPickerEvent &evt);
 
@@ -32,12 +41,23 @@ class MainApp: public wxApp {
     void SetCanvasSlctRect(wxCommandEvent& WXUNUSED(event));
     void SetCanvasSlctCircle(wxCommandEvent& WXUNUSED(event));
     void SetCanvasLasso(wxCommandEvent& WXUNUSED(event));
+    void SetCanvasMagicWand(wxCommandEvent& WXUNUSED(event));
     void SetThiccness1(wxCommandEvent& WXUNUSED(event));
     void SetThiccness2(wxCommandEvent& WXUNUSED(event));
     void SetThiccness3(wxCommandEvent& WXUNUSED(event));
+    void OnThiccnessChanged(wxSpinEvent &evt);
+    void OnSmoothChanged(wxCommandEvent &evt);
+    void OnSoftnessChanged(wxSpinEvent &evt);
+    void OnToleranceChanged(wxSpinEvent &evt);
+    void OnDistanceChanged(wxCommandEvent &evt);
+    void OnRegionIndexChanged(wxCommandEvent &evt);
+    void OnHistorySelected(wxCommandEvent &evt);
 
     void disableThiccness();
     void enableThiccness();
+    void setThiccness(int thiccness);
+    void setBrush();
+    void setTolerance();
 };
 
 DECLARE_APP(MainApp)
@@ -56,7 +76,15 @@ enum
   CLR_PICKER = wxID_HIGHEST + 10,
   THICC_1 = wxID_HIGHEST + 11,
   THICC_2 = wxID_HIGHEST + 12,
-  THICC_3 = wxID_HIGHEST + 13
+  THICC_3 = wxID_HIGHEST + 13,
+  THICC_SPIN = wxID_HIGHEST + 14,
+  SMOOTH_CHECK = wxID_HIGHEST + 15,
+  SOFT_SPIN = wxID_HIGHEST + 16,
+  HISTORY_LIST = wxID_HIGHEST + 17,
+  TOLERANCE_SPIN = wxID_HIGHEST + 18,
+  EUCLIDEAN_CHECK = wxID_HIGHEST + 19,
+  BTN_Magic_wand = wxID_HIGHEST + 20,
+  REGION_CHECK = wxID_HIGHEST + 21
 };
 
 #endif
@@ -0,0 +1,427 @@
+/*
+ * Headless batch editor.
+ *
+ *   ./build/batch [-j threads] [-f png|bmp] -o outdir script image...
+ *
+ * Loads every image, runs the script on it through the
+ * same Controller/Raster code path the GUI uses and writes
+ * the result to outdir under the same name (or with the
+ * extension given by -f). No window and no display are
+ * needed. Files are spread over -j threads (default: one
+ * per hardware thread), each with its own engine.
+ *
+ * Script, one operation per line, '#' starts a comment.
+ * Coordinates are canvas pixels:
+ *
+ *   color R G B                  thicc N
+ *   line X0 Y0 X1 Y1             rect X0 Y0 X1 Y1
+ *   circle X0 Y0 X1 Y1           fill X Y
+ *   pencil X0 Y0 X1 Y1 [X Y]...  erase X0 Y0 X1 Y1 [X Y]...
+ *   select rect X0 Y0 X1 Y1      select circle X0 Y0 X1 Y1
+ *   select lasso X0 Y0 X1 Y1 X2 Y2 [X Y]...
+ *   select wand X Y
+ *   select all                   move X0 Y0 X1 Y1
+ *   delete                       undo
+ *   resize W H                   smooth SOFTNESS
+ *   hard                         jump STEP
+ *   tolerance N                  euclidean N
+ *   global                       contiguous
+ *   index                        noindex
+ *
+ * 'move' drags the current selection from X0,Y0 to X1,Y1.
+ * 'select wand' picks the region around X,Y the way 'fill'
+ * would fill it, by the current 'tolerance'.
+ * 'smooth' anti-aliases the drawing tools, with edges fading
+ * over SOFTNESS percent (0-100) of the brush radius; 'hard'
+ * goes back to aliased strokes. 'jump' shows the canvas as
+ * it was after the first STEP undoable operations.
+ * 'tolerance' makes 'fill' take in colours no channel of
+ * which is more than N (0-255) off the clicked one, and
+ * 'euclidean' those within N of it in RGBA space; 0, the
+ * default, fills exact matches only. After 'global', 'fill'
+ * replaces the colour everywhere it is (in the selection, if
+ * there is one) rather than where it is connected; back with
+ * 'contiguous'. 'index' keeps a region index between exact
+ * fills and wand selects (see regions.h), 'noindex' drops it.
+ *
+ * Output is one CSV row per file, in completion order:
+ *   file,width,height,load_ms,script_ms,save_ms,status
+ * followed by a summary on stderr. Exit status: 0 if every
+ * file was written, 1 if some failed, 2 on usage or script
+ * errors.
+ */
+#include <wx/gdicmn.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "raster.h"
+#include "controller.h"
+#include "image.h"
+#include "perf.h"
+#include "pool.h"
+
+enum OpType
+{
+  OP_COLOR,
+  OP_THICC,
+  OP_BRUSH,
+  OP_TOLERANCE,
+  OP_CONTIGUOUS,
+  OP_REGION_INDEX,
+  OP_STROKE,
+  OP_SELECT_ALL,
+  OP_DELETE,
+  OP_UNDO,
+  OP_JUMP,
+  OP_RESIZE
+};
+
+/* One script line. Only the fields for 'type' are set. */
+struct Op {
+  OpType type;
+  ToolType tool;               /* OP_STROKE */
+  std::vector<wxPoint> points; /* OP_STROKE, OP_RESIZE */
+  Color color;
+  int thiccness;
+  bool antialias;               /* OP_BRUSH */
+  int softness;
+  size_t step;                  /* OP_JUMP */
+  int tolerance;                /* OP_TOLERANCE */
+  ColorDistance distance;
+  bool contiguous;              /* OP_CONTIGUOUS */
+  bool regionIndex;             /* OP_REGION_INDEX */
+};
+
+struct Batch {
+  std::vector<Op> ops;
+  std::vector<std::string> files;
+  std::string outdir;
+  const char *extension = NULL;
+
+  std::atomic<size_t> next;
+  std::atomic<size_t> failed;
+  std::mutex output;
+
+  Batch() : next(0), failed(0) {}
+};
+
+static bool readInts(std::istringstream &in, std::vector<int> &v) {
+  int n;
+  while (in >> n) {
+    v.push_back(n);
+  }
+  return in.eof();
+}
+
+static std::vector<wxPoint> toPoints(const std::vector<int> &v) {
+  std::vector<wxPoint> points;
+  size_t i;
+  for (i=0; i + 1 < v.size(); i += 2) {
+    points.push_back(wxPoint(v[i], v[i + 1]));
+  }
+  return points;
+}
+
+/* Prints the offending line and returns false on errors */
+static bool parseScript(const char *path, std::vector<Op> &ops) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    fprintf(stderr, "%s: can't open script\n", path);
+    return false;
+  }
+
+  /* 'move' drags with the last selection tool */
+  bool hasSelection = false;
+  ToolType selectTool = SlctRect;
+
+  char buf[4096];
+  int lineNo = 0;
+  bool ok = true;
+  while (ok && fgets(buf, sizeof(buf), file) != NULL) {
+    lineNo++;
+    char *hash = strchr(buf, '#');
+    if (hash != NULL)
+      *hash = '\0';
+
+    std::istringstream in(buf);
+    std::string verb, kind;
+    if (!(in >> verb))
+      continue;
+
+    Op op;
+    std::vector<int> v;
+    if (verb == "select") {
+      in >> kind;
+      if (kind == "all") {
+        op.type = OP_SELECT_ALL;
+        ok = readInts(in, v) && v.empty();
+      } else {
+        op.type = OP_STROKE;
+        op.tool = kind == "rect" ? SlctRect : kind == "circle" ? SlctCircle
+          : kind == "wand" ? MagicWand : Lasso;
+        ok = (kind == "rect" || kind == "circle" || kind == "lasso"
+            || kind == "wand")
+          && readInts(in, v) && v.size() % 2 == 0
+          && (kind == "lasso" ? v.size() >= 6
+              : kind == "wand" ? v.size() == 2 : v.size() == 4);
+        hasSelection = true;
+        selectTool = op.tool;
+      }
+    } else if (verb == "line" || verb == "rect" || verb == "circle") {
+      op.type = OP_STROKE;
+      op.tool = verb == "line" ? Line : verb == "rect" ? DrawRect : DrawCircle;
+      ok = readInts(in, v) && v.size() == 4;
+    } else if (verb == "pencil" || verb == "erase") {
+      op.type = OP_STROKE;
+      op.tool = verb == "pencil" ? Pencil : Eraser;
+      ok = readInts(in, v) && v.size() >= 4 && v.size() % 2 == 0;
+    } else if (verb == "fill") {
+      op.type = OP_STROKE;
+      op.tool = Fill;
+      ok = readInts(in, v) && v.size() == 2;
+    } else if (verb == "move") {
+      op.type = OP_STROKE;
+      op.tool = selectTool;
+      ok = hasSelection && readInts(in, v) && v.size() == 4;
+    } else if (verb == "color") {
+      op.type = OP_COLOR;
+      ok = readInts(in, v) && v.size() == 3;
+      if (ok)
+        op.color = Color(v[0], v[1], v[2]);
+    } else if (verb == "thicc") {
+      op.type = OP_THICC;
+      ok = readInts(in, v) && v.size() == 1 && v[0] > 0;
+      if (ok)
+        op.thiccness = v[0];
+    } else if (verb == "smooth") {
+      op.type = OP_BRUSH;
+      op.antialias = true;
+      ok = readInts(in, v) && v.size() == 1
+        && v[0] >= 0 && v[0] <= COVERAGE_SOFTNESS_MAX;
+      if (ok)
+        op.softness = v[0];
+    } else if (verb == "hard") {
+      op.type = OP_BRUSH;
+      op.antialias = false;
+      op.softness = 0;
+      ok = readInts(in, v) && v.empty();
+    } else if (verb == "tolerance" || verb == "euclidean") {
+      op.type = OP_TOLERANCE;
+      op.distance = verb == "tolerance" ? DISTANCE_CHANNEL : DISTANCE_EUCLIDEAN;
+      ok = readInts(in, v) && v.size() == 1 && v[0] >= 0 && v[0] <= 255;
+      if (ok)
+        op.tolerance = v[0];
+    } else if (verb == "global" || verb == "contiguous") {
+      op.type = OP_CONTIGUOUS;
+      op.contiguous = verb == "contiguous";
+      ok = readInts(in, v) && v.empty();
+    } else if (verb == "index" || verb == "noindex") {
+      op.type = OP_REGION_INDEX;
+      op.regionIndex = verb == "index";
+      ok = readInts(in, v) && v.empty();
+    } else if (verb == "delete" || verb == "undo") {
+      op.type = verb == "delete" ? OP_DELETE : OP_UNDO;
+      ok = readInts(in, v) && v.empty();
+    } else if (verb == "jump") {
+      op.type = OP_JUMP;
+      ok = readInts(in, v) && v.size() == 1 && v[0] >= 0;
+      if (ok)
+        op.step = v[0];
+    } else if (verb == "resize") {
+      op.type = OP_RESIZE;
+      ok = readInts(in, v) && v.size() == 2 && v[0] > 0 && v[1] > 0;
+    } else {
+      ok = false;
+    }
+
+    if (ok) {
+      op.points = toPoints(v);
+      ops.push_back(op);
+    } else {
+      fprintf(stderr, "%s:%d: bad operation: %s", path, lineNo, buf);
+    }
+  }
+  fclose(file);
+  return ok;
+}
+
+static void press(Controller &controller, int key, bool ctrl) {
+  controller.keyDown(key, ctrl);
+  controller.keyUp(key);
+}
+
+/* The input the GUI would see for each operation */
+static void runScript(const std::vector<Op> &ops, Controller &controller,
+    Raster &raster) {
+  size_t i, k;
+  for (i=0; i < ops.size(); i++) {
+    const Op &op = ops[i];
+    switch (op.type) {
+      case OP_COLOR:
+        controller.setColor(op.color);
+        break;
+      case OP_THICC:
+        controller.setThiccness(op.thiccness);
+        break;
+      case OP_BRUSH:
+        controller.setBrush(op.antialias, op.softness);
+        break;
+      case OP_TOLERANCE:
+        controller.setTolerance(op.tolerance, op.distance);
+        break;
+      case OP_CONTIGUOUS:
+        controller.setContiguous(op.contiguous);
+        break;
+      case OP_REGION_INDEX:
+        controller.setRegionIndex(op.regionIndex);
+        break;
+      case OP_STROKE:
+        if (controller.getTool() != op.tool)
+          controller.setTool(op.tool);
+        controller.mouseDown(op.points[0]);
+        for (k=1; k < op.points.size(); k++) {
+          controller.mouseMoved(op.points[k]);
+        }
+        controller.mouseReleased(op.points.back());
+        break;
+      case OP_SELECT_ALL:
+        press(controller, KEY_A, true);
+        break;
+      case OP_DELETE:
+        press(controller, KEY_DEL, false);
+        break;
+      case OP_UNDO:
+        press(controller, KEY_Z, true);
+        break;
+      case OP_JUMP:
+        controller.jumpTo(op.step);
+        break;
+      case OP_RESIZE: {
+        /* Drag the resize handle in the corner */
+        wxPoint corner(raster.getWidth(), raster.getHeight());
+        controller.mouseDown(corner);
+        controller.mouseMoved(op.points[0]);
+        controller.mouseReleased(op.points[0]);
+        break;
+      }
+    }
+  }
+}
+
+static std::string outputPath(const Batch &batch, const std::string &input) {
+  size_t slash = input.rfind('/');
+  std::string name = slash == std::string::npos ? input : input.substr(slash + 1);
+  if (batch.extension != NULL) {
+    size_t dot = name.rfind('.');
+    if (dot != std::string::npos)
+      name.erase(dot);
+    name = name + "." + batch.extension;
+  }
+  return batch.outdir + "/" + name;
+}
+
+static void processFile(Batch &batch, const std::string &input) {
+  Raster raster(1, 1);
+  const char *status = "ok";
+
+  PerfTimer load;
+  ImageReader reader(input.c_str());
+  bool ok = reader.open() && reader.load(raster);
+  uint64_t loadNs = load.elapsed(), scriptNs = 0, saveNs = 0;
+  if (!ok)
+    status = "unreadable";
+
+  if (ok) {
+    PerfTimer script;
+    MemoryClipboard clipboard;
+    Controller controller(&raster, &clipboard);
+    runScript(batch.ops, controller, raster);
+    scriptNs = script.elapsed();
+
+    PerfTimer save;
+    ImageWriter writer(outputPath(batch, input).c_str());
+    ok = writer.save(raster);
+    saveNs = save.elapsed();
+    if (!ok)
+      status = "unwritable";
+  }
+
+  if (!ok)
+    batch.failed++;
+  std::lock_guard<std::mutex> guard(batch.output);
+  printf("%s,%u,%u,%.2f,%.2f,%.2f,%s\n", input.c_str(),
+      raster.getWidth(), raster.getHeight(),
+      loadNs / 1e6, scriptNs / 1e6, saveNs / 1e6, status);
+  fflush(stdout);
+}
+
+static void work(Batch *batch) {
+  size_t i;
+  while ((i = batch->next++) < batch->files.size()) {
+    processFile(*batch, batch->files[i]);
+  }
+}
+
+static int usage(const char *name) {
+  fprintf(stderr,
+      "usage: %s [-j threads] [-f png|bmp] -o outdir script image...\n", name);
+  return 2;
+}
+
+int main(int argc, char **argv) {
+  Batch batch;
+  int threads = ThreadPool::defaultSize();
+  int i = 1;
+  for (; i < argc && argv[i][0] == '-'; i++) {
+    if (i + 1 >= argc)
+      return usage(argv[0]);
+    if (strcmp(argv[i], "-j") == 0) {
+      threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-o") == 0) {
+      batch.outdir = argv[++i];
+    } else if (strcmp(argv[i], "-f") == 0) {
+      batch.extension = argv[++i];
+      if (strcmp(batch.extension, "png") != 0
+          && strcmp(batch.extension, "bmp") != 0)
+        return usage(argv[0]);
+    } else {
+      return usage(argv[0]);
+    }
+  }
+  if (batch.outdir.empty() || threads < 1 || argc - i < 2)
+    return usage(argv[0]);
+
+  if (!parseScript(argv[i++], batch.ops))
+    return 2;
+  for (; i < argc; i++) {
+    batch.files.push_back(argv[i]);
+  }
+
+  printf("file,width,height,load_ms,script_ms,save_ms,status\n");
+  PerfTimer total;
+  threads = std::min((size_t)threads, batch.files.size());
+  std::vector<std::thread> workers;
+  int t;
+  for (t=1; t < threads; t++) {
+    workers.push_back(std::thread(work, &batch));
+  }
+  work(&batch);
+  for (t=0; t < (int)workers.size(); t++) {
+    workers[t].join();
+  }
+
+  double seconds = total.elapsed() / 1e9;
+  fprintf(stderr, "%zu files in %.2f s on %d threads (%.0f files/min), "
+      "%zu failed\n", batch.files.size(), seconds, threads,
+      seconds > 0 ? batch.files.size() * 60 / seconds : 0.0,
+      (size_t)batch.failed);
+  return batch.failed > 0 ? 1 : 0;
+}
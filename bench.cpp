@@ -0,0 +1,1051 @@
+/*
+ * Microbenchmarks for the raster hot paths.
+ *
+ * Runs headless against Raster (no window, no display)
+ * and sweeps canvas size and line thickness. Output is
+ * one CSV row per case on stdout so that runs from two
+ * builds can be diffed or joined directly:
+ *
+ *   ./build/bench > before.csv
+ *   ./build/bench lerp > lerp.csv       (only cases containing "lerp")
+ *   ./build/bench _t > threads.csv      (pool scaling only)
+ *
+ * Columns:
+ *   bench,width,height,thicc,iters,ns_per_op,
+ *   pixels_per_op,pixels_per_s,bytes_per_op,allocs_per_op
+ *
+ * 'thicc' is 0 for operations that don't take a thickness.
+ * Cases suffixed _t<N> run the raster on an N-thread pool;
+ * each first checks that its output matches the serial one.
+ * Allocations come from the malloc hook in perf.cpp, so both
+ * operator new and the engine's own malloc calls show up.
+ *
+ * The motion_* cases are steady-state drags of the shape
+ * tools, whose allocs_per_op should be 0. motion_pencil and
+ * motion_pencil_worker take a frame of Pencil motion through
+ * Controller, inline and on a Worker, and fail unless it is.
+ *
+ * history_jump moves between random steps of a
+ * HISTORY_STEPS-entry history, history_jump_back goes from
+ * the newest step to a random one, and history_jump_packed
+ * jumps with all but the recent history packed.
+ *
+ * The *_lineart cases fill and select the background of a
+ * grid of broken lines, and their _indexed twins do it with
+ * the region index on, its tiles already built.
+ *
+ * png_save_wximage is the single-threaded wxImage::SaveFile
+ * baseline for the png_save_t<N> cases, and stroke_hard the
+ * aliased baseline for the anti-aliased stroke_soft<N>.
+ */
+#include <wx/gdicmn.h>
+#include <wx/image.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <zlib.h>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "raster.h"
+#include "controller.h"
+#include "worker.h"
+#include "interpolation.h"
+#include "perf.h"
+#include "pool.h"
+#include "document.h"
+#include "journal.h"
+#include "image.h"
+#include "format.h"
+
+/* Minimum time spent per case, and iteration bounds */
+#define MIN_TIME_NS 200000000LL
+#define MIN_ITERS 3
+#define MAX_ITERS 100000
+
+/* Scratch document, removed afterwards */
+#define BENCH_DOCUMENT "bench.pdoc"
+#define BENCH_PNG "bench.png"
+#define BENCH_BMP "bench.bmp"
+
+static const unsigned int SIZES[] = { 256, 1024, 2048 };
+static const int THICCNESS[] = { 1, 3, 5, 15, 64, 256 };
+static const int THREADS[] = { 1, 2, 4, 8 };
+
+/* Frames of a motion_pencil stroke, and samples a frame */
+#define PENCIL_FRAMES 32
+#define PENCIL_SAMPLES 4
+
+/* Strokes in the history the jump cases move through */
+#define HISTORY_STEPS 1000
+
+static const char *filter = NULL;
+
+/*
+ * Times 'op' until MIN_TIME_NS has elapsed. 'op' returns the
+ * number of pixels it touched. 'reset' runs between iterations
+ * and is not timed or counted. Returns the allocations per
+ * op, 0 when filtered out.
+ */
+static double run(const std::string &name, unsigned int w, unsigned int h,
+    int thicc, std::function<size_t()> op,
+    std::function<void()> reset = std::function<void()>())
+{
+  if (filter != NULL && name.find(filter) == std::string::npos)
+    return 0;
+
+  long long elapsed = 0;
+  size_t pixels = 0, bytes = 0, allocs = 0;
+  int iters = 0;
+  while (iters < MAX_ITERS &&
+      (iters < MIN_ITERS || elapsed < MIN_TIME_NS)) {
+    if (reset)
+      reset();
+
+    uint64_t b0 = perfAllocBytes(), a0 = perfAllocCount();
+    auto t0 = std::chrono::steady_clock::now();
+    pixels += op();
+    auto t1 = std::chrono::steady_clock::now();
+    bytes += perfAllocBytes() - b0;
+    allocs += perfAllocCount() - a0;
+
+    elapsed += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        t1 - t0).count();
+    iters++;
+  }
+
+  double nsPerOp = (double)elapsed / iters;
+  double pixelsPerOp = (double)pixels / iters;
+  printf("%s,%u,%u,%d,%d,%.1f,%.1f,%.0f,%.1f,%.2f\n",
+      name.c_str(), w, h, thicc, iters,
+      nsPerOp, pixelsPerOp,
+      elapsed > 0 ? pixels * 1e9 / elapsed : 0.0,
+      (double)bytes / iters, (double)allocs / iters);
+  fflush(stdout);
+  return (double)allocs / iters;
+}
+
+/*
+ * Has access to Raster's private kernels (see the friend
+ * declaration in raster.h).
+ */
+class RasterBench {
+  public:
+    static void lerp(unsigned int w, unsigned int h, int thicc);
+    static void shapes(unsigned int w, unsigned int h, int thicc);
+    static void strokes(unsigned int w, unsigned int h, int thicc);
+    static void motion(unsigned int w, unsigned int h, int thicc);
+    static void pencil(unsigned int w, unsigned int h, int thicc,
+        bool threaded);
+    static void fill(unsigned int w, unsigned int h);
+    static void selectionArea(unsigned int w, unsigned int h);
+    static void regions(unsigned int w, unsigned int h);
+    static void move(unsigned int w, unsigned int h);
+    static void revert(unsigned int w, unsigned int h);
+    static void history(unsigned int w, unsigned int h);
+    static void clipboard(unsigned int w, unsigned int h);
+    static void threads(unsigned int w, unsigned int h, int thicc);
+    static void document(unsigned int w, unsigned int h);
+    static void journal(unsigned int w, unsigned int h, int thicc);
+    static void image(unsigned int w, unsigned int h);
+};
+
+void RasterBench::lerp(unsigned int w, unsigned int h, int thicc) {
+  wxPoint p0(0, 0), p1(w - 1, h / 3);
+  run("lerp", w, h, thicc, [&]() {
+    return ::lerp(p0, p1, thicc).size();
+  });
+}
+
+void RasterBench::shapes(unsigned int w, unsigned int h, int thicc) {
+  Raster r(w, h);
+  r.startPos = wxPoint(w / 8, h / 8);
+  wxPoint end(w - w / 8, h - h / 8);
+
+  run("drawRectangle", w, h, thicc, [&]() {
+    Transaction txn;
+    r.isNewTxn = true;
+    return r.drawRectangle(end, txn, thicc).size();
+  });
+
+  run("drawCircle", w, h, thicc, [&]() {
+    Transaction txn;
+    r.isNewTxn = true;
+    return r.drawCircle(end, txn, thicc).size();
+  });
+}
+
+/*
+ * A whole pencil stroke, press to release, hard and then
+ * anti-aliased at a few softnesses. Undone between runs so
+ * that every stroke lands on a white canvas.
+ */
+void RasterBench::strokes(unsigned int w, unsigned int h, int thicc) {
+  static const int SOFTNESS[] = { 0, 50, 100 };
+  Raster r(w, h);
+  r.toolType = Pencil;
+  r.thiccness = thicc;
+
+  auto stroke = [&]() {
+    uint64_t written = r.pixelsWritten;
+    int i;
+    r.mouseDown(wxPoint(w / 8, h / 8));
+    for (i=1; i <= 16; i++) {
+      r.mouseMoved(wxPoint(w / 8 + (w * 3 / 4) * i / 16,
+            (i & 1) ? h - h / 8 : h / 8));
+    }
+    r.mouseReleased(wxPoint(w - w / 8, h / 8));
+    return (size_t)(r.pixelsWritten - written);
+  };
+  auto undo = [&]() {
+    if (!r.transactions.empty())
+      r.undo();
+  };
+
+  r.antialias = false;
+  run("stroke_hard", w, h, thicc, stroke, undo);
+
+  size_t s;
+  for (s=0; s < sizeof(SOFTNESS)/sizeof(SOFTNESS[0]); s++) {
+    char name[32];
+    snprintf(name, sizeof(name), "stroke_soft%d", SOFTNESS[s]);
+    r.antialias = true;
+    r.softness = SOFTNESS[s];
+    run(name, w, h, thicc, stroke, undo);
+  }
+}
+
+/*
+ * One motion event in the middle of a drag, hard and
+ * anti-aliased, once the stroke buffers have grown: the
+ * shape flips between two sizes so every event redraws it.
+ */
+void RasterBench::motion(unsigned int w, unsigned int h, int thicc) {
+  static const ToolType TOOLS[] = { Line, DrawRect, DrawCircle };
+  static const char *NAMES[] = { "line", "rect", "circle" };
+  wxPoint ends[2] = { wxPoint(w - w / 8, h - h / 8), wxPoint(w - w / 4, h / 2) };
+
+  size_t t;
+  int aa;
+  for (aa=0; aa < 2; aa++) {
+    for (t=0; t < sizeof(TOOLS)/sizeof(TOOLS[0]); t++) {
+      char name[32];
+      snprintf(name, sizeof(name), "motion_%s%s", NAMES[t], aa ? "_aa" : "");
+
+      Raster r(w, h);
+      r.toolType = TOOLS[t];
+      r.thiccness = thicc;
+      r.antialias = aa != 0;
+      r.mouseDown(wxPoint(w / 8, h / 8));
+      r.mouseMoved(ends[0]);
+      r.mouseMoved(ends[1]);
+
+      int k = 0;
+      run(name, w, h, thicc, [&]() {
+        uint64_t written = r.pixelsWritten;
+        r.mouseMoved(ends[k++ & 1]);
+        return (size_t)(r.pixelsWritten - written);
+      });
+      r.mouseReleased(ends[k & 1]);
+    }
+  }
+
+  pencil(w, h, thicc, false);
+  pencil(w, h, thicc, true);
+}
+
+/*
+ * A frame of Pencil motion the way Canvas delivers it:
+ * samples queued on Controller, then one flush, waiting for
+ * the worker if there is one and taking its frame like the
+ * UI does. Strokes of PENCIL_FRAMES frames are undone and
+ * started over between frames; the first one, before the
+ * timing, grows the buffers every later one reuses.
+ */
+void RasterBench::pencil(unsigned int w, unsigned int h, int thicc,
+    bool threaded) {
+  const char *name = threaded ? "motion_pencil_worker" : "motion_pencil";
+  if (filter != NULL && strstr(name, filter) == NULL)
+    return;
+
+  Raster r(w, h);
+  MemoryClipboard clipboard;
+  Controller controller(&r, &clipboard);
+  Worker *worker = NULL;
+  if (threaded) {
+    worker = new Worker(&r, Worker::Presented(), Worker::Done());
+    controller.setWorker(worker);
+  }
+  controller.setTool(Pencil);
+  controller.setThiccness(thicc);
+
+  int frame = 0;
+  auto wait = [&]() {
+    if (worker == NULL)
+      return;
+    worker->sync();
+    Frame &front = worker->lockFront();
+    front.isDirty = false;
+    front.timings.clear();
+    worker->unlockFront();
+  };
+  auto start = [&]() {
+    frame = 0;
+    controller.mouseDown(wxPoint(w / 8, h / 8));
+    wait();
+  };
+  auto step = [&]() {
+    uint64_t written = r.pixelsWritten;
+    int s;
+    for (s=0; s < PENCIL_SAMPLES; s++) {
+      int i = frame * PENCIL_SAMPLES + s;
+      controller.queueMotion(wxPoint(w / 8 + (i * 37) % (w - w / 4),
+          h / 8 + (i * 53) % (h - h / 4)));
+    }
+    controller.flushMotion();
+    frame++;
+    wait();
+    return (size_t)(r.pixelsWritten - written);
+  };
+  auto restart = [&]() {
+    if (frame < PENCIL_FRAMES)
+      return;
+    controller.mouseReleased(wxPoint(w / 8, h / 8));
+    controller.keyDown(KEY_Z, true);
+    controller.keyUp(KEY_Z);
+    start();
+  };
+
+  start();
+  while (frame < PENCIL_FRAMES) {
+    step();
+  }
+  restart();
+  double allocs = run(name, w, h, thicc, step, restart);
+  controller.mouseReleased(wxPoint(w / 8, h / 8));
+  wait();
+  delete worker;
+
+  if (allocs != 0) {
+    fprintf(stderr, "%s: %.2f allocations per motion event (%ux%u)\n",
+        name, allocs, w, h);
+    exit(1);
+  }
+}
+
+void RasterBench::fill(unsigned int w, unsigned int h) {
+  Raster r(w, h);
+  Color colors[2] = { Color(10, 20, 30), WHITE };
+  int k = 0;
+
+  /* Each op floods the whole (uniform) canvas */
+  run("fill", w, h, 0, [&]() {
+    Transaction txn;
+    r.fill(wxPoint(w / 2, h / 2), colors[k++ & 1], txn);
+    return txn.pixels.size();
+  });
+
+  /* The same floods by colour distance */
+  r.tolerance = 16;
+  r.distance = DISTANCE_CHANNEL;
+  run("fill_tolerance", w, h, 0, [&]() {
+    Transaction txn;
+    r.fill(wxPoint(w / 2, h / 2), colors[k++ & 1], txn);
+    return txn.pixels.size();
+  });
+  r.distance = DISTANCE_EUCLIDEAN;
+  run("fill_euclidean", w, h, 0, [&]() {
+    Transaction txn;
+    r.fill(wxPoint(w / 2, h / 2), colors[k++ & 1], txn);
+    return txn.pixels.size();
+  });
+
+  /* Non-contiguous: the whole canvas again, kept as a mask */
+  r.tolerance = 0;
+  run("replace", w, h, 0, [&]() {
+    Transaction txn;
+    r.replaceColor(wxPoint(w / 2, h / 2), colors[k++ & 1], txn);
+    return txn.changes.count;
+  });
+  r.tolerance = 16;
+  r.distance = DISTANCE_CHANNEL;
+  run("replace_tolerance", w, h, 0, [&]() {
+    Transaction txn;
+    r.replaceColor(wxPoint(w / 2, h / 2), colors[k++ & 1], txn);
+    return txn.changes.count;
+  });
+  Transaction replaced;
+  r.replaceColor(wxPoint(w / 2, h / 2), colors[k++ & 1], replaced);
+  run("replace_revert", w, h, 0, [&]() {
+    r.revertChanges(replaced.changes);
+    return replaced.changes.count;
+  });
+
+  /* The same replace in row bands on the pool */
+  size_t t;
+  for (t=0; t < sizeof(THREADS)/sizeof(THREADS[0]); t++) {
+    char name[32];
+    snprintf(name, sizeof(name), "replace_t%d", THREADS[t]);
+    if (filter != NULL && strstr(name, filter) == NULL)
+      continue;
+
+    ThreadPool pool(THREADS[t]);
+    Raster pooled(w, h);
+    pooled.setPool(&pool);
+    pooled.tolerance = 16;
+    run(name, w, h, 0, [&]() {
+      Transaction txn;
+      pooled.replaceColor(wxPoint(w / 2, h / 2), colors[k++ & 1], txn);
+      return txn.changes.count;
+    });
+  }
+}
+
+void RasterBench::selectionArea(unsigned int w, unsigned int h) {
+  Raster r(w, h);
+  wxPoint p0(w / 4, h / 4), p1(w - w / 4, h - h / 4);
+  std::vector<Pixel> area;
+
+  RectangleSelection rect(p0, p1);
+  run("getSelectionArea_rect", w, h, 0, [&]() {
+    area.clear();
+    r.getSelectionArea(area, &rect);
+    return area.size();
+  });
+
+  CircleSelection circle(p0, p1);
+  run("getSelectionArea_circle", w, h, 0, [&]() {
+    area.clear();
+    r.getSelectionArea(area, &circle);
+    return area.size();
+  });
+
+  /* Lasso border: a closed 64-gon inscribed in the rectangle */
+  std::vector<wxPoint> border;
+  {
+    double cx = (p0.x + p1.x) / 2.0, cy = (p0.y + p1.y) / 2.0;
+    double rx = (p1.x - p0.x) / 2.0, ry = (p1.y - p0.y) / 2.0;
+    int i;
+    for (i=0; i < 64; i++) {
+      double t = 2*M_PI*i / 64;
+      border.push_back(wxPoint((int)(cx + rx*cos(t)), (int)(cy + ry*sin(t))));
+    }
+  }
+  LassoSelection lasso(p0, p1, border);
+  run("getSelectionArea_lasso", w, h, 0, [&]() {
+    area.clear();
+    r.getSelectionArea(area, &lasso);
+    return area.size();
+  });
+
+  /* The magic wand on the uniform canvas picks all of it */
+  run("select_wand", w, h, 0, [&]() {
+    if (!r.selectRegion(wxPoint(w / 2, h / 2)))
+      return (size_t)0;
+    return (size_t)w * h;
+  }, [&]() {
+    r.clearSelection();
+  });
+}
+
+/* Lines every 32 pixels both ways, a gap in each every
+ * 64, so the background is one winding region */
+static void lineArt(Raster &r, unsigned int w, unsigned int h) {
+  uint32_t *buffer = (uint32_t *)r.getBuffer();
+  size_t stride = r.getStride();
+  uint32_t ink = Color(0, 0, 0).value();
+  unsigned int x, y;
+  for (y=0; y < h; y++) {
+    for (x=0; x < w; x++) {
+      if ((y % 32 == 16 && x % 64 >= 4) || (x % 32 == 16 && y % 64 >= 4))
+        buffer[(size_t)y * stride + x] = ink;
+    }
+  }
+}
+
+void RasterBench::regions(unsigned int w, unsigned int h) {
+  Color colors[2] = { Color(10, 20, 30), WHITE };
+  wxPoint p(w / 2, h / 2 + 4);
+  int k = 0;
+
+  /* Build every tile of the uniform canvas */
+  Raster blank(w, h);
+  blank.setRegionIndex(true);
+  run("region_index_build", w, h, 0, [&]() {
+    blank.regions.search(blank.Buffer, blank.stride, p.x, p.y);
+    return (size_t)w * h;
+  }, [&]() {
+    blank.regions.release();
+  });
+
+  int indexed;
+  for (indexed=0; indexed < 2; indexed++) {
+    const char *suffix = indexed ? "_indexed" : "";
+    Raster r(w, h);
+    lineArt(r, w, h);
+    r.setRegionIndex(indexed);
+    k = 0;
+
+    run(std::string("fill_lineart") + suffix, w, h, 0, [&]() {
+      Transaction txn;
+      r.fill(p, colors[k++ & 1], txn);
+      return txn.pixels.size() + txn.changes.count;
+    });
+
+    run(std::string("select_wand_lineart") + suffix, w, h, 0, [&]() {
+      if (!r.selectRegion(p))
+        return (size_t)0;
+      return r.maskSelection()->count;
+    }, [&]() {
+      r.clearSelection();
+    });
+    r.clearSelection();
+  }
+}
+
+/*
+ * Drag an existing rectangle selection back and forth,
+ * exactly like handleSelectionMove() does.
+ */
+void RasterBench::move(unsigned int w, unsigned int h) {
+  Raster r(w, h);
+  r.toolType = SlctRect;
+  r.mouseDown(wxPoint(w / 4, h / 4));
+  r.mouseMoved(wxPoint(w / 2, h / 2));
+  r.mouseReleased(wxPoint(w / 2, h / 2));
+
+  r.isNewTxn = true;
+  int k = 0;
+  run("move", w, h, 0, [&]() {
+    Transaction txn;
+    int d = (k++ & 1) ? 8 : 16;
+    r.move(r.selectionArea, d, d, txn);
+    r.currentTxn = txn;
+    r.isNewTxn = false;
+    return r.selectionArea.size();
+  });
+}
+
+void RasterBench::revert(unsigned int w, unsigned int h) {
+  Raster r(w, h);
+  r.toolType = Pencil;
+  r.thiccness = 5;
+  r.mouseDown(wxPoint(0, 0));
+  int i;
+  for (i=1; i <= 32; i++) {
+    r.mouseMoved(wxPoint((w - 1) * i / 32, (h - 1) * (i & 1)));
+  }
+  Transaction txn = r.currentTxn;
+
+  run("revertTransaction", w, h, 0, [&]() {
+    r.revertTransaction(txn);
+    return txn.pixels.size();
+  });
+}
+
+/*
+ * HISTORY_STEPS thick lines in changing colours, all over
+ * the canvas, then jumps between them. The targets come
+ * from a fixed LCG so that runs compare.
+ */
+void RasterBench::history(unsigned int w, unsigned int h) {
+  Raster r(w, h);
+  r.toolType = Line;
+  r.thiccness = 15;
+
+  uint32_t seed = 1;
+  auto next = [&](uint32_t n) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 8) % n;
+  };
+  int i;
+  for (i=0; i < HISTORY_STEPS; i++) {
+    r.color = Color(next(256), next(256), next(256));
+    r.mouseDown(wxPoint(next(w), next(h)));
+    r.mouseMoved(wxPoint(next(w), next(h)));
+    r.mouseReleased(wxPoint(next(w), next(h)));
+  }
+
+  run("history_jump", w, h, 0, [&]() {
+    uint64_t written = r.pixelsWritten;
+    r.jumpTo(next(HISTORY_STEPS + 1));
+    return (size_t)(r.pixelsWritten - written);
+  });
+
+  run("history_jump_back", w, h, 0, [&]() {
+    uint64_t written = r.pixelsWritten;
+    r.jumpTo(next(HISTORY_STEPS));
+    return (size_t)(r.pixelsWritten - written);
+  }, [&]() {
+    r.jumpTo(HISTORY_STEPS);
+  });
+
+  /* Everything cold again before each jump */
+  run("history_jump_packed", w, h, 0, [&]() {
+    uint64_t written = r.pixelsWritten;
+    r.jumpTo(next(HISTORY_STEPS + 1));
+    return (size_t)(r.pixelsWritten - written);
+  }, [&]() {
+    while (r.packHistory())
+      ;
+  });
+}
+
+void RasterBench::clipboard(unsigned int w, unsigned int h) {
+  Raster r(w, h);
+
+  /* Half-canvas opaque RGB image, no alpha */
+  unsigned int M = w / 2, N = h / 2;
+  std::vector<unsigned char> img(3 * M * N);
+  size_t i;
+  for (i=0; i < img.size(); i++) {
+    img[i] = (unsigned char)(i * 7);
+  }
+
+  run("paste", w, h, 0, [&]() {
+    r.paste(&img[0], NULL, M, N);
+    return (size_t)M * N;
+  }, [&]() {
+    std::vector<Transaction> none;
+    r.setHistory(none);
+  });
+
+  run("copy", w, h, 0, [&]() {
+    unsigned char *data, *alpha;
+    int cw, ch;
+    if (!r.copy(&data, &alpha, cw, ch))
+      return (size_t)0;
+    free(data);
+    free(alpha);
+    return r.selectionArea.size();
+  });
+}
+
+/*
+ * A thick line dragged corner to corner: every move reverts
+ * the previous line, saves what is under the new one and
+ * draws it, which are the three passes the pool splits up.
+ */
+static void drag(Raster &r, int k) {
+  unsigned int w = r.getWidth(), h = r.getHeight();
+  r.mouseMoved((k & 1) ? wxPoint(w - 1, h - 1) : wxPoint(w - 1, 0));
+}
+
+static void startDrag(Raster &r, int thicc) {
+  r.toolType = Line;
+  r.thiccness = thicc;
+  r.mouseDown(wxPoint(0, 0));
+}
+
+void RasterBench::threads(unsigned int w, unsigned int h, int thicc) {
+  size_t t;
+  for (t=0; t < sizeof(THREADS)/sizeof(THREADS[0]); t++) {
+    char name[32];
+    snprintf(name, sizeof(name), "line_t%d", THREADS[t]);
+    if (filter != NULL && strstr(name, filter) == NULL)
+      continue;
+
+    ThreadPool pool(THREADS[t]);
+    Raster serial(w, h), r(w, h);
+    r.setPool(&pool);
+
+    /* Same strokes on both, they must not differ in a bit */
+    startDrag(serial, thicc);
+    startDrag(r, thicc);
+    int k;
+    for (k=0; k < 3; k++) {
+      drag(serial, k);
+      drag(r, k);
+    }
+    wxRect d0, d1;
+    bool dirty0 = serial.takeDirty(d0), dirty1 = r.takeDirty(d1);
+    const std::vector<Pixel> &t0 = serial.currentTxn.pixels;
+    const std::vector<Pixel> &t1 = r.currentTxn.pixels;
+    bool same = serial.hash() == r.hash() &&
+        serial.getPixelsWritten() == r.getPixelsWritten() &&
+        dirty0 == dirty1 && d0 == d1 && t0.size() == t1.size();
+    size_t i;
+    for (i=0; same && i < t0.size(); i++) {
+      same = t0[i].x == t1[i].x && t0[i].y == t1[i].y &&
+        memcmp(&t0[i].color, &t1[i].color, sizeof(Color)) == 0;
+    }
+    if (!same) {
+      fprintf(stderr, "%s: output differs from serial (%ux%u, thicc %d)\n",
+          name, w, h, thicc);
+      exit(1);
+    }
+
+    run(name, w, h, thicc, [&]() {
+      drag(r, k++);
+      return r.currentTxn.pixels.size();
+    });
+  }
+}
+
+/*
+ * Open maps the pixels instead of reading them, so it
+ * should not grow with the canvas. Saves after a one-tile
+ * stroke only write that tile (plus the history).
+ */
+void RasterBench::document(unsigned int w, unsigned int h) {
+  Raster r(w, h);
+  r.toolType = Pencil;
+  r.thiccness = 3;
+  {
+    Document doc(BENCH_DOCUMENT, false);
+    if (!doc.save(r)) {
+      fprintf(stderr, "document: could not write %s\n", BENCH_DOCUMENT);
+      return;
+    }
+
+    int k = 0;
+    run("document_save_tile", w, h, 0, [&]() {
+      doc.save(r);
+      return (size_t)w * TILE_ROWS * doc.getTilesWritten();
+    }, [&]() {
+      wxPoint p(k++ % (w - 8), h / 2);
+      r.mouseDown(p);
+      r.mouseMoved(p + wxPoint(8, 0));
+      r.mouseReleased(p + wxPoint(8, 0));
+    });
+  }
+
+  run("document_open", w, h, 0, [&]() {
+    Document doc(BENCH_DOCUMENT, false);
+    if (!doc.open())
+      return (size_t)0;
+    doc.load(r);
+    return (size_t)w * h;
+  });
+  unlink(BENCH_DOCUMENT);
+}
+
+/*
+ * A committed line stroke with and without autosave; the
+ * difference is the journal's cost on the raster thread
+ * (encoding, the writes and fsyncs run on their own).
+ * Then checks that selections moved, dropped and undone
+ * replay to the same canvas.
+ */
+void RasterBench::journal(unsigned int w, unsigned int h, int thicc) {
+  {
+    Journal journal;
+    journal.checkpoint(BENCH_DOCUMENT, w, h);
+
+    int j;
+    for (j=0; j < 2; j++) {
+      Raster r(w, h);
+      r.toolType = Line;
+      r.thiccness = thicc;
+      if (j == 1)
+        r.setJournal(&journal);
+
+      int k = 0;
+      run(j == 0 ? "stroke" : "stroke_journaled", w, h, thicc, [&]() {
+        wxPoint p0(0, (k * 7) % h), p1(w - 1, (k * 13) % h);
+        k++;
+        r.mouseDown(p0);
+        r.mouseMoved(p1);
+        r.mouseReleased(p1);
+        return r.currentTxn.pixels.size();
+      });
+    }
+  }
+
+  /* Select, move, deselect and undo, then select and drop
+   * again; recovery has to come back to the live canvas,
+   * without any selection border */
+  uint64_t live;
+  {
+    Journal journal;
+    journal.checkpoint(BENCH_DOCUMENT, w, h);
+    Raster r(w, h);
+    r.setJournal(&journal);
+    r.toolType = Line;
+    r.thiccness = thicc;
+    r.mouseDown(wxPoint(0, h / 4));
+    r.mouseMoved(wxPoint(w - 1, h / 2));
+    r.mouseReleased(wxPoint(w - 1, h / 2));
+
+    r.toolType = SlctRect;
+    r.mouseDown(wxPoint(w / 8, h / 8));
+    r.mouseMoved(wxPoint(w / 2, h / 2));
+    r.mouseReleased(wxPoint(w / 2, h / 2));
+    r.mouseDown(wxPoint(w / 4, h / 4));
+    r.mouseMoved(wxPoint(w / 3, h / 3));
+    r.mouseReleased(wxPoint(w / 3, h / 3));
+    r.mouseDown(wxPoint(w - 2, h - 2));
+    r.mouseReleased(wxPoint(w - 2, h - 2));
+    r.undo();
+
+    r.mouseDown(wxPoint(w / 8, h / 8));
+    r.mouseMoved(wxPoint(w / 2, h / 2));
+    r.mouseReleased(wxPoint(w / 2, h / 2));
+    r.mouseDown(wxPoint(w - 2, h - 2));
+    r.mouseReleased(wxPoint(w - 2, h - 2));
+    live = r.hash();
+  }
+
+  JournalReader reader;
+  Raster back(1, 1);
+  if (!reader.open(Journal::pathFor(BENCH_DOCUMENT))) {
+    fprintf(stderr, "journal: could not reopen the journal\n");
+    exit(1);
+  }
+  reader.replay(back, NULL);
+  if (back.hash() != live) {
+    fprintf(stderr, "journal: replay differs from the live canvas (%ux%u)\n", w, h);
+    exit(1);
+  }
+  unlink(Journal::pathFor(BENCH_DOCUMENT).c_str());
+}
+
+static bool readFile(const char *path, std::vector<char> &data) {
+  FILE *file = fopen(path, "rb");
+  if (file == NULL)
+    return false;
+  char chunk[65536];
+  size_t n;
+  data.clear();
+  while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    data.insert(data.end(), chunk, chunk + n);
+  }
+  fclose(file);
+  return true;
+}
+
+/* Every chunk of the PNG in 'data' through IEND has the
+ * CRC of its type and data */
+static bool checkPngChunks(const std::vector<char> &data) {
+  const unsigned char *p = (const unsigned char *)&data[0];
+  size_t at = 8;
+  while (at + 12 <= data.size()) {
+    size_t n = (size_t)p[at] << 24 | p[at + 1] << 16 | p[at + 2] << 8 | p[at + 3];
+    if (at + 12 + n > data.size())
+      return false;
+    const unsigned char *tail = p + at + 8 + n;
+    uLong crc = crc32(0, p + at + 4, 4 + n);
+    if (crc != ((uLong)tail[0] << 24 | tail[1] << 16 | tail[2] << 8 | tail[3]))
+      return false;
+    if (memcmp(p + at + 4, "IEND", 4) == 0)
+      return at + 12 + n == data.size();
+    at += 12 + n;
+  }
+  return false;
+}
+
+/*
+ * Export and import of a canvas with strokes and some
+ * noise, so that deflate has real work to do. The PNG
+ * must not depend on the thread count in a single byte.
+ */
+void RasterBench::image(unsigned int w, unsigned int h) {
+  Raster r(w, h);
+  r.toolType = Line;
+  int k;
+  for (k=0; k < 64; k++) {
+    r.thiccness = 1 + k % 15;
+    r.color = Color(k * 37, k * 91, k * 13);
+    wxPoint p0((k * 53) % w, (k * 29) % h), p1((k * 97) % w, (k * 71) % h);
+    r.mouseDown(p0);
+    r.mouseMoved(p1);
+    r.mouseReleased(p1);
+  }
+  std::vector<unsigned char> noise(3 * (w / 4) * (h / 4));
+  for (k=0; k < (int)noise.size(); k++) {
+    noise[k] = rand();
+  }
+  r.paste(&noise[0], NULL, w / 4, h / 4);
+  r.mouseDown(wxPoint(w - 1, h - 1));
+  r.mouseReleased(wxPoint(w - 1, h - 1));
+
+  std::vector<char> serial, out;
+  {
+    ImageWriter writer(BENCH_PNG);
+    if (!writer.save(r) || !readFile(BENCH_PNG, serial)) {
+      fprintf(stderr, "image: could not write %s\n", BENCH_PNG);
+      return;
+    }
+  }
+
+  /* The same canvas with one translucent pixel goes out as RGBA */
+  std::vector<char> translucent;
+  {
+    uint32_t kept = r.Buffer[0];
+    r.Buffer[0] = Color(1, 2, 3, 128).value();
+    ImageWriter writer(BENCH_PNG);
+    bool saved = writer.save(r) && readFile(BENCH_PNG, translucent);
+    r.Buffer[0] = kept;
+    if (!saved) {
+      fprintf(stderr, "image: could not write %s\n", BENCH_PNG);
+      return;
+    }
+  }
+  if (!checkPngChunks(serial) || !checkPngChunks(translucent)) {
+    fprintf(stderr, "image: bad chunk CRC in %s (%ux%u)\n", BENCH_PNG, w, h);
+    exit(1);
+  }
+
+  size_t t;
+  for (t=0; t < sizeof(THREADS)/sizeof(THREADS[0]); t++) {
+    char name[32];
+    snprintf(name, sizeof(name), "png_save_t%d", THREADS[t]);
+    if (filter != NULL && strstr(name, filter) == NULL)
+      continue;
+
+    ThreadPool pool(THREADS[t]);
+    ImageWriter writer(BENCH_PNG, &pool);
+    if (!writer.save(r) || !readFile(BENCH_PNG, out) || out != serial) {
+      fprintf(stderr, "%s: output differs from serial (%ux%u)\n", name, w, h);
+      exit(1);
+    }
+    run(name, w, h, 0, [&]() {
+      writer.save(r);
+      return (size_t)w * h;
+    });
+  }
+
+  /* wxImage wants packed RGB; converted outside the timing */
+  std::vector<unsigned char> rgb(3*(size_t)w*h);
+  unsigned int x, y;
+  for (y=0; y < h; y++) {
+    for (x=0; x < w; x++) {
+      Color c = Color::fromValue(r.getBuffer()[y*r.getStride() + x]);
+      rgb[3*((size_t)y*w + x)] = c.r;
+      rgb[3*((size_t)y*w + x) + 1] = c.g;
+      rgb[3*((size_t)y*w + x) + 2] = c.b;
+    }
+  }
+  run("png_save_wximage", w, h, 0, [&]() {
+    wxImage img(w, h, &rgb[0], true);
+    img.SaveFile(BENCH_PNG, wxBITMAP_TYPE_PNG);
+    return (size_t)w * h;
+  });
+
+  {
+    ImageWriter writer(BENCH_PNG);
+    writer.save(r);
+  }
+  Raster loaded(1, 1);
+  run("png_load", w, h, 0, [&]() {
+    ImageReader reader(BENCH_PNG);
+    if (!reader.open() || !reader.load(loaded))
+      return (size_t)0;
+    return (size_t)w * h;
+  });
+
+  run("bmp_save", w, h, 0, [&]() {
+    ImageWriter writer(BENCH_BMP);
+    writer.save(r);
+    return (size_t)w * h;
+  });
+  run("bmp_load", w, h, 0, [&]() {
+    ImageReader reader(BENCH_BMP);
+    if (!reader.open() || !reader.load(loaded))
+      return (size_t)0;
+    return (size_t)w * h;
+  });
+  unlink(BENCH_PNG);
+  unlink(BENCH_BMP);
+}
+
+/*
+ * The span kernels on a bare w*h buffer of one pixel
+ * format: flooding the whole (uniform) buffer, and a
+ * half-transparent colour blended over every row.
+ */
+template <typename F>
+static void formatKernels(const char *format, unsigned int w, unsigned int h,
+    const F &f = F()) {
+  std::vector<typename F::Unit> buffer((size_t)w * h);
+  fillSpan(&buffer[0], buffer.size(), WHITE, f);
+
+  typename F::Unit values[2] = { f.pack(Color(10, 20, 30)), f.pack(WHITE) };
+  int k = 0;
+  run(std::string("floodFill_") + format, w, h, 0, [&]() {
+    size_t n = 0;
+    floodFill<F>(&buffer[0], w, w, h, w / 2, h / 2, values[k++ & 1],
+        [&](unsigned int, unsigned int x0, unsigned int x1) {
+          n += x1 - x0;
+          return true;
+        });
+    return n;
+  });
+
+  std::vector<unsigned char> mask;
+  run(std::string("toleranceFill_") + format, w, h, 0, [&]() {
+    ColorMatch match = { f.unpack(buffer[0]), 16, DISTANCE_CHANNEL };
+    typename F::Unit value = values[k++ & 1];
+    size_t n = 0;
+    toleranceFill<F>(&buffer[0], w, w, h, w / 2, h / 2, match, mask,
+        [&](unsigned int y, unsigned int x0, unsigned int x1) {
+          SpanFill<F>::run(&buffer[(size_t)y * w + x0], x1 - x0, value);
+          n += x1 - x0;
+          return true;
+        }, f);
+    return n;
+  });
+
+  run(std::string("blendSpan_") + format, w, h, 0, [&]() {
+    unsigned int y;
+    for (y=0; y < h; y++) {
+      blendSpan(&buffer[(size_t)y * w], w, Color(200, 100, 50, 128), f);
+    }
+    return (size_t)w * h;
+  });
+}
+
+static void formats(unsigned int w, unsigned int h) {
+  /* A grey ramp with the two fill colours in front */
+  uint32_t palette[256];
+  int i;
+  for (i=0; i < 256; i++) {
+    palette[i] = Color(i, i, i).value();
+  }
+  palette[0] = Color(10, 20, 30).value();
+
+  formatKernels<Rgba32>("rgba32", w, h);
+  formatKernels<Rgb24>("rgb24", w, h);
+  formatKernels<Gray8>("gray8", w, h);
+  formatKernels<Indexed8>("indexed8", w, h, Indexed8(palette));
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1)
+    filter = argv[1];
+
+  wxImage::AddHandler(new wxPNGHandler);
+
+  printf("bench,width,height,thicc,iters,ns_per_op,"
+      "pixels_per_op,pixels_per_s,bytes_per_op,allocs_per_op\n");
+
+  size_t s, t;
+  for (s=0; s < sizeof(SIZES)/sizeof(SIZES[0]); s++) {
+    unsigned int w = SIZES[s], h = SIZES[s];
+
+    for (t=0; t < sizeof(THICCNESS)/sizeof(THICCNESS[0]); t++) {
+      RasterBench::lerp(w, h, THICCNESS[t]);
+      RasterBench::shapes(w, h, THICCNESS[t]);
+      RasterBench::strokes(w, h, THICCNESS[t]);
+      RasterBench::motion(w, h, THICCNESS[t]);
+      RasterBench::threads(w, h, THICCNESS[t]);
+      RasterBench::journal(w, h, THICCNESS[t]);
+    }
+    RasterBench::fill(w, h);
+    RasterBench::selectionArea(w, h);
+    RasterBench::regions(w, h);
+    RasterBench::move(w, h);
+    RasterBench::revert(w, h);
+    RasterBench::history(w, h);
+    RasterBench::clipboard(w, h);
+    RasterBench::document(w, h);
+    RasterBench::image(w, h);
+    formats(w, h);
+  }
+  return 0;
+}
@@ -10,322 +10,68 @@
 
 #endif
 
-#include <unordered_set>
-#include <queue>
 #include <stdio.h>
-#include <sstream>
 #include <iostream>
-#include <math.h>
 
-#include "helper.h"
 #include "canvas.h"
-#include "interpolation.h"
-#include "selection.h"
 
-#define RESIZE_CTRL_LENGTH 10
-
-#define LOC(x,y,w) (3*((y)*(w)+(x)))
-#define ALPHA_LOC(x,y,w) ((y)*(w)+(x))
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
 #define MAX(x, y) ((x) > (y) ? (x) : (y))
 
+#define PERF_DUMP_FILE "paint_perf.csv"
+#define HUD_WIDTH 330
+#define HUD_LINE_HEIGHT 16
+
 BEGIN_EVENT_TABLE( Canvas, wxPanel )
   EVT_KEY_DOWN(Canvas::keyDownEvent)
   EVT_KEY_UP(Canvas::keyUpEvent)
   EVT_PAINT(Canvas::paintEvent)
+  EVT_SIZE(Canvas::sizeEvent)
   EVT_MOTION(Canvas::mouseMoved)
   EVT_LEFT_DOWN(Canvas::mouseDown)
   EVT_LEFT_UP(Canvas::mouseReleased)
+  EVT_TIMER(FRAME_TIMER, Canvas::frameTick)
+  EVT_TIMER(JOB_TIMER, Canvas::jobTick)
 END_EVENT_TABLE()
 
-Color WHITE = Color((char) 255, (char) 255, (char) 255);
-Color SELECT = Color((char) 66, (char) 135, (char) 245);
-
-/* CONSTRUCTORS */
-Canvas::Canvas(wxFrame *parent) :
-wxPanel(parent) {
-  color = Color(0, 0, 0);
-  thiccness = 3;
-  isResize = false;
-}
-
-Canvas::Canvas(wxFrame *parent, unsigned int width, unsigned int height) :
-wxPanel(parent) {
-  this->width = width;
-  this->height = height;
-  this->SetFocus();
-
-  resizeWidth = width;
-  resizeHeight = height;
-
-  color = Color(0, 0, 0);
-  thiccness = 3;
-  isResize = false;
-
-  /* Initialize the buffer */
-  size_t sz = 3*width*height*sizeof(char);
-  Buffer = (char *)malloc(sz);
-
-  /* White-out buffer */
-  memset(Buffer, 255, sz);
-}
-
-void Canvas::addTransaction(Transaction &t) {
-  transactions.push_back(t);
-}
-
-void Canvas::revertTransaction(Transaction &txn) {
-  std::vector<Pixel> *pixels;
-  Pixel p;
-  pixels = &(txn.pixels);
-  int i;
-  for (i=0; i<pixels->size(); i++) {
-    p = (*pixels)[i];
-    updateBuffer(p); 
-  }
-}
-
-void
-Canvas::updateTransaction(Transaction &txn, const std::vector<wxPoint> &points)
-{
-  int i=0;
-  wxPoint pt;
-  Pixel p;
-  for (i=0; i < points.size(); i++) {
-    pt = points[i];
-    p = Pixel(getPixelColor(pt), pt);
-    txn.update(p);
-  }
-}
-
-Color
-Canvas::getPixelColor(const wxPoint &p) {
-  /* Update buffer with new colors */
-  if (p.x >= width || p.y >= height)
-    return WHITE;
-
-  int i = LOC(p.x, p.y, width);
-  if (i >= 3 * width * height)
-    return WHITE;
-
-  return Color(
-    Buffer[i],
-    Buffer[i+1],
-    Buffer[i+2]
-  );
-}
-
-Pixel
-Canvas::getPixel(const wxPoint &p) {
-  wxPoint _p(p.x, p.y);
-  return Pixel(getPixelColor(p), _p);
-}
-
-void
-Canvas::getNeighbors(const wxPoint &p, wxPoint *neighbors, int &ncount) {
-  int x, y;
-  ncount = 0;
-
-  // Up
-  x = p.x;
-  y = p.y - 1;
-  if (x < width && y < height) {
-    neighbors[ncount].x = x;
-    neighbors[ncount].y = y;
-    ncount++; 
-  }
-
-  // Down
-  x = p.x;
-  y = p.y + 1;
-  if (x < width && y < height) {
-    neighbors[ncount].x = x;
-    neighbors[ncount].y = y;
-    ncount++; 
-  }
-
-  // Left
-  x = p.x - 1;
-  y = p.y;
-  if (x < width && y < height) {
-    neighbors[ncount].x = x;
-    neighbors[ncount].y = y;
-    ncount++; 
-  }
-
-  // Right
-  x = p.x + 1;
-  y = p.y;
-  if (x < width && y < height) {
-    neighbors[ncount].x = x;
-    neighbors[ncount].y = y;
-    ncount++; 
-  }
-}
-
-void Canvas::updateBuffer(const Pixel &p) {
-  /* Update buffer with new colors */
-  if (p.x >= width || p.y >= height)
-    return;
-
-  int i = LOC(p.x, p.y, width);
-  if (i >= 3 * width * height || i < 0)
-    return;
-
-  Buffer[i] = p.color.r;
-  Buffer[i+1] = p.color.g;
-  Buffer[i+2] = p.color.b;
-}
-
-void Canvas::updateBuffer(const std::vector<wxPoint> &points,
-                          const Color &color) {
-  Pixel p;
-  wxPoint point;
-  int i;
-  for (i=0; i<points.size(); i++) {
-    point = points[i];
-    p = Pixel(color.r, color.g, color.b, point.x, point.y);
-    updateBuffer(p);
-  }
-}
-
 /*
- * Called by the system of by wxWidgets when the panel needs
- * to be redrawn. You can also trigger this call by
- * calling Refresh()/Update().
+ * Clipboard backed by wxTheClipboard
  */
-void Canvas::paintEvent(wxPaintEvent & evt)
-{
-  wxPaintDC dc(this);
-  render(dc);
-}
+class WxClipboard : public Clipboard {
+  public:
+    bool getImage(std::vector<unsigned char> &rgb,
+        std::vector<unsigned char> &alpha,
+        unsigned int &M, unsigned int &N);
+    void setImage(unsigned char *rgb, unsigned char *alpha, int M, int N);
+};
 
 /*
- * Here we do the actual rendering. I put it in a separate
- * method so that it can work no matter what type of DC
- * (e.g. wxPaintDC or wxClientDC) is used.
+ * Read clipboard bitmap as wxImage and copy out its
+ * RGBRGB.. data (+ alpha, if any).
  */
-void Canvas::render(wxDC&  dc)
-{
-  /*
-   * Draw out the bitmap
-   */
-  ////////////////////////////////////
-  wxImage img(width, height, (unsigned char *)Buffer, true);
-  wxBitmap bmp(img);  
-  dc.DrawBitmap(bmp, 0, 0, false);
-
-  if (isResize) {
-    dc.SetBrush(*wxTRANSPARENT_BRUSH);
-    dc.SetPen( wxPen( wxColor(0, 0, 0), 1) ); // 10-pixels-thick pink outline
-    dc.DrawRectangle( 0, 0, resizeWidth, resizeHeight );
-  }
-
-  dc.SetBrush(*wxBLACK_BRUSH);
-  dc.SetPen(wxPen(wxColor(0, 0, 0), 1));
-  dc.DrawRectangle(resizeWidth-RESIZE_CTRL_LENGTH/2, resizeHeight-RESIZE_CTRL_LENGTH/2,
-      RESIZE_CTRL_LENGTH, RESIZE_CTRL_LENGTH);
-  ///////////////////////////////////
-}
-
-bool Canvas::pasteFromClip(Transaction &txn) {
-  bool isPasted = false;
+bool WxClipboard::getImage(std::vector<unsigned char> &rgb,
+    std::vector<unsigned char> &alpha,
+    unsigned int &M, unsigned int &N) {
+  bool hasImage = false;
   if (wxTheClipboard->Open()) {
-    /*
-     * Copy bitmap / image:
-     * (1) Read and cast clipboard bitmap as wxImage
-     * (2) Get wxImage's internal data buffer which contains
-     *     RGBRGBRGB.. data format of pixels, row major. 
-     * (3) Check corresponding alpha values for each pixel.
-     *     If alpha value of pixel is NOT 0 (i.e. not completely
-     *     transparent), then copy that pixel's RGB.
-     *     If alpha value of pixel is 0, then ignore pixel, as
-     *     is transparent.
-     * (4) Iterate through, add previous color to transactions,
-     *     then update display buffer.
-     * (5) Initialize selectionArea and selectionBorder:
-     *   - If previous selection exists, free it
-     *   - Initialize selectionArea to be the non-alpha pixels
-     *     pasted from clipboard.
-     *   - For simplicity, set border to the bounding box
-     *     (i.e. for Lasso, border would not be tightly 
-     *     bounded like it is during the actual selection).
-     *     This should not affect the actual pixels being
-     *     moved if the user performs click-drag since
-     *     selectionArea is still strictly based on the area
-     *     selected by the user (and not, say, the bounding
-     *     box)
-     *  
-     * Note: Could try and optimize using memset, this
-     * requires changes to the transaction system.
-     */
     if (wxTheClipboard->IsSupported(wxDF_BITMAP)) {
-      clearSelection();
-
       wxImage bmpImage;
       wxBitmapDataObject data;
 
       wxTheClipboard->GetData(data);
       bmpImage = data.GetBitmap().ConvertToImage();
 
-      unsigned char *buffer, *alpha;
-      unsigned int N, M;
-      bool hasAlpha;
-      N = bmpImage.GetHeight();
       M = bmpImage.GetWidth();
-      buffer = bmpImage.GetData();
-      alpha = bmpImage.GetAlpha();
-      hasAlpha = bmpImage.HasAlpha(); 
-
-      wxPoint tl, br;
-      tl = wxPoint(0, 0);
-      br = wxPoint(std::min(width, M-1), std::min(height, N-1)); 
-      selectionBorder = drawRectangle(tl, br, 1);
-      int i;
-      for (i=0; i<selectionBorder.size(); i++) {
-        wxPoint p = selectionBorder[i];
-        Pixel pixel = getPixel(p);
-        selectTxn.update(pixel);
-        selectionArea.push_back(pixel);
-      }
-
-      int x, y;
-      for (y=0; y<std::min(height, N); y++) {
-        for (x=0; x<std::min(width, M); x++) {
-          wxPoint p(x,y);
-          Pixel pixel;
-          Color prev_c = getPixelColor(p); /* prev color */
-          Color c;
-          int ind;
-
-          ind = ALPHA_LOC(x, y, M);
-          if (!hasAlpha || alpha[ind] != wxIMAGE_ALPHA_TRANSPARENT) {
-            ind = LOC(x, y, M);
-            c = Color(
-              buffer[ind],
-              buffer[ind+1],
-              buffer[ind+2]
-            );
-
-            pixel = Pixel(c, p);
-            txn.update(Pixel(prev_c, p));
-
-            updateBuffer(pixel);
-            selectionArea.push_back(pixel);
-          }
-        }
+      N = bmpImage.GetHeight();
+      if (M > 0 && N > 0) {
+        rgb.assign(bmpImage.GetData(), bmpImage.GetData() + 3*M*N);
+        alpha.clear();
+        if (bmpImage.HasAlpha())
+          alpha.assign(bmpImage.GetAlpha(), bmpImage.GetAlpha() + M*N);
+        hasImage = true;
       }
-
-      updateBuffer(
-        makeDashed(selectionBorder),
-        SELECT);
-      selectBackgrnd.insert(txn);
-      whiteoutSelect = false;
-      selected = true;
-      toolType = SlctRect;
-      isPaste = true;
-    } 
-    /* 
+    }
+    /*
      * Add more options here:
      * e.g. wxDF_TEXT to process clipboard text input
      */
@@ -333,1011 +79,635 @@ bool Canvas::pasteFromClip(Transaction &txn) {
     // Always close the clipboard
     wxTheClipboard->Close();
   }
-  return isPaste;
+  return hasImage;
 }
 
- void Canvas::cpySelectToClip() {
-  /* 
+void WxClipboard::setImage(unsigned char *rgb, unsigned char *alpha,
+    int M, int N) {
+  /*
    * Alpha channel issue:
    * https://forums.wxwidgets.org/viewtopic.php?t=46865&p=197052
    * http://trac.wxwidgets.org/ticket/16198
-   * 
-   * Note - Non-rectangular selection:
-   * Use alpha channel to accept non-rectangular
-   * selection areas.
-   * e.g. Set alpha to 1 for transparent, so when
-   * pasting, we can check alpha channel of 
-   * the corresponding pixel to decide whether to
-   * update it or not.
    */
-  if (selected) {
-    /*
-     * Steps:
-     * (1) Do one pass on data to set every pixel's
-     *     alpha to 0 (i.e. transparent)
-     * (2) Do one pass on selectionArea. Since all pixels
-     *     contained in selectionArea have been selected,
-     *     set color of the respective pixel in 'data' 
-     *     and set the alpha of that pixel to 1.
-     * (3) Copy data onto clipboard as bitmap data
-     */
-    assert(selection != NULL);
-
-    int N, M;
-    int minX, minY;
-    unsigned char *data, *alpha;
-
-    N = selection->getHeight();
-    M = selection->getWidth();
-    minX = (int)selection->minX;
-    minY = (int)selection->minY;
-
-    data = (unsigned char *)malloc(3*N*M);
-    alpha = (unsigned char *)malloc(N*M);
-
-    // (1)
-    memset(data, 255, 3*N*M);
-    memset(alpha, wxIMAGE_ALPHA_TRANSPARENT, N*M);
-
-    // (2)
-    {
-      wxPoint p;
-      Pixel pixel;
-      int i;
-      for (i=0; i<selectionArea.size(); i++) {
-        pixel = selectionArea[i];
-        p = wxPoint(pixel.x, pixel.y);
-        
-        int x, y;
-        x = p.x - minX;
-        y = p.y - minY;
-
-        int ind;
-        ind = LOC(x, y, M);
-        data[ind] = pixel.color.r;
-        data[ind+1] = pixel.color.g;
-        data[ind+2] = pixel.color.b;         
-
-        ind = ALPHA_LOC(x, y, M);
-        alpha[ind] = wxIMAGE_ALPHA_OPAQUE;
-      }
-    }
-
-    // (3)
-    wxImage img(M, N, data, alpha, false);
-    wxBitmap bmp(img, 4*8*sizeof(unsigned char));
-    bmp.SetDepth(4*8*sizeof(unsigned char));
-    if (wxTheClipboard->Open()) {
-      wxTheClipboard->SetData(new wxBitmapDataObject(bmp));
-      wxTheClipboard->Close();
-    } else {
-      free(alpha);
-    }    
+  /* wxImage takes ownership of rgb and alpha */
+  wxImage img(M, N, rgb, alpha, false);
+  wxBitmap bmp(img, 4*8*sizeof(unsigned char));
+  bmp.SetDepth(4*8*sizeof(unsigned char));
+  if (wxTheClipboard->Open()) {
+    wxTheClipboard->SetData(new wxBitmapDataObject(bmp));
+    wxTheClipboard->Close();
   }
 }
 
-void Canvas::selectAll(Transaction &txn) {
-  clearSelection();
-
-  selectionArea.resize(width*height);
-  wxPoint tl, br;
-  tl = wxPoint(0, 0);
-  br = wxPoint(width-1, height-1); 
-  selectionBorder = drawRectangle(tl, br, 1);
-  int i;
-  for (i=0; i<selectionBorder.size(); i++) {
-    wxPoint p = selectionBorder[i];
-    selectTxn.update(getPixel(p));
-  }
-
-  int x, y;
-  for (y=0; y<height; y++) {
-    for (x=0; x<width; x++) {
-      wxPoint p(x,y);
-      Color prev_c = getPixelColor(p); /* prev color */
-      Pixel pixel = Pixel(prev_c, p);
-      txn.update(pixel);
+/* CONSTRUCTORS */
+Canvas::Canvas(wxFrame *parent, unsigned int width, unsigned int height) :
+wxPanel(parent) {
+  this->SetFocus();
 
-      selectionArea[y*width + x] = pixel;
-    }
+  raster = new Raster(width, height);
+  pool = new ThreadPool(ThreadPool::defaultSize());
+  raster->setPool(pool);
+  journal = new Journal();
+  raster->setJournal(journal);
+  clipboard = new WxClipboard();
+  controller = new Controller(raster, clipboard);
+  frameTimer.SetOwner(this, FRAME_TIMER);
+
+  /* New frames and job completion are posted back
+   * to the UI thread */
+  frame = parent;
+  worker = new Worker(raster,
+      [this]() {
+        CallAfter([this]() { present(); });
+      },
+      [this](bool cancelled) {
+        CallAfter([this, cancelled]() { jobFinished(cancelled); });
+      });
+  controller->setWorker(worker);
+  jobTimer.SetOwner(this, JOB_TIMER);
+}
+
+Canvas::~Canvas() {
+  /* Settle running jobs here, their posted completion
+   * will never be delivered */
+  worker->sync();
+  while (controller->isBusy()) {
+    controller->finishJob(worker->getControl()->wasCancelled());
+    worker->cancel();
+    worker->sync();
+  }
+  delete worker;
+  delete pool;
+  delete journal;
+  delete recovery;
+  delete importing;
+  delete exporting;
+
+  if (recorder != NULL) {
+    recorder->finish(*raster);
+    delete recorder;
+  }
+  delete controller;
+  delete clipboard;
+  delete raster;
+  delete document;
+}
+
+bool Canvas::startRecording(const char *path) {
+  worker->sync();
+  Recorder *rec = new Recorder();
+  if (!rec->open(path, raster->getWidth(), raster->getHeight())) {
+    delete rec;
+    return false;
   }
-
-  updateBuffer(
-    makeDashed(selectionBorder),
-    SELECT);
-  selection = new RectangleSelection(tl, br);
-  selectBackgrnd.insert(txn);
-  whiteoutSelect = true;
-  selected = true;
-  toolType = SlctRect;
-  isPaste = true;
+  recorder = rec;
+  controller->setRecorder(recorder);
+  return true;
 }
 
-bool Canvas::clearSelectedArea(Transaction &txn, Color c) {
-  if (!selected) {
+bool Canvas::open(const char *path) {
+  if (controller->isBusy())
     return false;
-  }
-
-  wxPoint p; 
-  Pixel pixel, _pixel;
-  int i;
-  for (i=0; i<selectionArea.size(); i++) {
-    pixel = selectionArea[i];
-    p = wxPoint(pixel.x, pixel.y);
+  if (!wxString(path).Lower().EndsWith(wxT(".pdoc")))
+    return openImage(path);
 
-    _pixel = Pixel(c, p);
-    txn.update(pixel);
-    updateBuffer(_pixel);
+  Document *doc = new Document(path);
+  if (!doc->open()) {
+    delete doc;
+    return false;
   }
 
+  /* Unsaved changes to it, from a session that crashed */
+  JournalReader *reader = new JournalReader();
+  if (!reader->open(Journal::pathFor(path)) || reader->getRecords() == 0) {
+    delete reader;
+    reader = NULL;
+  }
+
+  /* The previous document's load, if any, has completed
+   * since nothing is running */
+  delete document;
+  delete recovery;
+  document = doc;
+  recovery = reader;
+  handleInput([&]() {
+    if (reader != NULL)
+      controller->recover(doc, reader);
+    else
+      controller->load(doc);
+  });
+  if (reader != NULL)
+    setStatus(wxString::Format("Recovered %d unsaved changes",
+          (int)reader->getRecords()));
   return true;
 }
 
-void Canvas::keyDownEvent(wxKeyEvent &evt) {
-  char uc = evt.GetUnicodeKey();
-  if (evt.ControlDown()) {
-    switch (uc) {
-      case (KEY_Z):
-        if (!isUndo && transactions.size() > 0) {
-          isUndo = true;
-
-          Transaction *latest;
-          latest = &transactions.back(); 
-          revertTransaction(*latest);
-          transactions.pop_back();
-        }
-        break;
-      case (KEY_C):
-        if (!isCopy) {
-          isCopy = true;
-          cpySelectToClip();           
-        }
-        break;
-      case (KEY_V):
-        if (!isPaste) {
-          isPaste = true;
-          Transaction txn;
-          if (pasteFromClip(txn)) {
-            currentTxn = txn;
-            addTransaction(currentTxn);
-          }
-        }
-        break;
-      case (KEY_A):
-        if (!isSelectAll) {
-          Transaction txn;
-          selectAll(txn);
-          currentTxn = txn;
-        }
-      default: 
-        break;
-    }
+bool Canvas::openImage(const char *path) {
+  ImageReader *image = new ImageReader(path);
+  if (!image->open()) {
+    delete image;
+    return false;
   }
 
-  if (uc == KEY_DEL) {
-    if (!isDelete) {
-      isDelete = true;
-      Transaction txn;
-      if (clearSelectedArea(txn, Color(255, 255, 255))) {
-        clearSelection();
-        currentTxn = txn;
-        addTransaction(currentTxn);
-      } 
-    }
+  JournalReader *reader = new JournalReader();
+  if (!reader->open(Journal::pathFor(path)) || reader->getRecords() == 0) {
+    delete reader;
+    reader = NULL;
   }
 
-  wxWindow::Refresh();
+  delete document;
+  delete recovery;
+  delete importing;
+  document = NULL;
+  recovery = reader;
+  importing = image;
+  handleInput([&]() {
+    controller->importImage(image, reader);
+  });
+  return true;
 }
 
-void Canvas::keyUpEvent(wxKeyEvent & evt) {
-  char uc = evt.GetUnicodeKey();
-  // Z is released - not checking for Ctrl here on purpose
-  switch(uc) {
-    case (KEY_Z):
-      isUndo = false;
-      break;
-    case (KEY_C):
-      isCopy = false;
-      break;
-    case (KEY_V):
-      isPaste = false;
-      break;
-    case (KEY_A):
-      isSelectAll = false;
-      break;
-    case (KEY_DEL):
-      isDelete = false;
-      break;
-    default:
-      break; 
-  }
-}
+bool Canvas::exportImage(const char *path) {
+  if (controller->isBusy())
+    return false;
 
-bool Canvas::isResizeEvt(const int &x, const int &y) {
-  return ((x >= width - RESIZE_CTRL_LENGTH/2) &&
-      (x <= width + RESIZE_CTRL_LENGTH) &&
-      (y >= height - RESIZE_CTRL_LENGTH/2) &&
-      (y <= height + RESIZE_CTRL_LENGTH));
+  delete exporting;
+  exporting = new ImageWriter(path, pool);
+  exportTimer = PerfTimer();
+  handleInput([&]() {
+    controller->exportImage(exporting);
+  });
+  return true;
 }
 
-/* Event handlers to handle CANVAS mouse events */
-/*
- * Handle CLICK event
- * Drawing Tools: Pencil, Line, DrawRect, DrawCircle
- *    - Fill in the clicked pixel - all have the same functionality
- */
-void Canvas::mouseDown(wxMouseEvent &evt)
-{
-  this->SetFocus();
-  
-  /* Always should be left is down */
-  assert(evt.LeftIsDown());
-
-  isNewTxn = true;
-  int x = evt.GetX();
-  int y = evt.GetY();
-  startPos = wxPoint(x, y);
-
-  if ((isResize = isResizeEvt(x, y))) {
-    resizeWidth = width;
-    resizeHeight = height;
+void Canvas::startAutosave() {
+  JournalReader *reader = new JournalReader();
+  if (reader->open(JOURNAL_UNTITLED) && reader->getBase().empty()
+      && reader->getRecords() > 0) {
+    delete recovery;
+    recovery = reader;
+    handleInput([&]() {
+      controller->recover(NULL, reader);
+    });
+    setStatus(wxString::Format("Recovered %d unsaved changes",
+          (int)reader->getRecords()));
     return;
   }
+  delete reader;
 
-  Transaction txn;
-  Pixel p(color.r, color.g, color.b, x, y);
-  switch(toolType) {
-    case Eraser:
-    case Pencil:
-      freehand.clear();
-      freehand.push_back(wxPoint(x, y));
-    case Line:
-    case DrawRect:
-    case DrawCircle:
-      break;
-    case Fill:
-      fill(startPos, color, txn);
-      currentTxn = txn;
-      break;
-    case SlctRect:
-      handleSelectionClick(startPos);
-      break;
-    case SlctCircle:
-      handleSelectionClick(startPos);
-      break;
-    case Lasso:
-      freehand.clear();
-      handleSelectionClick(startPos);
-      break;
-    default:
-      break;
-  }
-
-  wxWindow::Refresh();
+  worker->sync();
+  journal->checkpoint(NULL, raster->getWidth(), raster->getHeight());
 }
 
-void Canvas::mouseMoved(wxMouseEvent &evt)
-{
-  if (!evt.LeftIsDown())
-    return;
-
-  wxPoint currPos = wxPoint(evt.GetX(), evt.GetY());
-  Transaction txn;
+bool Canvas::save() {
+  if (controller->isBusy()) {
+    setStatus(wxT("Busy, not saved"));
+    return false;
+  }
 
-  if (isResize) {
-    resizeWidth = width + currPos.x - startPos.x;
-    resizeHeight = height + currPos.y - startPos.y;
-    wxWindow::Refresh();
-    return;
+  if (document == NULL) {
+    wxFileDialog dialog(this, wxT("Save document"), wxEmptyString,
+        wxEmptyString, wxT("Paint documents (*.pdoc)|*.pdoc"),
+        wxFD_SAVE | wxFD_OVERWRITE_PROMPT);
+    if (dialog.ShowModal() != wxID_OK)
+      return false;
+    document = new Document(dialog.GetPath().mb_str());
   }
 
-  switch(toolType) {
-    case Pencil:
-      freehand.push_back(currPos);
-      updateBuffer(
-        drawFreeHand(currPos, txn, thiccness),
-        color);
-      currentTxn = txn;
-      break;
-    case Line:
-      updateBuffer(
-        drawLine(currPos, txn, thiccness),
-        color);
-      currentTxn = txn;
-      break;
-    case DrawRect:
-      updateBuffer(
-          drawRectangle(currPos, txn, thiccness),
-          color);
-      currentTxn = txn;
-      break;
-    case DrawCircle:
-      updateBuffer(
-        drawCircle(currPos, txn, thiccness),
-        color);
-      currentTxn = txn;
-      break;
-    case Eraser:
-      freehand.push_back(currPos);
-      updateBuffer(
-          drawFreeHand(currPos, txn, thiccness),
-          WHITE);
-      currentTxn = txn;
-      break;
-    case SlctRect:
-      handleSelectionMove(currPos, &Canvas::drawRectangle);
-      break;
-    case SlctCircle:
-      handleSelectionMove(currPos, &Canvas::drawCircle);
-      break;
-    case Lasso:
-      freehand.push_back(currPos);
-      handleSelectionMove(currPos, &Canvas::drawFreeHand);
-      break;
-    default:
-      break;
+  worker->sync();
+  PerfTimer timer;
+  if (!document->save(*raster)) {
+    setStatus(wxString::Format("Could not save %s", document->getPath()));
+    return false;
   }
+  setStatus(wxString::Format("Saved %s (%d tiles, %.1f ms)",
+        document->getPath(), (int)document->getTilesWritten(),
+        timer.elapsed() / 1e6));
+  return true;
+}
 
-  wxWindow::Refresh();
-  isNewTxn = false;
+void Canvas::setStatus(const wxString &text) {
+  if (frame->GetStatusBar() != NULL)
+    frame->SetStatusText(text);
 }
 
-/*
- * Resizes buffer. Copies over pixels
- * from previous buffer into a temp
- * buffer containing resizeWidth * resizeHeight
- * pixels.
- */
-void Canvas::moveBuffer() {
-  char *tempBuff = (char*) malloc(3*resizeWidth*resizeHeight);
-  memset(tempBuff, 255, 3*resizeWidth*resizeHeight);
-
-  char *src, *dst;
-  size_t size = MIN(width, resizeWidth);
-  int i, _height = MIN(height, resizeHeight);
-  for (i=0; i < _height; i++) {
-    src = Buffer + LOC(0, i, width);
-    dst = tempBuff + LOC(0, i, resizeWidth);
-
-    memmove(dst, src, size*3);
-  }
+void Canvas::setTool(ToolType toolType) {
+  controller->setTool(toolType);
+}
 
-  isResize = false;
-  width = resizeWidth;
-  height = resizeHeight;
-  free(Buffer);
-  Buffer = tempBuff;
+void Canvas::setColor(const Color &color) {
+  controller->setColor(color);
 }
 
-void Canvas::mouseReleased(wxMouseEvent &evt)
-{
-  wxPoint pt = wxPoint(evt.GetX(), evt.GetY());
+void Canvas::setThiccness(int thiccness) {
+  controller->setThiccness(thiccness);
+}
 
-  if (isResize) {
-    moveBuffer();
-    wxWindow::Refresh();
-    return;
-  }
+void Canvas::setBrush(bool antialias, int softness) {
+  controller->setBrush(antialias, softness);
+}
 
-  switch (toolType) {
-    case SlctRect:
-    case SlctCircle:
-    case Lasso:
-      handleSelectionRelease(startPos, pt);
-      wxWindow::Refresh();
-      break;
-    default:
-      break;
-  }
+void Canvas::setTolerance(int tolerance, ColorDistance distance) {
+  controller->setTolerance(tolerance, distance);
+}
 
-  // commit transaction
-  addTransaction(currentTxn);
+void Canvas::setRegionIndex(bool on) {
+  controller->setRegionIndex(on);
 }
 
-std::vector<wxPoint>
-Canvas::drawFreeHand(const wxPoint &currPos, Transaction &txn, const int &_width)
-{
-  if (!isNewTxn) {
-    revertTransaction(currentTxn);
-  }
+void Canvas::jumpTo(size_t step) {
+  controller->jumpTo(step);
+}
 
-  std::vector<wxPoint> points, _pts;
-  wxPoint p0, p1;
-  int i;
-  for (i=0; i<freehand.size()-1; i++) {
-    p0 = freehand[i];
-    p1 = freehand[i+1];
+/*
+ * Posted by the raster thread when a new frame is up.
+ * Hand its dirty region to the navigator so that only
+ * the affected thumbnail cells are re-downsampled, file
+ * the raster timings, then repaint the canvas.
+ */
+void Canvas::present() {
+  Frame &front = worker->lockFront();
+  if (front.width != navWidth || front.height != navHeight) {
+    /* Dimensions changed, the thumbnail has to be rebuilt */
+    resetNavigator(front);
+  } else if (front.isDirty && navigator != NULL) {
+    navigator->resample(front.buffer, front.width, front.height, front.dirty);
+  }
+  front.isDirty = false;
+  updateHistory(front);
+
+  size_t i;
+  for (i=0; i < front.timings.size(); i++) {
+    perf.record(front.timings[i].first, PERF_RASTER, front.timings[i].second);
+  }
+  front.timings.clear();
+  perf.frame(front.pixelsWritten, front.undoBytes, front.strokeDuplicates);
+  perf.history(front.packedBytes, front.packedRawBytes);
+  perf.regions(front.regionBytes, front.regionTiles, front.regionNs);
+  worker->unlockFront();
+
+  isShownStale = true;
+  wxWindow::Refresh();
+}
 
-    _pts = lerp(p0, p1, _width);
-    points.insert(points.end(), _pts.begin(), _pts.end());
-  }
+void Canvas::setNavigator(Navigator *navigator) {
+  this->navigator = navigator;
+  resetNavigator(worker->lockFront());
+  worker->unlockFront();
+}
 
-  updateTransaction(txn, points);
-  return points;
+void Canvas::setHistoryList(wxListBox *list) {
+  historyList = list;
+  updateHistory(worker->lockFront());
+  worker->unlockFront();
 }
 
-std::vector<wxPoint>
-Canvas::drawCircle(const wxPoint &currPos, Transaction &txn, const int &_width) {
-  std::vector<wxPoint> points;
-  /*
-   * Steps:
-   * (1) If not first transaction, delete previous transaction.
-   *     We must do this since we're constantly redrawing
-   *     the circle's trace as the user is "dragging" across
-   *     the screen 
-   * (2) Interpolate some points such that the interpolated
-   *     points form a circle by using distance b/w currPos
-   *     and startPos
-   * (3) Further interpolate by calling either linear or
-   *     polynomial interpolation on the sparse points to
-   *     generate the pixels
-   * (4) Write all previous buffer values to the txn
-   */  
-
-  // (1)
-  if (!isNewTxn) {
-    revertTransaction(currentTxn);
-  }
+/* Entries are only added or dropped at the end */
+void Canvas::updateHistory(const Frame &frame) {
+  if (historyList == NULL)
+    return;
 
-  /*
-   * Steps for (2):
-   * (2a) Find diameter/radius
-   * (2b) Find center point
-   * (2c) Traverse around the circle by using center point
-   */
-  double radius = length(currPos, startPos)/2;
-  wxPoint c;
-  {
-    wxRealVec v; 
-    wxVec _v = currPos - startPos;
-    v = wxRealVec((double)_v.x, (double)_v.y);
-    v = normalize(v);
-
-    wxRealPoint _curr(startPos);
-    c = wxPoint(_curr + radius*v);
+  unsigned int n = historyList->GetCount();
+  unsigned int size = frame.historySize + 1;
+  if (n == 0) {
+    historyList->Append(wxT("Open"));
+    n = 1;
   }
-
-  /*
-   * Number of samples depends on the circumference
-   * of the circle
-   */ 
-  std::vector<wxPoint> draft;
-  {
-    wxRealPoint p;
-    wxRealVec _u; 
-    double _x, _y;
-    double _P = (2*M_PI) / (2*M_PI*radius);
-    double theta;
-    for (theta=0.0; theta<2*M_PI; theta+=_P) {
-      _x = cos(theta);
-      _y = sin(theta);
-      _u = normalize(wxRealVec(_x,_y)); // should be normal, but..
-
-      p = wxRealPoint(c) + radius*_u;
-      draft.push_back(wxPoint(p));
-    }
+  while (n > size) {
+    historyList->Delete(--n);
   }
-
-  // (3)
-  {
-    std::vector<wxPoint> pts;
-    wxPoint p0, p1; 
-    int i;
-    for (i=0; i<draft.size()-1; i++) {
-      p0 = draft[i];
-      p1 = draft[i+1];
-
-      pts = lerp(p0, p1, _width);
-      points.insert(points.end(), pts.begin(), pts.end());
-    } 
+  for (; n < size; n++) {
+    historyList->Append(wxString::Format("Step %u", n));
   }
-
-  // (4)
-  updateTransaction(txn, points);
-  return points;
+  if (historyList->GetSelection() != (int)frame.historyStep)
+    historyList->SetSelection(frame.historyStep);
 }
 
-std::vector<wxPoint> 
-Canvas::drawLine(const wxPoint &currPos, Transaction &txn, const int &_width) {
-  std::vector<wxPoint> points; 
-  /*
-   * Steps:
-   * (1) If isNewTxn, revert
-   * (2) Interpolate line from startPos to currPos
-   */
-  if (!isNewTxn) {
-    revertTransaction(currentTxn);
-  } 
-
-  points = lerp(startPos, currPos, _width);
-  updateTransaction(txn, points);
+void Canvas::resetNavigator(const Frame &frame) {
+  navWidth = frame.width;
+  navHeight = frame.height;
+  if (navigator == NULL)
+    return;
 
-  return points;
+  navigator->reset(frame.buffer, navWidth, navHeight);
+  updateViewport();
 }
 
-void
-Canvas::fill(const wxPoint &p, const Color &color, Transaction &txn) {
-  /*
-   * Steps:
-   * (1) From given point 'p', perform breadth-first
-   *     algorithm, fill in every pixel whose color
-   *     is the same as 'p'.
-   * (2) Update given Transaction 'txn' with all filled
-   *     pixels.
-   * 
-   * Note: we are not 'filling' in the pixel here, that is
-   * done in calling event handler function. This function
-   * simply passes back the points to be filled in. 
-   */
-  Color c = getPixelColor(p);
-  if (c == color) {
+/*
+ * The visible part of the canvas is whatever fits
+ * in the panel's client area. Uses the navigator's
+ * copy of the dimensions: a resize may be in flight.
+ */
+void Canvas::updateViewport() {
+  if (navigator == NULL)
     return;
-  }
 
-  int loc = LOC(p.x, p.y, width);
-  txn.update(Pixel(c,p));
-  Buffer[loc] = color.r;
-  Buffer[loc+1] = color.g;
-  Buffer[loc+2] = color.b;
-
-  std::queue<wxPoint> Q;
-  Q.push(p);
-
-  wxPoint neighbors[4];
-  int ncount;
-  wxPoint _p;
-  while (!Q.empty()) {
-    _p = Q.front();
-    Q.pop();
-
-    getNeighbors(_p, neighbors, ncount);
-
-    std::string _pstr;
-    int _x, _y;
-    int i;
-    for (i=0; i<ncount; i++) {
-      _x = neighbors[i].x;
-      _y = neighbors[i].y;
-      char r,g,b;
-      loc = LOC(_x, _y, width);
-      r = Buffer[loc];
-      g = Buffer[loc+1];
-      b = Buffer[loc+2];
-      if (r == c.r && g == c.g && b == c.b) {
-        txn.update(Pixel(r,g,b,_x,_y));
-        Buffer[loc] = color.r;
-        Buffer[loc+1] = color.g;
-        Buffer[loc+2] = color.b;
-        Q.push(wxPoint(_x,_y));
-      }
-    }
-  }
+  wxSize client = GetClientSize();
+  navigator->setViewport(wxRect(0, 0,
+        MIN((int)navWidth, client.GetWidth()),
+        MIN((int)navHeight, client.GetHeight())));
+}
+
+void Canvas::sizeEvent(wxSizeEvent &evt) {
+  updateViewport();
+  evt.Skip();
 }
 
-std::vector<wxPoint>
-Canvas::drawRectangle(const wxPoint &tl, const wxPoint &br, const int &w)
+/*
+ * Called by the system of by wxWidgets when the panel needs
+ * to be redrawn. You can also trigger this call by
+ * calling Refresh()/Update().
+ */
+void Canvas::paintEvent(wxPaintEvent & evt)
 {
-  /* 
-   * tl
-   * p3                              p2
-   * |-------------------------------|
-   * |                               |
-   * |                               | 
-   * |-------------------------------|
-   * p0                              p1
-   *                                 br
-   */
-  std::vector<wxPoint> points;
-  wxPoint p0, p1, p2, p3;
-
-  auto insert = [&points, &w](wxPoint &from, wxPoint &to)
-  {
-    std::vector<wxPoint> line;
-    line = lerp(from, to, w);
-    points.insert(points.end(), line.begin(), line.end());
-  };
-
-  p0 = wxPoint(tl.x, br.y);
-  p1 = wxPoint(br.x, br.y);
-  p2 = wxPoint(br.x, tl.y);
-  p3 = wxPoint(tl.x, tl.y);
-
-  insert(p0, p1);
-  insert(p1, p2);
-  insert(p2, p3);
-  insert(p3, p0);
-
-  return points; 
+  wxPaintDC dc(this);
+  render(dc);
 }
 
-std::vector<wxPoint>
-Canvas::drawRectangle(const wxPoint &p1, Transaction &txn, const int &_width)
+/*
+ * Here we do the actual rendering. I put it in a separate
+ * method so that it can work no matter what type of DC
+ * (e.g. wxPaintDC or wxClientDC) is used.
+ */
+void Canvas::render(wxDC&  dc)
 {
+  PerfTimer paint;
+
   /*
-   * Approach:
-   * 1. If isNewTxn is FALSE (i.e. user previously moved the mouse) then
-   *    revert the current Transaction
-   * 2. Get the pixels to fill in by performing linear interpolation on each
-   *    pair of coordinates on the rectangle
-   *      <x0, y0> -> <x1, y1>, <x0, y0> -> <x0, y1>
-   *      <x1, y0> -> <x1, y1>, <x1, y1> -> <x1, y0>
-   * 3. Update currentTxn to include all points from 2.
-   * 4. Return the points
+   * Draw out the bitmap
    */
-  // (1)
-  if (!isNewTxn) {
-    revertTransaction(currentTxn);
+  ////////////////////////////////////
+  if (isShownStale) {
+    Frame &front = worker->lockFront();
+    wxImage img(front.width, front.height,
+        (unsigned char *)front.buffer, true);
+    shown = wxBitmap(img);
+    worker->unlockFront();
+    isShownStale = false;
+  }
+  dc.DrawBitmap(shown, 0, 0, false);
+
+  unsigned int resizeWidth = controller->getResizeWidth();
+  unsigned int resizeHeight = controller->getResizeHeight();
+  if (controller->isResizing()) {
+    dc.SetBrush(*wxTRANSPARENT_BRUSH);
+    dc.SetPen( wxPen( wxColor(0, 0, 0), 1) ); // 10-pixels-thick pink outline
+    dc.DrawRectangle( 0, 0, resizeWidth, resizeHeight );
   }
 
-  // (2)
-  std::vector<wxPoint> points;
-
-  {
-    wxPoint p2 = wxPoint(startPos.x, p1.y);
-    wxPoint p3 = wxPoint(p1.x, startPos.y);
-    std::vector<wxPoint> lines[4];
-
-    lines[0] = lerp(startPos, p3, _width);
-    lines[1] = lerp(p1, p3, _width);
-    lines[2] = lerp(p1, p2, _width);
-    lines[3] = lerp(startPos, p2, _width);
+  dc.SetBrush(*wxBLACK_BRUSH);
+  dc.SetPen(wxPen(wxColor(0, 0, 0), 1));
+  dc.DrawRectangle(resizeWidth-RESIZE_CTRL_LENGTH/2, resizeHeight-RESIZE_CTRL_LENGTH/2,
+      RESIZE_CTRL_LENGTH, RESIZE_CTRL_LENGTH);
+  ///////////////////////////////////
 
-    int i;
-    for (i=0; i < 4; i++) {
-      points.insert(points.end(), lines[i].begin(), lines[i].end());
-    }
-  }
+  if (showHud)
+    drawHud(dc);
 
-  updateTransaction(txn, points);
-  return points;
+  perf.record(controller->getTool(), PERF_PAINT, paint.elapsed());
 }
 
 /*
- * Used for generating Selection Border
- * - Given a border, remove points on the border
+ * Performance HUD in the top-right corner: latency of
+ * each stage for the current tool, then the counters.
  */
-std::vector<wxPoint>
-Canvas::makeDashed(const std::vector<wxPoint> &border)
+void Canvas::drawHud(wxDC &dc)
 {
-  std::vector<wxPoint> dashed;
-  int i;
-  for (i=0; i < border.size()-5; i++) {
-    if (i % 8 == 0) {
-      if (i+5 >= border.size()) {
-        break;
-      }
-      dashed.insert(
-          dashed.end(),
-          border.begin() + i,
-          border.begin() + i + 5);
-    }
-  }
-  return dashed;
-}
-
-void printPixels(std::vector<Pixel> pixels) {
+  ToolType tool = controller->getTool();
+  wxString lines[PERF_STAGES + 9];
+  int n = 0;
+
+  lines[n++] = wxString::Format("%s  (p50 / p99 / max ms)", toolName(tool));
+  int s;
+  for (s=0; s < PERF_STAGES; s++) {
+    const Histogram &h = perf.get(tool, (PerfStage)s);
+    lines[n++] = wxString::Format("%-6s %7.2f %7.2f %7.2f  n=%llu",
+        stageName((PerfStage)s),
+        h.percentile(0.5) / 1e6, h.percentile(0.99) / 1e6,
+        h.getMax() / 1e6, (unsigned long long)h.getCount());
+  }
+  lines[n++] = wxString::Format("last frame: %llu px, %llu B undo, %llu allocs",
+      (unsigned long long)perf.getLastPixels(),
+      (unsigned long long)perf.getLastUndoBytes(),
+      (unsigned long long)perf.getLastAllocs());
+  lines[n++] = wxString::Format("total: %llu px, %.1f MB undo",
+      (unsigned long long)perf.getPixels(),
+      perf.getUndoBytes() / (1024.0 * 1024.0));
+  lines[n++] = wxString::Format("stroke duplicates: %llu px, %.1f MB undo saved",
+      (unsigned long long)perf.getDuplicates(),
+      perf.getDuplicates() * sizeof(Pixel) / (1024.0 * 1024.0));
+  lines[n++] = wxString::Format("merged motion events: %llu",
+      (unsigned long long)controller->getMergedEvents());
+  uint64_t commits = journal->getCommits(), syncs = journal->getSyncs();
+  lines[n++] = wxString::Format(
+      "journal: %llu commits, %.0f B %.1f us each, %llu fsyncs %.1f ms avg",
+      (unsigned long long)commits,
+      commits ? (double)journal->getBytes() / commits : 0.0,
+      commits ? journal->getEncodeNs() / 1e3 / commits : 0.0,
+      (unsigned long long)syncs,
+      syncs ? journal->getSyncNs() / 1e6 / syncs : 0.0);
+  lines[n++] = wxString::Format("allocs: %llu (%.1f MB)",
+      (unsigned long long)perfAllocCount(),
+      perfAllocBytes() / (1024.0 * 1024.0));
+  lines[n++] = wxString::Format("history: %.1f MB packed to %.1f MB, rss %.1f MB",
+      perf.getPackedRawBytes() / (1024.0 * 1024.0),
+      perf.getPackedBytes() / (1024.0 * 1024.0),
+      perfResidentBytes() / (1024.0 * 1024.0));
+  lines[n++] = wxString::Format("region index: %.1f MB, %llu tiles built in %.1f ms",
+      perf.getRegionBytes() / (1024.0 * 1024.0),
+      (unsigned long long)perf.getRegionTiles(),
+      perf.getRegionNs() / 1e6);
+
+  int x = MAX(0, GetClientSize().GetWidth() - HUD_WIDTH);
+  dc.SetBrush(*wxWHITE_BRUSH);
+  dc.SetPen(wxPen(wxColor(0, 0, 0), 1));
+  dc.DrawRectangle(x, 0, HUD_WIDTH, n*HUD_LINE_HEIGHT + 8);
+  dc.SetTextForeground(wxColor(0, 0, 0));
   int i;
-  Pixel p;
-  for (i=0; i < pixels.size(); i++) {
-    p = pixels[i];
-    printf("pixel: (%d, %d) (%d %d %d)\n",
-        p.x,
-        p.y,
-        p.color.r,
-        p.color.g,
-        p.color.b);
+  for (i=0; i < n; i++) {
+    dc.DrawText(lines[i], x + 4, 4 + i*HUD_LINE_HEIGHT);
   }
 }
 
 /*
- * Reset all selection related fields
+ * Runs one input event through the controller and times
+ * it. The controller only queues engine commands, the
+ * raster thread reports back through present().
  */
-void Canvas::clearSelection() {
-  selected = false;
-  whiteoutSelect = true;
-  selectionArea.clear();
-  selectionBorder.clear();
-  revertTransaction(selectTxn);
-  selectTxn.pixels.clear();
-  selectBackgrnd.pixels.clear();
-  if (selection != NULL) {
-    delete selection;
-    selection = NULL;
-  }
+template <typename F>
+void Canvas::handleInput(F dispatch)
+{
+  PerfTimer input;
+  ToolType tool = controller->getTool();
+  bool wasBusy = controller->isBusy();
+
+  dispatch();
+  if (!wasBusy && controller->isBusy())
+    jobTimer.Start(JOB_STATUS_INTERVAL_MS);
+
+  /* The resize preview is drawn from controller state */
+  if (controller->isResizing())
+    wxWindow::Refresh();
+  perf.record(tool, PERF_INPUT, input.elapsed());
 }
 
-void
-Canvas::handleSelectionClick(wxPoint &pt)
+/* Progress of the running job in the status bar */
+void Canvas::jobTick(wxTimerEvent &evt)
 {
-  if (!selected || selection == NULL) {
+  if (frame->GetStatusBar() == NULL)
     return;
-  }
-  if (!selection->isWithinBounds(pt)) {
-    clearSelection();
-  }
+
+  frame->SetStatusText(wxString::Format("Working... %d%%  (Esc to cancel)",
+        worker->getProgress() * 100 / JOB_PROGRESS_MAX));
 }
 
 /*
- * Functions to set the selection area
- * based on the Selection object.
- * One function for each type of selection.
+ * Posted by the worker thread once a job returned. Input
+ * deferred meanwhile is dispatched by finishJob() and may
+ * well start the next job.
  */
-void
-Canvas::getSelectionArea(
-    std::vector<Pixel> &area,
-    RectangleSelection *selection)
+void Canvas::jobFinished(bool cancelled)
 {
-  /*
-   * The width and height of the selection
-   * should include the pixels occupied
-   * by the selection border
-   */
-  int _width = (selection->maxX - selection->minX);
-  int _height = (selection->maxY - selection->minY);
-  area.resize(_width * _height);
-
-  int startX = selection->minX + 1;
-  int startY = selection->minY + 1;
-  int endX = startX + _width;
-  int endY = startY + _height;
-
-  /* Set the selectionArea pixels */
-  int i, j, k=0;
-  Pixel p;
-  wxPoint pt;
-  for (i=startX; i < endX; i++) {
-    for (j=startY; j < endY; j++) {
-      pt = wxPoint(i, j);
-      p = getPixel(pt);
-      area[k] = p;
-      k++;
-    }
-  }
+  jobTimer.Stop();
+  controller->finishJob(cancelled);
+  setStatus(cancelled ? wxT("Cancelled") : wxT(""));
+
+  /* Only set for the job that just returned: neither is
+   * started while another job runs */
+  if (importing != NULL) {
+    if (importing->hasFailed())
+      setStatus(wxString::Format("Could not read %s", importing->getPath()));
+    else if (!cancelled && recovery != NULL)
+      setStatus(wxString::Format("Recovered %d unsaved changes",
+            (int)recovery->getRecords()));
+    delete importing;
+    importing = NULL;
+  }
+  if (exporting != NULL) {
+    if (exporting->wasSaved())
+      setStatus(wxString::Format("Exported %s (%.1f MB, %.1f ms)",
+            exporting->getPath(), exporting->getBytes() / (1024.0 * 1024.0),
+            exportTimer.elapsed() / 1e6));
+    else if (!cancelled)
+      setStatus(wxString::Format("Could not write %s", exporting->getPath()));
+    delete exporting;
+    exporting = NULL;
+  }
+
+  if (controller->isBusy())
+    jobTimer.Start(JOB_STATUS_INTERVAL_MS);
 }
 
-void
-Canvas::getSelectionArea(
-    std::vector<Pixel> &selectionArea,
-    CircleSelection *selection)
-{
-  wxPoint c = selection->_c;
-  double r = selection->_r;
-
-  int minX, maxX, minY, maxY;
-  minX = selection->minX;
-  maxX = selection->maxX;
-  minY = selection->minY;
-  maxY = selection->maxY;
-
-  int x, y;
-  wxPoint pt;
-  for (x=minX; x < maxX; x++) {
-    for (y=minY; y < maxY; y++) {
-      pt = wxPoint(x, y);
-      if (squaredLength(pt, c) < r*r) {
-        selectionArea.push_back(getPixel(pt));
+void Canvas::keyDownEvent(wxKeyEvent &evt) {
+  switch (evt.GetKeyCode()) {
+    case WXK_ESCAPE:
+      if (controller->isBusy()) {
+        worker->cancel();
+        return;
       }
-    }
+      break;
+    case WXK_F3:
+      showHud = !showHud;
+      wxWindow::Refresh();
+      return;
+    case WXK_F4:
+      if (!perf.dump(PERF_DUMP_FILE))
+        std::cerr << "Could not write " << PERF_DUMP_FILE << "\n";
+      return;
+    default:
+      break;
   }
 
-}
+  char uc = evt.GetUnicodeKey();
+  bool ctrl = evt.ControlDown();
 
-void
-Canvas::getSelectionArea(
-    std::vector<Pixel> &selectionArea,
-    LassoSelection *selection)
-{
-  int minX, maxX, minY, maxY;
-  minX = selection->minX;
-  maxX = selection->maxX;
-  minY = selection->minY;
-  maxY = selection->maxY;
-
-  int x, y;
-  wxPoint pt;
-  for (x=minX+1; x < maxX; x++) {
-    for (y=minY+1; y < maxY; y++) {
-      pt = wxPoint(x, y);
-      if (selection->isWithinBounds(pt)) {
-        selectionArea.push_back(getPixel(pt));
-      }
-    }
+  /* Documents, handled here since they aren't recorded */
+  if (ctrl && uc == 'S') {
+    save();
+    return;
   }
-}
-
-/*
- * Handles mouseMove event for selection tools
- * Takes in a "drawBorder" parameter which points to one
- * of: drawRectangle(), drawCircle(), or drawFreehand()
- * depending on the tool type.
- */
-void
-Canvas::handleSelectionMove(const wxPoint &currPos,
-  std::vector<wxPoint> (Canvas::*drawBorder)(const wxPoint&, Transaction &, const int&))
-{
-  /*
-   * Two cases to consider:
-   * 1. User hasn't made a selection
-   *    - Have to draw the selection border
-   * 2. User has a selection
-   *    - Have to move the selected pixels to the
-   *      new position
-   */
-  if (!selected) {
-    Transaction txn, sTxn;
-    if (!isNewTxn)
-      revertTransaction(currentTxn);
-
-    selectionBorder = (this->*drawBorder)(currPos, txn, 1);
-    updateBuffer(
-        makeDashed(selectionBorder),
-        SELECT);
-
-    selectTxn = txn;
-    currentTxn = txn;
+  if (ctrl && uc == 'O') {
+    wxFileDialog dialog(this, wxT("Open document"), wxEmptyString,
+        wxEmptyString,
+        wxT("Paint documents (*.pdoc)|*.pdoc|Images (*.png;*.bmp)|*.png;*.bmp"),
+        wxFD_OPEN | wxFD_FILE_MUST_EXIST);
+    if (dialog.ShowModal() == wxID_OK && !open(dialog.GetPath().mb_str()))
+      setStatus(wxString(wxT("Could not open ")) + dialog.GetPath());
+    return;
   }
-  else {
-    int xOffset = currPos.x - startPos.x;
-    int yOffset = currPos.y - startPos.y;
-    Transaction txn;
-    move(selectionArea, xOffset, yOffset, txn);
-    currentTxn = txn;
+  if (ctrl && uc == 'E') {
+    wxFileDialog dialog(this, wxT("Export image"), wxEmptyString,
+        wxEmptyString, wxT("PNG (*.png)|*.png|BMP (*.bmp)|*.bmp"),
+        wxFD_SAVE | wxFD_OVERWRITE_PROMPT);
+    if (dialog.ShowModal() == wxID_OK && !exportImage(dialog.GetPath().mb_str()))
+      setStatus(wxT("Busy, not exported"));
+    return;
   }
+
+  handleInput([&]() {
+    controller->keyDown(uc, ctrl);
+  });
 }
 
-void
-Canvas::handleSelectionRelease(const wxPoint &p0, const wxPoint &p1)
+void Canvas::keyUpEvent(wxKeyEvent & evt) {
+  char uc = evt.GetUnicodeKey();
+  controller->keyUp(uc);
+}
+
+/* Event handlers to handle CANVAS mouse events */
+void Canvas::mouseDown(wxMouseEvent &evt)
 {
-  /*
-   * Two cases to consider:
-   * 1. User has not made a selection yet
-   *      The release action will complete the selection
-   *      process and define the selectionArea.
-   * 2. User has a selection already
-   *      Clear the selection.
-   */
-  if (selected) {
-    clearSelection();
-  }
-  else {
-    /*
-     * Selection area provided by the getSelectionArea()
-     * functions don't include the border pixels because
-     * when we reach this function, the bordr pixels
-     * will no longer have the original colours but the
-     * SELECT colour as the border is already rendered.
-     * We get the border pixels from the selectTxn
-     * because selectTxn has the original colours.
-     */
-    std::vector<wxPoint> interp = lerp(p0, p1, 1);
-    switch (toolType) {
-      case SlctRect:
-        selection = new RectangleSelection(p0, p1);
-        getSelectionArea(selectionArea,
-            dynamic_cast<RectangleSelection *>(selection));
-        break;
-      case SlctCircle:
-        selection = new CircleSelection(p0, p1);
-        getSelectionArea(selectionArea,
-            dynamic_cast<CircleSelection *>(selection));
-        break;
-      case Lasso:
-        /*
-         * Have to connect the start and end mouse
-         * positions to create a closed polygon shape.
-         * Since the border is changed, we also
-         * have to update selectTxn which is in charge
-         * of reverting the border once the user
-         * completes translation (on mouse release).
-         */
-        selectionBorder.insert(selectionBorder.end(),
-            interp.begin(), interp.end());
-        updateTransaction(selectTxn, interp);
-        selection = new LassoSelection(p0, p1, selectionBorder);
-        getSelectionArea(selectionArea,
-            dynamic_cast<LassoSelection *>(selection));
-        break;
-      default:
-        break;
-    }
-    selectionArea.insert(selectionArea.end(),
-        selectTxn.pixels.begin(),
-        selectTxn.pixels.end());
-    selected = true;
-  }
+  this->SetFocus();
+
+  /* Always should be left is down */
+  assert(evt.LeftIsDown());
+
+  /* Shift+click fills non-contiguously, for that click only */
+  wxPoint p(evt.GetX(), evt.GetY());
+  bool global = evt.ShiftDown() && controller->getTool() == Fill;
+  handleInput([&]() {
+    if (global)
+      controller->setContiguous(false);
+    controller->mouseDown(p);
+    if (global)
+      controller->setContiguous(true);
+  });
+  frameTimer.Start(FRAME_INTERVAL_MS);
 }
 
-void
-Canvas::move(
-    const std::vector<Pixel> &pixels,
-    const int &xOffset, const int &yOffset,
-    Transaction &txn)
+/*
+ * Motion is only queued here; frameTick() rasterizes all
+ * samples received during the frame in one pass.
+ */
+void Canvas::mouseMoved(wxMouseEvent &evt)
 {
-  /*
-   * Step:
-   * 1. Save all pixels (the original selection, and the new
-   *    translaged pixels). This has to be done first in case
-   *    there is overlap between the original selection and
-   *    the new position.
-   * 2. White out selection (should include border pixels)
-   * 3. Translate the selection area
-   * 4. Save border pixels to selectTxn (required
-   *      for mouseRelease event - have to revert
-   *      the border)
-   * 5. Redraw border
-   */
-  if (!isNewTxn) {
-    revertTransaction(currentTxn);
-  }
+  if (!evt.LeftIsDown())
+    return;
 
-  // (1) Save all pixels (original and translated)
-  {
-    int i;
-    Pixel pixel, translatedPix;
-    wxPoint oldPt, newPt;
-    for (i=0; i < selectionArea.size(); i++) {
-      pixel = selectionArea[i];
-
-      newPt = wxPoint(pixel.x + xOffset, pixel.y + yOffset);
-      oldPt = wxPoint(pixel.x, pixel.y);
-      translatedPix = Pixel(getPixelColor(newPt), newPt);
-      txn.update(pixel);
-      txn.update(translatedPix);
-    }
-  }
+  controller->queueMotion(wxPoint(evt.GetX(), evt.GetY()));
+}
 
-  // (2) Option 1: whiteout pixels
-  //     Option 2: restore pixels to what's 'underneath'
-  {
-    if (whiteoutSelect) {
-      int i;
-      wxPoint oldPt, newPt;
-      Pixel pixel, whitePixel, oldPixel;
-      for (i=0; i < selectionArea.size(); i++) {
-        pixel = selectionArea[i];
-        oldPt = wxPoint(pixel.x, pixel.y);
-        whitePixel = Pixel(Color(255, 255, 255), oldPt);
-        updateBuffer(whitePixel);
-      }
-    } else {
-      revertTransaction(selectBackgrnd);
-    }
-  }
+void Canvas::frameTick(wxTimerEvent &evt)
+{
+  if (!controller->hasPendingMotion())
+    return;
 
-  // (3) translate the selection
-  {
-    int i;
-    wxPoint newPt;
-    Color clr;
-    Pixel pixel, newPixel, p;
-    for (i=0; i < selectionArea.size(); i++) {
-      pixel = selectionArea[i];
-      clr = pixel.color;
-
-      newPt = wxPoint(
-          pixel.x + xOffset,
-          pixel.y + yOffset);
-      newPixel = Pixel(clr, newPt);
-
-      updateBuffer(newPixel);
-    }
-  }
+  handleInput([&]() {
+    controller->flushMotion();
+  });
+}
 
-  // (4-5) Save border pixels to select txn, draw border
-  {
-    int i;
-    wxPoint pt, newPt;
-    std::vector<wxPoint> border;
-    border.resize(selectionBorder.size());
-
-    for (i=0; i < selectionBorder.size(); i++) {
-      pt = selectionBorder[i];
-      newPt = wxPoint(pt.x + xOffset, pt.y + yOffset);
-      selectTxn.pixels[i] = Pixel(getPixelColor(newPt), newPt);
-      border[i] = newPt;
-    }
+/*
+ * Release flushes any queued motion first. A resize
+ * finishes in present(), which rebuilds the
+ * navigator once the new dimensions are in.
+ */
+void Canvas::mouseReleased(wxMouseEvent &evt)
+{
+  frameTimer.Stop();
 
-    /* draw border */
-    updateBuffer(makeDashed(border), SELECT);
-  }
-}
\ No newline at end of file
+  wxPoint p(evt.GetX(), evt.GetY());
+  handleInput([&]() {
+    controller->mouseReleased(p);
+  });
+}
@@ -5,155 +5,155 @@
 #ifndef PAINT_CANVAS_H
 #define PAINT_CANVAS_H
 
-#include "transaction.h"
-#include "pixel.h"
-#include "selection.h"
-
-enum ToolType
+#include "raster.h"
+#include "controller.h"
+#include "recorder.h"
+#include "perf.h"
+#include "navigator.h"
+#include "worker.h"
+#include "pool.h"
+#include "document.h"
+#include "journal.h"
+#include "image.h"
+
+/* Motion is rasterized at most once per display frame */
+#define FRAME_INTERVAL_MS 16
+
+/* Status bar refresh while a background job runs */
+#define JOB_STATUS_INTERVAL_MS 100
+
+enum
 {
-  Pencil,
-  Line,
-  DrawRect,
-  DrawCircle,
-  Eraser,
-  Fill,
-  SlctRect,
-  SlctCircle,
-  Lasso
-};
-
-enum KEY_PRESS
-{
-  KEY_Z = 90,
-  KEY_C = 67,
-  KEY_V = 86,
-  KEY_A = 65,
-  KEY_DEL = 127
+  FRAME_TIMER = wxID_HIGHEST + 100,
+  JOB_TIMER = wxID_HIGHEST + 101
 };
 
+/*
+ * Window adapter around the headless Raster engine.
+ * Forwards wx mouse/key events to a Controller, backs
+ * its clipboard with the system clipboard and paints
+ * the frames published by the raster thread.
+ */
 class Canvas : public wxPanel {
   private:
-    /* In pixels */
-    unsigned int width;
-    unsigned int height;
-
-    /* Used to hold temporary width while the
-     * user resizes the canvas*/
-    unsigned int resizeWidth;
-    unsigned int resizeHeight;
-
-    /* The mouse position where the user first
-     * clicked the left mouse button*/
-    wxPoint startPos;
-
-    /* TRUE if the user is resizing the canvas */
-    bool isResize = false;
-
-    /* Holds the transaction currently
-     * taking place.
-     * There should only be ONE txn occuring
-     * at a time */
-    bool isNewTxn;
-    Transaction currentTxn;
-    Transaction selectTxn;
-    Transaction selectBackgrnd;
-
-    /* Selection tool fields */
-    bool whiteoutSelect = true;
-    bool selected = false;
-    std::vector<Pixel> selectionArea;
-    std::vector<wxPoint> selectionBorder;
-    Selection *selection = NULL;
-
-    /* Sampled points for freehand */
-    std::vector<wxPoint> freehand;
-
-    /* This is the main buffer that is drawn to the screen */
-    char *Buffer;
-    std::vector<Transaction> transactions;
-    
-    /* 
-     * For Ctrl+Z - redo options
-     *
-     * Note:
-     * If we want to implement "Redo" option, need another
-     * 'forward' list of transactions to store the pixel 
-     * values after a particular transaction.
-     * Currently 'transactions' vector stores the previous
-     * state of the changed pixels so we can always go back
-     * to the buffer state prior to a transaction.
-     * 
-     * A 'forward' transactions vector would store the 
-     * values and locations of the pixels changed as a result
-     * of the transaction, so upon an 'undo' (i.e. Ctrl+Z),
-     * a 'redo' can be executed so that the transaction which
-     * was undid, can be reinstated onto the buffer.
-     */
-    bool isRedo = false; /* Currently not supported */
-    bool isUndo = false;
-    bool isCopy = false;
-    bool isPaste = false;
-    bool isSelectAll = false;
-    bool isDelete = false;
+    /* All pixel state lives here */
+    Raster *raster;
+    Controller *controller;
+    Clipboard *clipboard;
+
+    /* Raster thread, owns 'raster' from construction
+     * on. The status bar of 'frame' shows the progress
+     * of heavy commands, Esc cancels them. */
+    Worker *worker;
+    wxFrame *frame;
+    wxTimer jobTimer;
+
+    /* Helpers the raster thread splits large strokes over */
+    ThreadPool *pool;
+
+    /* Bitmap of the last presented frame */
+    wxBitmap shown;
+    bool isShownStale = true;
+
+    /* Document the canvas was opened from or last saved
+     * to, NULL for a new canvas. Ctrl+O opens, Ctrl+S saves. */
+    Document *document = NULL;
+
+    /* Autosave of every committed change, and the journal
+     * being recovered from, if any */
+    Journal *journal;
+    JournalReader *recovery = NULL;
+
+    /* Image being imported or exported by the running job.
+     * Ctrl+O opens images as well, Ctrl+E exports. */
+    ImageReader *importing = NULL;
+    ImageWriter *exporting = NULL;
+    PerfTimer exportTimer;
+
+    /* Optional input recording, see startRecording() */
+    Recorder *recorder = NULL;
+
+    /* Overview panel, kept in sync through the
+     * engine's dirty region */
+    Navigator *navigator = NULL;
+    unsigned int navWidth = 0;
+    unsigned int navHeight = 0;
+
+    /* History panel, one entry per step plus the blank
+     * canvas; the selected one is the step shown */
+    wxListBox *historyList = NULL;
+
+    /* Per-tool latency histograms and counters.
+     * F3 toggles the on-screen HUD, F4 dumps to PERF_DUMP_FILE. */
+    PerfStats perf;
+    bool showHud = false;
+
+    /* Runs while the button is down and drains the
+     * queued motion samples once per frame */
+    wxTimer frameTimer;
 
     /*
      * Private functions
      */
-    Pixel getPixel(const wxPoint &p);
-    Color getPixelColor(const wxPoint &p);
-    void getNeighbors(const wxPoint &p, wxPoint *neighbors, int &ncount);
-
-    void updateBuffer(const std::vector<wxPoint> &points, const Color &color);
-    void updateBuffer(const Pixel &p);
-    void addTransaction(Transaction &txn);
-    void revertTransaction(Transaction &txn);
-    void updateTransaction(Transaction &txn, const std::vector<wxPoint> &points);
-
-    bool pasteFromClip(Transaction &txn);
-    void cpySelectToClip();
-    void selectAll(Transaction &txn);
-    bool clearSelectedArea(Transaction &txn, Color c);
-
-    std::vector<wxPoint> drawFreeHand(const wxPoint &currPos, Transaction &txn, const int &_width);
-    std::vector<wxPoint> drawRectangle(const wxPoint &currPos, Transaction &txn, const int &_width);
-    std::vector<wxPoint> drawRectangle(const wxPoint &tl, const wxPoint &br, const int &_width);
-    std::vector<wxPoint> drawCircle(const wxPoint &currPos, Transaction &txn, const int &_width);
-    std::vector<wxPoint> drawLine(const wxPoint &currPos, Transaction &txn, const int &_width);
-    void fill(const wxPoint &p, const Color &color, Transaction &txn);
-
-    /* Event handlers for rectangle selection */
-    void clearSelection();
-
-    void getSelectionArea(std::vector<Pixel> &area, RectangleSelection *selection);
-    void getSelectionArea(std::vector<Pixel> &area, CircleSelection *selection);
-    void getSelectionArea(std::vector<Pixel> &area, LassoSelection *selection);
-
-    std::vector<wxPoint> makeDashed(const std::vector<wxPoint> &border);
-    void handleSelectionClick(wxPoint &pt);
-    void handleSelectionMove(const wxPoint &currPos,
-         std::vector<wxPoint> (Canvas::*drawBorder)(const wxPoint&, Transaction &, const int&));
-    void handleSelectionRelease(const wxPoint &p0, const wxPoint &p1);
-
-    void move(const std::vector<Pixel> &pixels,
-        const int &xOffset, const int &yOffset, Transaction &txn);
-
-    /* handle resize events */
-    bool isResizeEvt(const int &x, const int &y);
-    void moveBuffer();
+    void present();
+    void updateViewport();
+    void resetNavigator(const Frame &frame);
+    void updateHistory(const Frame &frame);
+    void jobFinished(bool cancelled);
+    bool openImage(const char *path);
+    void setStatus(const wxString &text);
+
+    template <typename F> void handleInput(F dispatch);
+    void drawHud(wxDC &dc);
 
 public:
-    Canvas(wxFrame *parent);
     Canvas(wxFrame *parent, unsigned int width, unsigned int height);
-    ToolType toolType;
+    ~Canvas();
+
+    void setNavigator(Navigator *navigator);
+    void setHistoryList(wxListBox *list);
 
-    /* The colour selected by the user */
-    Color color;
+    /* Record every input event to 'path' until the canvas
+     * is destroyed. Returns false if the file can't be opened. */
+    bool startRecording(const char *path);
+
+    /*
+     * Replace the canvas with the document or PNG/BMP image
+     * at 'path', plus whatever its journal holds that was
+     * never saved. Images decode in the background and show
+     * up as they do; the canvas is untitled afterwards.
+     * Returns false if it can't be opened or a job runs.
+     */
+    bool open(const char *path);
+
+    /* Write the canvas to a PNG or BMP (by extension) in
+     * the background. Returns false if a job runs. */
+    bool exportImage(const char *path);
+
+    /*
+     * Autosave an untitled canvas. A journal left behind
+     * by a crashed untitled session is recovered first.
+     */
+    void startAutosave();
+
+    /*
+     * Save to the current document, asking for a file
+     * name the first time. Only modified tiles are written.
+     */
+    bool save();
 
-    /* Line thickness for drawing tools */
-    int thiccness;
+    /* Tool settings, forwarded to the engine */
+    void setTool(ToolType toolType);
+    void setColor(const Color &color);
+    void setThiccness(int thiccness);
+    void setBrush(bool antialias, int softness);
+    void setTolerance(int tolerance, ColorDistance distance);
+    void setRegionIndex(bool on);
+    void jumpTo(size_t step);
 
     /* Screen refresh event handlers */
     void paintEvent(wxPaintEvent & evt);
+    void sizeEvent(wxSizeEvent & evt);
     void paintNow();
 
     /* Mouse event handlers */
@@ -162,6 +162,8 @@ public:
     void mouseDown(wxMouseEvent & evt);
     void mouseMoved(wxMouseEvent & evt);
     void mouseReleased(wxMouseEvent & evt);
+    void frameTick(wxTimerEvent & evt);
+    void jobTick(wxTimerEvent & evt);
 
     void render(wxDC& dc);
     DECLARE_EVENT_TABLE()
@@ -0,0 +1,509 @@
+#include <wx/gdicmn.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "controller.h"
+#include "recorder.h"
+
+/************** MemoryClipboard ****************/
+bool MemoryClipboard::getImage(std::vector<unsigned char> &rgb,
+    std::vector<unsigned char> &alpha,
+    unsigned int &M, unsigned int &N) {
+  if (this->M == 0 || this->N == 0)
+    return false;
+
+  rgb = this->rgb;
+  alpha = this->alpha;
+  M = this->M;
+  N = this->N;
+  return true;
+}
+
+void MemoryClipboard::setImage(unsigned char *rgb, unsigned char *alpha,
+    int M, int N) {
+  this->rgb.assign(rgb, rgb + 3*M*N);
+  this->alpha.assign(alpha, alpha + M*N);
+  this->M = M;
+  this->N = N;
+  free(rgb);
+  free(alpha);
+}
+
+/************** Controller ****************/
+Controller::Controller(Raster *raster, Clipboard *clipboard) {
+  this->raster = raster;
+  this->clipboard = clipboard;
+  syncState();
+  resizeWidth = width;
+  resizeHeight = height;
+}
+
+void Controller::setRecorder(Recorder *recorder) {
+  this->recorder = recorder;
+  if (recorder == NULL)
+    return;
+
+  /* Current settings, so that replays start from the same state */
+  if (worker)
+    worker->sync();
+  recorder->tool(raster->toolType);
+  recorder->color(raster->color);
+  recorder->thiccness(raster->thiccness);
+  recorder->brush(raster->antialias, raster->softness);
+  recorder->tolerance(raster->tolerance, raster->distance);
+  recorder->contiguous(raster->contiguous);
+}
+
+void Controller::setWorker(Worker *worker) {
+  this->worker = worker;
+}
+
+/*
+ * Engine state the input path depends on. Only read
+ * while the raster thread is idle.
+ */
+void Controller::syncState() {
+  tool = raster->toolType;
+  width = raster->getWidth();
+  height = raster->getHeight();
+}
+
+/*
+ * Hands 'cmd' to the raster thread, or runs it inline if
+ * there is none (replays, benchmarks). Input is deferred
+ * until a heavy command has finished.
+ */
+void Controller::send(Command &cmd) {
+  if (worker == NULL) {
+    cmd.run(*raster);
+    if (cmd.heavy)
+      syncState();
+    return;
+  }
+
+  if (cmd.heavy)
+    busy = true;
+  worker->push(cmd);
+}
+
+/*
+ * The heavy command has returned: pick up the state it
+ * changed, note a cancellation in the recording and catch
+ * up on the input that arrived meanwhile.
+ */
+void Controller::finishJob(bool cancelled) {
+  busy = false;
+  syncState();
+  if (cancelled && recorder)
+    recorder->cancel();
+
+  while (!busy && !deferred.empty()) {
+    std::function<void()> input = deferred.front();
+    deferred.pop_front();
+    input();
+  }
+}
+
+void Controller::setTool(ToolType toolType) {
+  if (busy) {
+    deferred.push_back([this, toolType]() { setTool(toolType); });
+    return;
+  }
+  if (recorder)
+    recorder->tool(toolType);
+  tool = toolType;
+
+  Command cmd;
+  cmd.type = CMD_TOOL;
+  cmd.tool = toolType;
+  send(cmd);
+}
+
+void Controller::setColor(const Color &color) {
+  if (busy) {
+    Color c = color;
+    deferred.push_back([this, c]() { setColor(c); });
+    return;
+  }
+  if (recorder)
+    recorder->color(color);
+
+  Command cmd;
+  cmd.type = CMD_COLOR;
+  cmd.color = color;
+  send(cmd);
+}
+
+void Controller::setThiccness(int thiccness) {
+  if (busy) {
+    deferred.push_back([this, thiccness]() { setThiccness(thiccness); });
+    return;
+  }
+  if (recorder)
+    recorder->thiccness(thiccness);
+
+  Command cmd;
+  cmd.type = CMD_THICC;
+  cmd.thiccness = thiccness;
+  send(cmd);
+}
+
+void Controller::setBrush(bool antialias, int softness) {
+  if (busy) {
+    deferred.push_back([this, antialias, softness]() {
+      setBrush(antialias, softness);
+    });
+    return;
+  }
+  if (recorder)
+    recorder->brush(antialias, softness);
+
+  Command cmd;
+  cmd.type = CMD_BRUSH;
+  cmd.antialias = antialias;
+  cmd.softness = softness;
+  send(cmd);
+}
+
+void Controller::setTolerance(int tolerance, ColorDistance distance) {
+  if (busy) {
+    deferred.push_back([this, tolerance, distance]() {
+      setTolerance(tolerance, distance);
+    });
+    return;
+  }
+  if (recorder)
+    recorder->tolerance(tolerance, distance);
+
+  Command cmd;
+  cmd.type = CMD_TOLERANCE;
+  cmd.tolerance = tolerance;
+  cmd.distance = distance;
+  send(cmd);
+}
+
+void Controller::setContiguous(bool contiguous) {
+  if (busy) {
+    deferred.push_back([this, contiguous]() { setContiguous(contiguous); });
+    return;
+  }
+  if (recorder)
+    recorder->contiguous(contiguous);
+
+  Command cmd;
+  cmd.type = CMD_CONTIGUOUS;
+  cmd.contiguous = contiguous;
+  send(cmd);
+}
+
+void Controller::setRegionIndex(bool on) {
+  if (busy) {
+    deferred.push_back([this, on]() { setRegionIndex(on); });
+    return;
+  }
+
+  Command cmd;
+  cmd.type = CMD_REGION_INDEX;
+  cmd.regionIndex = on;
+  send(cmd);
+}
+
+void Controller::jumpTo(size_t step) {
+  if (busy) {
+    deferred.push_back([this, step]() { jumpTo(step); });
+    return;
+  }
+  if (recorder)
+    recorder->jump(step);
+
+  Command cmd;
+  cmd.type = CMD_JUMP;
+  cmd.step = step;
+  send(cmd);
+}
+
+bool Controller::isResizeEvt(const int &x, const int &y) {
+  int width = this->width;
+  int height = this->height;
+  return ((x >= width - RESIZE_CTRL_LENGTH/2) &&
+      (x <= width + RESIZE_CTRL_LENGTH) &&
+      (y >= height - RESIZE_CTRL_LENGTH/2) &&
+      (y <= height + RESIZE_CTRL_LENGTH));
+}
+
+void Controller::mouseDown(const wxPoint &p) {
+  if (busy) {
+    deferred.push_back([this, p]() { mouseDown(p); });
+    return;
+  }
+  flushMotion();
+  if (recorder)
+    recorder->mouseDown(p);
+
+  startPos = p;
+  if ((isResize = isResizeEvt(p.x, p.y))) {
+    resizeWidth = width;
+    resizeHeight = height;
+    return;
+  }
+
+  Command cmd;
+  cmd.type = CMD_MOUSE_DOWN;
+  cmd.heavy = tool == Fill || tool == MagicWand;
+  cmd.p = p;
+  send(cmd);
+}
+
+void Controller::mouseMoved(const wxPoint &p) {
+  if (busy) {
+    deferred.push_back([this, p]() { mouseMoved(p); });
+    return;
+  }
+  if (recorder)
+    recorder->mouseMoved(p);
+
+  /* A frame of one sample */
+  pendingMotion.push_back(p);
+  flushMotion();
+}
+
+void Controller::queueMotion(const wxPoint &p) {
+  if (busy) {
+    deferred.push_back([this, p]() { queueMotion(p); });
+    return;
+  }
+  if (recorder)
+    recorder->mouseMoved(p);
+  pendingMotion.push_back(p);
+}
+
+bool Controller::flushMotion() {
+  if (busy || pendingMotion.empty())
+    return false;
+
+  mergedEvents += pendingMotion.size() - 1;
+  if (isResize) {
+    wxPoint p = pendingMotion.back();
+    resizeWidth = width + p.x - startPos.x;
+    resizeHeight = height + p.y - startPos.y;
+    pendingMotion.clear();
+    return true;
+  }
+
+  /* The samples go in their own storage, which comes back
+   * for a later frame: at once when run inline, once run
+   * from the worker. A drag then allocates nothing. */
+  Command cmd;
+  cmd.type = CMD_MOUSE_MOVE;
+  cmd.samples.swap(pendingMotion);
+  send(cmd);
+  if (worker == NULL) {
+    cmd.samples.clear();
+    pendingMotion.swap(cmd.samples);
+  } else {
+    worker->reclaim(pendingMotion);
+  }
+  return true;
+}
+
+void Controller::mouseReleased(const wxPoint &p) {
+  if (busy) {
+    deferred.push_back([this, p]() { mouseReleased(p); });
+    return;
+  }
+  flushMotion();
+  if (recorder)
+    recorder->mouseReleased(p);
+
+  Command cmd;
+  if (isResize) {
+    isResize = false;
+    cmd.type = CMD_RESIZE;
+    cmd.heavy = true;
+    cmd.M = resizeWidth;
+    cmd.N = resizeHeight;
+    send(cmd);
+    return;
+  }
+
+  cmd.type = CMD_MOUSE_UP;
+  cmd.p = p;
+  send(cmd);
+}
+
+void Controller::keyDown(int key, bool ctrl) {
+  if (busy) {
+    deferred.push_back([this, key, ctrl]() { keyDown(key, ctrl); });
+    return;
+  }
+  flushMotion();
+
+  /*
+   * Read the clipboard up front so that a recording
+   * carries the exact image this paste will see.
+   */
+  std::vector<unsigned char> rgb, alpha;
+  unsigned int M = 0, N = 0;
+  bool hasImage = false;
+  if (ctrl && key == KEY_V && !isPaste)
+    hasImage = clipboard->getImage(rgb, alpha, M, N);
+
+  if (recorder) {
+    if (hasImage)
+      recorder->clipboard(rgb, alpha, M, N);
+    recorder->keyDown(key, ctrl);
+  }
+
+  Command cmd;
+  if (ctrl) {
+    switch (key) {
+      case (KEY_Z):
+        if (!isUndo) {
+          isUndo = true;
+          cmd.type = CMD_UNDO;
+          send(cmd);
+        }
+        break;
+      case (KEY_C):
+        if (!isCopy) {
+          isCopy = true;
+
+          /* The selection has to be read where it stands,
+           * after everything queued so far */
+          if (worker)
+            worker->sync();
+          unsigned char *data, *_alpha;
+          int w, h;
+          if (raster->copy(&data, &_alpha, w, h))
+            clipboard->setImage(data, _alpha, w, h);
+        }
+        break;
+      case (KEY_V):
+        if (!isPaste) {
+          isPaste = true;
+          if (hasImage) {
+            cmd.type = CMD_PASTE;
+            cmd.heavy = true;
+            cmd.rgb.swap(rgb);
+            cmd.alpha.swap(alpha);
+            cmd.M = M;
+            cmd.N = N;
+            send(cmd);
+          }
+        }
+        break;
+      case (KEY_A):
+        if (!isSelectAll) {
+          isSelectAll = true;
+          cmd.type = CMD_SELECT_ALL;
+          cmd.heavy = true;
+          send(cmd);
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  if (key == KEY_DEL) {
+    if (!isDelete) {
+      isDelete = true;
+      cmd.type = CMD_DELETE;
+      cmd.heavy = true;
+      send(cmd);
+    }
+  }
+}
+
+void Controller::keyUp(int key) {
+  if (busy) {
+    deferred.push_back([this, key]() { keyUp(key); });
+    return;
+  }
+  if (recorder)
+    recorder->keyUp(key);
+
+  // Z is released - not checking for Ctrl here on purpose
+  switch(key) {
+    case (KEY_Z):
+      isUndo = false;
+      break;
+    case (KEY_C):
+      isCopy = false;
+      break;
+    case (KEY_V):
+      isPaste = false;
+      break;
+    case (KEY_A):
+      isSelectAll = false;
+      break;
+    case (KEY_DEL):
+      isDelete = false;
+      break;
+    default:
+      break;
+  }
+}
+
+void Controller::load(Document *document) {
+  if (busy) {
+    deferred.push_back([this, document]() { load(document); });
+    return;
+  }
+  flushMotion();
+
+  Command cmd;
+  cmd.type = CMD_LOAD;
+  cmd.heavy = true;
+  cmd.document = document;
+  send(cmd);
+}
+
+void Controller::recover(Document *document, JournalReader *journal) {
+  if (busy) {
+    deferred.push_back([this, document, journal]() {
+      recover(document, journal);
+    });
+    return;
+  }
+  flushMotion();
+
+  Command cmd;
+  cmd.type = CMD_RECOVER;
+  cmd.heavy = true;
+  cmd.document = document;
+  cmd.journal = journal;
+  send(cmd);
+}
+
+void Controller::importImage(ImageReader *image, JournalReader *journal) {
+  if (busy) {
+    deferred.push_back([this, image, journal]() {
+      importImage(image, journal);
+    });
+    return;
+  }
+  flushMotion();
+
+  Command cmd;
+  cmd.type = CMD_IMPORT;
+  cmd.heavy = true;
+  cmd.image = image;
+  cmd.journal = journal;
+  send(cmd);
+}
+
+void Controller::exportImage(ImageWriter *writer) {
+  if (busy) {
+    deferred.push_back([this, writer]() { exportImage(writer); });
+    return;
+  }
+  flushMotion();
+
+  Command cmd;
+  cmd.type = CMD_EXPORT;
+  cmd.heavy = true;
+  cmd.writer = writer;
+  send(cmd);
+}
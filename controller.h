@@ -0,0 +1,205 @@
+#ifndef PAINT_CONTROLLER_H
+#define PAINT_CONTROLLER_H
+
+/*
+ * Headless input dispatch.
+ *
+ * Receives the raw pointer/key stream (as delivered to
+ * Canvas by wx) and turns it into Raster calls: resize
+ * drags, key repeat guards and clipboard shortcuts all
+ * live here. Because it never touches a window, the
+ * same code path runs live in Canvas and offline in the
+ * replayer, which is what makes replays deterministic.
+ */
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <vector>
+
+#include "raster.h"
+#include "worker.h"
+
+#define RESIZE_CTRL_LENGTH 10
+
+enum KEY_PRESS
+{
+  KEY_Z = 90,
+  KEY_C = 67,
+  KEY_V = 86,
+  KEY_A = 65,
+  KEY_DEL = 127
+};
+
+class Recorder;
+
+/*
+ * Clipboard access. Canvas talks to the system
+ * clipboard, the replayer uses MemoryClipboard.
+ */
+class Clipboard {
+  public:
+    virtual ~Clipboard() {}
+
+    /* Returns false if the clipboard holds no image.
+     * 'alpha' is left empty for images without alpha. */
+    virtual bool getImage(std::vector<unsigned char> &rgb,
+        std::vector<unsigned char> &alpha,
+        unsigned int &M, unsigned int &N) = 0;
+
+    /* Takes ownership of the malloc'd buffers */
+    virtual void setImage(unsigned char *rgb, unsigned char *alpha,
+        int M, int N) = 0;
+};
+
+class MemoryClipboard : public Clipboard {
+  public:
+    std::vector<unsigned char> rgb;
+    std::vector<unsigned char> alpha;
+    unsigned int M = 0;
+    unsigned int N = 0;
+
+    bool getImage(std::vector<unsigned char> &rgb,
+        std::vector<unsigned char> &alpha,
+        unsigned int &M, unsigned int &N);
+    void setImage(unsigned char *rgb, unsigned char *alpha, int M, int N);
+};
+
+class Controller {
+  private:
+    Raster *raster;
+    Clipboard *clipboard;
+
+    /* Optional event recorder, NULL when not recording */
+    Recorder *recorder = NULL;
+
+    /*
+     * Optional raster thread. Every engine call becomes a
+     * Command on its queue. While a heavy command runs all
+     * input is deferred (not even recorded) until
+     * finishJob() and then dispatched in arrival order.
+     */
+    Worker *worker = NULL;
+    bool busy = false;
+    std::deque<std::function<void()> > deferred;
+
+    /* Engine state needed to interpret input, mirrored
+     * so the raster thread is never read while it runs */
+    ToolType tool;
+    unsigned int width;
+    unsigned int height;
+
+    /* Used to hold temporary width while the
+     * user resizes the canvas*/
+    unsigned int resizeWidth;
+    unsigned int resizeHeight;
+
+    /* The mouse position where the user first
+     * clicked the left mouse button*/
+    wxPoint startPos;
+
+    /* TRUE if the user is resizing the canvas */
+    bool isResize = false;
+
+    /*
+     * Key repeat guards: a held key only fires once.
+     *
+     * Redo has no key yet; steps undone stay reachable
+     * through jumpTo() until the next commit.
+     */
+    bool isRedo = false; /* Currently not supported */
+    bool isUndo = false;
+    bool isCopy = false;
+    bool isPaste = false;
+    bool isSelectAll = false;
+    bool isDelete = false;
+
+    /*
+     * Motion samples received since the last frame. They are
+     * rasterized together by flushMotion(), once per frame.
+     */
+    std::vector<wxPoint> pendingMotion;
+    uint64_t mergedEvents = 0;
+
+    bool isResizeEvt(const int &x, const int &y);
+    void syncState();
+    void send(Command &cmd);
+
+  public:
+    Controller(Raster *raster, Clipboard *clipboard);
+
+    inline Raster *getRaster() { return raster; }
+
+    /* Starts writing every input to 'recorder' */
+    void setRecorder(Recorder *recorder);
+
+    /*
+     * Run the engine on 'worker'. When it reports a heavy
+     * command done, the owner must call finishJob() from
+     * the input thread. NULL runs everything inline.
+     */
+    void setWorker(Worker *worker);
+    void finishJob(bool cancelled);
+    inline bool isBusy() const { return busy; }
+    inline ToolType getTool() const { return tool; }
+
+    /* Tool settings */
+    void setTool(ToolType toolType);
+    void setColor(const Color &color);
+    void setThiccness(int thiccness);
+    void setBrush(bool antialias, int softness);
+    void setTolerance(int tolerance, ColorDistance distance);
+    void setContiguous(bool contiguous);
+
+    /* Index regions for fills and wand selects; not
+     * recorded, it never changes what they pick */
+    void setRegionIndex(bool on);
+
+    /* History panel: show the canvas after 'step' transactions */
+    void jumpTo(size_t step);
+
+    /* Resize preview */
+    inline bool isResizing() const { return isResize; }
+    inline unsigned int getResizeWidth() const { return resizeWidth; }
+    inline unsigned int getResizeHeight() const { return resizeHeight; }
+
+    /* Raw input stream. mouseMoved is only called while
+     * the left button is down. */
+    void mouseDown(const wxPoint &p);
+    void mouseMoved(const wxPoint &p);
+
+    /*
+     * Frame-paced motion: queueMotion() only records and
+     * stores the sample, flushMotion() rasterizes everything
+     * queued in one pass. Any other input flushes first, so
+     * ordering is preserved.
+     */
+    void queueMotion(const wxPoint &p);
+    bool flushMotion();
+    inline bool hasPendingMotion() const { return !pendingMotion.empty(); }
+
+    /* Motion events folded into another one by flushMotion() */
+    inline uint64_t getMergedEvents() const { return mergedEvents; }
+
+    void mouseReleased(const wxPoint &p);
+    void keyDown(int key, bool ctrl);
+    void keyUp(int key);
+
+    /*
+     * Replace the canvas with an opened document. Not
+     * recorded: a recording spanning a load won't replay.
+     */
+    void load(Document *document);
+
+    /* Same, then replay 'journal' on top (a NULL document
+     * starts from a blank canvas). Not recorded either. */
+    void recover(Document *document, JournalReader *journal);
+
+    /* Replace the canvas with an opened image, then replay
+     * 'journal' if not NULL. Not recorded. */
+    void importImage(ImageReader *image, JournalReader *journal);
+
+    /* Write the canvas out as an image */
+    void exportImage(ImageWriter *writer);
+};
+
+#endif //PAINT_CONTROLLER_H
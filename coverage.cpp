@@ -0,0 +1,185 @@
+#include <wx/gdicmn.h>
+
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
+#include "coverage.h"
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+/************** Coverage ****************/
+void Coverage::setBrush(int width, int softness) {
+  double radius = MAX(width, 1) / 2.0;
+  softness = MAX(0, MIN(softness, COVERAGE_SOFTNESS_MAX));
+
+  outer = radius + 0.5;
+  scale = 1.0 / (1.0 + (outer - 1.0) * softness / COVERAGE_SOFTNESS_MAX);
+}
+
+/*
+ * Clear what the previous stroke covered and take the new
+ * bounding box, clipped to the canvas. Grown memory comes
+ * zeroed, so only the old extents need clearing.
+ */
+void Coverage::reset(int l, int t, int r, int b,
+    unsigned int w, unsigned int h) {
+  int i, pitch = right - left;
+  for (i=0; i < bottom - top; i++) {
+    if (x0[i] < x1[i])
+      memset(&mask[(size_t)i * pitch + x0[i] - left], 0, x1[i] - x0[i]);
+  }
+
+  left = MAX(l, 0);
+  top = MAX(t, 0);
+  right = MAX(MIN(r, (int)w), left);
+  bottom = MAX(MIN(b, (int)h), top);
+
+  size_t rows = bottom - top;
+  if (mask.size() < rows * (right - left))
+    mask.resize(rows * (right - left));
+  x0.assign(rows, INT_MAX);
+  x1.assign(rows, INT_MIN);
+}
+
+inline void Coverage::put(int x, int y, double distance) {
+  double c = (outer - distance) * scale;
+  if (c <= 0)
+    return;
+  unsigned char v = c >= 1 ? 255 : (unsigned char)(c * 255 + 0.5);
+  if (v == 0)
+    return;
+
+  int i = y - top;
+  unsigned char &m = mask[(size_t)i * (right - left) + x - left];
+  m = MAX(m, v);
+  x0[i] = MIN(x0[i], x);
+  x1[i] = MAX(x1[i], x + 1);
+}
+
+/*
+ * Narrow [lo, hi] to the x with min <= k*x + c <= max, given
+ * 1/k: called for every row, so without a division
+ */
+static inline void clip(double k, double inverse, double c,
+    double min, double max, double &lo, double &hi) {
+  if (k == 0) {
+    if (c < min || c > max)
+      hi = lo - 1;
+    return;
+  }
+  double p = (min - c) * inverse, q = (max - c) * inverse;
+  lo = MAX(lo, MIN(p, q));
+  hi = MIN(hi, MAX(p, q));
+}
+
+/* Widen [lo, hi] by the chord of the disc at (cx, cy) on row y */
+static inline void chord(double cx, double cy, double r, int y,
+    double &lo, double &hi) {
+  double dy = y - cy;
+  if (dy*dy > r*r)
+    return;
+  double half = sqrt(r*r - dy*dy);
+  lo = MIN(lo, cx - half);
+  hi = MAX(hi, cx + half);
+}
+
+/*
+ * A capsule's rows are convex, so each is a single run: the
+ * hull of the two end discs' chords and the slab between
+ * them. Only pixels in that run are measured.
+ */
+void Coverage::capsule(const wxPoint &a, const wxPoint &b) {
+  double dx = b.x - a.x, dy = b.y - a.y;
+  double length = sqrt(dx*dx + dy*dy);
+  double ux = length > 0 ? dx / length : 0, uy = length > 0 ? dy / length : 0;
+  double iux = ux != 0 ? 1 / ux : 0, iuy = uy != 0 ? -1 / uy : 0;
+
+  int y, x;
+  int y0 = MAX(top, (int)floor(MIN(a.y, b.y) - outer));
+  int y1 = MIN(bottom - 1, (int)ceil(MAX(a.y, b.y) + outer));
+  for (y=y0; y <= y1; y++) {
+    double lo = HUGE_VAL, hi = -HUGE_VAL;
+    chord(a.x, a.y, outer, y, lo, hi);
+    chord(b.x, b.y, outer, y, lo, hi);
+    if (length > 0) {
+      double slo = -HUGE_VAL, shi = HUGE_VAL, ry = y - a.y;
+      /* Along the segment, and within reach of it */
+      clip(ux, iux, ry * uy - a.x * ux, 0, length, slo, shi);
+      clip(-uy, iuy, ry * ux + a.x * uy, -outer, outer, slo, shi);
+      if (slo <= shi) {
+        lo = MIN(lo, slo);
+        hi = MAX(hi, shi);
+      }
+    }
+
+    /*
+     * Along the row, the projection onto the segment and the
+     * distance across it both change linearly. Only past the
+     * ends does the distance need a square root.
+     */
+    int from = MAX(left, (int)ceil(lo)), to = MIN(right - 1, (int)floor(hi));
+    double px = from - a.x, py = y - a.y;
+    double along = px * ux + py * uy, across = py * ux - px * uy;
+    for (x=from; x <= to; x++, along += ux, across -= uy) {
+      if (length > 0 && along >= 0 && along <= length) {
+        put(x, y, fabs(across));
+      } else {
+        double ex = x - (along < 0 ? a.x : b.x), ey = y - (along < 0 ? a.y : b.y);
+        put(x, y, sqrt(ex*ex + ey*ey));
+      }
+    }
+  }
+}
+
+void Coverage::polyline(const std::vector<wxPoint> &path,
+    unsigned int w, unsigned int h) {
+  int l = INT_MAX, t = INT_MAX, r = INT_MIN, b = INT_MIN;
+  size_t i;
+  for (i=0; i < path.size(); i++) {
+    l = MIN(l, path[i].x);
+    t = MIN(t, path[i].y);
+    r = MAX(r, path[i].x);
+    b = MAX(b, path[i].y);
+  }
+  int reach = (int)ceil(outer);
+  reset(l - reach, t - reach, r + reach + 1, b + reach + 1, w, h);
+
+  /* Like lerp(), a lone point draws nothing */
+  for (i=0; i + 1 < path.size(); i++) {
+    capsule(path[i], path[i + 1]);
+  }
+}
+
+void Coverage::ring(const wxRealPoint &centre, double radius,
+    unsigned int w, unsigned int h) {
+  double reach = radius + outer;
+  reset((int)floor(centre.x - reach), (int)floor(centre.y - reach),
+      (int)ceil(centre.x + reach) + 1, (int)ceil(centre.y + reach) + 1, w, h);
+
+  /* Each row is the outer chord less the inner one */
+  double inner = radius - outer;
+  int y, x, k;
+  for (y=top; y < bottom; y++) {
+    double dy = y - centre.y;
+    if (dy*dy > reach*reach)
+      continue;
+    double oh = sqrt(reach*reach - dy*dy);
+    double ih = inner > 0 && dy*dy < inner*inner
+      ? sqrt(inner*inner - dy*dy) : -1;
+
+    double spans[2][2] = {
+      { centre.x - oh, ih < 0 ? centre.x + oh : centre.x - ih },
+      { centre.x + ih, centre.x + oh }
+    };
+    for (k=0; k < (ih < 0 ? 1 : 2); k++) {
+      int from = MAX(left, (int)ceil(spans[k][0]));
+      int to = MIN(right - 1, (int)floor(spans[k][1]));
+      for (x=from; x <= to; x++) {
+        double dx = x - centre.x;
+        put(x, y, fabs(sqrt(dx*dx + dy*dy) - radius));
+      }
+    }
+  }
+}
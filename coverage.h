@@ -0,0 +1,79 @@
+#ifndef PAINT_COVERAGE_H
+#define PAINT_COVERAGE_H
+
+/*
+ * Anti-aliased stroke coverage.
+ *
+ * Rasterises one stroke into a mask of 0-255 coverage per
+ * pixel, clipped to the canvas: capsules (round-capped
+ * segments) along a polyline, or a ring for circles.
+ * Coverage comes from each pixel centre's exact distance
+ * to the stroke's centre line, and a pixel covered by two
+ * parts of the stroke keeps the larger value, so overlaps
+ * never build up when the mask is blended.
+ *
+ * The mask spans the stroke's bounding box and keeps its
+ * memory from one stroke to the next; only the rows' covered
+ * extents are cleared in between.
+ */
+#include <wx/gdicmn.h>
+
+#include <vector>
+
+/* Softness is a percentage of the brush radius */
+#define COVERAGE_SOFTNESS_MAX 100
+
+class Coverage {
+  private:
+    /* Bounding box [left, right) x [top, bottom) */
+    int left = 0;
+    int right = 0;
+    int top = 0;
+    int bottom = 0;
+    std::vector<unsigned char> mask;
+
+    /* Covered [x0, x1) of each row, empty when x0 >= x1 */
+    std::vector<int> x0;
+    std::vector<int> x1;
+
+    /* Distance at which coverage reaches zero, and one over
+     * the width of the ramp down to it */
+    double outer = 0.5;
+    double scale = 1.0;
+
+    void reset(int l, int t, int r, int b, unsigned int w, unsigned int h);
+    inline void put(int x, int y, double distance);
+    void capsule(const wxPoint &a, const wxPoint &b);
+
+  public:
+    /*
+     * Brush 'width' pixels across. Softness 0 is a hard
+     * edge anti-aliased over one pixel; COVERAGE_SOFTNESS_MAX
+     * fades all the way from the centre line.
+     */
+    void setBrush(int width, int softness);
+
+    /* Replace the mask with a stroke on a w x h canvas */
+    void polyline(const std::vector<wxPoint> &path,
+        unsigned int w, unsigned int h);
+    void ring(const wxRealPoint &centre, double radius,
+        unsigned int w, unsigned int h);
+
+    inline int getTop() const { return top; }
+    inline int getBottom() const { return bottom; }
+
+    /* Covered [from, to) of row y, with row[x] its coverage;
+     * false when nothing on the row is covered */
+    inline bool row(int y, int &from, int &to,
+        const unsigned char *&row) const {
+      int i = y - top;
+      if (x0[i] >= x1[i])
+        return false;
+      from = x0[i];
+      to = x1[i];
+      row = &mask[(size_t)i * (right - left)] - left;
+      return true;
+    }
+};
+
+#endif
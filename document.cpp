@@ -0,0 +1,347 @@
+#include <wx/gdicmn.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "document.h"
+#include "journal.h"
+#include "format.h"
+#include "pack.h"
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+
+/* Bytes of the header actually used */
+#define DOC_HEADER_SIZE 44
+
+/* Bytes per history pixel: i32 x, i32 y, u8 r, g, b, a */
+#define DOC_PIXEL_SIZE 12
+
+/* Version 1: no alpha, in history or pixels */
+#define DOC_V1_PIXEL_SIZE 11
+
+static void put32(std::vector<unsigned char> &out, uint32_t v) {
+  int i;
+  for (i=0; i < 4; i++) {
+    out.push_back((v >> (8*i)) & 0xff);
+  }
+}
+
+static void put64(std::vector<unsigned char> &out, uint64_t v) {
+  int i;
+  for (i=0; i < 8; i++) {
+    out.push_back((v >> (8*i)) & 0xff);
+  }
+}
+
+static uint32_t get32(const unsigned char *in) {
+  return (uint32_t)in[0] | (uint32_t)in[1] << 8 |
+    (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+static uint64_t get64(const unsigned char *in) {
+  return (uint64_t)get32(in) | (uint64_t)get32(in + 4) << 32;
+}
+
+/* pwrite/pread that don't stop at partial transfers */
+static bool writeAt(int fd, const void *data, size_t n, uint64_t offset) {
+  const char *p = (const char *)data;
+  while (n > 0) {
+    ssize_t k = pwrite(fd, p, n, offset);
+    if (k < 0 && errno == EINTR)
+      continue;
+    if (k <= 0)
+      return false;
+    p += k;
+    n -= k;
+    offset += k;
+  }
+  return true;
+}
+
+static bool readAt(int fd, void *data, size_t n, uint64_t offset) {
+  char *p = (char *)data;
+  while (n > 0) {
+    ssize_t k = pread(fd, p, n, offset);
+    if (k < 0 && errno == EINTR)
+      continue;
+    if (k <= 0)
+      return false;
+    p += k;
+    n -= k;
+    offset += k;
+  }
+  return true;
+}
+
+/* Raster releases mapped buffers through this */
+static void unmap(uint32_t *buffer, size_t size) {
+  munmap(buffer, size);
+}
+
+/************** Document ****************/
+Document::Document(const char *path, bool withHistory) {
+  this->path = path;
+  this->withHistory = withHistory;
+}
+
+Document::~Document() {
+  if (mapped != NULL && isMapped)
+    munmap(mapped, 4*Raster::strideFor(mappedWidth)*mappedHeight);
+  else
+    free(mapped);
+  if (fd >= 0)
+    close(fd);
+}
+
+bool Document::open() {
+  fd = ::open(path.c_str(), O_RDWR);
+  if (fd < 0)
+    return false;
+
+  unsigned char header[DOC_HEADER_SIZE];
+  struct stat st;
+  if (!readAt(fd, header, DOC_HEADER_SIZE, 0) || fstat(fd, &st) != 0
+      || memcmp(header, DOC_MAGIC, 4) != 0
+      || (get32(header + 4) != DOC_VERSION && get32(header + 4) != 1)) {
+    close(fd);
+    fd = -1;
+    return false;
+  }
+
+  uint32_t version = get32(header + 4);
+  unsigned int w = get32(header + 8);
+  unsigned int h = get32(header + 12);
+  uint64_t pixelOffset = get64(header + 20);
+  uint64_t historyOffset = get64(header + 28);
+  uint64_t historyBytes = get64(header + 36);
+  size_t bytes = version == 1 ? 3*(size_t)w*h : 4*Raster::strideFor(w)*h;
+  if (w == 0 || h == 0 || pixelOffset != DOC_PIXEL_OFFSET
+      || (uint64_t)st.st_size < pixelOffset + bytes
+      || (uint64_t)st.st_size < historyOffset + historyBytes) {
+    close(fd);
+    fd = -1;
+    return false;
+  }
+
+  if (version == 1) {
+    mapped = readVersion1(w, h);
+    isMapped = false;
+    /* Laid out differently: the next save writes it all */
+    width = height = 0;
+  } else {
+    /* Private: drawing must not touch the file until saved */
+    void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+        fd, pixelOffset);
+    mapped = p == MAP_FAILED ? NULL : (uint32_t *)p;
+    isMapped = true;
+    width = w;
+    height = h;
+  }
+  if (mapped == NULL) {
+    close(fd);
+    fd = -1;
+    return false;
+  }
+  mappedWidth = w;
+  mappedHeight = h;
+
+  history.clear();
+  size_t pixelSize = version == 1 ? DOC_V1_PIXEL_SIZE : DOC_PIXEL_SIZE;
+  if (withHistory && historyBytes > 0
+      && !readHistory(historyOffset, historyBytes, pixelSize)) {
+    /* The pixels are fine, only the undo steps are lost */
+    history.clear();
+  }
+  return true;
+}
+
+/* Packed RGB rows into a new buffer */
+uint32_t *Document::readVersion1(unsigned int w, unsigned int h) {
+  uint32_t *buffer = Raster::newBuffer(w, h);
+  if (buffer == NULL)
+    return NULL;
+
+  size_t stride = Raster::strideFor(w);
+  std::vector<unsigned char> row(3*(size_t)w);
+  unsigned int y;
+  for (y=0; y < h; y++) {
+    if (!readAt(fd, &row[0], row.size(),
+          DOC_PIXEL_OFFSET + (uint64_t)y * row.size())) {
+      free(buffer);
+      return NULL;
+    }
+    copySpan<Rgb24, Rgba32>((const Rgb24::Unit *)&row[0],
+        buffer + y*stride, w);
+  }
+  return buffer;
+}
+
+bool Document::readHistory(uint64_t offset, uint64_t bytes, size_t pixelSize) {
+  std::vector<unsigned char> data(bytes);
+  if (!readAt(fd, &data[0], bytes, offset) || bytes < 8)
+    return false;
+
+  const unsigned char *in = &data[0], *end = in + bytes;
+  uint64_t count = get64(in), i, k;
+  in += 8;
+  for (i=0; i < count; i++) {
+    if (end - in < 8)
+      return false;
+    uint64_t n = get64(in);
+    in += 8;
+    if ((uint64_t)(end - in) / pixelSize < n)
+      return false;
+
+    history.push_back(Transaction());
+    std::vector<Pixel> &pixels = history.back().pixels;
+    pixels.resize(n);
+    for (k=0; k < n; k++) {
+      unsigned char a = pixelSize == DOC_PIXEL_SIZE ? in[11] : 255;
+      pixels[k] = Pixel(Color(in[8], in[9], in[10], a),
+          wxPoint((int32_t)get32(in), (int32_t)get32(in + 4)));
+      in += pixelSize;
+    }
+  }
+  return true;
+}
+
+void Document::load(Raster &raster) {
+  if (mapped == NULL)
+    return;
+  raster.adopt(mapped, mappedWidth, mappedHeight, isMapped ? unmap : NULL);
+  raster.setHistory(history);
+  history.clear();
+  mapped = NULL;
+  if (raster.getJournal() != NULL)
+    raster.getJournal()->checkpoint(path.c_str(), mappedWidth, mappedHeight);
+}
+
+bool Document::writeHeader(uint64_t historyBytes) {
+  std::vector<unsigned char> header(DOC_MAGIC, DOC_MAGIC + 4);
+  put32(header, DOC_VERSION);
+  put32(header, width);
+  put32(header, height);
+  put32(header, TILE_ROWS);
+  put64(header, DOC_PIXEL_OFFSET);
+  put64(header, DOC_PIXEL_OFFSET + 4*(uint64_t)Raster::strideFor(width)*height);
+  put64(header, historyBytes);
+  return writeAt(fd, &header[0], header.size(), 0);
+}
+
+/*
+ * History goes after the pixels and is rewritten whole;
+ * the file is cut off right behind it.
+ */
+bool Document::writeHistory(const Raster &raster, uint64_t offset) {
+  std::vector<unsigned char> out;
+  if (withHistory) {
+    /* Steps jumped back over are not part of the document */
+    const std::vector<Transaction> &txns = raster.getHistory();
+    std::vector<Pixel> unpacked;
+    size_t i, k, n = raster.getHistoryStep();
+    put64(out, n);
+    for (i=0; i < n; i++) {
+      if (txns[i].isMasked())
+        txns[i].expand(unpacked);
+      const std::vector<Pixel> &pixels = txns[i].isMasked()
+        || (txns[i].isPacked()
+          && unpackPixels(txns[i].packed, txns[i].packedCount, unpacked))
+        ? unpacked : txns[i].pixels;
+      put64(out, pixels.size());
+      for (k=0; k < pixels.size(); k++) {
+        put32(out, pixels[k].x);
+        put32(out, pixels[k].y);
+        out.push_back(pixels[k].color.r);
+        out.push_back(pixels[k].color.g);
+        out.push_back(pixels[k].color.b);
+        out.push_back(pixels[k].color.a);
+      }
+    }
+  }
+
+  if (!out.empty() && !writeAt(fd, &out[0], out.size(), offset))
+    return false;
+  if (ftruncate(fd, offset + out.size()) != 0)
+    return false;
+  return writeHeader(out.size());
+}
+
+bool Document::writeAll(const Raster &raster) {
+  unsigned int w = raster.getWidth(), h = raster.getHeight();
+  if (!writeAt(fd, raster.getBuffer(), 4*raster.getStride()*h,
+        DOC_PIXEL_OFFSET)) {
+    /* Whatever made it to disk, the next save starts over */
+    width = height = 0;
+    return false;
+  }
+  width = w;
+  height = h;
+  tilesWritten = (h + TILE_ROWS - 1) / TILE_ROWS;
+  return true;
+}
+
+/*
+ * The selection border is not part of the document: the
+ * colours under it go to disk (and to the journal's
+ * checkpoint), then it is drawn back.
+ */
+bool Document::save(Raster &raster) {
+  raster.hideOverlay();
+  bool ok = writeCanvas(raster);
+  raster.showOverlay();
+  return ok;
+}
+
+bool Document::writeCanvas(Raster &raster) {
+  tilesWritten = 0;
+  if (fd < 0) {
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd < 0)
+      return false;
+  }
+
+  if (raster.getWidth() != width || raster.getHeight() != height) {
+    if (!writeAll(raster))
+      return false;
+  } else {
+    /* Runs of modified tiles go out in one write each */
+    const std::vector<unsigned char> &modified = raster.getModified();
+    size_t row = 4*raster.getStride();
+    size_t t = 0, n = modified.size();
+    while (t < n) {
+      if (!modified[t]) {
+        t++;
+        continue;
+      }
+      size_t first = t;
+      while (t < n && modified[t]) {
+        t++;
+      }
+
+      size_t y0 = first * TILE_ROWS;
+      size_t y1 = MIN(t * TILE_ROWS, (size_t)height);
+      const char *pixels = (const char *)raster.getBuffer();
+      if (!writeAt(fd, pixels + y0 * row, (y1 - y0) * row,
+            DOC_PIXEL_OFFSET + y0 * row))
+        return false;
+      tilesWritten += t - first;
+    }
+  }
+
+  if (!writeHistory(raster,
+        DOC_PIXEL_OFFSET + 4*(uint64_t)raster.getStride()*height))
+    return false;
+  if (fdatasync(fd) != 0)
+    return false;
+
+  raster.clearModified();
+
+  /* Everything journaled so far is in the file now */
+  if (raster.getJournal() != NULL)
+    raster.getJournal()->checkpoint(path.c_str(), width, height);
+  return true;
+}
@@ -0,0 +1,101 @@
+#ifndef PAINT_DOCUMENT_H
+#define PAINT_DOCUMENT_H
+
+/*
+ * Native document format.
+ *
+ * The pixel section is the engine buffer verbatim (RGBA,
+ * padded rows) at a page aligned offset, so opening a
+ * document maps it copy-on-write and hands the mapping to
+ * Raster: no decoding, and only the pages actually drawn
+ * or shown are ever read. Saving rewrites just the tiles
+ * (full-width bands of TILE_ROWS rows) modified since the
+ * last open or save, then the history and the header.
+ *
+ * File layout (integers little endian):
+ *
+ *   header, DOC_PIXEL_OFFSET bytes, zero padded:
+ *     "PDOC" u32 version  u32 width  u32 height  u32 tileRows
+ *     u64 pixelOffset  u64 historyOffset  u64 historyBytes
+ *   pixels  rgba[4*stride*height]
+ *     (stride: width rounded up to PIXEL_ALIGN pixels)
+ *   history (optional, historyBytes == 0 when absent):
+ *     u64 count { u64 n { i32 x  i32 y  u8 r  u8 g  u8 b  u8 a }* }*
+ *
+ * Version 1 documents (packed RGB, no alpha) are still
+ * read, into memory rather than mapped; the next save
+ * rewrites them as version 2.
+ *
+ * Headless, like Raster.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "raster.h"
+
+#define DOC_MAGIC "PDOC"
+#define DOC_VERSION 2
+
+/* Multiple of every page size in use (4K, 16K, 64K) */
+#define DOC_PIXEL_OFFSET 65536
+
+class Document {
+  private:
+    std::string path;
+    bool withHistory;
+    int fd = -1;
+
+    /* Layout of the file on disk, 0x0 before the first save */
+    unsigned int width = 0;
+    unsigned int height = 0;
+
+    /* Mapped (or read, for version 1) by open(), handed
+     * over by load() */
+    uint32_t *mapped = NULL;
+    bool isMapped = false;
+    unsigned int mappedWidth = 0;
+    unsigned int mappedHeight = 0;
+    std::vector<Transaction> history;
+
+    /* Tiles written by the last save() */
+    size_t tilesWritten = 0;
+
+    bool writeCanvas(Raster &raster);
+    bool writeAll(const Raster &raster);
+    bool writeHistory(const Raster &raster, uint64_t offset);
+    bool writeHeader(uint64_t historyBytes);
+    bool readHistory(uint64_t offset, uint64_t bytes, size_t pixelSize);
+    uint32_t *readVersion1(unsigned int w, unsigned int h);
+
+  public:
+    /* 'withHistory' also saves the undo history */
+    Document(const char *path, bool withHistory = true);
+    ~Document();
+
+    inline const char *getPath() const { return path.c_str(); }
+    inline size_t getTilesWritten() const { return tilesWritten; }
+
+    /*
+     * Map an existing document. Returns false if the file
+     * can't be opened or isn't a document; save() then
+     * creates it. Call from any thread, then load().
+     */
+    bool open();
+
+    /* Raster thread. Swap the opened document into 'raster'.
+     * Its journal, if any, restarts from this document. */
+    void load(Raster &raster);
+
+    /*
+     * Write what changed since the last open/save, or the
+     * whole document if it is new or was resized. The
+     * raster must be idle. Returns false on I/O errors.
+     * The raster's journal then restarts from the saved
+     * file, which needs 'withHistory' for journaled undos.
+     */
+    bool save(Raster &raster);
+};
+
+#endif //PAINT_DOCUMENT_H
@@ -0,0 +1,760 @@
+#ifndef PAINT_FORMAT_H
+#define PAINT_FORMAT_H
+
+/*
+ * Pixel formats and the span kernels templated on them.
+ *
+ * A format is a traits type: 'Unit' is what one pixel is
+ * stored as, pack()/unpack() convert to and from a Color,
+ * and HAS_ALPHA says whether unpack() can return anything
+ * but opaque. Every kernel is instantiated per format (per
+ * pair, for conversions), so the loops are specialised at
+ * compile time with no per-pixel dispatch, and the
+ * specialisations further down replace the generic loop
+ * where a format allows something cheaper.
+ *
+ * The canvas is Rgba32. The others are the formats of files
+ * and of the display frame, and what a canvas short on
+ * memory could be kept in (Indexed8 or Gray8, one byte a
+ * pixel).
+ *
+ * Formats with state (Indexed8's palette) are passed in as
+ * objects; the stateless ones default-construct.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "pixel.h"
+
+/* 8-bit RGBA in memory order, the canvas format */
+struct Rgba32 {
+  typedef uint32_t Unit;
+  static const bool HAS_ALPHA = true;
+
+  static inline Unit pack(const Color &c) { return c.value(); }
+  static inline Color unpack(Unit u) { return Color::fromValue(u); }
+};
+
+/* Packed RGB: PNG colour type 2, the display frame */
+struct Rgb24 {
+  struct Unit { unsigned char r, g, b; };
+  static const bool HAS_ALPHA = false;
+
+  static inline Unit pack(const Color &c) {
+    Unit u = { c.r, c.g, c.b };
+    return u;
+  }
+  static inline Color unpack(Unit u) { return Color(u.r, u.g, u.b); }
+};
+
+/* Packed BGR: 24-bit BMP */
+struct Bgr24 {
+  struct Unit { unsigned char b, g, r; };
+  static const bool HAS_ALPHA = false;
+
+  static inline Unit pack(const Color &c) {
+    Unit u = { c.b, c.g, c.r };
+    return u;
+  }
+  static inline Color unpack(Unit u) { return Color(u.r, u.g, u.b); }
+};
+
+/* 8-bit luma, BT.601 weights summing to 256 */
+struct Gray8 {
+  typedef unsigned char Unit;
+  static const bool HAS_ALPHA = false;
+
+  static inline Unit pack(const Color &c) {
+    return (77 * c.r + 150 * c.g + 29 * c.b + 128) >> 8;
+  }
+  static inline Color unpack(Unit u) { return Color(u, u, u); }
+};
+
+/* 8-bit index into 256 Color values (unused entries zero) */
+struct Indexed8 {
+  typedef unsigned char Unit;
+  static const bool HAS_ALPHA = true;
+
+  const uint32_t *palette;
+
+  explicit Indexed8(const uint32_t *palette) : palette(palette) {}
+
+  inline Color unpack(Unit u) const { return Color::fromValue(palette[u]); }
+
+  /* Nearest entry, first one on ties. A linear search, so
+   * kernels pack once per span rather than per pixel. */
+  inline Unit pack(const Color &c) const {
+    int i, best = 0;
+    unsigned int bestDistance = ~0u;
+    for (i=0; i < 256 && bestDistance > 0; i++) {
+      Color e = Color::fromValue(palette[i]);
+      int dr = e.r - c.r, dg = e.g - c.g, db = e.b - c.b, da = e.a - c.a;
+      unsigned int d = dr*dr + dg*dg + db*db + da*da;
+      if (d < bestDistance) {
+        bestDistance = d;
+        best = i;
+      }
+    }
+    return best;
+  }
+};
+
+static_assert(sizeof(Rgb24::Unit) == 3 && sizeof(Bgr24::Unit) == 3,
+    "packed formats must not be padded");
+
+template <typename F>
+static inline bool sameUnit(const typename F::Unit &a,
+    const typename F::Unit &b) {
+  return memcmp(&a, &b, sizeof(a)) == 0;
+}
+
+/************** Fill ****************/
+/* One stored value over a span */
+template <typename F>
+struct SpanFill {
+  static inline void run(typename F::Unit *dst, size_t n,
+      typename F::Unit v) {
+    size_t i;
+    for (i=0; i < n; i++) {
+      dst[i] = v;
+    }
+  }
+};
+
+/* One byte a pixel */
+struct ByteFill {
+  static inline void run(unsigned char *dst, size_t n, unsigned char v) {
+    memset(dst, v, n);
+  }
+};
+
+template <> struct SpanFill<Gray8> : ByteFill {};
+template <> struct SpanFill<Indexed8> : ByteFill {};
+
+template <typename F>
+static inline void fillSpan(typename F::Unit *dst, size_t n,
+    const Color &c, const F &format = F()) {
+  SpanFill<F>::run(dst, n, format.pack(c));
+}
+
+/************** Copy ****************/
+/* Convert a span from one format to another */
+template <typename Src, typename Dst>
+struct SpanCopy {
+  static inline void run(const typename Src::Unit *src,
+      typename Dst::Unit *dst, size_t n, const Src &from, const Dst &to) {
+    size_t i;
+    for (i=0; i < n; i++) {
+      dst[i] = to.pack(from.unpack(src[i]));
+    }
+  }
+};
+
+/* Same format: the bytes are the pixels. Two Indexed8
+ * spans must share a palette. */
+template <typename F>
+struct SpanCopy<F, F> {
+  static inline void run(const typename F::Unit *src,
+      typename F::Unit *dst, size_t n, const F &, const F &) {
+    memcpy(dst, src, n * sizeof(*src));
+  }
+};
+
+/* Palette entries are already canvas pixels */
+template <>
+struct SpanCopy<Indexed8, Rgba32> {
+  static inline void run(const unsigned char *src, uint32_t *dst, size_t n,
+      const Indexed8 &from, const Rgba32 &) {
+    size_t i;
+    for (i=0; i < n; i++) {
+      dst[i] = from.palette[src[i]];
+    }
+  }
+};
+
+template <typename Src, typename Dst>
+static inline void copySpan(const typename Src::Unit *src,
+    typename Dst::Unit *dst, size_t n, const Src &from = Src(),
+    const Dst &to = Dst()) {
+  SpanCopy<Src, Dst>::run(src, dst, n, from, to);
+}
+
+/************** Blend ****************/
+/* v / 255, rounded */
+static inline unsigned int div255(unsigned int v) {
+  return (v + 127) / 255;
+}
+
+/* Straight-alpha 'over', exact for an opaque destination */
+static inline Color blendOver(const Color &s, const Color &d) {
+  if (s.a == 255 || d.a == 0)
+    return s;
+  if (d.a == 255) {
+    unsigned int t = 255 - s.a;
+    return Color(div255(s.r * s.a + d.r * t),
+        div255(s.g * s.a + d.g * t),
+        div255(s.b * s.a + d.b * t));
+  }
+  /* Both translucent: weigh by coverage */
+  unsigned int wd = d.a * (255 - s.a), a = s.a * 255 + wd;
+  if (a == 0)
+    return d;
+  return Color((s.r * s.a * 255 + d.r * wd + a / 2) / a,
+      (s.g * s.a * 255 + d.g * wd + a / 2) / a,
+      (s.b * s.a * 255 + d.b * wd + a / 2) / a,
+      (a + 127) / 255);
+}
+
+/* Source pixels over the destination span */
+template <typename Src, typename Dst, bool = Src::HAS_ALPHA>
+struct SpanBlend {
+  static inline void run(const typename Src::Unit *src,
+      typename Dst::Unit *dst, size_t n, const Src &from, const Dst &to) {
+    size_t i;
+    for (i=0; i < n; i++) {
+      Color s = from.unpack(src[i]);
+      /* Opaque pixels never need the destination */
+      if (s.a == 255)
+        dst[i] = to.pack(s);
+      else if (s.a != 0)
+        dst[i] = to.pack(blendOver(s, to.unpack(dst[i])));
+    }
+  }
+};
+
+/* Nothing to blend without alpha */
+template <typename Src, typename Dst>
+struct SpanBlend<Src, Dst, false> : SpanCopy<Src, Dst> {};
+
+template <typename Src, typename Dst>
+static inline void blendSpan(const typename Src::Unit *src,
+    typename Dst::Unit *dst, size_t n, const Src &from = Src(),
+    const Dst &to = Dst()) {
+  SpanBlend<Src, Dst>::run(src, dst, n, from, to);
+}
+
+/* One colour over the destination span */
+template <typename F>
+struct SpanTint {
+  static inline void run(typename F::Unit *dst, size_t n, const Color &c,
+      const F &format) {
+    size_t i;
+    for (i=0; i < n; i++) {
+      dst[i] = format.pack(blendOver(c, format.unpack(dst[i])));
+    }
+  }
+};
+
+/* 256 possible inputs: blend and re-match each palette
+ * entry the span uses once, then remap */
+template <>
+struct SpanTint<Indexed8> {
+  static inline void run(unsigned char *dst, size_t n, const Color &c,
+      const Indexed8 &format) {
+    unsigned char remap[256];
+    bool known[256] = { false };
+    size_t i;
+    for (i=0; i < n; i++) {
+      unsigned char u = dst[i];
+      if (!known[u]) {
+        remap[u] = format.pack(blendOver(c, format.unpack(u)));
+        known[u] = true;
+      }
+      dst[i] = remap[u];
+    }
+  }
+};
+
+template <typename F>
+static inline void blendSpan(typename F::Unit *dst, size_t n,
+    const Color &c, const F &format = F()) {
+  if (c.a == 255)
+    fillSpan(dst, n, c, format);
+  else if (c.a != 0)
+    SpanTint<F>::run(dst, n, c, format);
+}
+
+/************** Coverage ****************/
+/*
+ * 'c' over the span, each pixel at its own coverage
+ * (0-255) of c's alpha: how anti-aliased strokes are laid
+ * down. Zero coverage leaves the pixel alone.
+ */
+template <typename F>
+static inline void maskBlendLoop(typename F::Unit *dst,
+    const unsigned char *mask, size_t n, const Color &c, const F &format) {
+  size_t i;
+  for (i=0; i < n; i++) {
+    if (mask[i] == 0)
+      continue;
+    Color s = c;
+    s.a = div255(mask[i] * c.a);
+    dst[i] = format.pack(blendOver(s, format.unpack(dst[i])));
+  }
+}
+
+template <typename F>
+struct SpanMaskBlend {
+  static inline void run(typename F::Unit *dst, const unsigned char *mask,
+      size_t n, const Color &c, const F &format) {
+    maskBlendLoop(dst, mask, n, c, format);
+  }
+};
+
+#ifdef __SSE2__
+/*
+ * Four canvas pixels at a time, as 16-bit lanes. Over an
+ * opaque pixel the blend is the same sum for all four
+ * channels (alpha stays 255), so groups that are entirely
+ * opaque go through SSE2 and the rest, like the tail, through
+ * the scalar loop. Both round the same way; the results are
+ * identical.
+ */
+template <>
+struct SpanMaskBlend<Rgba32> {
+  static inline __m128i div255x8(__m128i v) {
+    v = _mm_add_epi16(v, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(v, _mm_srli_epi16(v, 8)), 8);
+  }
+
+  static inline void run(uint32_t *dst, const unsigned char *mask, size_t n,
+      const Color &c, const Rgba32 &format) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i full = _mm_set1_epi16(255);
+    const __m128i alpha = _mm_set1_epi32((int)Color(0, 0, 0, 255).value());
+    const __m128i ca = _mm_set1_epi16(c.a);
+    const __m128i src = _mm_unpacklo_epi8(
+        _mm_set1_epi32((int)Color(c.r, c.g, c.b, 255).value()), zero);
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+      uint32_t m;
+      memcpy(&m, mask + i, 4);
+      if (m == 0)
+        continue;
+      __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+      __m128i opaque = _mm_cmpeq_epi32(_mm_and_si128(d, alpha), alpha);
+      if (_mm_movemask_epi8(opaque) != 0xffff) {
+        maskBlendLoop(dst + i, mask + i, 4, c, format);
+        continue;
+      }
+
+      /* Each pixel's coverage in all four of its lanes */
+      __m128i a = _mm_cvtsi32_si128((int)m);
+      a = _mm_unpacklo_epi8(a, a);
+      a = _mm_unpacklo_epi16(a, a);
+      __m128i aLo = _mm_unpacklo_epi8(a, zero), aHi = _mm_unpackhi_epi8(a, zero);
+      if (c.a != 255) {
+        aLo = div255x8(_mm_mullo_epi16(aLo, ca));
+        aHi = div255x8(_mm_mullo_epi16(aHi, ca));
+      }
+
+      __m128i dLo = _mm_unpacklo_epi8(d, zero), dHi = _mm_unpackhi_epi8(d, zero);
+      __m128i lo = div255x8(_mm_add_epi16(_mm_mullo_epi16(src, aLo),
+            _mm_mullo_epi16(dLo, _mm_sub_epi16(full, aLo))));
+      __m128i hi = div255x8(_mm_add_epi16(_mm_mullo_epi16(src, aHi),
+            _mm_mullo_epi16(dHi, _mm_sub_epi16(full, aHi))));
+      _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+    maskBlendLoop(dst + i, mask + i, n - i, c, format);
+  }
+};
+#endif
+
+template <typename F>
+static inline void blendMaskSpan(typename F::Unit *dst,
+    const unsigned char *mask, size_t n, const Color &c,
+    const F &format = F()) {
+  SpanMaskBlend<F>::run(dst, mask, n, c, format);
+}
+
+/*
+ * Take coverage (0-255) off each pixel's alpha: the soft
+ * eraser. Pixels erased completely become transparent
+ * white, as the hard eraser leaves them.
+ */
+template <typename F>
+static inline void eraseMaskSpan(typename F::Unit *dst,
+    const unsigned char *mask, size_t n, const F &format = F()) {
+  size_t i;
+  for (i=0; i < n; i++) {
+    if (mask[i] == 0)
+      continue;
+    Color d = format.unpack(dst[i]);
+    d.a = div255(d.a * (255 - mask[i]));
+    dst[i] = format.pack(d.a == 0 ? Color(255, 255, 255, 0) : d);
+  }
+}
+
+/************** Colour distance ****************/
+/* How a colour's distance from a fill's target is measured */
+enum ColorDistance {
+  DISTANCE_CHANNEL,  /* the largest difference in any one channel */
+  DISTANCE_EUCLIDEAN /* straight-line, over all four channels */
+};
+
+/* Colours within 'tolerance' of 'target', alpha included */
+struct ColorMatch {
+  Color target;
+  int tolerance;
+  ColorDistance distance;
+
+  inline bool operator()(const Color &c) const {
+    int dr = c.r - target.r, dg = c.g - target.g;
+    int db = c.b - target.b, da = c.a - target.a;
+    if (distance == DISTANCE_EUCLIDEAN)
+      return dr*dr + dg*dg + db*db + da*da <= tolerance*tolerance;
+    return dr <= tolerance && -dr <= tolerance
+        && dg <= tolerance && -dg <= tolerance
+        && db <= tolerance && -db <= tolerance
+        && da <= tolerance && -da <= tolerance;
+  }
+};
+
+/* One byte a pixel into 'out': 1 where 'match' accepts it, 0
+ * where it does not */
+template <typename F>
+static inline void matchLoop(const typename F::Unit *src, size_t n,
+    const ColorMatch &match, unsigned char *out, const F &format) {
+  size_t i;
+  for (i=0; i < n; i++) {
+    out[i] = match(format.unpack(src[i]));
+  }
+}
+
+template <typename F>
+struct SpanMatch {
+  static inline void run(const typename F::Unit *src, size_t n,
+      const ColorMatch &match, unsigned char *out, const F &format) {
+    matchLoop(src, n, match, out, format);
+  }
+};
+
+#ifdef __SSE2__
+/*
+ * 'match' on four canvas pixels at a time. The absolute
+ * difference of each channel is two saturating
+ * subtractions; per channel, a pixel matches when no channel
+ * is left over after taking off the tolerance, and Euclidean
+ * squares the differences as 16-bit lanes, summed a pixel at
+ * a time by madd and one shift. Exact in both modes: the
+ * same answers as ColorMatch.
+ */
+struct MatchRgba32x4 {
+  __m128i zero, target, channel, radius;
+  bool euclidean;
+
+  explicit MatchRgba32x4(const ColorMatch &match) {
+    zero = _mm_setzero_si128();
+    target = _mm_set1_epi32((int)match.target.value());
+    channel = _mm_set1_epi8(
+        (char)(match.tolerance < 255 ? match.tolerance : 255));
+    /* Sums up to 4*255^2, so compared as signed 32-bit */
+    radius = _mm_set1_epi32(
+        match.tolerance < 511 ? match.tolerance*match.tolerance : 4*255*255);
+    euclidean = match.distance == DISTANCE_EUCLIDEAN;
+  }
+
+  /* All ones in the lanes of the pixels that match */
+  inline __m128i operator()(__m128i s) const {
+    __m128i d = _mm_or_si128(_mm_subs_epu8(s, target),
+        _mm_subs_epu8(target, s));
+    if (!euclidean)
+      return _mm_cmpeq_epi32(_mm_subs_epu8(d, channel), zero);
+
+    __m128i lo = _mm_unpacklo_epi8(d, zero), hi = _mm_unpackhi_epi8(d, zero);
+    lo = _mm_madd_epi16(lo, lo);
+    hi = _mm_madd_epi16(hi, hi);
+    lo = _mm_add_epi32(lo, _mm_srli_epi64(lo, 32));
+    hi = _mm_add_epi32(hi, _mm_srli_epi64(hi, 32));
+    __m128i sum = _mm_unpacklo_epi64(
+        _mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 1, 2, 0)),
+        _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 1, 2, 0)));
+    return _mm_andnot_si128(_mm_cmpgt_epi32(sum, radius),
+        _mm_set1_epi32(-1));
+  }
+};
+
+template <>
+struct SpanMatch<Rgba32> {
+  static inline void run(const uint32_t *src, size_t n,
+      const ColorMatch &match, unsigned char *out, const Rgba32 &format) {
+    const MatchRgba32x4 test(match);
+    const __m128i one = _mm_set1_epi8(1);
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+      __m128i hit = test(_mm_loadu_si128((const __m128i *)(src + i)));
+      hit = _mm_packs_epi16(_mm_packs_epi32(hit, test.zero), test.zero);
+      int bytes = _mm_cvtsi128_si32(_mm_and_si128(hit, one));
+      memcpy(out + i, &bytes, 4);
+    }
+    matchLoop(src + i, n - i, match, out + i, format);
+  }
+};
+#endif
+
+template <typename F>
+static inline void matchSpan(const typename F::Unit *src, size_t n,
+    const ColorMatch &match, unsigned char *out, const F &format = F()) {
+  SpanMatch<F>::run(src, n, match, out, format);
+}
+
+/************** Replace ****************/
+/*
+ * 'value' over every pixel of the span that 'match' accepts,
+ * 'allow' (a bit a pixel, NULL for all of them) lets through
+ * and that does not hold 'value' already: a colour replaced
+ * wherever it is, rather than where it is connected. Each
+ * pixel written gets its bit set in 'changed' (cleared by the
+ * caller) and, with 'before', its old value appended there.
+ * Returns how many were written. Bit i of a mask is bit
+ * i % 64 of word i / 64.
+ */
+template <typename F>
+static inline size_t replaceLoop(typename F::Unit *dst, size_t i, size_t n,
+    const ColorMatch &match, typename F::Unit value, const uint64_t *allow,
+    uint64_t *changed, std::vector<typename F::Unit> *before,
+    const F &format) {
+  size_t written = 0;
+  for (; i < n; i++) {
+    if (allow != NULL && !((allow[i / 64] >> (i % 64)) & 1))
+      continue;
+    if (sameUnit<F>(dst[i], value) || !match(format.unpack(dst[i])))
+      continue;
+    if (before != NULL)
+      before->push_back(dst[i]);
+    dst[i] = value;
+    changed[i / 64] |= (uint64_t)1 << (i % 64);
+    written++;
+  }
+  return written;
+}
+
+template <typename F>
+struct SpanReplace {
+  static inline size_t run(typename F::Unit *dst, size_t n,
+      const ColorMatch &match, typename F::Unit value, const uint64_t *allow,
+      uint64_t *changed, std::vector<typename F::Unit> *before,
+      const F &format) {
+    return replaceLoop(dst, 0, n, match, value, allow, changed, before, format);
+  }
+};
+
+#ifdef __SSE2__
+/*
+ * Four canvas pixels at a time: the match, less the pixels
+ * already holding 'value' and those 'allow' leaves out, is
+ * a nibble of the changed mask, and selects between 'value'
+ * and the old pixels for the store. Groups with no match are
+ * only read.
+ */
+template <>
+struct SpanReplace<Rgba32> {
+  static inline size_t run(uint32_t *dst, size_t n, const ColorMatch &match,
+      uint32_t value, const uint64_t *allow, uint64_t *changed,
+      std::vector<uint32_t> *before, const Rgba32 &format) {
+    const MatchRgba32x4 test(match);
+    const __m128i v = _mm_set1_epi32((int)value);
+    const __m128i lane = _mm_set_epi32(8, 4, 2, 1);
+
+    size_t i = 0, written = 0;
+    for (; i + 4 <= n; i += 4) {
+      unsigned int bits = allow != NULL ? (allow[i / 64] >> (i % 64)) & 15 : 15;
+      if (bits == 0)
+        continue;
+      __m128i s = _mm_loadu_si128((__m128i *)(dst + i));
+      __m128i hit = _mm_andnot_si128(_mm_cmpeq_epi32(s, v), test(s));
+      bits &= _mm_movemask_ps(_mm_castsi128_ps(hit));
+      if (bits == 0)
+        continue;
+
+      unsigned int k;
+      if (before != NULL) {
+        for (k=0; k < 4; k++) {
+          if ((bits >> k) & 1)
+            before->push_back(dst[i + k]);
+        }
+      }
+      __m128i write = _mm_cmpeq_epi32(
+          _mm_and_si128(_mm_set1_epi32(bits), lane), lane);
+      _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(
+            _mm_and_si128(write, v), _mm_andnot_si128(write, s)));
+      changed[i / 64] |= (uint64_t)bits << (i % 64);
+      written += (bits & 1) + ((bits >> 1) & 1) + ((bits >> 2) & 1) + (bits >> 3);
+    }
+    return written
+      + replaceLoop(dst, i, n, match, value, allow, changed, before, format);
+  }
+};
+#endif
+
+template <typename F>
+static inline size_t replaceSpan(typename F::Unit *dst, size_t n,
+    const ColorMatch &match, typename F::Unit value, const uint64_t *allow,
+    uint64_t *changed, std::vector<typename F::Unit> *before,
+    const F &format = F()) {
+  return SpanReplace<F>::run(dst, n, match, value, allow, changed, before,
+      format);
+}
+
+/************** Flood fill ****************/
+/*
+ * Scanline flood fill: every pixel 4-connected to (x, y)
+ * and holding the same value as it is set to 'value'. Each
+ * run is written with SpanFill and then reported as
+ * span(y, x0, x1) for [x0, x1); returning false stops the
+ * fill there, with the runs reported so far written.
+ */
+template <typename F, typename Span>
+static bool floodFill(typename F::Unit *buffer, size_t stride,
+    unsigned int w, unsigned int h, unsigned int x, unsigned int y,
+    typename F::Unit value, Span span) {
+  typedef typename F::Unit Unit;
+  const Unit target = buffer[(size_t)y*stride + x];
+  if (sameUnit<F>(target, value))
+    return true;
+
+  /* Seeds, two coordinates each */
+  std::vector<unsigned int> seeds;
+  seeds.push_back(x);
+  seeds.push_back(y);
+  while (!seeds.empty()) {
+    unsigned int sy = seeds.back();
+    seeds.pop_back();
+    unsigned int sx = seeds.back();
+    seeds.pop_back();
+
+    Unit *row = buffer + (size_t)sy*stride;
+    if (!sameUnit<F>(row[sx], target))
+      continue;
+    unsigned int x0 = sx, x1 = sx + 1;
+    while (x0 > 0 && sameUnit<F>(row[x0 - 1], target)) {
+      x0--;
+    }
+    while (x1 < w && sameUnit<F>(row[x1], target)) {
+      x1++;
+    }
+    SpanFill<F>::run(row + x0, x1 - x0, value);
+    if (!span(sy, x0, x1))
+      return false;
+
+    /* One seed per run of target in the rows either side */
+    int d;
+    for (d=-1; d <= 1; d += 2) {
+      unsigned int ny = sy + d;
+      if (ny >= h)
+        continue;
+      const Unit *next = buffer + (size_t)ny*stride;
+      bool inRun = false;
+      unsigned int nx;
+      for (nx=x0; nx < x1; nx++) {
+        bool match = sameUnit<F>(next[nx], target);
+        if (match && !inRun) {
+          seeds.push_back(nx);
+          seeds.push_back(ny);
+        }
+        inRun = match;
+      }
+    }
+  }
+  return true;
+}
+
+/*
+ * Flood fill by colour distance: the pixels 4-connected to
+ * (x, y) through pixels that 'match' accepts, reported as
+ * span(y, x0, x1) like floodFill(). The filled value may
+ * itself match, so what is left to fill is kept in 'mask'
+ * (w*h bytes, any contents) rather than read back from the
+ * buffer, each row matched with SpanMatch the first time the
+ * fill reaches it. Nothing is written here: the caller writes
+ * each run when it is reported, and a row is always matched
+ * before any run in it is.
+ */
+static inline uint64_t maskWord(const unsigned char *m) {
+  uint64_t v;
+  memcpy(&v, m, 8);
+  return v;
+}
+
+template <typename F, typename Span>
+static bool toleranceFill(const typename F::Unit *buffer, size_t stride,
+    unsigned int w, unsigned int h, unsigned int x, unsigned int y,
+    const ColorMatch &match, std::vector<unsigned char> &mask, Span span,
+    const F &format = F()) {
+  if (mask.size() < (size_t)w*h)
+    mask.resize((size_t)w*h);
+  std::vector<bool> matched(h, false);
+  auto row = [&](unsigned int y) {
+    unsigned char *m = &mask[(size_t)y*w];
+    if (!matched[y]) {
+      SpanMatch<F>::run(buffer + (size_t)y*stride, w, match, m, format);
+      matched[y] = true;
+    }
+    return m;
+  };
+
+  /* Runs of the mask are skipped eight bytes at a time */
+  const uint64_t ones = 0x0101010101010101ULL;
+  std::vector<unsigned int> seeds;
+  seeds.push_back(x);
+  seeds.push_back(y);
+  while (!seeds.empty()) {
+    unsigned int sy = seeds.back();
+    seeds.pop_back();
+    unsigned int sx = seeds.back();
+    seeds.pop_back();
+
+    unsigned char *m = row(sy);
+    if (!m[sx])
+      continue;
+    unsigned int x0 = sx, x1 = sx + 1;
+    while (x0 >= 8 && maskWord(m + x0 - 8) == ones) {
+      x0 -= 8;
+    }
+    while (x0 > 0 && m[x0 - 1]) {
+      x0--;
+    }
+    while (x1 + 8 <= w && maskWord(m + x1) == ones) {
+      x1 += 8;
+    }
+    while (x1 < w && m[x1]) {
+      x1++;
+    }
+    memset(m + x0, 0, x1 - x0);
+    if (!span(sy, x0, x1))
+      return false;
+
+    int d;
+    for (d=-1; d <= 1; d += 2) {
+      unsigned int ny = sy + d;
+      if (ny >= h)
+        continue;
+      const unsigned char *next = row(ny);
+      bool inRun = false;
+      unsigned int nx = x0;
+      while (nx < x1) {
+        if (nx + 8 <= x1 && maskWord(next + nx) == (inRun ? ones : 0)) {
+          nx += 8;
+          continue;
+        }
+        bool hit = next[nx] != 0;
+        if (hit && !inRun) {
+          seeds.push_back(nx);
+          seeds.push_back(ny);
+        }
+        inRun = hit;
+        nx++;
+      }
+    }
+  }
+  return true;
+}
+
+#endif
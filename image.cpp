@@ -0,0 +1,739 @@
+#include <wx/gdicmn.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "image.h"
+#include "journal.h"
+#include "pool.h"
+#include "format.h"
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+/* Compressed bytes read from the file at a time */
+#define IMAGE_READ_BYTES 65536
+
+/* Bytes between early-out checks when costing a filter */
+#define PNG_COST_STEP 256
+
+/* Bands per pool thread in one exported block */
+#define PNG_BANDS_PER_THREAD 2
+
+#define BMP_HEADER_SIZE 54
+
+static const unsigned char PNG_SIGNATURE[8] =
+  { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+static uint32_t get32be(const unsigned char *in) {
+  return (uint32_t)in[0] << 24 | (uint32_t)in[1] << 16 |
+    (uint32_t)in[2] << 8 | (uint32_t)in[3];
+}
+
+static uint32_t get32le(const unsigned char *in) {
+  return (uint32_t)in[0] | (uint32_t)in[1] << 8 |
+    (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+static void put32be(unsigned char *out, uint32_t v) {
+  out[0] = v >> 24;
+  out[1] = v >> 16;
+  out[2] = v >> 8;
+  out[3] = v;
+}
+
+static void put32le(unsigned char *out, uint32_t v) {
+  out[0] = v;
+  out[1] = v >> 8;
+  out[2] = v >> 16;
+  out[3] = v >> 24;
+}
+
+/* Written to compile to selects rather than branches */
+static inline unsigned char paeth(int a, int b, int c) {
+  int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2*c);
+  int bc = pb <= pc ? b : c;
+  return pa <= pb && pa <= pc ? a : bc;
+}
+
+/* PNG filter predictors: None, Sub, Up, Average, Paeth */
+template <int Type>
+static inline unsigned char predict(unsigned char a, unsigned char b,
+    unsigned char c) {
+  switch (Type) {
+    case 0: return 0;
+    case 1: return a;
+    case 2: return b;
+    case 3: return (a + b) >> 1;
+    default: return paeth(a, b, c);
+  }
+}
+
+/* Undo filter 'Type' on a row of 'n' bytes in place */
+template <int Type>
+static void unfilter(unsigned char *cur, const unsigned char *prev,
+    size_t n, size_t bpp) {
+  size_t i;
+  for (i=0; i < bpp && i < n; i++) {
+    cur[i] += predict<Type>(0, prev[i], 0);
+  }
+  for (; i < n; i++) {
+    cur[i] += predict<Type>(cur[i - bpp], prev[i], prev[i - bpp]);
+  }
+}
+
+/*
+ * Sum of the filtered bytes taken as signed, libpng's
+ * heuristic for picking a row's filter. Gives up once
+ * past 'limit', the cost of the best filter so far.
+ * 'Bpp' is 3 for RGB rows, 4 for RGBA.
+ */
+template <int Type, int Bpp>
+static uint64_t filterCost(const unsigned char *x, const unsigned char *above,
+    size_t n, uint64_t limit) {
+  uint64_t sum = 0;
+  size_t i;
+  for (i=0; i < Bpp && i < n; i++) {
+    signed char d = x[i] - predict<Type>(0, above[i], 0);
+    sum += abs(d);
+  }
+  while (i < n && sum < limit) {
+    size_t end = MIN(n, i + PNG_COST_STEP);
+    unsigned int part = 0;
+    for (; i < end; i++) {
+      signed char d = x[i] - predict<Type>(x[i - Bpp], above[i], above[i - Bpp]);
+      part += abs(d);
+    }
+    sum += part;
+  }
+  return sum;
+}
+
+template <int Type, int Bpp>
+static void filterRow(unsigned char *out, const unsigned char *x,
+    const unsigned char *above, size_t n) {
+  size_t i;
+  for (i=0; i < Bpp && i < n; i++) {
+    out[i] = x[i] - predict<Type>(0, above[i], 0);
+  }
+  for (; i < n; i++) {
+    out[i] = x[i] - predict<Type>(x[i - Bpp], above[i], above[i - Bpp]);
+  }
+}
+
+/* By filter type, for RGB [0] and RGBA [1] rows */
+static uint64_t (*const FILTER_COSTS[2][5])(const unsigned char *,
+    const unsigned char *, size_t, uint64_t) = {
+  { filterCost<0, 3>, filterCost<1, 3>, filterCost<2, 3>, filterCost<3, 3>,
+    filterCost<4, 3> },
+  { filterCost<0, 4>, filterCost<1, 4>, filterCost<2, 4>, filterCost<3, 4>,
+    filterCost<4, 4> }
+};
+
+static void (*const FILTER_ROWS[2][5])(unsigned char *, const unsigned char *,
+    const unsigned char *, size_t) = {
+  { filterRow<0, 3>, filterRow<1, 3>, filterRow<2, 3>, filterRow<3, 3>,
+    filterRow<4, 3> },
+  { filterRow<0, 4>, filterRow<1, 4>, filterRow<2, 4>, filterRow<3, 4>,
+    filterRow<4, 4> }
+};
+
+ImageFormat imageFormatFor(const char *path) {
+  size_t n = strlen(path);
+  if (n >= 4 && strcasecmp(path + n - 4, ".bmp") == 0)
+    return IMG_BMP;
+  return IMG_PNG;
+}
+
+/************** ImageReader ****************/
+ImageReader::ImageReader(const char *path) {
+  this->path = path;
+  format = imageFormatFor(path);
+  memset(palette, 0, sizeof(palette));
+  memset(&zs, 0, sizeof(zs));
+}
+
+ImageReader::~ImageReader() {
+  if (inflating)
+    inflateEnd(&zs);
+  if (file != NULL)
+    fclose(file);
+}
+
+bool ImageReader::open() {
+  file = fopen(path.c_str(), "rb");
+  if (file == NULL)
+    return false;
+
+  bool ok = format == IMG_PNG ? openPng() : openBmp();
+  /* Keeps the canvas size addressable as an int */
+  if (ok && (uint64_t)Raster::strideFor(width) * height > 0x7fffffff / 4)
+    ok = false;
+  if (!ok) {
+    fclose(file);
+    file = NULL;
+  }
+  return ok;
+}
+
+/*
+ * Read up to the first IDAT, keeping the header and the
+ * palette. The file is left at the start of the image data.
+ */
+bool ImageReader::openPng() {
+  unsigned char head[13];
+  if (fread(head, 1, 8, file) != 8 || memcmp(head, PNG_SIGNATURE, 8) != 0)
+    return false;
+
+  bool hasHeader = false;
+  for (;;) {
+    unsigned char chunk[8];
+    if (fread(chunk, 1, 8, file) != 8)
+      return false;
+    uint32_t len = get32be(chunk);
+    const char *type = (const char *)chunk + 4;
+
+    if (memcmp(type, "IHDR", 4) == 0) {
+      if (len != 13 || fread(head, 1, 13, file) != 13)
+        return false;
+      width = get32be(head);
+      height = get32be(head + 4);
+      depth = head[8];
+      colorType = head[9];
+      /* Compression, filter method, interlace */
+      if (head[10] != 0 || head[11] != 0 || head[12] != 0)
+        return false;
+      hasHeader = true;
+    } else if (memcmp(type, "PLTE", 4) == 0 && len <= 3*256) {
+      unsigned char entries[3*256];
+      if (fread(entries, 1, len, file) != len)
+        return false;
+      uint32_t i;
+      for (i=0; i < len / 3; i++) {
+        palette[i] = Color(entries[3*i], entries[3*i + 1],
+            entries[3*i + 2]).value();
+      }
+    } else if (memcmp(type, "tRNS", 4) == 0 && colorType == 3 && len <= 256) {
+      unsigned char alpha[256];
+      if (fread(alpha, 1, len, file) != len)
+        return false;
+      uint32_t i;
+      for (i=0; i < len; i++) {
+        Color c = Color::fromValue(palette[i]);
+        c.a = alpha[i];
+        palette[i] = c.value();
+      }
+    } else if (memcmp(type, "IDAT", 4) == 0) {
+      idatLeft = len;
+      break;
+    } else if (memcmp(type, "IEND", 4) == 0) {
+      return false;
+    } else if (fseeko(file, len, SEEK_CUR) != 0) {
+      return false;
+    }
+    /* CRC */
+    if (memcmp(type, "IDAT", 4) != 0 && fseeko(file, 4, SEEK_CUR) != 0)
+      return false;
+  }
+
+  switch (colorType) {
+    case 0: channels = 1; break;
+    case 2: channels = 3; break;
+    case 3: channels = 1; break;
+    case 4: channels = 2; break;
+    case 6: channels = 4; break;
+    default: return false;
+  }
+  bool sub8 = depth == 1 || depth == 2 || depth == 4;
+  if (!hasHeader || width == 0 || height == 0
+      || !(depth == 8 || (depth == 16 && colorType != 3)
+        || (sub8 && (colorType == 0 || colorType == 3))))
+    return false;
+
+  size_t rowBytes = ((size_t)width * channels * depth + 7) / 8;
+  row.assign(1 + rowBytes, 0);
+  prev.assign(1 + rowBytes, 0);
+  in.resize(IMAGE_READ_BYTES);
+  if (inflateInit(&zs) != Z_OK)
+    return false;
+  inflating = true;
+  return true;
+}
+
+bool ImageReader::openBmp() {
+  unsigned char head[BMP_HEADER_SIZE + 12];
+  if (fread(head, 1, BMP_HEADER_SIZE, file) != BMP_HEADER_SIZE
+      || head[0] != 'B' || head[1] != 'M')
+    return false;
+
+  uint32_t infoSize = get32le(head + 14);
+  int32_t w = (int32_t)get32le(head + 18);
+  int32_t h = (int32_t)get32le(head + 22);
+  bits = head[28] | head[29] << 8;
+  uint32_t compression = get32le(head + 30);
+  if (infoSize < 40 || w <= 0 || h == 0 || h == INT32_MIN)
+    return false;
+
+  if (bits == 32 && compression == 3) {
+    /* BI_BITFIELDS: only the usual BGRA layout */
+    if (fread(head + BMP_HEADER_SIZE, 1, 12, file) != 12
+        || get32le(head + BMP_HEADER_SIZE) != 0x00ff0000
+        || get32le(head + BMP_HEADER_SIZE + 4) != 0x0000ff00
+        || get32le(head + BMP_HEADER_SIZE + 8) != 0x000000ff)
+      return false;
+  } else if (!((bits == 24 || bits == 32) && compression == 0)) {
+    return false;
+  }
+
+  width = w;
+  bottomUp = h > 0;
+  height = bottomUp ? h : -h;
+  dataOffset = get32le(head + 10);
+  stride = ((size_t)width * (bits / 8) + 3) & ~(size_t)3;
+  return true;
+}
+
+/* Move on to the next IDAT chunk, skipping the CRC */
+bool ImageReader::nextIdat() {
+  unsigned char chunk[8];
+  do {
+    if (fseeko(file, 4, SEEK_CUR) != 0 || fread(chunk, 1, 8, file) != 8
+        || memcmp(chunk + 4, "IDAT", 4) != 0)
+      return false;
+    idatLeft = get32be(chunk);
+  } while (idatLeft == 0);
+  return true;
+}
+
+bool ImageReader::readPng(uint32_t *rows, size_t pitch, unsigned int count) {
+  size_t rowBytes = row.size() - 1;
+  size_t bpp = MAX(1, channels * depth / 8);
+  unsigned int r;
+  for (r=0; r < count; r++) {
+    zs.next_out = &row[0];
+    zs.avail_out = row.size();
+    while (zs.avail_out > 0) {
+      if (zs.avail_in == 0) {
+        if (idatLeft == 0 && !nextIdat())
+          return false;
+        size_t n = MIN((size_t)idatLeft, in.size());
+        if (fread(&in[0], 1, n, file) != n)
+          return false;
+        idatLeft -= n;
+        zs.next_in = &in[0];
+        zs.avail_in = n;
+      }
+      int status = inflate(&zs, Z_NO_FLUSH);
+      if (status == Z_STREAM_END && zs.avail_out > 0)
+        return false;
+      if (status != Z_OK && status != Z_STREAM_END)
+        return false;
+    }
+
+    unsigned char *cur = &row[1];
+    const unsigned char *above = &prev[1];
+    switch (row[0]) {
+      case 0: break;
+      case 1: unfilter<1>(cur, above, rowBytes, bpp); break;
+      case 2: unfilter<2>(cur, above, rowBytes, bpp); break;
+      case 3: unfilter<3>(cur, above, rowBytes, bpp); break;
+      case 4: unfilter<4>(cur, above, rowBytes, bpp); break;
+      default: return false;
+    }
+    convert(cur, rows + r*pitch);
+    row.swap(prev);
+  }
+  return true;
+}
+
+/* One unfiltered PNG row to canvas pixels */
+void ImageReader::convert(const unsigned char *src, uint32_t *out) {
+  unsigned int x;
+  if (depth == 8) {
+    switch (colorType) {
+      case 0:
+        copySpan<Gray8, Rgba32>(src, out, width);
+        return;
+      case 2:
+        copySpan<Rgb24, Rgba32>((const Rgb24::Unit *)src, out, width);
+        return;
+      case 3:
+        copySpan<Indexed8, Rgba32>(src, out, width, Indexed8(palette));
+        return;
+      case 6:
+        copySpan<Rgba32, Rgba32>((const uint32_t *)src, out, width);
+        return;
+    }
+  }
+
+  /* Everything else, a sample at a time */
+  int shift = depth == 16 ? 1 : 0;
+  unsigned int mask = (1 << MIN(depth, 8)) - 1;
+  for (x=0; x < width; x++) {
+    unsigned int s[4], k;
+    for (k=0; k < (unsigned int)channels; k++) {
+      size_t i = (size_t)x * channels + k;
+      if (depth >= 8) {
+        s[k] = src[i << shift];
+      } else {
+        size_t bit = i * depth;
+        s[k] = (src[bit / 8] >> (8 - depth - bit % 8)) & mask;
+      }
+    }
+
+    unsigned char g = s[0] * 255 / mask;
+    switch (colorType) {
+      case 0:
+        out[x] = Color(g, g, g).value();
+        break;
+      case 2:
+        out[x] = Color(s[0], s[1], s[2]).value();
+        break;
+      case 3:
+        out[x] = palette[s[0] & 0xff];
+        break;
+      case 4:
+        out[x] = Color(g, g, g, s[1]).value();
+        break;
+      default:
+        out[x] = Color(s[0], s[1], s[2], s[3]).value();
+        break;
+    }
+  }
+}
+
+/* Bottom-up rows y..y+count-1 are one run in the file as well */
+bool ImageReader::readBmp(uint32_t *rows, size_t pitch, unsigned int y,
+    unsigned int count) {
+  int64_t first = bottomUp ? height - y - count : y;
+  raw.resize(count * stride);
+  if (fseeko(file, dataOffset + first * (int64_t)stride, SEEK_SET) != 0
+      || fread(&raw[0], 1, raw.size(), file) != raw.size())
+    return false;
+
+  size_t step = bits / 8;
+  unsigned int r, x;
+  for (r=0; r < count; r++) {
+    const unsigned char *src = &raw[(bottomUp ? count - 1 - r : r) * stride];
+    uint32_t *out = rows + r*pitch;
+    if (step == 3) {
+      copySpan<Bgr24, Rgba32>((const Bgr24::Unit *)src, out, width);
+      continue;
+    }
+    for (x=0; x < width; x++, src += step) {
+      out[x] = Color(src[2], src[1], src[0]).value();
+    }
+  }
+  return true;
+}
+
+bool ImageReader::load(Raster &raster) {
+  if (file == NULL)
+    return false;
+
+  bool ok = raster.import(width, height,
+      [this](uint32_t *rows, size_t pitch, unsigned int y, unsigned int count) {
+        bool ok = format == IMG_PNG ? readPng(rows, pitch, count)
+          : readBmp(rows, pitch, y, count);
+        failed = failed || !ok;
+        return ok;
+      });
+
+  fclose(file);
+  file = NULL;
+  if (ok && raster.getJournal() != NULL)
+    raster.getJournal()->checkpoint(path.c_str(), width, height);
+  return ok;
+}
+
+/************** ImageWriter ****************/
+ImageWriter::ImageWriter(const char *path, ThreadPool *pool, int level) {
+  this->path = path;
+  this->pool = pool;
+  this->level = level;
+  format = imageFormatFor(path);
+}
+
+ImageWriter::~ImageWriter() {
+  if (file != NULL)
+    fclose(file);
+}
+
+bool ImageWriter::put(const void *data, size_t n) {
+  bytes += n;
+  return fwrite(data, 1, n, file) == n;
+}
+
+bool ImageWriter::putChunk(const char *type, const unsigned char *data,
+    size_t n) {
+  /* crc32() of a NULL buffer is its initial value, not crc */
+  uLong crc = crc32(0, (const Bytef *)type, 4);
+  return putChunk(type, data, n, n == 0 ? crc : crc32(crc, data, n));
+}
+
+/* 'crc' covers the type and the data */
+bool ImageWriter::putChunk(const char *type, const unsigned char *data,
+    size_t n, uLong crc) {
+  unsigned char head[8], tail[4];
+  put32be(head, n);
+  memcpy(head + 4, type, 4);
+  put32be(tail, crc);
+  return put(head, 8) && (n == 0 || put(data, n)) && put(tail, 4);
+}
+
+/* The colours under the selection border are exported,
+ * not the border */
+bool ImageWriter::save(Raster &raster) {
+  raster.hideOverlay();
+  bool ok = writeImage(raster);
+  raster.showOverlay();
+  return ok;
+}
+
+bool ImageWriter::writeImage(Raster &raster) {
+  unsigned int w = raster.getWidth(), h = raster.getHeight();
+  bytes = 0;
+  saved = false;
+  file = fopen(path.c_str(), "wb");
+  if (file == NULL)
+    return false;
+
+  bool ok;
+  if (format == IMG_PNG) {
+    /* RGBA only when it's needed */
+    channels = raster.isOpaque() ? 3 : 4;
+    unsigned char ihdr[13];
+    put32be(ihdr, w);
+    put32be(ihdr + 4, h);
+    ihdr[8] = 8;
+    ihdr[9] = channels == 4 ? 6 : 2;
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+    /* zlib header: deflate, 32K window, level hint, check bits */
+    int hint = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+    unsigned char zhead[2] = { 0x78, (unsigned char)(hint << 6) };
+    zhead[1] += 31 - (zhead[0] * 256 + zhead[1]) % 31;
+
+    last.clear();
+    window.clear();
+    adler = adler32(0, NULL, 0);
+    bandRows = MAX(1, PNG_BAND_BYTES / (channels*(size_t)w));
+    unsigned int block = bandRows * PNG_BANDS_PER_THREAD *
+      (pool != NULL ? pool->size() : 1);
+
+    ok = put(PNG_SIGNATURE, 8) && putChunk("IHDR", ihdr, 13)
+      && putChunk("IDAT", zhead, 2)
+      && raster.exportImage(
+          [&](const uint32_t *rows, size_t pitch, unsigned int y,
+              unsigned int count) {
+            return writePng(raster, rows, pitch, y, count);
+          }, block);
+    if (ok) {
+      unsigned char trailer[4];
+      put32be(trailer, adler);
+      ok = putChunk("IDAT", trailer, 4) && putChunk("IEND", NULL, 0);
+    }
+  } else {
+    size_t stride = (3*(size_t)w + 3) & ~(size_t)3;
+    uint64_t size = BMP_HEADER_SIZE + (uint64_t)stride * h;
+    unsigned char head[BMP_HEADER_SIZE];
+    memset(head, 0, sizeof(head));
+    head[0] = 'B';
+    head[1] = 'M';
+    put32le(head + 2, size);
+    put32le(head + 10, BMP_HEADER_SIZE);
+    put32le(head + 14, 40);
+    put32le(head + 18, w);
+    put32le(head + 22, h);
+    head[26] = 1;
+    head[28] = 24;
+    put32le(head + 34, stride * h);
+
+    ok = size <= 0xffffffffULL && put(head, BMP_HEADER_SIZE)
+      && raster.exportImage(
+          [&](const uint32_t *rows, size_t pitch, unsigned int y,
+              unsigned int count) {
+            return writeBmp(raster, rows, pitch, y, count);
+          });
+  }
+
+  ok = fclose(file) == 0 && ok;
+  file = NULL;
+  if (!ok)
+    unlink(path.c_str());
+  saved = ok;
+  return ok;
+}
+
+/*
+ * Pick the cheapest filter for each row (libpng's
+ * minimum sum of absolute differences) and write it out
+ * behind its filter type byte. Rows are 'rowBytes' long
+ * and 'pitch' bytes apart; 'above' is the row before the
+ * band, NULL at the top of the image.
+ */
+void ImageWriter::filter(Band &band, const unsigned char *rows, size_t pitch,
+    const unsigned char *above, size_t rowBytes, unsigned int count) {
+  std::vector<unsigned char> zeros;
+  if (above == NULL) {
+    zeros.assign(rowBytes, 0);
+    above = &zeros[0];
+  }
+
+  int rgba = channels == 4;
+  band.filtered.resize(count * (1 + rowBytes));
+  unsigned char *out = &band.filtered[0];
+  unsigned int r;
+  for (r=0; r < count; r++) {
+    const unsigned char *x = rows + r * pitch;
+    int best = 0, t;
+    uint64_t bestCost = FILTER_COSTS[rgba][0](x, above, rowBytes, UINT64_MAX);
+    for (t=1; t < 5; t++) {
+      uint64_t cost = FILTER_COSTS[rgba][t](x, above, rowBytes, bestCost);
+      if (cost < bestCost) {
+        best = t;
+        bestCost = cost;
+      }
+    }
+    *out++ = best;
+    FILTER_ROWS[rgba][best](out, x, above, rowBytes);
+    out += rowBytes;
+    above = x;
+  }
+  band.adler = adler32(adler32(0, NULL, 0), &band.filtered[0],
+      band.filtered.size());
+}
+
+/*
+ * One raw deflate stream primed with the data before it.
+ * It ends on a byte boundary (sync flush) so the next band
+ * can follow directly; only the last one is final.
+ */
+void ImageWriter::deflateBand(Band &band, const unsigned char *dict,
+    size_t dictLen, bool isLast) {
+  z_stream z;
+  memset(&z, 0, sizeof(z));
+  band.ok = false;
+  if (deflateInit2(&z, level, Z_DEFLATED, -15, 8, Z_FILTERED) != Z_OK)
+    return;
+  if (dictLen > 0)
+    deflateSetDictionary(&z, dict, dictLen);
+
+  /* A sync flush adds an empty stored block to the bound */
+  band.out.resize(deflateBound(&z, band.filtered.size()) + 16);
+  z.next_in = &band.filtered[0];
+  z.avail_in = band.filtered.size();
+  z.next_out = &band.out[0];
+  z.avail_out = band.out.size();
+  int status = deflate(&z, isLast ? Z_FINISH : Z_SYNC_FLUSH);
+  band.ok = z.avail_in == 0 &&
+    (isLast ? status == Z_STREAM_END : status == Z_OK);
+  band.out.resize(band.out.size() - z.avail_out);
+  deflateEnd(&z);
+
+  band.crc = crc32(crc32(0, (const Bytef *)"IDAT", 4),
+      &band.out[0], band.out.size());
+}
+
+/*
+ * A block of rows: filter its bands, then deflate them,
+ * both across the pool, and append them as IDAT chunks.
+ * RGBA rows are filtered straight from the canvas, RGB
+ * ones are packed first, by the band's own task.
+ */
+bool ImageWriter::writePng(const Raster &raster, const uint32_t *rows,
+    size_t pitch, unsigned int y, unsigned int count) {
+  unsigned int w = raster.getWidth();
+  size_t rowBytes = channels*(size_t)w;
+  size_t n = (count + bandRows - 1) / bandRows;
+  if (bands.size() < n)
+    bands.resize(n);
+  bool isEnd = y + count == raster.getHeight();
+
+  ThreadPool::Task filterTask = [&](size_t b) {
+    Band &band = bands[b];
+    unsigned int r0 = b * bandRows, rn = MIN(bandRows, count - r0);
+    const unsigned char *first = last.empty() ? NULL : &last[0];
+    if (channels == 4) {
+      const unsigned char *data = (const unsigned char *)rows;
+      size_t step = 4*pitch;
+      filter(band, data + r0 * step, step,
+          b > 0 ? data + (r0 - 1) * step : first, rowBytes, rn);
+      return;
+    }
+
+    /* Along with the row above, unless that is 'last' */
+    unsigned int from = b > 0 ? r0 - 1 : r0, r;
+    band.packed.resize((r0 + rn - from) * rowBytes);
+    for (r=from; r < r0 + rn; r++) {
+      copySpan<Rgba32, Rgb24>(rows + r*pitch,
+          (Rgb24::Unit *)&band.packed[(r - from) * rowBytes], w);
+    }
+    const unsigned char *data = &band.packed[0];
+    filter(band, b > 0 ? data + rowBytes : data, rowBytes,
+        b > 0 ? data : first, rowBytes, rn);
+  };
+  ThreadPool::Task deflateTask = [&](size_t b) {
+    const std::vector<unsigned char> &before =
+      b > 0 ? bands[b - 1].filtered : window;
+    size_t k = MIN(before.size(), (size_t)PNG_WINDOW);
+    deflateBand(bands[b], k > 0 ? &before[before.size() - k] : NULL, k,
+        isEnd && b == n - 1);
+  };
+
+  size_t b;
+  if (pool != NULL) {
+    pool->run(n, filterTask);
+    pool->run(n, deflateTask);
+  } else {
+    for (b=0; b < n; b++) {
+      filterTask(b);
+    }
+    for (b=0; b < n; b++) {
+      deflateTask(b);
+    }
+  }
+
+  for (b=0; b < n; b++) {
+    Band &band = bands[b];
+    if (!band.ok || !putChunk("IDAT", &band.out[0], band.out.size(), band.crc))
+      return false;
+    adler = adler32_combine(adler, band.adler, band.filtered.size());
+  }
+
+  /* What the next block builds on */
+  const std::vector<unsigned char> &tail = bands[n - 1].filtered;
+  size_t k = MIN(tail.size(), (size_t)PNG_WINDOW);
+  window.assign(tail.end() - k, tail.end());
+  if (channels == 4) {
+    const unsigned char *end = (const unsigned char *)(rows + (count - 1)*pitch);
+    last.assign(end, end + rowBytes);
+  } else {
+    const std::vector<unsigned char> &packed = bands[n - 1].packed;
+    last.assign(packed.end() - rowBytes, packed.end());
+  }
+  return true;
+}
+
+/* Bottom-up: the block goes to the end of what's left.
+ * 24-bit, so transparency is composited onto white. */
+bool ImageWriter::writeBmp(const Raster &raster, const uint32_t *rows,
+    size_t pitch, unsigned int y, unsigned int count) {
+  unsigned int w = raster.getWidth(), h = raster.getHeight();
+  size_t stride = (3*(size_t)w + 3) & ~(size_t)3;
+  raw.assign(count * stride, 0);
+
+  unsigned int r;
+  for (r=0; r < count; r++) {
+    Bgr24::Unit *out = (Bgr24::Unit *)&raw[(count - 1 - r) * stride];
+    fillSpan<Bgr24>(out, w, WHITE);
+    blendSpan<Rgba32, Bgr24>(rows + r*pitch, out, w);
+  }
+
+  int64_t first = h - y - count;
+  if (fseeko(file, BMP_HEADER_SIZE + first * (int64_t)stride, SEEK_SET) != 0)
+    return false;
+  return put(&raw[0], raw.size());
+}
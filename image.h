@@ -0,0 +1,183 @@
+#ifndef PAINT_IMAGE_H
+#define PAINT_IMAGE_H
+
+/*
+ * PNG and BMP import/export.
+ *
+ * Both directions stream: rows are decoded straight into
+ * the canvas buffer through Raster::import(), a block at a
+ * time, and encoded from it through Raster::exportImage(),
+ * so neither side ever holds a second copy of the image.
+ * RGBA rows go out without any conversion.
+ *
+ * PNG export cuts each block into row bands and filters and
+ * deflates them on the pool, one raw deflate stream per band
+ * ended by a sync flush. Each band is primed with the last
+ * 32 KiB of the band before it, so the concatenation is a
+ * single valid zlib stream (the Adler-32 values are combined)
+ * that compresses about as well as a serial one.
+ *
+ * Supported on import: non-interlaced PNG of any colour type
+ * and bit depth (alpha and palette transparency are kept)
+ * and uncompressed 24/32-bit BMP (read as opaque). Export
+ * writes 8-bit PNG, RGBA if the canvas has any transparency
+ * and RGB otherwise, or 24-bit BMP composited onto white.
+ * Headless, like Raster.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+#include "raster.h"
+
+class ThreadPool;
+
+/* Same default as libpng, so sizes compare with wxImage */
+#define PNG_LEVEL 6
+
+/* Raw bytes per compressed band */
+#define PNG_BAND_BYTES (1 << 20)
+
+/* Deflate window, carried over from band to band */
+#define PNG_WINDOW 32768
+
+enum ImageFormat
+{
+  IMG_PNG,
+  IMG_BMP
+};
+
+/* By file extension; anything but .bmp is PNG */
+ImageFormat imageFormatFor(const char *path);
+
+class ImageReader {
+  private:
+    std::string path;
+    ImageFormat format;
+    FILE *file = NULL;
+    bool failed = false;
+
+    unsigned int width = 0;
+    unsigned int height = 0;
+
+    /* PNG: header fields, then the inflate state between
+     * blocks; 'prev' is the previous unfiltered row */
+    int depth = 0;
+    int colorType = 0;
+    int channels = 0;
+    uint32_t palette[256];    /* as canvas pixels */
+    z_stream zs;
+    bool inflating = false;
+    uint32_t idatLeft = 0;
+    std::vector<unsigned char> in;
+    std::vector<unsigned char> row;
+    std::vector<unsigned char> prev;
+
+    /* BMP: where the rows start, bytes per row incl. padding */
+    int bits = 0;
+    bool bottomUp = true;
+    int64_t dataOffset = 0;
+    size_t stride = 0;
+    std::vector<unsigned char> raw;
+
+    bool openPng();
+    bool openBmp();
+    bool nextIdat();
+    bool readPng(uint32_t *rows, size_t pitch, unsigned int count);
+    bool readBmp(uint32_t *rows, size_t pitch, unsigned int y,
+        unsigned int count);
+    void convert(const unsigned char *src, uint32_t *dst);
+
+  public:
+    ImageReader(const char *path);
+    ~ImageReader();
+
+    inline const char *getPath() const { return path.c_str(); }
+    inline unsigned int getWidth() const { return width; }
+    inline unsigned int getHeight() const { return height; }
+
+    /* True if load() stopped at a bad or truncated file */
+    inline bool hasFailed() const { return failed; }
+
+    /* Read the header. False if the file is missing, not an
+     * image or uses an unsupported variant. Any thread. */
+    bool open();
+
+    /*
+     * Raster thread. Decode into 'raster', replacing the
+     * canvas; see Raster::import(). Its journal, if any,
+     * restarts from this file.
+     */
+    bool load(Raster &raster);
+};
+
+class ImageWriter {
+  private:
+    std::string path;
+    ImageFormat format;
+    ThreadPool *pool;
+    int level;
+    FILE *file = NULL;
+
+    /* Outcome of the last save() */
+    uint64_t bytes = 0;
+    bool saved = false;
+
+    /* PNG state between blocks: the last row and deflate
+     * window of the previous block, the running checksum.
+     * 'channels' is 3 (RGB) or 4 (RGBA). */
+    int channels = 3;
+    unsigned int bandRows = 1;
+    std::vector<unsigned char> last;
+    std::vector<unsigned char> window;
+    uLong adler = 1;
+
+    /* One per task, kept to reuse their memory */
+    struct Band {
+      std::vector<unsigned char> packed;
+      std::vector<unsigned char> filtered;
+      std::vector<unsigned char> out;
+      uLong adler;
+      uLong crc;
+      bool ok;
+    };
+    std::vector<Band> bands;
+
+    /* BMP rows, converted and padded */
+    std::vector<unsigned char> raw;
+
+    bool writeImage(Raster &raster);
+    bool put(const void *data, size_t n);
+    bool putChunk(const char *type, const unsigned char *data, size_t n);
+    bool putChunk(const char *type, const unsigned char *data, size_t n,
+        uLong crc);
+    bool writePng(const Raster &raster, const uint32_t *rows, size_t pitch,
+        unsigned int y, unsigned int count);
+    void filter(Band &band, const unsigned char *rows, size_t pitch,
+        const unsigned char *above, size_t rowBytes, unsigned int count);
+    void deflateBand(Band &band, const unsigned char *dict, size_t dictLen,
+        bool isLast);
+    bool writeBmp(const Raster &raster, const uint32_t *rows, size_t pitch,
+        unsigned int y, unsigned int count);
+
+  public:
+    /* Bands are compressed on 'pool' (not owned), NULL is serial */
+    ImageWriter(const char *path, ThreadPool *pool = NULL,
+        int level = PNG_LEVEL);
+    ~ImageWriter();
+
+    inline const char *getPath() const { return path.c_str(); }
+    inline uint64_t getBytes() const { return bytes; }
+    inline bool wasSaved() const { return saved; }
+
+    /*
+     * Raster thread, or with the raster idle. Write the
+     * canvas. On I/O errors or when the job is cancelled
+     * the partial file is removed and false is returned.
+     */
+    bool save(Raster &raster);
+};
+
+#endif //PAINT_IMAGE_H
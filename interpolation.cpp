@@ -2,12 +2,10 @@
 // Created by Patricia M Marukot on 2020-05-06.
 //
 
-#include <wx/wxprec.h>
-#ifndef WX_PRECOMP
-#include <wx/wx.h>
-#endif
+#include <wx/gdicmn.h>
 
 #include <math.h>
+#include <mutex>
 #include <vector>
 #include <iostream>
 
@@ -15,6 +13,8 @@
 #include "interpolation.h"
 
 #define ABS(x) ((x) < 0 ? -(x) : x)
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
 
 /*
  * This is a library to perform spline interpolation
@@ -28,7 +28,8 @@
  * Formula:
  *    y = y0 + (x - x0) * (y1 - y0) / (x1 - x0)
  */
-std::vector<wxPoint> lerp(wxPoint p0, wxPoint p1, int width)
+static void lerpSquare(wxPoint p0, wxPoint p1, int width,
+    std::vector<wxPoint> &points)
 {
   int x0, x1, y0, y1;
   if (p0.x < p1.x) {
@@ -48,14 +49,10 @@ std::vector<wxPoint> lerp(wxPoint p0, wxPoint p1, int width)
    * This draws only a square centered around (x,y).
    * 
    * Note: 
-   * Algorithm is inefficient due to multiple overlapping
-   * pixels. For example, from the current implementation,
-   * points (x,y) and (x+1,y) - which are next to one another
-   * in pixel space - will have virtually identical surrounding
-   * points. Not bothering to optimize this because despite this,
-   * all drawing operations are still fast.
+   * Only single pixel lines come through here now, wider
+   * brushes are round and stamped incrementally (see
+   * lerpRound).
    */
-  std::vector<wxPoint> points;
   auto thicc = [&points, &width](int x, int y) {
     int left, right;
     int top, bot;
@@ -108,5 +105,150 @@ std::vector<wxPoint> lerp(wxPoint p0, wxPoint p1, int width)
       thicc(x, y);
     }
   }
+}
+
+/*
+ * Round brush of diameter d as one span per row, built
+ * once per diameter. Row i is dy = i - d/2 and covers
+ * dx in [x0, x1). Offsets run from -d/2 to d - d/2 - 1
+ * like the square stamp, so even sizes sit half a pixel
+ * up and left of the sample.
+ */
+struct Stamp {
+  std::vector<int> x0;
+  std::vector<int> x1;
+};
+
+static const Stamp &stampFor(int d) {
+  static std::mutex lock;
+  static Stamp *stamps[BRUSH_MAX_DIAMETER + 1];
+
+  std::lock_guard<std::mutex> guard(lock);
+  if (stamps[d] != NULL)
+    return *stamps[d];
+
+  /* Pixel centres inside the circle, in doubled coordinates
+   * so that the half-pixel centre of even sizes is exact */
+  Stamp *stamp = new Stamp;
+  int lo = -(d / 2), k = d - 1 + 2*lo;
+  int i, dx;
+  for (i=0; i < d; i++) {
+    int v = 2*(lo + i) - k;
+    int x0 = 0, x1 = 0;
+    for (dx=lo; dx < lo + d; dx++) {
+      int u = 2*dx - k;
+      if (u*u + v*v > d*d)
+        continue;
+      if (x0 == x1)
+        x0 = dx;
+      x1 = dx + 1;
+    }
+    stamp->x0.push_back(x0);
+    stamp->x1.push_back(x1);
+  }
+  stamps[d] = stamp;
+  return *stamp;
+}
+
+/* [x0, x1) on row y, less what lies left of the canvas */
+static void emitSpan(std::vector<wxPoint> &points, int y, int x0, int x1) {
+  int x;
+  for (x=MAX(x0, 0); x < x1; x++) {
+    points.push_back(wxPoint(x, y));
+  }
+}
+
+/*
+ * Drag the round brush along 'path': every pixel of the
+ * first stamp, then for each step (never more than a pixel
+ * along either axis) only the spans the previous stamp did
+ * not already cover. A step adds at most two spans a row,
+ * so the cost grows with the diameter rather than its
+ * square.
+ */
+static void lerpRound(const wxPoint *path, size_t count, int width,
+    std::vector<wxPoint> &points)
+{
+  const Stamp &stamp = stampFor(width);
+  int lo = -(width / 2);
+
+  bool first = true;
+  wxPoint prev;
+  auto step = [&](int x, int y) {
+    int i;
+    for (i=0; i < width; i++) {
+      int row = y + lo + i;
+      if (row < 0)
+        continue;
+      int n0 = x + stamp.x0[i], n1 = x + stamp.x1[i];
+
+      /* Same row of the previous stamp, if it had one */
+      int j = row - prev.y - lo;
+      if (first || j < 0 || j >= width) {
+        emitSpan(points, row, n0, n1);
+        continue;
+      }
+      int o0 = prev.x + stamp.x0[j], o1 = prev.x + stamp.x1[j];
+      emitSpan(points, row, n0, MIN(n1, o0));
+      emitSpan(points, row, MAX(n0, o1), n1);
+    }
+    prev = wxPoint(x, y);
+    first = false;
+  };
+
+  size_t s;
+  for (s=0; s + 1 < count; s++) {
+    wxPoint p0 = path[s], p1 = path[s + 1];
+    int dx = p1.x - p0.x, dy = p1.y - p0.y;
+    int n = MAX(ABS(dx), ABS(dy)), i;
+    for (i=0; i < n; i++) {
+      step(p0.x + dx * i / n, p0.y + dy * i / n);
+    }
+  }
+  if (count > 1)
+    step(path[count - 1].x, path[count - 1].y);
+}
+
+static void lerpPath(const wxPoint *path, size_t count, int width,
+    std::vector<wxPoint> &points)
+{
+  points.clear();
+  width = MIN(width, BRUSH_MAX_DIAMETER);
+  if (width > 1) {
+    lerpRound(path, count, width, points);
+    return;
+  }
+
+  /* Single pixels keep the original two-pass walk, which
+   * selection borders depend on */
+  size_t s;
+  for (s=0; s + 1 < count; s++) {
+    lerpSquare(path[s], path[s + 1], width, points);
+  }
+}
+
+void lerp(wxPoint p0, wxPoint p1, int width, std::vector<wxPoint> &points)
+{
+  wxPoint path[2] = { p0, p1 };
+  lerpPath(path, 2, width, points);
+}
+
+void lerp(const std::vector<wxPoint> &path, int width,
+    std::vector<wxPoint> &points)
+{
+  lerpPath(path.empty() ? NULL : &path[0], path.size(), width, points);
+}
+
+std::vector<wxPoint> lerp(wxPoint p0, wxPoint p1, int width)
+{
+  std::vector<wxPoint> points;
+  lerp(p0, p1, width, points);
+  return points;
+}
+
+std::vector<wxPoint> lerp(const std::vector<wxPoint> &path, int width)
+{
+  std::vector<wxPoint> points;
+  lerp(path, width, points);
   return points;
-}
\ No newline at end of file
+}
@@ -7,6 +7,23 @@
 
 #include <vector>
 
+/* Largest brush, in pixels across */
+#define BRUSH_MAX_DIAMETER 256
+
+/*
+ * Pixels covered by a brush 'width' pixels across dragged
+ * from p0 to p1, or along every segment of 'path'. Brushes
+ * wider than a pixel are round, and a pixel may be listed
+ * more than once.
+ */
 std::vector<wxPoint> lerp(wxPoint p0, wxPoint p1, int width);
+std::vector<wxPoint> lerp(const std::vector<wxPoint> &path, int width);
+
+/* Same, into 'points' (cleared first). A buffer reused from
+ * one call to the next stops allocating once it has grown
+ * to the largest stroke. */
+void lerp(wxPoint p0, wxPoint p1, int width, std::vector<wxPoint> &points);
+void lerp(const std::vector<wxPoint> &path, int width,
+    std::vector<wxPoint> &points);
 
 #endif //PAINT_INTERPOLATION_H
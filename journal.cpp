@@ -0,0 +1,387 @@
+#include <wx/gdicmn.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+
+#include "journal.h"
+#include "perf.h"
+
+static void putVarint(std::vector<unsigned char> &out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back((v & 0x7f) | 0x80);
+    v >>= 7;
+  }
+  out.push_back(v);
+}
+
+/* Into memory the caller has sized (up to 10 bytes) */
+static inline void putVarint(unsigned char *&out, uint64_t v) {
+  while (v >= 0x80) {
+    *out++ = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  *out++ = v;
+}
+
+static inline void putSigned(unsigned char *&out, int64_t v) {
+  putVarint(out, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+/* Advances 'in'; false if the varint runs past 'end' */
+static bool getVarint(const unsigned char *&in, const unsigned char *end,
+    uint64_t &v) {
+  int shift = 0;
+  v = 0;
+  do {
+    if (in == end || shift > 63)
+      return false;
+    v |= (uint64_t)(*in & 0x7f) << shift;
+    shift += 7;
+  } while (*in++ & 0x80);
+  return true;
+}
+
+static bool getSigned(const unsigned char *&in, const unsigned char *end,
+    int64_t &v) {
+  uint64_t u;
+  if (!getVarint(in, end, u))
+    return false;
+  v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+  return true;
+}
+
+/*
+ * Adler-32 of the type byte and payload. Catches torn and
+ * garbled tails, and unlike a byte-serial hash it keeps up
+ * with the encoder (the modulo is taken every 5552 bytes).
+ */
+static uint32_t checksum(unsigned char type, const unsigned char *data,
+    size_t n) {
+  uint32_t a = 1 + type, b = a;
+  while (n > 0) {
+    size_t k = n < 5552 ? n : 5552;
+    n -= k;
+    while (k-- > 0) {
+      a += *data++;
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+  }
+  return b << 16 | a;
+}
+
+static bool writeAll(int fd, const unsigned char *data, size_t n) {
+  while (n > 0) {
+    ssize_t k = write(fd, data, n);
+    if (k < 0 && errno == EINTR)
+      continue;
+    if (k <= 0)
+      return false;
+    data += k;
+    n -= k;
+  }
+  return true;
+}
+
+/************** Journal ****************/
+Journal::Journal() :
+  commits(0), encodeNs(0), bytes(0), syncs(0), syncNs(0) {
+  thread = std::thread(&Journal::loop, this);
+}
+
+Journal::~Journal() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_one();
+  thread.join();
+
+  if (fd >= 0)
+    close(fd);
+  if (records == 0 && !path.empty())
+    unlink(path.c_str());
+}
+
+std::string Journal::pathFor(const char *document) {
+  if (document == NULL)
+    return JOURNAL_UNTITLED;
+  return std::string(document) + ".journal";
+}
+
+void Journal::checkpoint(const char *document,
+    unsigned int width, unsigned int height) {
+  std::vector<unsigned char> head(JOURNAL_MAGIC, JOURNAL_MAGIC + 4);
+  head.push_back(JOURNAL_VERSION);
+  putVarint(head, width);
+  putVarint(head, height);
+  size_t n = document == NULL ? 0 : strlen(document);
+  putVarint(head, n);
+  head.insert(head.end(), document, document + n);
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    /* Whatever wasn't written yet is part of the checkpoint */
+    pending.clear();
+    records = 0;
+    isRestart = true;
+    nextPath = pathFor(document);
+    header.swap(head);
+  }
+  wake.notify_one();
+}
+
+void Journal::append(JournalType type, const unsigned char *payload, size_t n) {
+  unsigned char head[16], *h = head;
+  *h++ = type;
+  putVarint(h, n);
+  uint32_t sum = checksum(type, payload, n);
+  unsigned char tail[4];
+  int i;
+  for (i=0; i < 4; i++) {
+    tail[i] = (sum >> (8*i)) & 0xff;
+  }
+
+  bool wasEmpty;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    wasEmpty = pending.empty();
+    pending.insert(pending.end(), head, h);
+    pending.insert(pending.end(), payload, payload + n);
+    pending.insert(pending.end(), tail, tail + 4);
+    records++;
+  }
+  bytes += (h - head) + n + 4;
+  if (wasEmpty)
+    wake.notify_one();
+}
+
+void Journal::commit(const Transaction &txn, const uint32_t *buffer,
+    size_t stride, unsigned int width, unsigned int height) {
+  PerfTimer timer;
+  const std::vector<Pixel> &pixels = txn.pixels;
+  size_t count = pixels.size() + txn.changes.count;
+
+  /* Worst case: two 5-byte deltas and two colours per pixel */
+  if (scratch.size() < 10 + count * 18)
+    scratch.resize(10 + count * 18);
+  unsigned char *out = &scratch[0];
+  putVarint(out, count);
+
+  int lastX = 0, lastY = 0;
+  auto put = [&](int x, int y, uint32_t before) {
+    putSigned(out, (int64_t)x - lastX);
+    putSigned(out, (int64_t)y - lastY);
+    lastX = x;
+    lastY = y;
+
+    uint32_t after = WHITE.value();
+    if ((unsigned int)x < width && (unsigned int)y < height)
+      after = buffer[(size_t)y*stride + x];
+    memcpy(out, &before, 4);
+    memcpy(out + 4, &after, 4);
+    out += 8;
+  };
+
+  /* A colour replace is journalled as the pixels it wrote */
+  txn.changes.forEach(put);
+  size_t i;
+  for (i=0; i < pixels.size(); i++) {
+    put(pixels[i].x, pixels[i].y, pixels[i].color.value());
+  }
+  append(JRN_COMMIT, &scratch[0], out - &scratch[0]);
+
+  commits++;
+  encodeNs += timer.elapsed();
+}
+
+void Journal::undo() {
+  append(JRN_UNDO, NULL, 0);
+}
+
+void Journal::resize(unsigned int width, unsigned int height) {
+  unsigned char payload[20], *out = payload;
+  putVarint(out, width);
+  putVarint(out, height);
+  append(JRN_RESIZE, payload, out - payload);
+}
+
+/*
+ * Writer thread. Waits for records, lets them pile up for
+ * JOURNAL_SYNC_MS, then writes and syncs them in one go.
+ */
+void Journal::loop() {
+  for (;;) {
+    std::vector<unsigned char> out, head;
+    std::string newPath;
+    bool restart, stop;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      wake.wait(guard, [this]() {
+        return stopping || isRestart || !pending.empty();
+      });
+      if (!stopping && !isRestart) {
+        wake.wait_for(guard, std::chrono::milliseconds(JOURNAL_SYNC_MS),
+            [this]() { return stopping || isRestart; });
+      }
+
+      out.swap(pending);
+      restart = isRestart;
+      isRestart = false;
+      newPath.swap(nextPath);
+      head.swap(header);
+      stop = stopping;
+    }
+
+    if (restart) {
+      if (fd >= 0)
+        close(fd);
+      /* Superseded by the checkpoint */
+      if (!path.empty() && path != newPath)
+        unlink(path.c_str());
+      path = newPath;
+      fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+      if (fd >= 0 && !writeAll(fd, &head[0], head.size())) {
+        close(fd);
+        fd = -1;
+      }
+    }
+
+    if (fd >= 0 && (restart || !out.empty())) {
+      if (!out.empty() && !writeAll(fd, &out[0], out.size())) {
+        /* Disk full or gone: stop journaling, keep the rest */
+        close(fd);
+        fd = -1;
+      } else {
+        PerfTimer timer;
+        fdatasync(fd);
+        syncs++;
+        syncNs += timer.elapsed();
+      }
+    }
+
+    if (stop)
+      return;
+  }
+}
+
+/************** JournalReader ****************/
+bool JournalReader::open(const std::string &path) {
+  FILE *file = fopen(path.c_str(), "rb");
+  if (file == NULL)
+    return false;
+
+  data.clear();
+  unsigned char chunk[1 << 16];
+  size_t n;
+  while ((n = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+    data.insert(data.end(), chunk, chunk + n);
+  }
+  fclose(file);
+
+  const unsigned char *in = data.empty() ? NULL : &data[0];
+  const unsigned char *end = in + data.size();
+  uint64_t w, h, len;
+  if (data.size() < 5 || memcmp(in, JOURNAL_MAGIC, 4) != 0
+      || in[4] != JOURNAL_VERSION)
+    return false;
+  in += 5;
+  if (!getVarint(in, end, w) || !getVarint(in, end, h)
+      || !getVarint(in, end, len) || (uint64_t)(end - in) < len)
+    return false;
+  width = w;
+  height = h;
+  base.assign((const char *)in, len);
+  in += len;
+
+  /* Keep the records up to the first bad one */
+  const unsigned char *start = in;
+  records = 0;
+  for (;;) {
+    const unsigned char *rec = in;
+    uint64_t size;
+    if (end - in < 1)
+      break;
+    unsigned char type = *in++;
+    if (!getVarint(in, end, size) || (uint64_t)(end - in) < size + 4)
+      break;
+    const unsigned char *payload = in;
+    in += size;
+    uint32_t sum = (uint32_t)in[0] | (uint32_t)in[1] << 8 |
+      (uint32_t)in[2] << 16 | (uint32_t)in[3] << 24;
+    in += 4;
+    if (sum != checksum(type, payload, size)) {
+      in = rec;
+      break;
+    }
+    records++;
+  }
+  data.resize(in - &data[0]);
+  data.erase(data.begin(), data.begin() + (start - &data[0]));
+  return true;
+}
+
+void JournalReader::replay(Raster &raster, const char *document) {
+  if (document == NULL) {
+    uint32_t *blank = Raster::newBuffer(width, height);
+    if (blank == NULL)
+      return;
+    raster.adopt(blank, width, height, NULL);
+  }
+  if (raster.getJournal() != NULL)
+    raster.getJournal()->checkpoint(document,
+        raster.getWidth(), raster.getHeight());
+
+  const unsigned char *in = data.empty() ? NULL : &data[0];
+  const unsigned char *end = in + data.size();
+  size_t r;
+  for (r=0; r < records; r++) {
+    unsigned char type = *in++;
+    uint64_t size;
+    getVarint(in, end, size);
+    const unsigned char *p = in, *pend = in + size;
+    in += size + 4;
+
+    switch (type) {
+      case JRN_COMMIT: {
+        uint64_t n, i;
+        if (!getVarint(p, pend, n) || (uint64_t)(pend - p) / 10 < n)
+          break;
+        Transaction before;
+        std::vector<Pixel> after(n);
+        before.pixels.resize(n);
+        wxPoint last(0, 0);
+        for (i=0; i < n; i++) {
+          int64_t dx, dy;
+          if (!getSigned(p, pend, dx) || !getSigned(p, pend, dy)
+              || pend - p < 8)
+            break;
+          last = wxPoint(last.x + dx, last.y + dy);
+          before.pixels[i] = Pixel(Color(p[0], p[1], p[2], p[3]), last);
+          after[i] = Pixel(Color(p[4], p[5], p[6], p[7]), last);
+          p += 8;
+        }
+        if (i == n)
+          raster.applyCommit(before, after);
+        break;
+      }
+      case JRN_UNDO:
+        raster.undo();
+        break;
+      case JRN_RESIZE: {
+        uint64_t w, h;
+        if (getVarint(p, pend, w) && getVarint(p, pend, h))
+          raster.resize(w, h);
+        break;
+      }
+      default:
+        break;
+    }
+  }
+}
@@ -0,0 +1,152 @@
+#ifndef PAINT_JOURNAL_H
+#define PAINT_JOURNAL_H
+
+/*
+ * Crash-safe autosave.
+ *
+ * Every committed Transaction is appended to a journal
+ * next to the document (or JOURNAL_UNTITLED for a canvas
+ * that was never saved), together with the colours it
+ * left behind, so that the journal replayed onto the last
+ * checkpoint rebuilds both the pixels and the undo history.
+ * The checkpoint is the document as last opened or saved,
+ * or a blank canvas; saving starts a new, empty journal.
+ *
+ * The raster thread only encodes records into memory. A
+ * writer thread appends them and fsyncs at most once per
+ * JOURNAL_SYNC_MS, so at most that much work is lost.
+ * Every record carries a checksum: a torn write at the
+ * end of the file is detected and dropped on recovery.
+ *
+ * File layout (integers are LEB128 varints, signed values
+ * zigzag encoded):
+ *
+ *   "PJRN" u8 version  width  height  len base[len]
+ *   { u8 type  len payload[len]  u32 adler32(type, payload) }*
+ *
+ *   COMMIT  n { dx dy  u8 old[4]  u8 new[4] }*   (RGBA)
+ *                        (dx dy relative to the previous pixel)
+ *   UNDO
+ *   RESIZE  width height
+ */
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "raster.h"
+
+#define JOURNAL_MAGIC "PJRN"
+#define JOURNAL_VERSION 2
+
+/* Journal of a canvas that has no document yet */
+#define JOURNAL_UNTITLED "untitled.journal"
+
+/* Longest time a committed stroke waits for its fsync */
+#define JOURNAL_SYNC_MS 250
+
+enum JournalType
+{
+  JRN_COMMIT = 1,
+  JRN_UNDO,
+  JRN_RESIZE
+};
+
+class Journal {
+  private:
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    /* Encoded records not written yet, and a pending
+     * checkpoint: the next file and its header */
+    std::vector<unsigned char> pending;
+    bool isRestart = false;
+    std::string nextPath;
+    std::vector<unsigned char> header;
+
+    /* Writer thread only */
+    int fd = -1;
+    std::string path;
+
+    /* Records since the last checkpoint */
+    uint64_t records = 0;
+
+    /* Overhead, for the HUD */
+    std::atomic<uint64_t> commits;
+    std::atomic<uint64_t> encodeNs;
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> syncs;
+    std::atomic<uint64_t> syncNs;
+
+    /* Raster thread: commits are encoded here first */
+    std::vector<unsigned char> scratch;
+
+    void append(JournalType type, const unsigned char *payload, size_t n);
+    void loop();
+
+  public:
+    Journal();
+
+    /* Flushes. Removes the file if nothing was journaled
+     * since the last checkpoint. */
+    ~Journal();
+
+    /* Where the journal of 'document' (NULL: untitled) lives */
+    static std::string pathFor(const char *document);
+
+    /*
+     * Start over from 'document' (NULL: a blank canvas of
+     * width x height). The previous journal is superseded
+     * and removed. The raster must be idle or the caller
+     * must be the raster thread.
+     */
+    void checkpoint(const char *document, unsigned int width, unsigned int height);
+
+    /* Raster thread. 'buffer' holds the colours after 'txn',
+     * laid out like Raster's */
+    void commit(const Transaction &txn, const uint32_t *buffer,
+        size_t stride, unsigned int width, unsigned int height);
+    void undo();
+    void resize(unsigned int width, unsigned int height);
+
+    inline uint64_t getCommits() const { return commits; }
+    inline uint64_t getEncodeNs() const { return encodeNs; }
+    inline uint64_t getBytes() const { return bytes; }
+    inline uint64_t getSyncs() const { return syncs; }
+    inline uint64_t getSyncNs() const { return syncNs; }
+};
+
+/*
+ * Reads a journal back. Everything up to the first torn
+ * or corrupt record is kept.
+ */
+class JournalReader {
+  private:
+    std::vector<unsigned char> data;
+    size_t records = 0;
+    std::string base;
+    unsigned int width = 0;
+    unsigned int height = 0;
+
+  public:
+    /* Returns false if 'path' is missing or not a journal */
+    bool open(const std::string &path);
+
+    /* Checkpoint document, empty for a blank canvas */
+    inline const std::string &getBase() const { return base; }
+    inline size_t getRecords() const { return records; }
+
+    /*
+     * Raster thread. Start from the checkpoint, 'document'
+     * already loaded or NULL for a blank canvas, and apply
+     * every record. They are journaled again as they go.
+     */
+    void replay(Raster &raster, const char *document);
+};
+
+#endif //PAINT_JOURNAL_H
@@ -0,0 +1,150 @@
+#include <wx/wxprec.h>
+#ifndef WX_PRECOMP
+#include <wx/wx.h>
+#endif
+
+#include "navigator.h"
+
+#define LOC(x,y,w) (3*((y)*(w)+(x)))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+BEGIN_EVENT_TABLE( Navigator, wxPanel )
+  EVT_PAINT(Navigator::paintEvent)
+END_EVENT_TABLE()
+
+Navigator::Navigator(wxWindow *parent, int maxWidth, int maxHeight) :
+wxPanel(parent, wxID_ANY, wxDefaultPosition, wxSize(maxWidth, maxHeight)) {
+  this->maxWidth = maxWidth;
+  this->maxHeight = maxHeight;
+  thumbWidth = 0;
+  thumbHeight = 0;
+  scale = 1;
+}
+
+Navigator::~Navigator() {
+  free(thumb);
+}
+
+/*
+ * Average the scale x scale block of canvas pixels
+ * covered by thumbnail cell (cx, cy). Blocks on the
+ * right/bottom edge are clipped to the canvas.
+ */
+void Navigator::resampleCell(const char *buffer, unsigned int width,
+    unsigned int height, int cx, int cy) {
+  int x0 = cx * scale;
+  int y0 = cy * scale;
+  int x1 = MIN(x0 + scale, (int)width);
+  int y1 = MIN(y0 + scale, (int)height);
+
+  unsigned int r = 0, g = 0, b = 0, n = 0;
+  int x, y;
+  for (y=y0; y < y1; y++) {
+    const unsigned char *row =
+      (const unsigned char *)buffer + LOC(x0, y, width);
+    for (x=x0; x < x1; x++) {
+      r += row[0];
+      g += row[1];
+      b += row[2];
+      row += 3;
+    }
+    n += x1 - x0;
+  }
+
+  if (n == 0)
+    return;
+
+  int i = LOC(cx, cy, thumbWidth);
+  thumb[i] = r / n;
+  thumb[i+1] = g / n;
+  thumb[i+2] = b / n;
+}
+
+/*
+ * Rebuild the whole thumbnail. Only needed when the
+ * canvas dimensions change (e.g. after a resize), never
+ * for regular drawing operations.
+ */
+void Navigator::reset(const char *buffer, unsigned int width,
+    unsigned int height) {
+  int sx = (width + maxWidth - 1) / maxWidth;
+  int sy = (height + maxHeight - 1) / maxHeight;
+  scale = MAX(1, MAX(sx, sy));
+
+  thumbWidth = (width + scale - 1) / scale;
+  thumbHeight = (height + scale - 1) / scale;
+
+  free(thumb);
+  thumb = (unsigned char *)malloc(3*thumbWidth*thumbHeight);
+  memset(thumb, 255, 3*thumbWidth*thumbHeight);
+
+  int cx, cy;
+  for (cy=0; cy < thumbHeight; cy++) {
+    for (cx=0; cx < thumbWidth; cx++) {
+      resampleCell(buffer, width, height, cx, cy);
+    }
+  }
+
+  SetMinSize(wxSize(thumbWidth, thumbHeight));
+  wxWindow::Refresh();
+}
+
+/*
+ * Re-downsample only the cells overlapping 'dirty'
+ * (canvas coordinates). Cost is proportional to the
+ * dirty area, not to the canvas size.
+ */
+void Navigator::resample(const char *buffer, unsigned int width,
+    unsigned int height, const wxRect &dirty) {
+  if (thumb == NULL || dirty.IsEmpty())
+    return;
+
+  int x0 = MAX(0, dirty.GetLeft());
+  int y0 = MAX(0, dirty.GetTop());
+  int x1 = MIN((int)width - 1, dirty.GetRight());
+  int y1 = MIN((int)height - 1, dirty.GetBottom());
+  if (x0 > x1 || y0 > y1)
+    return;
+
+  int cx0 = x0 / scale, cx1 = x1 / scale;
+  int cy0 = y0 / scale, cy1 = y1 / scale;
+  int cx, cy;
+  for (cy=cy0; cy <= cy1; cy++) {
+    for (cx=cx0; cx <= cx1; cx++) {
+      resampleCell(buffer, width, height, cx, cy);
+    }
+  }
+
+  RefreshRect(wxRect(cx0, cy0, cx1 - cx0 + 1, cy1 - cy0 + 1), false);
+}
+
+void Navigator::setViewport(const wxRect &viewport) {
+  this->viewport = viewport;
+  wxWindow::Refresh();
+}
+
+void Navigator::paintEvent(wxPaintEvent &evt) {
+  wxPaintDC dc(this);
+  render(dc);
+}
+
+void Navigator::render(wxDC &dc) {
+  if (thumb == NULL)
+    return;
+
+  wxImage img(thumbWidth, thumbHeight, thumb, true);
+  wxBitmap bmp(img);
+  dc.DrawBitmap(bmp, 0, 0, false);
+
+  /* Mark the viewport, scaled down to thumbnail space */
+  if (!viewport.IsEmpty()) {
+    dc.SetBrush(*wxTRANSPARENT_BRUSH);
+    dc.SetPen(wxPen(wxColor(255, 0, 0), 1));
+    dc.DrawRectangle(
+        viewport.GetLeft() / scale,
+        viewport.GetTop() / scale,
+        MAX(1, (viewport.GetWidth() + scale - 1) / scale),
+        MAX(1, (viewport.GetHeight() + scale - 1) / scale));
+  }
+}
@@ -0,0 +1,51 @@
+#ifndef PAINT_NAVIGATOR_H
+#define PAINT_NAVIGATOR_H
+
+/*
+ * Small overview panel showing the whole canvas
+ * with the visible viewport marked.
+ *
+ * The thumbnail is a box-filtered downsample of the
+ * canvas buffer. Every thumbnail pixel ("cell") covers a
+ * scale x scale block of canvas pixels, so a dirty
+ * region reported by the canvas only requires the cells
+ * overlapping that region to be re-averaged.
+ * A full resample only happens when the canvas itself
+ * changes size (see reset()).
+ */
+class Navigator : public wxPanel {
+  private:
+    /* Maximum size of the panel, in pixels */
+    int maxWidth;
+    int maxHeight;
+
+    /* Actual thumbnail size and the size of the
+     * canvas block that each cell averages */
+    int thumbWidth;
+    int thumbHeight;
+    int scale;
+
+    /* RGBRGB.. thumbnail, thumbWidth * thumbHeight cells */
+    unsigned char *thumb = NULL;
+
+    /* Visible part of the canvas, in canvas coordinates */
+    wxRect viewport;
+
+    void resampleCell(const char *buffer, unsigned int width,
+        unsigned int height, int cx, int cy);
+
+  public:
+    Navigator(wxWindow *parent, int maxWidth, int maxHeight);
+    ~Navigator();
+
+    void reset(const char *buffer, unsigned int width, unsigned int height);
+    void resample(const char *buffer, unsigned int width,
+        unsigned int height, const wxRect &dirty);
+    void setViewport(const wxRect &viewport);
+
+    void paintEvent(wxPaintEvent &evt);
+    void render(wxDC &dc);
+    DECLARE_EVENT_TABLE()
+};
+
+#endif //PAINT_NAVIGATOR_H
@@ -0,0 +1,74 @@
+#include <wx/gdicmn.h>
+
+#include <string.h>
+#include <zlib.h>
+
+#include "pack.h"
+
+/* Plane bytes per pixel: x step, y step, colour */
+#define PIXEL_PLANES 12
+
+/************** Bytes ****************/
+bool packBytes(const void *data, size_t size, std::vector<unsigned char> &out) {
+  uLongf n = compressBound(size);
+  out.resize(n);
+  if (compress2(&out[0], &n, (const Bytef *)data, size, Z_BEST_SPEED) != Z_OK
+      || n >= size) {
+    out.clear();
+    return false;
+  }
+  out.resize(n);
+  out.shrink_to_fit();
+  return true;
+}
+
+bool unpackBytes(const std::vector<unsigned char> &packed, void *out, size_t size) {
+  uLongf n = size;
+  return uncompress((Bytef *)out, &n, &packed[0], packed.size()) == Z_OK
+    && n == size;
+}
+
+/************** Pixels ****************/
+bool packPixels(const std::vector<Pixel> &pixels, std::vector<unsigned char> &out,
+    std::vector<unsigned char> &scratch) {
+  size_t i, n = pixels.size();
+  scratch.resize(n * PIXEL_PLANES);
+  unsigned char *dx = &scratch[0], *dy = dx + 4*n, *colors = dy + 4*n;
+
+  int32_t lastX = 0, lastY = 0;
+  for (i=0; i < n; i++) {
+    int32_t x = pixels[i].x - lastX, y = pixels[i].y - lastY;
+    uint32_t c = pixels[i].color.value();
+    memcpy(dx + 4*i, &x, 4);
+    memcpy(dy + 4*i, &y, 4);
+    memcpy(colors + 4*i, &c, 4);
+    lastX = pixels[i].x;
+    lastY = pixels[i].y;
+  }
+  return packBytes(&scratch[0], scratch.size(), out);
+}
+
+bool unpackPixels(const std::vector<unsigned char> &packed, size_t count,
+    std::vector<Pixel> &out) {
+  std::vector<unsigned char> planes(count * PIXEL_PLANES);
+  if (!unpackBytes(packed, &planes[0], planes.size()))
+    return false;
+
+  const unsigned char *dx = &planes[0], *dy = dx + 4*count, *colors = dy + 4*count;
+  out.resize(count);
+  int32_t x = 0, y = 0;
+  size_t i;
+  for (i=0; i < count; i++) {
+    int32_t sx, sy;
+    uint32_t c;
+    memcpy(&sx, dx + 4*i, 4);
+    memcpy(&sy, dy + 4*i, 4);
+    memcpy(&c, colors + 4*i, 4);
+    x += sx;
+    y += sy;
+    out[i].x = x;
+    out[i].y = y;
+    out[i].color = Color::fromValue(c);
+  }
+  return true;
+}
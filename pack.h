@@ -0,0 +1,36 @@
+#ifndef PAINT_PACK_H
+#define PAINT_PACK_H
+
+/*
+ * Cold storage for the undo history.
+ *
+ * History entries the user is unlikely to come back to are
+ * deflated at the fastest level while the raster thread is
+ * idle, and inflated again when a jump reaches them. A
+ * transaction's pixels are delta coded first and split
+ * into planes (x steps, y steps, colours), so that strokes
+ * turn into long runs deflate can take apart.
+ */
+#include <wx/gdicmn.h>
+
+#include <stdint.h>
+#include <vector>
+
+#include "pixel.h"
+
+/* Deflate 'size' bytes into 'out'. False, with 'out' empty,
+ * if that does not make them smaller. */
+bool packBytes(const void *data, size_t size, std::vector<unsigned char> &out);
+
+/* Inflate 'packed' into exactly 'size' bytes at 'out' */
+bool unpackBytes(const std::vector<unsigned char> &packed, void *out, size_t size);
+
+/* 'scratch' holds the planes in between */
+bool packPixels(const std::vector<Pixel> &pixels, std::vector<unsigned char> &out,
+    std::vector<unsigned char> &scratch);
+
+/* The 'count' pixels packPixels() packed, into 'out' */
+bool unpackPixels(const std::vector<unsigned char> &packed, size_t count,
+    std::vector<Pixel> &out);
+
+#endif //PAINT_PACK_H
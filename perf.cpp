@@ -0,0 +1,207 @@
+#include <wx/gdicmn.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <atomic>
+
+#include "perf.h"
+
+/*
+ * Allocation counters. Interposing malloc catches both
+ * operator new and the engine's own malloc calls.
+ * Relaxed atomics: worker threads allocate too.
+ */
+static std::atomic<uint64_t> allocCount(0);
+static std::atomic<uint64_t> allocBytes(0);
+
+#ifdef __GLIBC__
+extern "C" void *__libc_malloc(size_t n);
+extern "C" void *__libc_calloc(size_t n, size_t sz);
+extern "C" void *__libc_realloc(void *p, size_t n);
+
+extern "C" void *malloc(size_t n) {
+  allocCount.fetch_add(1, std::memory_order_relaxed);
+  allocBytes.fetch_add(n, std::memory_order_relaxed);
+  return __libc_malloc(n);
+}
+
+extern "C" void *calloc(size_t n, size_t sz) {
+  allocCount.fetch_add(1, std::memory_order_relaxed);
+  allocBytes.fetch_add(n * sz, std::memory_order_relaxed);
+  return __libc_calloc(n, sz);
+}
+
+extern "C" void *realloc(void *p, size_t n) {
+  allocCount.fetch_add(1, std::memory_order_relaxed);
+  allocBytes.fetch_add(n, std::memory_order_relaxed);
+  return __libc_realloc(p, n);
+}
+#endif
+
+uint64_t perfAllocCount() {
+  return allocCount.load(std::memory_order_relaxed);
+}
+
+uint64_t perfAllocBytes() {
+  return allocBytes.load(std::memory_order_relaxed);
+}
+
+uint64_t perfResidentBytes() {
+  FILE *file = fopen("/proc/self/statm", "r");
+  if (file == NULL)
+    return 0;
+  unsigned long long size, resident;
+  int n = fscanf(file, "%llu %llu", &size, &resident);
+  fclose(file);
+  if (n != 2)
+    return 0;
+  return resident * (uint64_t)sysconf(_SC_PAGESIZE);
+}
+
+static const char *TOOL_NAMES[] = {
+  "Pencil", "Line", "DrawRect", "DrawCircle", "Eraser",
+  "Fill", "SlctRect", "SlctCircle", "Lasso", "MagicWand"
+};
+
+static const char *STAGE_NAMES[] = { "input", "raster", "paint" };
+
+const char *toolName(ToolType tool) {
+  return TOOL_NAMES[tool];
+}
+
+const char *stageName(PerfStage stage) {
+  return STAGE_NAMES[stage];
+}
+
+/************** Histogram ****************/
+Histogram::Histogram() {
+  memset(buckets, 0, sizeof(buckets));
+  count = 0;
+  max = 0;
+  total = 0;
+}
+
+/*
+ * Values below 8 ns get their own bucket, above that
+ * each power of two is split in HIST_SUB_BUCKETS.
+ */
+int Histogram::bucketOf(uint64_t ns) {
+  if (ns < 8)
+    return (int)ns;
+
+  int msb = 63 - __builtin_clzll(ns);
+  int sub = (ns >> (msb - 2)) & (HIST_SUB_BUCKETS - 1);
+  int b = (msb - 1) * HIST_SUB_BUCKETS + sub;
+  return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+uint64_t Histogram::upperBound(int bucket) {
+  if (bucket < 8)
+    return bucket;
+
+  int msb = bucket / HIST_SUB_BUCKETS + 1;
+  int sub = bucket % HIST_SUB_BUCKETS;
+  return ((uint64_t)(HIST_SUB_BUCKETS + sub + 1) << (msb - 2)) - 1;
+}
+
+void Histogram::add(uint64_t ns) {
+  buckets[bucketOf(ns)]++;
+  count++;
+  total += ns;
+  if (ns > max)
+    max = ns;
+}
+
+uint64_t Histogram::percentile(double p) const {
+  if (count == 0)
+    return 0;
+
+  uint64_t target = (uint64_t)(p * count + 0.5);
+  if (target < 1)
+    target = 1;
+
+  uint64_t seen = 0;
+  int i;
+  for (i=0; i < HIST_BUCKETS; i++) {
+    seen += buckets[i];
+    if (seen >= target) {
+      uint64_t ub = upperBound(i);
+      return ub < max ? ub : max;
+    }
+  }
+  return max;
+}
+
+/************** PerfStats ****************/
+void PerfStats::record(ToolType tool, PerfStage stage, uint64_t ns) {
+  hist[tool][stage].add(ns);
+}
+
+const Histogram &PerfStats::get(ToolType tool, PerfStage stage) const {
+  return hist[tool][stage];
+}
+
+void PerfStats::frame(uint64_t pixelsWritten, uint64_t undoBytes,
+    uint64_t strokeDuplicates) {
+  uint64_t allocCount = perfAllocCount();
+  lastPixels = pixelsWritten - pixels;
+  lastUndoBytes = undoBytes - this->undoBytes;
+  lastAllocs = allocCount - allocs;
+
+  pixels = pixelsWritten;
+  this->undoBytes = undoBytes;
+  allocs = allocCount;
+  duplicates = strokeDuplicates;
+}
+
+void PerfStats::history(uint64_t packedBytes, uint64_t packedRawBytes) {
+  this->packedBytes = packedBytes;
+  this->packedRawBytes = packedRawBytes;
+}
+
+void PerfStats::regions(uint64_t bytes, uint64_t tiles, uint64_t ns) {
+  regionBytes = bytes;
+  regionTiles = tiles;
+  regionNs = ns;
+}
+
+bool PerfStats::dump(const char *path) const {
+  FILE *file = fopen(path, "w");
+  if (file == NULL)
+    return false;
+
+  fprintf(file, "tool,stage,count,mean_ns,p50_ns,p99_ns,max_ns\n");
+  int t, s;
+  for (t=0; t < ToolCount; t++) {
+    for (s=0; s < PERF_STAGES; s++) {
+      const Histogram &h = hist[t][s];
+      if (h.getCount() == 0)
+        continue;
+      fprintf(file, "%s,%s,%llu,%llu,%llu,%llu,%llu\n",
+          TOOL_NAMES[t], STAGE_NAMES[s],
+          (unsigned long long)h.getCount(),
+          (unsigned long long)(h.getTotal() / h.getCount()),
+          (unsigned long long)h.percentile(0.5),
+          (unsigned long long)h.percentile(0.99),
+          (unsigned long long)h.getMax());
+    }
+  }
+
+  fprintf(file, "\ncounter,value\n");
+  fprintf(file, "pixels_written,%llu\n", (unsigned long long)pixels);
+  fprintf(file, "undo_bytes,%llu\n", (unsigned long long)undoBytes);
+  fprintf(file, "stroke_duplicates,%llu\n", (unsigned long long)duplicates);
+  fprintf(file, "allocations,%llu\n", (unsigned long long)perfAllocCount());
+  fprintf(file, "allocated_bytes,%llu\n", (unsigned long long)perfAllocBytes());
+  fprintf(file, "history_packed_bytes,%llu\n", (unsigned long long)packedBytes);
+  fprintf(file, "history_packed_raw_bytes,%llu\n", (unsigned long long)packedRawBytes);
+  fprintf(file, "region_index_bytes,%llu\n", (unsigned long long)regionBytes);
+  fprintf(file, "region_tiles_built,%llu\n", (unsigned long long)regionTiles);
+  fprintf(file, "region_build_ns,%llu\n", (unsigned long long)regionNs);
+  fprintf(file, "resident_bytes,%llu\n", (unsigned long long)perfResidentBytes());
+
+  fclose(file);
+  return true;
+}
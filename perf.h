@@ -0,0 +1,129 @@
+#ifndef PAINT_PERF_H
+#define PAINT_PERF_H
+
+/*
+ * Latency and throughput instrumentation.
+ *
+ * Every input event is timed in three stages: the whole
+ * handler (input), each engine command it triggers, as
+ * measured on the raster thread (raster), and every
+ * repaint (paint). Samples go into per-tool log-scale
+ * histograms, cheap enough to update on every mouse move.
+ *
+ * Allocation counts come from a process-wide malloc hook
+ * (glibc only, see perf.cpp); elsewhere they read as 0.
+ */
+#include <stdint.h>
+#include <chrono>
+
+#include "raster.h"
+
+enum PerfStage
+{
+  PERF_INPUT,
+  PERF_RASTER,
+  PERF_PAINT,
+  PERF_STAGES
+};
+
+/* 4 buckets per power of two, up to ~2^40 ns (18 minutes) */
+#define HIST_SUB_BUCKETS 4
+#define HIST_BUCKETS (40 * HIST_SUB_BUCKETS)
+
+class Histogram {
+  private:
+    uint64_t buckets[HIST_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+    uint64_t total;
+
+    static int bucketOf(uint64_t ns);
+    static uint64_t upperBound(int bucket);
+
+  public:
+    Histogram();
+
+    void add(uint64_t ns);
+
+    /* p in [0, 1]. Resolution is one bucket (~19%) */
+    uint64_t percentile(double p) const;
+
+    inline uint64_t getCount() const { return count; }
+    inline uint64_t getMax() const { return max; }
+    inline uint64_t getTotal() const { return total; }
+};
+
+class PerfTimer {
+  private:
+    std::chrono::steady_clock::time_point start;
+
+  public:
+    inline PerfTimer() : start(std::chrono::steady_clock::now()) {}
+
+    inline uint64_t elapsed() const {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+          std::chrono::steady_clock::now() - start).count();
+    }
+};
+
+/* Process-wide allocation counters */
+uint64_t perfAllocCount();
+uint64_t perfAllocBytes();
+
+/* Resident set size, 0 where it can't be read */
+uint64_t perfResidentBytes();
+
+class PerfStats {
+  private:
+    Histogram hist[ToolCount][PERF_STAGES];
+
+    /* Counter deltas over the last presented frame */
+    uint64_t lastPixels = 0;
+    uint64_t lastUndoBytes = 0;
+    uint64_t lastAllocs = 0;
+
+    /* Counter values at the last presented frame */
+    uint64_t pixels = 0;
+    uint64_t undoBytes = 0;
+    uint64_t allocs = 0;
+    uint64_t duplicates = 0;
+    uint64_t packedBytes = 0;
+    uint64_t packedRawBytes = 0;
+    uint64_t regionBytes = 0;
+    uint64_t regionTiles = 0;
+    uint64_t regionNs = 0;
+
+  public:
+    void record(ToolType tool, PerfStage stage, uint64_t ns);
+    const Histogram &get(ToolType tool, PerfStage stage) const;
+
+    /* Engine counters of a newly presented frame */
+    void frame(uint64_t pixelsWritten, uint64_t undoBytes,
+        uint64_t strokeDuplicates);
+
+    /* History held deflated, and its size inflated */
+    void history(uint64_t packedBytes, uint64_t packedRawBytes);
+
+    /* Region index size, and its tile builds and their time */
+    void regions(uint64_t bytes, uint64_t tiles, uint64_t ns);
+
+    inline uint64_t getLastPixels() const { return lastPixels; }
+    inline uint64_t getLastUndoBytes() const { return lastUndoBytes; }
+    inline uint64_t getLastAllocs() const { return lastAllocs; }
+    inline uint64_t getPixels() const { return pixels; }
+    inline uint64_t getUndoBytes() const { return undoBytes; }
+    inline uint64_t getDuplicates() const { return duplicates; }
+    inline uint64_t getPackedBytes() const { return packedBytes; }
+    inline uint64_t getPackedRawBytes() const { return packedRawBytes; }
+    inline uint64_t getRegionBytes() const { return regionBytes; }
+    inline uint64_t getRegionTiles() const { return regionTiles; }
+    inline uint64_t getRegionNs() const { return regionNs; }
+
+    /* CSV dump of all non-empty histograms and the counters */
+    bool dump(const char *path) const;
+};
+
+const char *toolName(ToolType tool);
+const char *stageName(PerfStage stage);
+
+#endif //PAINT_PERF_H
@@ -1,23 +1,41 @@
 #ifndef PIXEL_H
 #define PIXEL_H
 
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * 8-bit RGBA, straight (not premultiplied) alpha, laid
+ * out in memory in that order. A canvas pixel is exactly
+ * one Color, loaded and stored whole as a uint32_t.
+ */
 class Color {
   public:
     inline Color();
-    inline Color(char r, char g, char b);
-    char r;
-    char g;
-    char b;
+    inline Color(unsigned char r, unsigned char g, unsigned char b,
+        unsigned char a = 255);
+    unsigned char r;
+    unsigned char g;
+    unsigned char b;
+    unsigned char a;
+
+    /* The canvas representation */
+    inline uint32_t value() const;
+    static inline Color fromValue(uint32_t v);
 
-    bool operator==(const Color &_b) {
-      return (r == _b.r && g == _b.g && b == _b.b);
+    bool operator==(const Color &_b) const {
+      return value() == _b.value();
+    }
+    bool operator!=(const Color &_b) const {
+      return value() != _b.value();
     }
 };
 
 class Pixel {
   public:
     inline Pixel();
-    inline Pixel(char r, char g, char b, wxCoord x, wxCoord y);
+    inline Pixel(unsigned char r, unsigned char g, unsigned char b,
+        wxCoord x, wxCoord y);
     inline Pixel(Color &&color, wxPoint &p);
     inline Pixel(const Color &color, const wxPoint &p);
     inline Pixel(Color &color, wxPoint &p);
@@ -29,10 +47,9 @@ class Pixel {
 
 inline Pixel::Pixel() {}
 
-inline Pixel::Pixel(char r, char g, char b, wxCoord x, wxCoord y) {
-  this->color.r = r;
-  this->color.g = g;
-  this->color.b = b;
+inline Pixel::Pixel(unsigned char r, unsigned char g, unsigned char b,
+    wxCoord x, wxCoord y) {
+  this->color = Color(r, g, b);
   this->x = x;
   this->y = y;
 }
@@ -57,10 +74,26 @@ inline Pixel::Pixel(Color &color, wxPoint &p) {
 
 inline Color::Color() {}
 
-inline Color::Color(char r, char g, char b) {
+inline Color::Color(unsigned char r, unsigned char g, unsigned char b,
+    unsigned char a) {
   this->r = r;
   this->g = g;
   this->b = b;
+  this->a = a;
+}
+
+/* memcpy keeps the byte order RGBA on any endianness and
+ * compiles to a single load/store */
+inline uint32_t Color::value() const {
+  uint32_t v;
+  memcpy(&v, this, sizeof(v));
+  return v;
+}
+
+inline Color Color::fromValue(uint32_t v) {
+  Color c;
+  memcpy(&c, &v, sizeof(c));
+  return c;
 }
 
 #endif
@@ -0,0 +1,126 @@
+#include "pool.h"
+
+/************** ThreadPool ****************/
+ThreadPool::ThreadPool(int threads) {
+  if (threads < 1)
+    threads = 1;
+
+  int i;
+  for (i=0; i < threads; i++) {
+    queues.push_back(new Queue());
+  }
+  for (i=1; i < threads; i++) {
+    helpers.push_back(std::thread(&ThreadPool::loop, this, (size_t)i));
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  wake.notify_all();
+
+  size_t i;
+  for (i=0; i < helpers.size(); i++) {
+    helpers[i].join();
+  }
+  for (i=0; i < queues.size(); i++) {
+    delete queues[i];
+  }
+}
+
+int ThreadPool::defaultSize() {
+  int n = (int)std::thread::hardware_concurrency();
+  return n > 0 ? n : 1;
+}
+
+/*
+ * Next task for participant 'self': its own oldest one,
+ * otherwise the newest one of somebody else.
+ */
+bool ThreadPool::take(size_t self, size_t &index) {
+  size_t n = queues.size();
+  {
+    Queue *own = queues[self];
+    std::lock_guard<std::mutex> guard(own->lock);
+    if (own->front < own->back) {
+      index = own->front++;
+      return true;
+    }
+  }
+
+  size_t k;
+  for (k=1; k < n; k++) {
+    Queue *victim = queues[(self + k) % n];
+    std::lock_guard<std::mutex> guard(victim->lock);
+    if (victim->front < victim->back) {
+      index = --victim->back;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::work(size_t self) {
+  size_t index;
+  while (take(self, index)) {
+    (*task)(index);
+  }
+}
+
+void ThreadPool::loop(size_t self) {
+  uint64_t seen = 0;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      wake.wait(guard, [this, seen]() {
+        return stopping || generation != seen;
+      });
+      if (stopping)
+        return;
+      seen = generation;
+    }
+
+    work(self);
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (--busy == 0)
+      done.notify_all();
+  }
+}
+
+void ThreadPool::run(size_t count, const Task &task) {
+  size_t i;
+  if (helpers.empty() || count < 2) {
+    for (i=0; i < count; i++) {
+      task(i);
+    }
+    return;
+  }
+
+  /* Contiguous runs keep neighbouring tasks on one thread
+   * until stealing kicks in. Helpers are all parked here,
+   * the previous run() waited for them. */
+  size_t n = queues.size();
+  for (i=0; i < n; i++) {
+    queues[i]->front = i * count / n;
+    queues[i]->back = (i + 1) * count / n;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    this->task = &task;
+    busy = helpers.size();
+    generation++;
+  }
+  wake.notify_all();
+
+  work(0);
+
+  /* Wait for the helpers to check out as well, so that
+   * none of them still holds 'task' after we return */
+  std::unique_lock<std::mutex> guard(lock);
+  done.wait(guard, [this]() { return busy == 0; });
+  this->task = NULL;
+}
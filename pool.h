@@ -0,0 +1,75 @@
+#ifndef PAINT_POOL_H
+#define PAINT_POOL_H
+
+/*
+ * Work-stealing thread pool for the raster kernels.
+ *
+ * run() hands out 'count' independent tasks, dealt out in
+ * contiguous runs to one queue per participant (the calling
+ * thread included). Each participant works through its own
+ * queue front to back and, once it runs dry, steals from the
+ * back of the others, so uneven tasks (a stroke crossing
+ * only a few row bands) still keep every thread busy.
+ *
+ * Tasks must not depend on each other or on the order in
+ * which they run. Only one thread may call run() at a time.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+  public:
+    typedef std::function<void(size_t)> Task;
+
+  private:
+    /* A contiguous run of task indices, [front, back) */
+    struct Queue {
+      std::mutex lock;
+      size_t front = 0;
+      size_t back = 0;
+    };
+
+    /* Slot 0 belongs to the thread calling run() */
+    std::vector<Queue *> queues;
+    std::vector<std::thread> helpers;
+
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const Task *task = NULL;
+    uint64_t generation = 0;
+    size_t busy = 0;
+    bool stopping = false;
+
+    bool take(size_t self, size_t &index);
+    void work(size_t self);
+    void loop(size_t self);
+
+  public:
+    /* 'threads' counts the caller; 1 runs everything inline */
+    ThreadPool(int threads);
+    ~ThreadPool();
+
+    inline int size() const { return (int)queues.size(); }
+
+    /* Calls task(i) once for every i < count, returns when all are done */
+    void run(size_t count, const Task &task);
+
+    /* Same for any callable, by reference: a Task holding a
+     * copy of a lambda with more than a couple of captures
+     * would be allocated on every call */
+    template <typename F>
+    inline void run(size_t count, const F &task) {
+      run(count, Task(std::cref(task)));
+    }
+
+    /* One thread per hardware thread */
+    static int defaultSize();
+};
+
+#endif //PAINT_POOL_H
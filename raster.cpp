@@ -0,0 +1,2452 @@
+#include <wx/gdicmn.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <math.h>
+#include <algorithm>
+
+#include "helper.h"
+#include "raster.h"
+#include "interpolation.h"
+#include "selection.h"
+#include "worker.h"
+#include "pool.h"
+#include "pack.h"
+#include "journal.h"
+#include "format.h"
+
+#define LOC(x,y,s) ((size_t)(y)*(s)+(x))
+#define RGB_LOC(x,y,w) (3*((y)*(w)+(x)))
+#define ALPHA_LOC(x,y,w) ((y)*(w)+(x))
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+/* Per-pixel loops poll for cancellation this often */
+#define JOB_CHECKPOINT_INTERVAL 4096
+
+/* Pixel lists shorter than this are written serially */
+#define PARALLEL_MIN_PIXELS 16384
+
+/* Row bands per pool thread, spare ones get stolen */
+#define BANDS_PER_THREAD 4
+
+Color WHITE = Color(255, 255, 255);
+Color SELECT = Color(66, 135, 245);
+Color ERASED = Color(255, 255, 255, 0);
+
+/* CONSTRUCTORS */
+Raster::Raster(unsigned int width, unsigned int height) {
+  this->width = width;
+  this->height = height;
+  stride = strideFor(width);
+
+  toolType = Pencil;
+  color = Color(0, 0, 0);
+  thiccness = 3;
+  antialias = false;
+  softness = 0;
+  tolerance = 0;
+  distance = DISTANCE_CHANNEL;
+  contiguous = true;
+
+  /* White-out buffer */
+  Buffer = newBuffer(width, height);
+  modified.assign((height + TILE_ROWS - 1) / TILE_ROWS, 0);
+  regions.reset(width, height, TILE_ROWS);
+  resetKeyframes();
+}
+
+Raster::~Raster() {
+  if (selection != NULL)
+    delete selection;
+  freeBuffer();
+}
+
+uint32_t *Raster::newBuffer(unsigned int width, unsigned int height) {
+  size_t n = strideFor(width) * height;
+  void *p = NULL;
+  /* Never ask for 0 bytes: NULL means out of memory */
+  if (posix_memalign(&p, 4*PIXEL_ALIGN, MAX(n, (size_t)1) * 4) != 0)
+    return NULL;
+
+  uint32_t *buffer = (uint32_t *)p;
+  fillSpan<Rgba32>(buffer, n, WHITE);
+  return buffer;
+}
+
+void Raster::freeBuffer() {
+  if (release != NULL)
+    release(Buffer, 4*stride*height);
+  else
+    free(Buffer);
+  release = NULL;
+}
+
+void Raster::adopt(uint32_t *buffer, unsigned int width, unsigned int height,
+    void (*release)(uint32_t *buffer, size_t size)) {
+  if (selection != NULL)
+    delete selection;
+  selection = NULL;
+  selected = false;
+  whiteoutSelect = true;
+  selectionArea.clear();
+  selectionBorder.clear();
+  selectTxn.pixels.clear();
+  selectBackgrnd.pixels.clear();
+  currentTxn.pixels.clear();
+  freehand.clear();
+  size_t i;
+  for (i=0; i < transactions.size(); i++) {
+    forgetPacked(transactions[i]);
+  }
+  transactions.clear();
+  applied = 0;
+  packFrom = 0;
+
+  freeBuffer();
+  Buffer = buffer;
+  this->release = release;
+  this->width = width;
+  this->height = height;
+  stride = strideFor(width);
+  modified.assign((height + TILE_ROWS - 1) / TILE_ROWS, 0);
+  regions.reset(width, height, TILE_ROWS);
+  resetKeyframes();
+
+  isDirty = width > 0 && height > 0;
+  dirtyMin = wxPoint(0, 0);
+  dirtyMax = wxPoint(width - 1, height - 1);
+}
+
+bool Raster::import(unsigned int width, unsigned int height,
+    const RowSource &source) {
+  uint32_t *buffer = newBuffer(width, height);
+  if (buffer == NULL)
+    return false;
+
+  /* Shown while it decodes; nothing else reads the engine
+   * meanwhile, so the old canvas is simply set aside */
+  uint32_t *prev = Buffer;
+  unsigned int prevWidth = this->width, prevHeight = this->height;
+  size_t prevStride = stride;
+  Buffer = buffer;
+  this->width = width;
+  this->height = height;
+  stride = strideFor(width);
+  isDirty = width > 0 && height > 0;
+  dirtyMin = wxPoint(0, 0);
+  dirtyMax = wxPoint(width - 1, height - 1);
+
+  bool ok = true;
+  unsigned int y = 0;
+  while (y < height) {
+    unsigned int n = MIN(IMAGE_ROWS, height - y);
+    if (!source(Buffer + LOC(0, y, stride), stride, y, n)) {
+      ok = false;
+      break;
+    }
+    if (!isDirty) {
+      dirtyMin = wxPoint(0, y);
+      dirtyMax = wxPoint(width - 1, y + n - 1);
+      isDirty = true;
+    }
+    dirtyMax.y = MAX(dirtyMax.y, (int)(y + n - 1));
+    y += n;
+
+    if (!checkpoint(y, height)) {
+      ok = false;
+      break;
+    }
+    preview();
+  }
+
+  Buffer = prev;
+  this->width = prevWidth;
+  this->height = prevHeight;
+  stride = prevStride;
+  if (!ok) {
+    free(buffer);
+    isDirty = prevWidth > 0 && prevHeight > 0;
+    dirtyMin = wxPoint(0, 0);
+    dirtyMax = wxPoint(prevWidth - 1, prevHeight - 1);
+    return false;
+  }
+  adopt(buffer, width, height, NULL);
+  return true;
+}
+
+bool Raster::exportImage(const RowSink &sink, unsigned int rows) {
+  unsigned int y = 0;
+  while (y < height) {
+    unsigned int n = MIN(rows, height - y);
+    if (!sink(Buffer + LOC(0, y, stride), stride, y, n))
+      return false;
+    y += n;
+    if (!checkpoint(y, height))
+      return false;
+  }
+  return true;
+}
+
+void Raster::setHistory(std::vector<Transaction> &history) {
+  size_t i;
+  for (i=0; i < transactions.size(); i++) {
+    forgetPacked(transactions[i]);
+  }
+  transactions.swap(history);
+  applied = transactions.size();
+  packFrom = 0;
+  resetKeyframes();
+  for (i=0; i < transactions.size(); i++) {
+    undoBytes += transactions[i].pixels.size() * sizeof(Pixel);
+  }
+}
+
+void Raster::clearModified() {
+  modified.assign(modified.size(), 0);
+}
+
+/* Rows y0..y1 (inclusive) were written */
+void Raster::markModified(int y0, int y1) {
+  int t;
+  for (t = y0 / TILE_ROWS; t <= y1 / TILE_ROWS; t++) {
+    modified[t] = 1;
+    baseChanged[t] = 1;
+    regions.touch(t);
+  }
+}
+
+bool Raster::takeDirty(wxRect &dirty) {
+  if (!isDirty)
+    return false;
+
+  dirty = wxRect(dirtyMin, dirtyMax);
+  isDirty = false;
+  return true;
+}
+
+bool Raster::isOpaque() const {
+  uint32_t all = ~(uint32_t)0;
+  size_t i, n = stride*height;
+  /* Row padding is white, opaque */
+  for (i=0; i < n; i++) {
+    all &= Buffer[i];
+  }
+  return Color::fromValue(all).a == 255;
+}
+
+uint64_t Raster::hash() const {
+  uint64_t h = 14695981039346656037ULL;
+  unsigned int x, y;
+  for (y=0; y < height; y++) {
+    const uint32_t *row = Buffer + LOC(0, y, stride);
+    for (x=0; x < width; x++) {
+      Color c = Color::fromValue(row[x]);
+      h = (h ^ c.r) * 1099511628211ULL;
+      h = (h ^ c.g) * 1099511628211ULL;
+      h = (h ^ c.b) * 1099511628211ULL;
+      if (c.a != 255)
+        h = (h ^ c.a) * 1099511628211ULL;
+    }
+  }
+  return h;
+}
+
+/* Input entry points */
+/*
+ * Handle CLICK event
+ * Drawing Tools: Pencil, Line, DrawRect, DrawCircle
+ *    - Fill in the clicked pixel - all have the same functionality
+ */
+void Raster::mouseDown(const wxPoint &p)
+{
+  isNewTxn = true;
+  startPos = p;
+
+  Transaction txn;
+  switch(toolType) {
+    case Eraser:
+    case Pencil:
+      freehand.clear();
+      freehand.push_back(p);
+    case Line:
+    case DrawRect:
+    case DrawCircle:
+      /* A drag builds each frame in one transaction while the
+       * other holds the last; the history took the last drag's
+       * over, so this one starts at the size of the spare */
+      currentTxn.pixels.reserve(spareTxn.pixels.capacity());
+      break;
+    case Fill:
+      if (contiguous)
+        fill(startPos, color, txn);
+      else
+        replaceColor(startPos, color, txn);
+      currentTxn = std::move(txn);
+      break;
+    case SlctRect:
+      handleSelectionClick(startPos);
+      break;
+    case SlctCircle:
+      handleSelectionClick(startPos);
+      break;
+    case Lasso:
+      freehand.clear();
+      handleSelectionClick(startPos);
+      break;
+    case MagicWand:
+      handleSelectionClick(startPos);
+      if (!selected && selectRegion(startPos)) {
+        wandPicked = true;
+        currentTxn = selectTxn;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+void Raster::mouseMoved(const wxPoint &currPos)
+{
+  /* Built in the storage of the transaction it replaces */
+  Transaction &txn = spareTxn;
+  txn.clear();
+
+  switch(toolType) {
+    case Pencil:
+      freehand.push_back(currPos);
+      if (antialias)
+        drawSoft(currPos, txn);
+      else
+        updateBuffer(
+          drawFreeHand(currPos, txn, thiccness),
+          color);
+      std::swap(currentTxn, txn);
+      break;
+    case Line:
+      if (antialias)
+        drawSoft(currPos, txn);
+      else
+        updateBuffer(
+          drawLine(currPos, txn, thiccness),
+          color);
+      std::swap(currentTxn, txn);
+      break;
+    case DrawRect:
+      if (antialias)
+        drawSoft(currPos, txn);
+      else
+        updateBuffer(
+            drawRectangle(currPos, txn, thiccness),
+            color);
+      std::swap(currentTxn, txn);
+      break;
+    case DrawCircle:
+      if (antialias)
+        drawSoft(currPos, txn);
+      else
+        updateBuffer(
+          drawCircle(currPos, txn, thiccness),
+          color);
+      std::swap(currentTxn, txn);
+      break;
+    case Eraser:
+      freehand.push_back(currPos);
+      if (antialias)
+        drawSoft(currPos, txn);
+      else
+        updateBuffer(
+            drawFreeHand(currPos, txn, thiccness),
+            ERASED);
+      std::swap(currentTxn, txn);
+      break;
+    case SlctRect:
+      handleSelectionMove(currPos, &Raster::drawRectangle);
+      break;
+    case SlctCircle:
+      handleSelectionMove(currPos, &Raster::drawCircle);
+      break;
+    case Lasso:
+      freehand.push_back(currPos);
+      handleSelectionMove(currPos, &Raster::drawFreeHand);
+      break;
+    case MagicWand:
+      /* The press that picks a region doesn't drag it */
+      if (selected && !wandPicked) {
+        listSelection();
+        move(selectionArea,
+            currPos.x - startPos.x, currPos.y - startPos.y, txn);
+        std::swap(currentTxn, txn);
+      }
+      break;
+    default:
+      break;
+  }
+
+  isNewTxn = false;
+}
+
+/*
+ * Freehand tools keep every sample in the stroke, all other
+ * tools only depend on the latest position. The stroke is
+ * redrawn once for the whole batch, which gives the same
+ * pixels as feeding the samples one at a time.
+ */
+void Raster::mouseMoved(const std::vector<wxPoint> &samples)
+{
+  if (samples.empty())
+    return;
+
+  switch(toolType) {
+    case Pencil:
+    case Eraser:
+    case Lasso:
+      freehand.insert(freehand.end(),
+          samples.begin(), samples.end() - 1);
+      break;
+    default:
+      break;
+  }
+
+  mouseMoved(samples.back());
+}
+
+void Raster::mouseReleased(const wxPoint &pt)
+{
+  switch (toolType) {
+    case SlctRect:
+    case SlctCircle:
+    case Lasso:
+      handleSelectionRelease(startPos, pt);
+      break;
+    case MagicWand:
+      if (wandPicked)
+        wandPicked = false;
+      else if (selected)
+        clearSelection();
+      break;
+    case Pencil:
+    case Eraser:
+    case Line:
+    case DrawRect:
+    case DrawCircle:
+      /* Moved into the history as it is, unless the drag came
+       * out much smaller than mouseDown() reserved for it */
+      if (currentTxn.pixels.capacity() > 2 * currentTxn.pixels.size())
+        currentTxn.pixels.shrink_to_fit();
+      break;
+    default:
+      break;
+  }
+
+  // commit transaction
+  addTransaction(currentTxn);
+}
+
+/* Keyboard commands */
+bool Raster::undo() {
+  if (applied == 0)
+    return false;
+  return jumpTo(applied - 1);
+}
+
+void Raster::selectAll() {
+  Transaction txn;
+  if (!selectAll(txn))
+    return;
+  currentTxn = std::move(txn);
+}
+
+bool Raster::deleteSelection() {
+  Transaction txn;
+  if (!clearSelectedArea(txn, Color(255, 255, 255)))
+    return false;
+
+  clearSelection();
+  currentTxn = std::move(txn);
+  addTransaction(currentTxn);
+  return true;
+}
+
+/*
+ * Paste an M x N RGB image (row major) at the top-left
+ * corner and select it.
+ *
+ * (1) Check corresponding alpha values for each pixel.
+ *     If alpha value of pixel is NOT 0 (i.e. not completely
+ *     transparent), then copy that pixel's RGB.
+ *     If alpha value of pixel is 0, then ignore pixel, as
+ *     is transparent.
+ * (2) Iterate through, add previous color to transactions,
+ *     then update display buffer.
+ * (3) Initialize selectionArea and selectionBorder:
+ *   - If previous selection exists, free it
+ *   - Initialize selectionArea to be the non-alpha pixels
+ *     pasted from clipboard.
+ *   - For simplicity, set border to the bounding box
+ *     (i.e. for Lasso, border would not be tightly
+ *     bounded like it is during the actual selection).
+ *     This should not affect the actual pixels being
+ *     moved if the user performs click-drag since
+ *     selectionArea is still strictly based on the area
+ *     selected by the user (and not, say, the bounding
+ *     box)
+ *
+ * 'alpha' may be NULL if the image has no alpha channel.
+ *
+ * Note: Could try and optimize using memset, this
+ * requires changes to the transaction system.
+ */
+bool Raster::paste(const unsigned char *buffer, const unsigned char *alpha,
+    unsigned int M, unsigned int N) {
+  clearSelection();
+
+  Transaction txn;
+  wxPoint tl, br;
+  tl = wxPoint(0, 0);
+  br = wxPoint(std::min(width, M-1), std::min(height, N-1));
+  selectionBorder = drawRectangle(tl, br, 1);
+  int i;
+  for (i=0; i<selectionBorder.size(); i++) {
+    wxPoint p = selectionBorder[i];
+    Pixel pixel = getPixel(p);
+    selectTxn.update(pixel);
+    selectionArea.push_back(pixel);
+  }
+
+  int x, y;
+  for (y=0; y<std::min(height, N); y++) {
+    if (!checkpoint(y, std::min(height, N))) {
+      revertTransaction(txn);
+      abandonSelection(txn);
+      return false;
+    }
+    for (x=0; x<std::min(width, M); x++) {
+      wxPoint p(x,y);
+      Pixel pixel;
+      Color prev_c = getPixelColor(p); /* prev color */
+      Color c;
+      int ind;
+
+      ind = ALPHA_LOC(x, y, M);
+      if (alpha == NULL || alpha[ind] != 0) {
+        unsigned char a = alpha == NULL ? 255 : alpha[ind];
+        ind = RGB_LOC(x, y, M);
+        c = Color(
+          buffer[ind],
+          buffer[ind+1],
+          buffer[ind+2],
+          a
+        );
+
+        pixel = Pixel(c, p);
+        txn.update(Pixel(prev_c, p));
+
+        updateBuffer(pixel);
+        selectionArea.push_back(pixel);
+      }
+    }
+  }
+
+  updateBuffer(
+    makeDashed(selectionBorder),
+    SELECT);
+  selection = new RectangleSelection(tl, br);
+  selectBackgrnd.insert(txn);
+  whiteoutSelect = false;
+  selected = true;
+  toolType = SlctRect;
+
+  currentTxn = std::move(txn);
+  addTransaction(currentTxn);
+  return true;
+}
+
+/*
+ * Copy the current selection into freshly malloc'd
+ * M x N RGB and alpha buffers, owned by the caller.
+ *
+ * Note - Non-rectangular selection:
+ * Use alpha channel to accept non-rectangular
+ * selection areas.
+ * e.g. Set alpha to 0 for unselected pixels, so
+ * when pasting, we can check alpha channel of
+ * the corresponding pixel to decide whether to
+ * update it or not. Selected pixels keep their
+ * own alpha.
+ *
+ * Steps:
+ * (1) Do one pass on data to set every pixel's
+ *     alpha to 0 (i.e. transparent)
+ * (2) Do one pass on selectionArea. Since all pixels
+ *     contained in selectionArea have been selected,
+ *     set color and alpha of the respective pixel in
+ *     'data'.
+ */
+bool Raster::copy(unsigned char **data, unsigned char **alpha,
+    int &M, int &N) {
+  if (!selected)
+    return false;
+
+  assert(selection != NULL);
+
+  int minX, minY;
+  N = selection->getHeight();
+  M = selection->getWidth();
+  minX = (int)selection->minX;
+  minY = (int)selection->minY;
+
+  *data = (unsigned char *)malloc(3*N*M);
+  *alpha = (unsigned char *)malloc(N*M);
+
+  // (1)
+  memset(*data, 255, 3*N*M);
+  memset(*alpha, 0, N*M);
+
+  // (2)
+  auto put = [&](const Pixel &pixel) {
+    int x, y;
+    x = pixel.x - minX;
+    y = pixel.y - minY;
+
+    int ind;
+    ind = RGB_LOC(x, y, M);
+    (*data)[ind] = pixel.color.r;
+    (*data)[ind+1] = pixel.color.g;
+    (*data)[ind+2] = pixel.color.b;
+
+    ind = ALPHA_LOC(x, y, M);
+    (*alpha)[ind] = pixel.color.a;
+  };
+
+  MaskSelection *mask = maskSelection();
+  if (mask != NULL) {
+    /* Straight off the canvas, but for the border: its
+     * colours are under the dashes, in selectTxn */
+    int x, y;
+    size_t i;
+    for (y=minY; y <= mask->maxY; y++) {
+      const unsigned char *m = &mask->mask[(size_t)y * width];
+      const uint32_t *row = Buffer + (size_t)y * stride;
+      for (x=minX; x <= mask->maxX; x++) {
+        if (m[x])
+          put(Pixel(Rgba32::unpack(row[x]), wxPoint(x, y)));
+      }
+    }
+    for (i=0; i < selectTxn.pixels.size(); i++) {
+      put(selectTxn.pixels[i]);
+    }
+    return true;
+  }
+
+  {
+    int i;
+    for (i=0; i<selectionArea.size(); i++) {
+      put(selectionArea[i]);
+    }
+  }
+  return true;
+}
+
+void Raster::hideOverlay() {
+  const std::vector<Pixel> &under = selectTxn.pixels;
+  overlayScratch.resize(under.size());
+  size_t i;
+  for (i=0; i < under.size(); i++) {
+    if ((unsigned int)under[i].x >= width || (unsigned int)under[i].y >= height)
+      continue;
+    uint32_t &at = Buffer[LOC(under[i].x, under[i].y, stride)];
+    overlayScratch[i] = at;
+    at = under[i].color.value();
+  }
+}
+
+/* In reverse, for a pixel listed twice */
+void Raster::showOverlay() {
+  const std::vector<Pixel> &under = selectTxn.pixels;
+  size_t i = under.size();
+  while (i > 0) {
+    i--;
+    if ((unsigned int)under[i].x >= width || (unsigned int)under[i].y >= height)
+      continue;
+    Buffer[LOC(under[i].x, under[i].y, stride)] = overlayScratch[i];
+  }
+}
+
+/* Takes over 't', which is left empty */
+void Raster::addTransaction(Transaction &t) {
+  dropFuture();
+  undoBytes += t.pixels.size() * sizeof(Pixel) + t.changes.bytes();
+  if (journal != NULL) {
+    hideOverlay();
+    journal->commit(t, Buffer, stride, width, height);
+    showOverlay();
+  }
+  transactions.push_back(std::move(t));
+  t.clear();
+  applied++;
+
+  /* A selection's border and lifted pixels are on the
+   * canvas but not in the history, keep them out */
+  if (applied % KEYFRAME_INTERVAL == 0 && !selected
+      && selectTxn.pixels.empty() && currentTxn.pixels.empty())
+    captureKeyframe(applied);
+}
+
+/*
+ * History jumps
+ */
+void Raster::resetKeyframes() {
+  keyframes.clear();
+  packKeyFrom = packTile = 0;
+  baseTiles.clear();
+  baseChanged.assign(modified.size(), 1);
+}
+
+/* Forget the steps jumped back over, and their keyframes */
+void Raster::dropFuture() {
+  if (applied == transactions.size())
+    return;
+  size_t i;
+  for (i=applied; i < transactions.size(); i++) {
+    forgetPacked(transactions[i]);
+  }
+  transactions.erase(transactions.begin() + applied, transactions.end());
+  keyframes.erase(keyframes.upper_bound(applied), keyframes.end());
+  packFrom = MIN(packFrom, applied);
+}
+
+/* Keep the canvas as the keyframe of 'step', which it shows */
+void Raster::captureKeyframe(size_t step) {
+  if (keyframes.count(step))
+    return;
+
+  Keyframe &key = keyframes[step];
+  if (step < packKeyFrom) {
+    packKeyFrom = step;
+    packTile = 0;
+  }
+  size_t t, tiles = modified.size();
+  key.tiles.resize(tiles);
+  for (t=0; t < tiles; t++) {
+    if (t < baseTiles.size() && !baseChanged[t]) {
+      key.tiles[t] = baseTiles[t];
+      continue;
+    }
+    unsigned int y, y0 = t * TILE_ROWS;
+    unsigned int y1 = MIN(y0 + TILE_ROWS, height);
+    Tile tile = std::make_shared<KeyTile>();
+    tile->raster = this;
+    tile->count = (size_t)width * (y1 - y0);
+    tile->pixels.resize(tile->count);
+    for (y=y0; y < y1; y++) {
+      copySpan<Rgba32, Rgba32>(Buffer + LOC(0, y, stride),
+          &tile->pixels[0] + (size_t)width * (y - y0), width);
+    }
+    key.tiles[t] = tile;
+  }
+  baseTiles = key.tiles;
+  baseChanged.assign(tiles, 0);
+}
+
+/* Only the bands that differ from the canvas are copied */
+void Raster::restoreKeyframe(const Keyframe &key) {
+  size_t t, tiles = key.tiles.size();
+  for (t=0; t < tiles; t++) {
+    if (t < baseTiles.size() && !baseChanged[t] && baseTiles[t] == key.tiles[t])
+      continue;
+    unsigned int y, y0 = t * TILE_ROWS;
+    unsigned int y1 = MIN(y0 + TILE_ROWS, height);
+    const KeyTile &band = *key.tiles[t];
+    if (!band.packed.empty() && stride == width) {
+      /* Unpadded rows: the band is one run of the canvas */
+      unpackBytes(band.packed, Buffer + LOC(0, y0, stride), 4 * band.count);
+    } else {
+      const uint32_t *tile;
+      if (band.packed.empty()) {
+        tile = &band.pixels[0];
+      } else {
+        tileScratch.resize(band.count);
+        unpackBytes(band.packed, &tileScratch[0], 4 * band.count);
+        tile = &tileScratch[0];
+      }
+      for (y=y0; y < y1; y++) {
+        copySpan<Rgba32, Rgba32>(tile + (size_t)width * (y - y0),
+            Buffer + LOC(0, y, stride), width);
+      }
+    }
+    markDirty(0, y0);
+    markDirty(width - 1, y1 - 1);
+    markModified(y0, y1 - 1);
+    pixelsWritten += (size_t)width * (y1 - y0);
+  }
+  baseTiles = key.tiles;
+  baseChanged.assign(tiles, 0);
+}
+
+/*
+ * Idle packing
+ */
+bool Raster::packHistory() {
+  if (applied <= HISTORY_HOT_STEPS)
+    return false;
+  size_t cold = applied - HISTORY_HOT_STEPS;
+
+  while (packFrom < cold) {
+    Transaction &txn = transactions[packFrom++];
+    if (txn.isPacked() || txn.pixels.empty()
+        || !packPixels(txn.pixels, txn.packed, packScratch))
+      continue;
+    txn.packedCount = txn.pixels.size();
+    packedBytes += txn.packed.size();
+    packedRawBytes += txn.packedCount * sizeof(Pixel);
+    std::vector<Pixel>().swap(txn.pixels);
+    return true;
+  }
+
+  /* Bands shared with another keyframe, or with the last
+   * one taken or restored, stay as they are */
+  std::map<size_t, Keyframe>::iterator key = keyframes.lower_bound(packKeyFrom);
+  for (; key != keyframes.end() && key->first < cold; key++) {
+    std::vector<Tile> &tiles = key->second.tiles;
+    while (packTile < tiles.size()) {
+      Tile &tile = tiles[packTile++];
+      if (!tile->packed.empty() || tile.use_count() > 1
+          || !packBytes(&tile->pixels[0], 4 * tile->count, tile->packed))
+        continue;
+      packedBytes += tile->packed.size();
+      packedRawBytes += 4 * tile->count;
+      std::vector<uint32_t>().swap(tile->pixels);
+      return true;
+    }
+    packKeyFrom = key->first + 1;
+    packTile = 0;
+  }
+  return false;
+}
+
+/* Inflate transaction 'step' if it was packed */
+void Raster::unpack(size_t step) {
+  Transaction &txn = transactions[step];
+  if (!txn.isPacked())
+    return;
+  forgetPacked(txn);
+  unpackPixels(txn.packed, txn.packedCount, txn.pixels);
+  std::vector<unsigned char>().swap(txn.packed);
+  txn.packedCount = 0;
+  packFrom = MIN(packFrom, step);
+}
+
+/* What is packed in there is about to go away */
+void Raster::forgetPacked(const Transaction &txn) {
+  if (!txn.isPacked())
+    return;
+  packedBytes -= txn.packed.size();
+  packedRawBytes -= txn.packedCount * sizeof(Pixel);
+}
+
+Raster::KeyTile::~KeyTile() {
+  if (packed.empty())
+    return;
+  raster->packedBytes -= packed.size();
+  raster->packedRawBytes -= 4 * count;
+}
+
+bool Raster::jumpTo(size_t step) {
+  if (step > transactions.size())
+    return false;
+
+  clearSelection();
+  currentTxn.clear();
+  if (step == applied)
+    return true;
+
+  /* The newest step is only ever come back to this way */
+  if (applied == transactions.size())
+    captureKeyframe(applied);
+
+  /* Revert from here, or from the first keyframe at or
+   * past 'step' if that is closer (or 'step' is ahead) */
+  size_t from = applied;
+  std::map<size_t, Keyframe>::iterator key = keyframes.lower_bound(step);
+  assert(step <= applied || key != keyframes.end());
+  if (step > applied || (key != keyframes.end() && key->first < applied)) {
+    restoreKeyframe(key->second);
+    from = key->first;
+  }
+
+  /* Keyframes passed on the way are kept for next time */
+  while (from > step) {
+    from--;
+    unpack(from);
+    revertTransaction(transactions[from]);
+    if (from % KEYFRAME_INTERVAL == 0)
+      captureKeyframe(from);
+  }
+
+  /* The journal replays a jump as undos and commits of
+   * what the canvas now shows */
+  if (journal != NULL) {
+    size_t i;
+    for (i=step; i < applied; i++) {
+      journal->undo();
+    }
+    hideOverlay();
+    for (i=applied; i < step; i++) {
+      unpack(i);
+      journal->commit(transactions[i], Buffer, stride, width, height);
+    }
+    showOverlay();
+  }
+  applied = step;
+  return true;
+}
+
+void Raster::applyCommit(Transaction &before, const std::vector<Pixel> &after) {
+  size_t i;
+  for (i=0; i < after.size(); i++) {
+    updateBuffer(after[i]);
+  }
+  addTransaction(before);
+
+  /* A jump forward is journalled as commits of the step it
+   * ended on: the canvases in between never existed */
+  keyframes.erase(applied);
+}
+
+/*
+ * Report progress to the running job, if any.
+ * Returns false if the job was cancelled.
+ */
+bool Raster::checkpoint(size_t done, size_t total) {
+  if (job == NULL)
+    return true;
+  return job->checkpoint(done, total);
+}
+
+/* Let the running job, if any, show what it has so far */
+void Raster::preview() {
+  if (job != NULL)
+    job->preview();
+}
+
+/*
+ * Drop a half-built selection after a cancelled
+ * selectAll/paste. The previous selection has already
+ * been cleared, nothing has been drawn yet.
+ */
+void Raster::abandonSelection(Transaction &txn) {
+  txn.pixels.clear();
+  selectionArea.clear();
+  selectionBorder.clear();
+  selectTxn.pixels.clear();
+  selectBackgrnd.pixels.clear();
+}
+
+bool Raster::isParallel(size_t count) const {
+  return pool != NULL && pool->size() > 1 && count >= PARALLEL_MIN_PIXELS;
+}
+
+/*
+ * Write 'count' pixels, source(i) being the i-th one, on the
+ * pool. The canvas is cut into row bands and each band is
+ * written by a single task, applying its pixels in list
+ * order: a pixel listed twice still ends up with the later
+ * colour, so the buffer, dirty region and pixel count are
+ * exactly what the serial loop produces.
+ */
+template <typename Source>
+void Raster::writeBands(size_t count, const Source &source) {
+  size_t chunks = pool->size();
+  size_t bands = MIN((size_t)height, chunks * BANDS_PER_THREAD);
+  if (bands == 0)
+    return;
+  size_t bandHeight = (height + bands - 1) / bands;
+  bands = (height + bandHeight - 1) / bandHeight;
+
+  /* (1) Split the list into chunks and sort each chunk's
+   *     indices by band, keeping their order. The lists
+   *     keep their storage for the next call. */
+  std::vector<std::vector<uint32_t> > &lists = bandLists;
+  if (lists.size() < chunks * bands)
+    lists.resize(chunks * bands);
+  pool->run(chunks, [&](size_t c) {
+    size_t b;
+    for (b=0; b < bands; b++) {
+      lists[c*bands + b].clear();
+    }
+
+    size_t i, end = (c + 1) * count / chunks;
+    for (i = c * count / chunks; i < end; i++) {
+      Pixel p = source(i);
+      if ((unsigned int)p.x >= width || (unsigned int)p.y >= height)
+        continue;
+      lists[c*bands + p.y / bandHeight].push_back(i);
+    }
+  });
+
+  /* (2) Write each band, visiting the chunks in order */
+  std::vector<Band> &state = bandState;
+  state.resize(bands);
+  pool->run(bands, [&](size_t b) {
+    Band &band = state[b];
+    band.isDirty = false;
+    band.written = 0;
+
+    size_t c, k;
+    for (c=0; c < chunks; c++) {
+      const std::vector<uint32_t> &list = lists[c*bands + b];
+      for (k=0; k < list.size(); k++) {
+        Pixel p = source(list[k]);
+        Buffer[LOC(p.x, p.y, stride)] = p.color.value();
+
+        if (!band.isDirty) {
+          band.dirtyMin = band.dirtyMax = wxPoint(p.x, p.y);
+          band.isDirty = true;
+          continue;
+        }
+        band.dirtyMin.x = MIN(band.dirtyMin.x, p.x);
+        band.dirtyMin.y = MIN(band.dirtyMin.y, p.y);
+        band.dirtyMax.x = MAX(band.dirtyMax.x, p.x);
+        band.dirtyMax.y = MAX(band.dirtyMax.y, p.y);
+      }
+      band.written += list.size();
+    }
+  });
+
+  /* (3) Fold the bands into the engine's own bookkeeping */
+  foldBands(bands);
+}
+
+/* Bands of 'rows' rows for 'count' pixels: one unless
+ * there are enough pixels to go on the pool */
+size_t Raster::splitBands(size_t rows, size_t count, size_t &bandHeight) const {
+  size_t bands = 1;
+  if (isParallel(count))
+    bands = MIN(rows, pool->size() * BANDS_PER_THREAD);
+  bandHeight = MAX((rows + bands - 1) / bands, (size_t)1);
+  return (rows + bandHeight - 1) / bandHeight;
+}
+
+/* Row 'y' wrote the set bits of 'bits', from column 'x' */
+void Raster::touchRow(Band &band, const uint64_t *bits, size_t words,
+    int x, int y) {
+  size_t w0 = 0, w1 = words;
+  while (w0 < w1 && bits[w0] == 0) {
+    w0++;
+  }
+  if (w0 == w1)
+    return;
+  while (bits[w1 - 1] == 0) {
+    w1--;
+  }
+  int x0 = x + (int)(w0 * 64) + __builtin_ctzll(bits[w0]);
+  int x1 = x + (int)((w1 - 1) * 64) + 63 - __builtin_clzll(bits[w1 - 1]);
+  if (!band.isDirty) {
+    band.dirtyMin = wxPoint(x0, y);
+    band.dirtyMax = wxPoint(x1, y);
+    band.isDirty = true;
+    return;
+  }
+  band.dirtyMin.x = MIN(band.dirtyMin.x, x0);
+  band.dirtyMin.y = MIN(band.dirtyMin.y, y);
+  band.dirtyMax.x = MAX(band.dirtyMax.x, x1);
+  band.dirtyMax.y = MAX(band.dirtyMax.y, y);
+}
+
+void Raster::foldBands(size_t bands) {
+  std::vector<Band> &state = bandState;
+  size_t b;
+  for (b=0; b < bands; b++) {
+    if (!state[b].isDirty)
+      continue;
+    markDirty(state[b].dirtyMin.x, state[b].dirtyMin.y);
+    markDirty(state[b].dirtyMax.x, state[b].dirtyMax.y);
+    markModified(state[b].dirtyMin.y, state[b].dirtyMax.y);
+    pixelsWritten += state[b].written;
+  }
+}
+
+/*
+ * Put back what a colour replace wrote, in row bands on the
+ * pool. With one colour per pixel, each band first counts
+ * where its colours start.
+ */
+void Raster::revertChanges(const ChangeMask &changes) {
+  if (changes.count == 0)
+    return;
+
+  size_t bandHeight;
+  size_t bands = splitBands(changes.height, changes.count, bandHeight);
+  const bool uniform = changes.before.size() == 1;
+  std::vector<size_t> start(bands + 1, 0);
+  size_t b;
+  if (!uniform) {
+    for (b=0; b < bands; b++) {
+      size_t i, end = MIN((b + 1) * bandHeight, (size_t)changes.height);
+      size_t n = 0;
+      for (i = b * bandHeight * changes.words; i < end * changes.words; i++) {
+        n += __builtin_popcountll(changes.bits[i]);
+      }
+      start[b + 1] = start[b] + n;
+    }
+  }
+
+  std::vector<Band> &state = bandState;
+  state.resize(bands);
+  auto revertBand = [&](size_t b) {
+    Band &band = state[b];
+    band.isDirty = false;
+    band.written = 0;
+
+    size_t k = start[b], w;
+    unsigned int r, end = MIN((b + 1) * bandHeight, (size_t)changes.height);
+    for (r = b * bandHeight; r < end; r++) {
+      const uint64_t *bits = &changes.bits[r * changes.words];
+      uint32_t *row = Buffer + LOC(changes.x, changes.y + r, stride);
+      for (w=0; w < changes.words; w++) {
+        uint64_t m = bits[w];
+        if (uniform && m == ~(uint64_t)0) {
+          SpanFill<Rgba32>::run(row + w * 64, 64, changes.before[0]);
+          band.written += 64;
+          continue;
+        }
+        while (m != 0) {
+          int i = __builtin_ctzll(m);
+          m &= m - 1;
+          row[w * 64 + i] = changes.before[uniform ? 0 : k++];
+          band.written++;
+        }
+      }
+      touchRow(band, bits, changes.words, changes.x, changes.y + r);
+    }
+  };
+  if (bands > 1)
+    pool->run(bands, revertBand);
+  else
+    revertBand(0);
+  foldBands(bands);
+}
+
+/*
+ * Non-contiguous fill: every pixel within 'tolerance' of the
+ * one at 'p' is set to 'color', on the whole canvas or in
+ * the selection, with SpanReplace over row bands on the
+ * pool. 'txn' keeps a ChangeMask rather than a Pixel for
+ * each pixel written; with no tolerance, or when everything
+ * written was the same colour anyway, one old colour does
+ * for all of them.
+ */
+void Raster::replaceColor(const wxPoint &p, const Color &color,
+    Transaction &txn) {
+  if ((unsigned int)p.x >= width || (unsigned int)p.y >= height)
+    return;
+
+  Color c = getPixelColor(p);
+  if (tolerance <= 0 && c == color) {
+    return;
+  }
+
+  /* The selection less its border, which shows SELECT until
+   * the selection is dropped */
+  int x0 = 0, y0 = 0, x1 = width, y1 = height;
+  MaskSelection *mask = maskSelection();
+  if (mask != NULL) {
+    x0 = mask->minX;
+    y0 = mask->minY;
+    x1 = mask->maxX + 1;
+    y1 = mask->maxY + 1;
+  } else if (selected) {
+    x0 = width;
+    y0 = height;
+    x1 = y1 = 0;
+    size_t i;
+    for (i=0; i < selectionArea.size(); i++) {
+      const Pixel &s = selectionArea[i];
+      if ((unsigned int)s.x >= width || (unsigned int)s.y >= height)
+        continue;
+      x0 = MIN(x0, s.x);
+      y0 = MIN(y0, s.y);
+      x1 = MAX(x1, s.x + 1);
+      y1 = MAX(y1, s.y + 1);
+    }
+    if (x0 >= x1)
+      return;
+  }
+
+  ChangeMask &changes = txn.changes;
+  changes.x = x0;
+  changes.y = y0;
+  changes.width = x1 - x0;
+  changes.height = y1 - y0;
+  changes.words = (changes.width + 63) / 64;
+  changes.bits.assign(changes.words * changes.height, 0);
+
+  const uint64_t *allow = NULL;
+  if (selected) {
+    replaceAllow.assign(changes.bits.size(), 0);
+    size_t i;
+    if (mask != NULL) {
+      int x, y;
+      for (y=y0; y < y1; y++) {
+        const unsigned char *m = &mask->mask[(size_t)y * width];
+        uint64_t *bits = &replaceAllow[(y - y0) * changes.words];
+        for (x=x0; x < x1; x++) {
+          if (m[x])
+            bits[(x - x0) / 64] |= (uint64_t)1 << ((x - x0) % 64);
+        }
+      }
+    } else {
+      for (i=0; i < selectionArea.size(); i++) {
+        const Pixel &s = selectionArea[i];
+        if (s.x < x0 || s.x >= x1 || s.y < y0 || s.y >= y1)
+          continue;
+        size_t bit = s.x - x0;
+        replaceAllow[(s.y - y0) * changes.words + bit / 64] |=
+          (uint64_t)1 << (bit % 64);
+      }
+    }
+    for (i=0; i < selectTxn.pixels.size(); i++) {
+      const Pixel &s = selectTxn.pixels[i];
+      if (s.x < x0 || s.x >= x1 || s.y < y0 || s.y >= y1)
+        continue;
+      size_t bit = s.x - x0;
+      replaceAllow[(s.y - y0) * changes.words + bit / 64] &=
+        ~((uint64_t)1 << (bit % 64));
+    }
+    allow = &replaceAllow[0];
+  }
+
+  /* Rounds of one band a thread, so that a cancel is seen
+   * between them */
+  ColorMatch match = { c, tolerance, distance };
+  const uint32_t value = Rgba32::pack(color);
+  const bool uniform = tolerance <= 0;
+  size_t bandHeight;
+  size_t bands = splitBands(changes.height,
+      (size_t)changes.width * changes.height, bandHeight);
+  size_t round = bands > 1 ? (size_t)pool->size() : 1;
+  std::vector<std::vector<uint32_t> > &lists = bandLists;
+  if (lists.size() < bands)
+    lists.resize(bands);
+  std::vector<Band> &state = bandState;
+  state.resize(bands);
+
+  auto replaceBand = [&](size_t b) {
+    Band &band = state[b];
+    band.isDirty = false;
+    band.written = 0;
+    std::vector<uint32_t> *before = uniform ? NULL : &lists[b];
+    if (before != NULL)
+      before->clear();
+
+    unsigned int r, end = MIN((b + 1) * bandHeight, (size_t)changes.height);
+    for (r = b * bandHeight; r < end; r++) {
+      size_t row = r * changes.words;
+      size_t n = replaceSpan<Rgba32>(Buffer + LOC(x0, y0 + r, stride),
+          changes.width, match, value, allow ? allow + row : NULL,
+          &changes.bits[row], before);
+      if (n == 0)
+        continue;
+      band.written += n;
+      touchRow(band, &changes.bits[row], changes.words, x0, y0 + r);
+    }
+  };
+
+  size_t done = 0;
+  bool cancelled = false;
+  while (done < bands && !cancelled) {
+    size_t n = MIN(round, bands - done);
+    if (n > 1) {
+      pool->run(n, [&](size_t i) { replaceBand(done + i); });
+    } else {
+      replaceBand(done);
+    }
+    done += n;
+    cancelled = !checkpoint(MIN(done * bandHeight, (size_t)changes.height),
+        changes.height);
+  }
+  foldBands(done);
+
+  size_t b;
+  changes.count = 0;
+  for (b=0; b < done; b++) {
+    changes.count += state[b].written;
+    if (!uniform)
+      changes.before.insert(changes.before.end(),
+          lists[b].begin(), lists[b].end());
+  }
+  if (changes.count == 0) {
+    changes.clear();
+    return;
+  }
+  if (uniform) {
+    changes.before.assign(1, c.value());
+  } else if (std::count(changes.before.begin(), changes.before.end(),
+        changes.before[0]) == (ptrdiff_t)changes.before.size()) {
+    uint32_t first = changes.before[0];
+    changes.before.assign(1, first);
+  }
+
+  if (cancelled) {
+    revertChanges(changes);
+    changes.clear();
+  }
+}
+
+void Raster::revertTransaction(Transaction &txn) {
+  std::vector<Pixel> *pixels;
+  Pixel p;
+  pixels = &(txn.pixels);
+  revertChanges(txn.changes);
+
+  if (isParallel(pixels->size())) {
+    writeBands(pixels->size(), [pixels](size_t i) {
+      return (*pixels)[i];
+    });
+    return;
+  }
+
+  int i;
+  for (i=0; i<pixels->size(); i++) {
+    p = (*pixels)[i];
+    updateBuffer(p); 
+  }
+}
+
+void
+Raster::updateTransaction(Transaction &txn, const std::vector<wxPoint> &points)
+{
+  /* Only reads the buffer, so plain chunks of the list will do */
+  if (isParallel(points.size())) {
+    size_t base = txn.pixels.size(), count = points.size();
+    size_t chunks = pool->size();
+    txn.pixels.resize(base + count);
+    pool->run(chunks, [&](size_t c) {
+      size_t i, end = (c + 1) * count / chunks;
+      for (i = c * count / chunks; i < end; i++) {
+        txn.pixels[base + i] = Pixel(getPixelColor(points[i]), points[i]);
+      }
+    });
+    return;
+  }
+
+  int i=0;
+  wxPoint pt;
+  Pixel p;
+  for (i=0; i < points.size(); i++) {
+    pt = points[i];
+    p = Pixel(getPixelColor(pt), pt);
+    txn.update(p);
+  }
+}
+
+/*
+ * Drop the pixels of a drawing tool's stroke that are off the
+ * canvas or already listed: overlapping brush stamps and
+ * segment joins list many pixels more than once, and each
+ * copy would be recorded, written and reverted again.
+ */
+void Raster::coverStroke(std::vector<wxPoint> &points) {
+  /* Selection borders keep theirs, they are dashed by index */
+  if (toolType == SlctRect || toolType == SlctCircle || toolType == Lasso)
+    return;
+
+  size_t area = (size_t)width * height;
+  if (strokeMask.size() != area) {
+    strokeMask.assign(area, 0);
+    strokeGen = 0;
+  }
+  if (++strokeGen == 0) {
+    memset(&strokeMask[0], 0, area);
+    strokeGen = 1;
+  }
+
+  size_t i, n = 0;
+  for (i=0; i < points.size(); i++) {
+    const wxPoint &p = points[i];
+    if ((unsigned int)p.x >= width || (unsigned int)p.y >= height)
+      continue;
+    unsigned char &covered = strokeMask[(size_t)p.y * width + p.x];
+    if (covered == strokeGen)
+      continue;
+    covered = strokeGen;
+    points[n++] = p;
+  }
+  strokeDuplicates += points.size() - n;
+  points.resize(n);
+}
+
+Color
+Raster::getPixelColor(const wxPoint &p) {
+  /* Update buffer with new colors */
+  if (p.x >= width || p.y >= height)
+    return WHITE;
+
+  return Color::fromValue(Buffer[LOC(p.x, p.y, stride)]);
+}
+
+Pixel
+Raster::getPixel(const wxPoint &p) {
+  wxPoint _p(p.x, p.y);
+  return Pixel(getPixelColor(p), _p);
+}
+
+/*
+ * Resizes buffer. Copies over pixels
+ * from previous buffer into a temp
+ * buffer containing resizeWidth * resizeHeight
+ * pixels.
+ */
+void Raster::resize(unsigned int resizeWidth, unsigned int resizeHeight) {
+  uint32_t *tempBuff = newBuffer(resizeWidth, resizeHeight);
+  if (tempBuff == NULL)
+    return;
+  size_t resizeStride = strideFor(resizeWidth);
+
+  uint32_t *src, *dst;
+  size_t size = MIN(width, resizeWidth);
+  int i, _height = MIN(height, resizeHeight);
+  for (i=0; i < _height; i++) {
+    if (!checkpoint(i, _height)) {
+      free(tempBuff);
+      return;
+    }
+    src = Buffer + LOC(0, i, stride);
+    dst = tempBuff + LOC(0, i, resizeStride);
+
+    copySpan<Rgba32, Rgba32>(src, dst, size);
+  }
+
+  freeBuffer();
+  width = resizeWidth;
+  height = resizeHeight;
+  stride = resizeStride;
+  Buffer = tempBuff;
+  modified.assign((height + TILE_ROWS - 1) / TILE_ROWS, 1);
+  regions.reset(width, height, TILE_ROWS);
+
+  /* Keyframes are all of the old size; a resize is an
+   * edit, so there is no going forward past it either */
+  dropFuture();
+  resetKeyframes();
+  if (journal != NULL)
+    journal->resize(width, height);
+
+  /* Dimensions changed, old dirty region is meaningless */
+  isDirty = false;
+}
+
+/*
+ * Grow the dirty region to include (x, y) and flag its tile.
+ * Called for every pixel written to Buffer.
+ */
+inline void Raster::markDirty(int x, int y) {
+  modified[y / TILE_ROWS] = 1;
+  baseChanged[y / TILE_ROWS] = 1;
+  regions.touch(y / TILE_ROWS);
+  if (!isDirty) {
+    dirtyMin = wxPoint(x, y);
+    dirtyMax = wxPoint(x, y);
+    isDirty = true;
+    return;
+  }
+  dirtyMin.x = MIN(dirtyMin.x, x);
+  dirtyMin.y = MIN(dirtyMin.y, y);
+  dirtyMax.x = MAX(dirtyMax.x, x);
+  dirtyMax.y = MAX(dirtyMax.y, y);
+}
+
+void Raster::updateBuffer(const Pixel &p) {
+  /* Update buffer with new colors */
+  if ((unsigned int)p.x >= width || (unsigned int)p.y >= height)
+    return;
+
+  markDirty(p.x, p.y);
+  pixelsWritten++;
+  Buffer[LOC(p.x, p.y, stride)] = p.color.value();
+}
+
+void Raster::updateBuffer(const std::vector<wxPoint> &points,
+                          const Color &color) {
+  if (isParallel(points.size())) {
+    writeBands(points.size(), [&points, &color](size_t i) {
+      return Pixel(color, points[i]);
+    });
+    return;
+  }
+
+  Pixel p;
+  int i;
+  for (i=0; i<points.size(); i++) {
+    p = Pixel(color, points[i]);
+    updateBuffer(p);
+  }
+}
+
+bool Raster::selectAll(Transaction &txn) {
+  clearSelection();
+
+  selectionArea.resize(width*height);
+  wxPoint tl, br;
+  tl = wxPoint(0, 0);
+  br = wxPoint(width-1, height-1); 
+  selectionBorder = drawRectangle(tl, br, 1);
+  int i;
+  for (i=0; i<selectionBorder.size(); i++) {
+    wxPoint p = selectionBorder[i];
+    selectTxn.update(getPixel(p));
+  }
+
+  int x, y;
+  for (y=0; y<height; y++) {
+    if (!checkpoint(y, height)) {
+      abandonSelection(txn);
+      return false;
+    }
+    for (x=0; x<width; x++) {
+      wxPoint p(x,y);
+      Color prev_c = getPixelColor(p); /* prev color */
+      Pixel pixel = Pixel(prev_c, p);
+      txn.update(pixel);
+
+      selectionArea[y*width + x] = pixel;
+    }
+  }
+
+  updateBuffer(
+    makeDashed(selectionBorder),
+    SELECT);
+  selection = new RectangleSelection(tl, br);
+  selectBackgrnd.insert(txn);
+  whiteoutSelect = true;
+  selected = true;
+  toolType = SlctRect;
+  return true;
+}
+
+bool Raster::clearSelectedArea(Transaction &txn, Color c) {
+  if (!selected) {
+    return false;
+  }
+
+  MaskSelection *mask = maskSelection();
+  if (mask != NULL)
+    return clearMask(*mask, txn, c);
+
+  wxPoint p; 
+  Pixel pixel, _pixel;
+  int i;
+  for (i=0; i<selectionArea.size(); i++) {
+    if (i % JOB_CHECKPOINT_INTERVAL == 0
+        && !checkpoint(i, selectionArea.size())) {
+      revertTransaction(txn);
+      txn.pixels.clear();
+      return false;
+    }
+    pixel = selectionArea[i];
+    p = wxPoint(pixel.x, pixel.y);
+
+    _pixel = Pixel(c, p);
+    txn.update(pixel);
+    updateBuffer(_pixel);
+  }
+
+  return true;
+}
+
+/*
+ * Delete for the magic wand: the mask's pixels go into a
+ * ChangeMask, their old colours in row order, which is also
+ * the order of the border's in selectTxn. The border is
+ * cleared with the rest, so it is no longer selectTxn's to
+ * restore.
+ */
+bool Raster::clearMask(const MaskSelection &mask, Transaction &txn,
+    Color c) {
+  ChangeMask &changes = txn.changes;
+  changes.x = mask.minX;
+  changes.y = mask.minY;
+  changes.width = mask.maxX - mask.minX + 1;
+  changes.height = mask.maxY - mask.minY + 1;
+  changes.words = (changes.width + 63) / 64;
+  changes.bits.assign(changes.words * changes.height, 0);
+  changes.before.clear();
+  changes.count = 0;
+
+  const uint32_t value = c.value();
+  size_t k = 0;
+  unsigned int r;
+  int x;
+  for (r=0; r < changes.height; r++) {
+    if (r % 64 == 0 && !checkpoint(r, changes.height)) {
+      changes.count = changes.before.size();
+      revertChanges(changes);
+      txn.clear();
+      updateBuffer(makeDashed(selectionBorder), SELECT);
+      return false;
+    }
+    int y = changes.y + r;
+    const unsigned char *m = &mask.mask[(size_t)y * width];
+    uint32_t *row = Buffer + (size_t)y * stride;
+    uint64_t *bits = &changes.bits[r * changes.words];
+    int x0 = -1, x1 = -1;
+    for (x=mask.minX; x <= mask.maxX; x++) {
+      if (!m[x])
+        continue;
+      uint32_t old = row[x];
+      if (k < selectionBorder.size() && selectionBorder[k].x == x
+          && selectionBorder[k].y == y)
+        old = selectTxn.pixels[k++].color.value();
+      changes.before.push_back(old);
+      size_t bit = x - changes.x;
+      bits[bit / 64] |= (uint64_t)1 << (bit % 64);
+      row[x] = value;
+      if (x0 < 0)
+        x0 = x;
+      x1 = x;
+    }
+    if (x0 >= 0) {
+      markDirty(x0, y);
+      markDirty(x1, y);
+    }
+  }
+  changes.count = changes.before.size();
+  pixelsWritten += changes.count;
+
+  if (std::count(changes.before.begin(), changes.before.end(),
+        changes.before[0]) == (ptrdiff_t)changes.before.size()) {
+    uint32_t first = changes.before[0];
+    changes.before.assign(1, first);
+  }
+  selectTxn.clear();
+  selectionBorder.clear();
+  return true;
+}
+
+const std::vector<wxPoint> &
+Raster::drawFreeHand(const wxPoint &currPos, Transaction &txn, const int &_width)
+{
+  if (!isNewTxn) {
+    revertTransaction(currentTxn);
+  }
+
+  lerp(freehand, _width, strokePoints);
+  coverStroke(strokePoints);
+
+  updateTransaction(txn, strokePoints);
+  return strokePoints;
+}
+
+const std::vector<wxPoint> &
+Raster::drawCircle(const wxPoint &currPos, Transaction &txn, const int &_width) {
+  /*
+   * Steps:
+   * (1) If not first transaction, delete previous transaction.
+   *     We must do this since we're constantly redrawing
+   *     the circle's trace as the user is "dragging" across
+   *     the screen 
+   * (2) Interpolate some points such that the interpolated
+   *     points form a circle by using distance b/w currPos
+   *     and startPos
+   * (3) Further interpolate by calling either linear or
+   *     polynomial interpolation on the sparse points to
+   *     generate the pixels
+   * (4) Write all previous buffer values to the txn
+   */  
+
+  // (1)
+  if (!isNewTxn) {
+    revertTransaction(currentTxn);
+  }
+
+  /*
+   * Steps for (2):
+   * (2a) Find diameter/radius
+   * (2b) Find center point
+   * (2c) Traverse around the circle by using center point
+   */
+  double radius = length(currPos, startPos)/2;
+  wxPoint c;
+  {
+    wxRealVec v; 
+    wxVec _v = currPos - startPos;
+    v = wxRealVec((double)_v.x, (double)_v.y);
+    v = normalize(v);
+
+    wxRealPoint _curr(startPos);
+    c = wxPoint(_curr + radius*v);
+  }
+
+  /*
+   * Number of samples depends on the circumference
+   * of the circle
+   */ 
+  path.clear();
+  {
+    wxRealPoint p;
+    wxRealVec _u; 
+    double _x, _y;
+    double _P = (2*M_PI) / (2*M_PI*radius);
+    double theta;
+    for (theta=0.0; theta<2*M_PI; theta+=_P) {
+      _x = cos(theta);
+      _y = sin(theta);
+      _u = normalize(wxRealVec(_x,_y)); // should be normal, but..
+
+      p = wxRealPoint(c) + radius*_u;
+      path.push_back(wxPoint(p));
+    }
+  }
+
+  // (3)
+  lerp(path, _width, strokePoints);
+  coverStroke(strokePoints);
+
+  // (4)
+  updateTransaction(txn, strokePoints);
+  return strokePoints;
+}
+
+const std::vector<wxPoint> &
+Raster::drawLine(const wxPoint &currPos, Transaction &txn, const int &_width) {
+  /*
+   * Steps:
+   * (1) If isNewTxn, revert
+   * (2) Interpolate line from startPos to currPos
+   */
+  if (!isNewTxn) {
+    revertTransaction(currentTxn);
+  } 
+
+  lerp(startPos, currPos, _width, strokePoints);
+  coverStroke(strokePoints);
+  updateTransaction(txn, strokePoints);
+
+  return strokePoints;
+}
+
+/* First covered x in [x, to), or 'to'; skips 8 at a time */
+static inline int coverageRun(const unsigned char *mask, int x, int to) {
+  uint64_t word;
+  while (x + 8 <= to) {
+    memcpy(&word, mask + x, sizeof(word));
+    if (word != 0)
+      break;
+    x += 8;
+  }
+  while (x < to && mask[x] == 0)
+    x++;
+  return x;
+}
+
+/*
+ * Anti-aliased version of the drawing tools: the same shape
+ * as coverage instead of a list of points, blended into the
+ * buffer a row at a time. Only pixels the blend actually
+ * changed go into 'txn'.
+ */
+void Raster::drawSoft(const wxPoint &currPos, Transaction &txn) {
+  if (!isNewTxn) {
+    revertTransaction(currentTxn);
+  }
+
+  coverage.setBrush(thiccness, softness);
+  path.clear();
+  switch (toolType) {
+    case Pencil:
+    case Eraser:
+      coverage.polyline(freehand, width, height);
+      break;
+    case Line:
+      path.push_back(startPos);
+      path.push_back(currPos);
+      coverage.polyline(path, width, height);
+      break;
+    case DrawRect:
+      path.push_back(startPos);
+      path.push_back(wxPoint(currPos.x, startPos.y));
+      path.push_back(currPos);
+      path.push_back(wxPoint(startPos.x, currPos.y));
+      path.push_back(startPos);
+      coverage.polyline(path, width, height);
+      break;
+    case DrawCircle: {
+      /* Same circle as drawCircle(), without the rounding */
+      wxRealPoint centre((startPos.x + currPos.x) / 2.0,
+          (startPos.y + currPos.y) / 2.0);
+      coverage.ring(centre, length(currPos, startPos) / 2, width, height);
+      break;
+    }
+    default:
+      return;
+  }
+
+  int y, x, from, to;
+  const unsigned char *mask;
+  for (y=coverage.getTop(); y < coverage.getBottom(); y++) {
+    if (!coverage.row(y, from, to, mask))
+      continue;
+    uint32_t *row = Buffer + LOC(0, y, stride);
+    int first = -1, last = -1;
+
+    /* Thin strokes leave long uncovered gaps inside a row's
+     * extent, so blend only the covered runs */
+    int start = coverageRun(mask, from, to), end;
+    for (; start < to; start = coverageRun(mask, end, to)) {
+      for (end=start + 1; end < to && mask[end] != 0; end++);
+
+      under.assign(row + start, row + end);
+      if (toolType == Eraser)
+        eraseMaskSpan<Rgba32>(row + start, mask + start, end - start);
+      else
+        blendMaskSpan<Rgba32>(row + start, mask + start, end - start, color);
+
+      for (x=start; x < end; x++) {
+        uint32_t old = under[x - start];
+        if (row[x] == old)
+          continue;
+        txn.update(Pixel(Color::fromValue(old), wxPoint(x, y)));
+        if (first < 0)
+          first = x;
+        last = x;
+        pixelsWritten++;
+      }
+    }
+    if (first >= 0) {
+      markDirty(first, y);
+      markDirty(last, y);
+    }
+  }
+}
+
+/* Set bits [b0, b1) of 'bits', a word at a time */
+static inline void setBits(uint64_t *bits, size_t b0, size_t b1) {
+  while (b0 < b1) {
+    size_t n = MIN(b1 - b0, 64 - b0 % 64);
+    bits[b0 / 64] |= n == 64 ? ~(uint64_t)0
+      : (((uint64_t)1 << n) - 1) << (b0 % 64);
+    b0 += n;
+  }
+}
+
+void
+Raster::fill(const wxPoint &p, const Color &color, Transaction &txn) {
+  /*
+   * Steps:
+   * (1) From given point 'p', scanline fill every pixel
+   *     connected to it whose color is the same as 'p', or
+   *     within 'tolerance' of it.
+   * (2) Update given Transaction 'txn' with all filled
+   *     pixels, a run at a time.
+   */
+  if ((unsigned int)p.x >= width || (unsigned int)p.y >= height)
+    return;
+
+  Color c = getPixelColor(p);
+  if (tolerance <= 0 && c == color) {
+    return;
+  }
+
+  const uint32_t value = Rgba32::pack(color);
+  size_t unchecked = JOB_CHECKPOINT_INTERVAL;
+  auto filled = [&](unsigned int y, unsigned int x0, unsigned int x1) {
+    markDirty(x0, y);
+    markDirty(x1 - 1, y);
+    pixelsWritten += x1 - x0;
+
+    /* The filled area is unknown up front, the
+     * canvas size bounds it */
+    unchecked += x1 - x0;
+    if (unchecked < JOB_CHECKPOINT_INTERVAL)
+      return true;
+    unchecked = 0;
+    return checkpoint(txn.pixels.size() + txn.changes.count,
+        (size_t)width*height);
+  };
+
+  bool done;
+  if (tolerance > 0) {
+    /* Pixels differ, so each keeps its own colour to undo to */
+    ColorMatch match = { c, tolerance, distance };
+    done = toleranceFill<Rgba32>(Buffer, stride, width, height, p.x, p.y,
+        match, fillMask,
+        [&](unsigned int y, unsigned int x0, unsigned int x1) {
+          uint32_t *row = Buffer + (size_t)y*stride;
+          unsigned int x;
+          for (x=x0; x < x1; x++) {
+            txn.update(Pixel(Rgba32::unpack(row[x]), wxPoint(x, y)));
+          }
+          SpanFill<Rgba32>::run(row + x0, x1 - x0, value);
+          return filled(y, x0, x1);
+        });
+  } else if (indexRegions) {
+    /* The component comes from the index whole. Its pixels
+     * were all 'c', so like replaceColor() the transaction
+     * keeps a ChangeMask over its bounds with one old colour,
+     * and each run is a span write; the index stays as it is */
+    done = regions.search(Buffer, stride, p.x, p.y);
+    if (done) {
+      unsigned int bx0 = width, by0 = height, bx1 = 0, by1 = 0;
+      regions.forEach(
+          [&](unsigned int y, unsigned int x0, unsigned int x1) {
+            bx0 = MIN(bx0, x0);
+            bx1 = MAX(bx1, x1);
+            by0 = MIN(by0, y);
+            by1 = MAX(by1, y + 1);
+            return true;
+          });
+
+      ChangeMask &changes = txn.changes;
+      changes.x = bx0;
+      changes.y = by0;
+      changes.width = bx1 - bx0;
+      changes.height = by1 - by0;
+      changes.words = (changes.width + 63) / 64;
+      changes.bits.assign(changes.words * changes.height, 0);
+      changes.before.assign(1, c.value());
+      changes.count = 0;
+      done = regions.forEach(
+          [&](unsigned int y, unsigned int x0, unsigned int x1) {
+            setBits(&changes.bits[(y - by0) * changes.words],
+                x0 - bx0, x1 - bx0);
+            changes.count += x1 - x0;
+            SpanFill<Rgba32>::run(Buffer + (size_t)y*stride + x0, x1 - x0,
+                value);
+            return filled(y, x0, x1);
+          });
+    }
+    if (done)
+      regions.recolor(value);
+  } else {
+    done = floodFill<Rgba32>(Buffer, stride, width, height, p.x, p.y, value,
+        [&](unsigned int y, unsigned int x0, unsigned int x1) {
+          unsigned int x;
+          for (x=x0; x < x1; x++) {
+            txn.update(Pixel(c, wxPoint(x, y)));
+          }
+          return filled(y, x0, x1);
+        });
+  }
+  if (!done) {
+    revertTransaction(txn);
+    txn.pixels.clear();
+    txn.changes.clear();
+  }
+}
+
+std::vector<wxPoint>
+Raster::drawRectangle(const wxPoint &tl, const wxPoint &br, const int &w)
+{
+  /* 
+   * tl
+   * p3                              p2
+   * |-------------------------------|
+   * |                               |
+   * |                               | 
+   * |-------------------------------|
+   * p0                              p1
+   *                                 br
+   */
+  std::vector<wxPoint> path;
+
+  /* Closed, so the brush goes round the corners in one go */
+  path.push_back(wxPoint(tl.x, br.y));
+  path.push_back(wxPoint(br.x, br.y));
+  path.push_back(wxPoint(br.x, tl.y));
+  path.push_back(wxPoint(tl.x, tl.y));
+  path.push_back(path[0]);
+
+  return lerp(path, w);
+}
+
+const std::vector<wxPoint> &
+Raster::drawRectangle(const wxPoint &p1, Transaction &txn, const int &_width)
+{
+  /*
+   * Approach:
+   * 1. If isNewTxn is FALSE (i.e. user previously moved the mouse) then
+   *    revert the current Transaction
+   * 2. Get the pixels to fill in by performing linear interpolation on each
+   *    pair of coordinates on the rectangle
+   *      <x0, y0> -> <x1, y1>, <x0, y0> -> <x0, y1>
+   *      <x1, y0> -> <x1, y1>, <x1, y1> -> <x1, y0>
+   * 3. Update currentTxn to include all points from 2.
+   * 4. Return the points
+   */
+  // (1)
+  if (!isNewTxn) {
+    revertTransaction(currentTxn);
+  }
+
+  // (2)
+  {
+    wxPoint p2 = wxPoint(startPos.x, p1.y);
+    wxPoint p3 = wxPoint(p1.x, startPos.y);
+
+    path.clear();
+    path.push_back(startPos);
+    path.push_back(p3);
+    path.push_back(p1);
+    path.push_back(p2);
+    path.push_back(startPos);
+    lerp(path, _width, strokePoints);
+    coverStroke(strokePoints);
+  }
+
+  updateTransaction(txn, strokePoints);
+  return strokePoints;
+}
+
+/*
+ * Used for generating Selection Border
+ * - Given a border, remove points on the border
+ */
+const std::vector<wxPoint> &
+Raster::makeDashed(const std::vector<wxPoint> &border)
+{
+  dashed.clear();
+  int i;
+  for (i=0; i < border.size()-5; i++) {
+    if (i % 8 == 0) {
+      if (i+5 >= border.size()) {
+        break;
+      }
+      dashed.insert(
+          dashed.end(),
+          border.begin() + i,
+          border.begin() + i + 5);
+    }
+  }
+  return dashed;
+}
+
+void printPixels(std::vector<Pixel> pixels) {
+  int i;
+  Pixel p;
+  for (i=0; i < pixels.size(); i++) {
+    p = pixels[i];
+    printf("pixel: (%d, %d) (%d %d %d %d)\n",
+        p.x,
+        p.y,
+        p.color.r,
+        p.color.g,
+        p.color.b,
+        p.color.a);
+  }
+}
+
+/*
+ * Reset all selection related fields
+ */
+void Raster::clearSelection() {
+  selected = false;
+  wandPicked = false;
+  whiteoutSelect = true;
+  selectionArea.clear();
+  selectionBorder.clear();
+  regions.setWrites(RegionIndex::WRITES_RESTORE);
+  revertTransaction(selectTxn);
+  regions.setWrites(RegionIndex::WRITES_EDIT);
+  selectTxn.pixels.clear();
+  selectBackgrnd.pixels.clear();
+  if (selection != NULL) {
+    delete selection;
+    selection = NULL;
+  }
+}
+
+void
+Raster::handleSelectionClick(wxPoint &pt)
+{
+  if (!selected || selection == NULL) {
+    return;
+  }
+  if (!selection->isWithinBounds(pt)) {
+    clearSelection();
+  }
+}
+
+/*
+ * Functions to set the selection area
+ * based on the Selection object.
+ * One function for each type of selection.
+ */
+void
+Raster::getSelectionArea(
+    std::vector<Pixel> &area,
+    RectangleSelection *selection)
+{
+  /*
+   * The width and height of the selection
+   * should include the pixels occupied
+   * by the selection border
+   */
+  int _width = (selection->maxX - selection->minX);
+  int _height = (selection->maxY - selection->minY);
+  area.resize(_width * _height);
+
+  int startX = selection->minX + 1;
+  int startY = selection->minY + 1;
+  int endX = startX + _width;
+  int endY = startY + _height;
+
+  /* Set the selectionArea pixels */
+  int i, j, k=0;
+  Pixel p;
+  wxPoint pt;
+  for (i=startX; i < endX; i++) {
+    for (j=startY; j < endY; j++) {
+      pt = wxPoint(i, j);
+      p = getPixel(pt);
+      area[k] = p;
+      k++;
+    }
+  }
+}
+
+void
+Raster::getSelectionArea(
+    std::vector<Pixel> &selectionArea,
+    CircleSelection *selection)
+{
+  wxPoint c = selection->_c;
+  double r = selection->_r;
+
+  int minX, maxX, minY, maxY;
+  minX = selection->minX;
+  maxX = selection->maxX;
+  minY = selection->minY;
+  maxY = selection->maxY;
+
+  int x, y;
+  wxPoint pt;
+  for (x=minX; x < maxX; x++) {
+    for (y=minY; y < maxY; y++) {
+      pt = wxPoint(x, y);
+      if (squaredLength(pt, c) < r*r) {
+        selectionArea.push_back(getPixel(pt));
+      }
+    }
+  }
+
+}
+
+void
+Raster::getSelectionArea(
+    std::vector<Pixel> &selectionArea,
+    LassoSelection *selection)
+{
+  int minX, maxX, minY, maxY;
+  minX = selection->minX;
+  maxX = selection->maxX;
+  minY = selection->minY;
+  maxY = selection->maxY;
+
+  int x, y;
+  wxPoint pt;
+  for (x=minX+1; x < maxX; x++) {
+    for (y=minY+1; y < maxY; y++) {
+      pt = wxPoint(x, y);
+      if (selection->isWithinBounds(pt)) {
+        selectionArea.push_back(getPixel(pt));
+      }
+    }
+  }
+}
+
+/*
+ * Handles mouseMove event for selection tools
+ * Takes in a "drawBorder" parameter which points to one
+ * of: drawRectangle(), drawCircle(), or drawFreehand()
+ * depending on the tool type.
+ */
+void
+Raster::handleSelectionMove(const wxPoint &currPos,
+  const std::vector<wxPoint> &(Raster::*drawBorder)(const wxPoint&, Transaction &, const int&))
+{
+  /*
+   * Two cases to consider:
+   * 1. User hasn't made a selection
+   *    - Have to draw the selection border
+   * 2. User has a selection
+   *    - Have to move the selected pixels to the
+   *      new position
+   */
+  Transaction &txn = spareTxn;
+  txn.clear();
+  if (!selected) {
+    if (!isNewTxn)
+      revertTransaction(currentTxn);
+
+    selectionBorder = (this->*drawBorder)(currPos, txn, 1);
+    updateBuffer(
+        makeDashed(selectionBorder),
+        SELECT);
+
+    selectTxn = txn;
+    std::swap(currentTxn, txn);
+  }
+  else {
+    int xOffset = currPos.x - startPos.x;
+    int yOffset = currPos.y - startPos.y;
+    move(selectionArea, xOffset, yOffset, txn);
+    std::swap(currentTxn, txn);
+  }
+}
+
+void
+Raster::handleSelectionRelease(const wxPoint &p0, const wxPoint &p1)
+{
+  /*
+   * Two cases to consider:
+   * 1. User has not made a selection yet
+   *      The release action will complete the selection
+   *      process and define the selectionArea.
+   * 2. User has a selection already
+   *      Clear the selection.
+   */
+  if (selected) {
+    clearSelection();
+  }
+  else {
+    /*
+     * Selection area provided by the getSelectionArea()
+     * functions don't include the border pixels because
+     * when we reach this function, the bordr pixels
+     * will no longer have the original colours but the
+     * SELECT colour as the border is already rendered.
+     * We get the border pixels from the selectTxn
+     * because selectTxn has the original colours.
+     */
+    std::vector<wxPoint> interp = lerp(p0, p1, 1);
+    switch (toolType) {
+      case SlctRect:
+        selection = new RectangleSelection(p0, p1);
+        getSelectionArea(selectionArea,
+            dynamic_cast<RectangleSelection *>(selection));
+        break;
+      case SlctCircle:
+        selection = new CircleSelection(p0, p1);
+        getSelectionArea(selectionArea,
+            dynamic_cast<CircleSelection *>(selection));
+        break;
+      case Lasso:
+        /*
+         * Have to connect the start and end mouse
+         * positions to create a closed polygon shape.
+         * Since the border is changed, we also
+         * have to update selectTxn which is in charge
+         * of reverting the border once the user
+         * completes translation (on mouse release).
+         */
+        selectionBorder.insert(selectionBorder.end(),
+            interp.begin(), interp.end());
+        updateTransaction(selectTxn, interp);
+        selection = new LassoSelection(p0, p1, selectionBorder);
+        getSelectionArea(selectionArea,
+            dynamic_cast<LassoSelection *>(selection));
+        break;
+      default:
+        break;
+    }
+    selectionArea.insert(selectionArea.end(),
+        selectTxn.pixels.begin(),
+        selectTxn.pixels.end());
+    selected = true;
+  }
+}
+
+void Raster::setRegionIndex(bool on) {
+  indexRegions = on;
+  if (!on)
+    regions.release();
+}
+
+MaskSelection *Raster::maskSelection() {
+  if (!selected)
+    return NULL;
+  return dynamic_cast<MaskSelection *>(selection);
+}
+
+/*
+ * Magic wand: select the region connected to 'p' within
+ * 'tolerance' of its colour. toleranceFill() hands over the
+ * region a span at a time, straight into the mask; no list
+ * of pixels is made. The border is the mask's edge, its
+ * colours kept in selectTxn like every selection border's.
+ */
+bool Raster::selectRegion(const wxPoint &p) {
+  clearSelection();
+  if ((unsigned int)p.x >= width || (unsigned int)p.y >= height)
+    return false;
+
+  MaskSelection *mask = new MaskSelection(width, height);
+  size_t found = 0, unchecked = 0;
+  auto picked = [&](unsigned int y, unsigned int x0, unsigned int x1) {
+    mask->add(y, x0, x1);
+    found += x1 - x0;
+    unchecked += x1 - x0;
+    if (unchecked < JOB_CHECKPOINT_INTERVAL)
+      return true;
+    unchecked = 0;
+    return checkpoint(found, (size_t)width*height);
+  };
+
+  bool done;
+  if (tolerance <= 0 && indexRegions) {
+    done = regions.search(Buffer, stride, p.x, p.y)
+      && regions.forEach(picked);
+  } else {
+    ColorMatch match = { getPixelColor(p), tolerance, distance };
+    done = toleranceFill<Rgba32>(Buffer, stride, width, height, p.x, p.y,
+        match, fillMask, picked);
+  }
+  if (!done) {
+    delete mask;
+    return false;
+  }
+
+  selection = mask;
+  mask->getBorder(selectionBorder);
+  updateTransaction(selectTxn, selectionBorder);
+  regions.setWrites(RegionIndex::WRITES_OVERLAY);
+  updateBuffer(
+    makeDashed(selectionBorder),
+    SELECT);
+  regions.setWrites(RegionIndex::WRITES_EDIT);
+  whiteoutSelect = true;
+  selected = true;
+  return true;
+}
+
+/*
+ * move() lifts the selection a pixel at a time, so a drag
+ * of the wand's selection lists it in selectionArea first:
+ * the mask less its border, then the border's colours from
+ * selectTxn.
+ */
+void Raster::listSelection() {
+  MaskSelection *mask = maskSelection();
+  if (mask == NULL || !selectionArea.empty())
+    return;
+
+  size_t i;
+  for (i=0; i < selectionBorder.size(); i++) {
+    const wxPoint &b = selectionBorder[i];
+    mask->mask[(size_t)b.y * width + b.x] = 2;
+  }
+  int x, y;
+  for (y=mask->minY; y <= mask->maxY; y++) {
+    const unsigned char *m = &mask->mask[(size_t)y * width];
+    const uint32_t *row = Buffer + (size_t)y * stride;
+    for (x=mask->minX; x <= mask->maxX; x++) {
+      if (m[x] == 1)
+        selectionArea.push_back(
+            Pixel(Rgba32::unpack(row[x]), wxPoint(x, y)));
+    }
+  }
+  for (i=0; i < selectionBorder.size(); i++) {
+    const wxPoint &b = selectionBorder[i];
+    mask->mask[(size_t)b.y * width + b.x] = 1;
+  }
+  selectionArea.insert(selectionArea.end(),
+      selectTxn.pixels.begin(),
+      selectTxn.pixels.end());
+}
+
+void
+Raster::move(
+    const std::vector<Pixel> &pixels,
+    const int &xOffset, const int &yOffset,
+    Transaction &txn)
+{
+  /*
+   * Step:
+   * 1. Save all pixels (the original selection, and the new
+   *    translaged pixels). This has to be done first in case
+   *    there is overlap between the original selection and
+   *    the new position.
+   * 2. White out selection (should include border pixels)
+   * 3. Translate the selection area
+   * 4. Save border pixels to selectTxn (required
+   *      for mouseRelease event - have to revert
+   *      the border)
+   * 5. Redraw border
+   */
+  if (!isNewTxn) {
+    revertTransaction(currentTxn);
+  }
+
+  // (1) Save all pixels (original and translated)
+  {
+    int i;
+    Pixel pixel, translatedPix;
+    wxPoint oldPt, newPt;
+    for (i=0; i < selectionArea.size(); i++) {
+      pixel = selectionArea[i];
+
+      newPt = wxPoint(pixel.x + xOffset, pixel.y + yOffset);
+      oldPt = wxPoint(pixel.x, pixel.y);
+      translatedPix = Pixel(getPixelColor(newPt), newPt);
+      txn.update(pixel);
+      txn.update(translatedPix);
+    }
+  }
+
+  // (2) Option 1: whiteout pixels
+  //     Option 2: restore pixels to what's 'underneath'
+  {
+    if (whiteoutSelect) {
+      int i;
+      wxPoint oldPt, newPt;
+      Pixel pixel, whitePixel, oldPixel;
+      for (i=0; i < selectionArea.size(); i++) {
+        pixel = selectionArea[i];
+        oldPt = wxPoint(pixel.x, pixel.y);
+        whitePixel = Pixel(Color(255, 255, 255), oldPt);
+        updateBuffer(whitePixel);
+      }
+    } else {
+      revertTransaction(selectBackgrnd);
+    }
+  }
+
+  // (3) translate the selection
+  {
+    int i;
+    wxPoint newPt;
+    Color clr;
+    Pixel pixel, newPixel, p;
+    for (i=0; i < selectionArea.size(); i++) {
+      pixel = selectionArea[i];
+      clr = pixel.color;
+
+      newPt = wxPoint(
+          pixel.x + xOffset,
+          pixel.y + yOffset);
+      newPixel = Pixel(clr, newPt);
+
+      updateBuffer(newPixel);
+    }
+  }
+
+  // (4-5) Save border pixels to select txn, draw border
+  {
+    int i;
+    wxPoint pt, newPt;
+    path.resize(selectionBorder.size());
+
+    for (i=0; i < selectionBorder.size(); i++) {
+      pt = selectionBorder[i];
+      newPt = wxPoint(pt.x + xOffset, pt.y + yOffset);
+      selectTxn.pixels[i] = Pixel(getPixelColor(newPt), newPt);
+      path[i] = newPt;
+    }
+
+    /* draw border */
+    updateBuffer(makeDashed(path), SELECT);
+  }
+}
\ No newline at end of file
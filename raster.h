@@ -0,0 +1,507 @@
+#ifndef PAINT_RASTER_H
+#define PAINT_RASTER_H
+
+/*
+ * Headless raster engine.
+ *
+ * Owns the pixel buffer, the transaction history and
+ * every drawing/selection tool. It only depends on the
+ * wx geometry types (wxPoint, wxRect) and never touches
+ * a window, DC or the clipboard, so it builds and runs
+ * without a display (benchmarks, replays, batch jobs).
+ *
+ * Canvas is a thin adapter on top of this: it turns wx
+ * events into the input entry points below and paints
+ * getBuffer() to the screen.
+ */
+#include <wx/gdicmn.h>
+
+#include <stdint.h>
+#include <functional>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "transaction.h"
+#include "pixel.h"
+#include "selection.h"
+#include "coverage.h"
+#include "format.h"
+#include "regions.h"
+
+class JobControl;
+class ThreadPool;
+class Journal;
+
+enum ToolType
+{
+  Pencil,
+  Line,
+  DrawRect,
+  DrawCircle,
+  Eraser,
+  Fill,
+  SlctRect,
+  SlctCircle,
+  Lasso,
+  MagicWand,
+  ToolCount
+};
+
+/* Rows handed to an image import/export at a time */
+#define IMAGE_ROWS 64
+
+/* Granularity of the modified-region tracking used by
+ * incremental saves: full-width bands of this many rows */
+#define TILE_ROWS 64
+
+/* History steps between two keyframes: the most
+ * transactions a jump ever has to revert */
+#define KEYFRAME_INTERVAL 32
+
+/* History steps behind the one shown that idle packing
+ * leaves alone, so that plain undo never has to inflate */
+#define HISTORY_HOT_STEPS 64
+
+/* Rows are padded to a multiple of this many pixels so
+ * that every row starts on a 16-byte boundary */
+#define PIXEL_ALIGN 4
+
+extern Color WHITE;
+extern Color SELECT;
+
+/* What the eraser leaves behind: white at zero opacity */
+extern Color ERASED;
+
+/*
+ * Image streaming: 'count' rows starting at row 'y', top
+ * to bottom, one Color value per pixel and 'stride'
+ * pixels from one row to the next. Return false to abort
+ * (bad file, I/O error).
+ */
+typedef std::function<bool(uint32_t *rows, size_t stride,
+    unsigned int y, unsigned int count)> RowSource;
+typedef std::function<bool(const uint32_t *rows, size_t stride,
+    unsigned int y, unsigned int count)> RowSink;
+
+class Raster {
+  /* Microbenchmarks drive the private kernels directly */
+  friend class RasterBench;
+
+  private:
+    /* In pixels; 'stride' is the padded row length */
+    unsigned int width;
+    unsigned int height;
+    size_t stride;
+
+    /* The mouse position where the user first
+     * clicked the left mouse button*/
+    wxPoint startPos;
+
+    /* Holds the transaction currently
+     * taking place.
+     * There should only be ONE txn occuring
+     * at a time */
+    bool isNewTxn;
+    Transaction currentTxn;
+    Transaction selectTxn;
+    Transaction selectBackgrnd;
+
+    /* The selection border's own colours while hideOverlay()
+     * has the ones under it in the buffer */
+    std::vector<uint32_t> overlayScratch;
+
+    /* Selection tool fields */
+    bool whiteoutSelect = true;
+    bool selected = false;
+    std::vector<Pixel> selectionArea;
+    std::vector<wxPoint> selectionBorder;
+    Selection *selection = NULL;
+
+    /* The magic wand's selection was made by the press now
+     * under way, which its release keeps */
+    bool wandPicked = false;
+
+    /* Sampled points for freehand */
+    std::vector<wxPoint> freehand;
+
+    /*
+     * Per-stroke buffers, reused from one motion event to the
+     * next so that a stroke stops allocating once they have
+     * grown to its size: the drawing tools' outline and
+     * pixels, a selection border's dashes, and the storage of
+     * the transaction currentTxn last replaced.
+     */
+    std::vector<wxPoint> path;
+    std::vector<wxPoint> strokePoints;
+    std::vector<wxPoint> dashed;
+    Transaction spareTxn;
+
+    /* What one row band wrote, merged after the parallel pass */
+    struct Band {
+      bool isDirty;
+      wxPoint dirtyMin;
+      wxPoint dirtyMax;
+      uint64_t written;
+    };
+
+    /* Per-chunk, per-band pixel lists of writeBands(), and
+     * what each band wrote */
+    std::vector<std::vector<uint32_t> > bandLists;
+    std::vector<Band> bandState;
+
+    /* Pixels already in the stroke being drawn, marked with
+     * 'strokeGen' so that the map never needs clearing */
+    std::vector<unsigned char> strokeMask;
+    unsigned char strokeGen = 0;
+
+    /* Anti-aliased strokes: the stroke's coverage, and the
+     * row under it before blending */
+    Coverage coverage;
+    std::vector<uint32_t> under;
+
+    /* What a tolerance fill has left to fill, see toleranceFill() */
+    std::vector<unsigned char> fillMask;
+
+    /* Components by tile, for exact fills and wand selects
+     * when 'indexRegions' is set */
+    bool indexRegions = false;
+    RegionIndex regions;
+
+    /* The selection as a bit mask, for replaceColor() */
+    std::vector<uint64_t> replaceAllow;
+
+    /* This is the main buffer: Color values, row major,
+     * 'stride' per row, 16-byte aligned. 'release' frees
+     * it if it didn't come from newBuffer(). */
+    uint32_t *Buffer;
+    void (*release)(uint32_t *buffer, size_t size) = NULL;
+
+    /* History held deflated, and what it takes up inflated.
+     * Ahead of the history so that they outlive it. */
+    uint64_t packedBytes = 0;
+    uint64_t packedRawBytes = 0;
+
+    /*
+     * History: transactions[0, applied) are on the canvas,
+     * the rest were jumped back over and stay reachable
+     * until the next commit drops them.
+     *
+     * Every KEYFRAME_INTERVAL steps, and at the newest step
+     * once it is left, the canvas is kept as a keyframe of
+     * TILE_ROWS bands. Bands that did not change since the
+     * previous keyframe are shared with it. A jump restores
+     * the nearest keyframe at or past its target and reverts
+     * the transactions in between.
+     */
+    struct KeyTile {
+      /* 'count' pixels, in 'pixels' or deflated in 'packed' */
+      Raster *raster;
+      size_t count;
+      std::vector<uint32_t> pixels;
+      std::vector<unsigned char> packed;
+
+      /* Takes what it packed off the raster's counters */
+      ~KeyTile();
+    };
+    typedef std::shared_ptr<KeyTile> Tile;
+    struct Keyframe {
+      std::vector<Tile> tiles;
+    };
+    std::vector<Transaction> transactions;
+    size_t applied = 0;
+    std::map<size_t, Keyframe> keyframes;
+
+    /* The bands of the last keyframe taken or restored, and
+     * which of them were written since */
+    std::vector<Tile> baseTiles;
+    std::vector<unsigned char> baseChanged;
+
+    /*
+     * Idle packing: transactions before 'packFrom', and the
+     * keyframes before 'packKeyFrom' plus the first 'packTile'
+     * bands of the next one, have been looked at. Unpacking
+     * or a new keyframe moves them back.
+     */
+    size_t packFrom = 0;
+    size_t packKeyFrom = 0;
+    size_t packTile = 0;
+    std::vector<unsigned char> packScratch;
+    std::vector<uint32_t> tileScratch;
+
+    /* Bounding box of the pixels written since the
+     * last call to takeDirty() */
+    bool isDirty = false;
+    wxPoint dirtyMin;
+    wxPoint dirtyMax;
+
+    /* One flag per TILE_ROWS band written since the
+     * last clearModified() */
+    std::vector<unsigned char> modified;
+
+    /* Running totals for instrumentation */
+    uint64_t pixelsWritten = 0;
+    uint64_t undoBytes = 0;
+    uint64_t strokeDuplicates = 0;
+
+    /* Set while a heavy operation runs on a Worker */
+    JobControl *job = NULL;
+
+    /* Splits large pixel writes into row bands, NULL is serial */
+    ThreadPool *pool = NULL;
+
+    /* Gets every commit, undo and resize; NULL for none */
+    Journal *journal = NULL;
+
+    /*
+     * Private functions
+     */
+    Pixel getPixel(const wxPoint &p);
+    Color getPixelColor(const wxPoint &p);
+
+    inline void markDirty(int x, int y);
+    void markModified(int y0, int y1);
+    void freeBuffer();
+    void resetKeyframes();
+    void dropFuture();
+    void captureKeyframe(size_t step);
+    void restoreKeyframe(const Keyframe &key);
+    void unpack(size_t step);
+    void forgetPacked(const Transaction &txn);
+    bool checkpoint(size_t done, size_t total);
+    void preview();
+    void abandonSelection(Transaction &txn);
+
+    void updateBuffer(const std::vector<wxPoint> &points, const Color &color);
+    void updateBuffer(const Pixel &p);
+    void addTransaction(Transaction &txn);
+    void revertTransaction(Transaction &txn);
+    void updateTransaction(Transaction &txn, const std::vector<wxPoint> &points);
+    void coverStroke(std::vector<wxPoint> &points);
+
+    bool isParallel(size_t count) const;
+    template <typename Source>
+    void writeBands(size_t count, const Source &source);
+    size_t splitBands(size_t rows, size_t count, size_t &bandHeight) const;
+    static void touchRow(Band &band, const uint64_t *bits, size_t words,
+        int x, int y);
+    void foldBands(size_t bands);
+
+    bool selectAll(Transaction &txn);
+    bool clearSelectedArea(Transaction &txn, Color c);
+    bool clearMask(const MaskSelection &mask, Transaction &txn, Color c);
+
+    const std::vector<wxPoint> &drawFreeHand(const wxPoint &currPos, Transaction &txn, const int &_width);
+    const std::vector<wxPoint> &drawRectangle(const wxPoint &currPos, Transaction &txn, const int &_width);
+    std::vector<wxPoint> drawRectangle(const wxPoint &tl, const wxPoint &br, const int &_width);
+    const std::vector<wxPoint> &drawCircle(const wxPoint &currPos, Transaction &txn, const int &_width);
+    const std::vector<wxPoint> &drawLine(const wxPoint &currPos, Transaction &txn, const int &_width);
+    void drawSoft(const wxPoint &currPos, Transaction &txn);
+    void fill(const wxPoint &p, const Color &color, Transaction &txn);
+    void replaceColor(const wxPoint &p, const Color &color, Transaction &txn);
+    void revertChanges(const ChangeMask &changes);
+
+    void clearSelection();
+
+    void getSelectionArea(std::vector<Pixel> &area, RectangleSelection *selection);
+    void getSelectionArea(std::vector<Pixel> &area, CircleSelection *selection);
+    void getSelectionArea(std::vector<Pixel> &area, LassoSelection *selection);
+
+    const std::vector<wxPoint> &makeDashed(const std::vector<wxPoint> &border);
+    void handleSelectionClick(wxPoint &pt);
+    void handleSelectionMove(const wxPoint &currPos,
+         const std::vector<wxPoint> &(Raster::*drawBorder)(const wxPoint&, Transaction &, const int&));
+    void handleSelectionRelease(const wxPoint &p0, const wxPoint &p1);
+
+    /* Magic wand: select the region around 'p' within
+     * 'tolerance' of its colour, as a MaskSelection */
+    MaskSelection *maskSelection();
+    bool selectRegion(const wxPoint &p);
+    void listSelection();
+
+    void move(const std::vector<Pixel> &pixels,
+        const int &xOffset, const int &yOffset, Transaction &txn);
+
+public:
+    Raster(unsigned int width, unsigned int height);
+    ~Raster();
+
+    ToolType toolType;
+
+    /* The colour selected by the user */
+    Color color;
+
+    /* Line thickness for drawing tools */
+    int thiccness;
+
+    /* Anti-alias drawing tools, with edges 'softness' percent
+     * of the brush radius wide (0 is a one-pixel edge) */
+    bool antialias;
+    int softness;
+
+    /* Fill pixels up to 'tolerance' away from the clicked
+     * colour, measured by 'distance'; 0 fills exact matches */
+    int tolerance;
+    ColorDistance distance;
+
+    /* Fill the region connected to the click; false replaces
+     * the colour everywhere (in the selection, if any) */
+    bool contiguous;
+
+    /* Look up exact fills and wand selects in a region index
+     * kept across clicks; off frees it */
+    void setRegionIndex(bool on);
+    inline bool hasRegionIndex() const { return indexRegions; }
+    inline const RegionIndex &getRegionIndex() const { return regions; }
+
+    inline unsigned int getWidth() const { return width; }
+    inline unsigned int getHeight() const { return height; }
+    inline size_t getStride() const { return stride; }
+    inline const uint32_t *getBuffer() const { return Buffer; }
+
+    /*
+     * Put the colours under the selection border (selectTxn)
+     * back in the buffer, then the border back over them.
+     * In between the buffer is the canvas without the
+     * selection, which is what the journal, documents and
+     * exports keep. Nothing is marked dirty.
+     */
+    void hideOverlay();
+    void showOverlay();
+
+    /* Row length in pixels for a canvas 'width' wide */
+    static inline size_t strideFor(unsigned int width) {
+      return ((size_t)width + PIXEL_ALIGN - 1) & ~(size_t)(PIXEL_ALIGN - 1);
+    }
+
+    /* A white canvas buffer for adopt(); NULL when out of memory */
+    static uint32_t *newBuffer(unsigned int width, unsigned int height);
+
+    /* False if any pixel is even partly transparent */
+    bool isOpaque() const;
+
+    /* Returns false if nothing was written since the last call */
+    bool takeDirty(wxRect &dirty);
+
+    inline uint64_t getPixelsWritten() const { return pixelsWritten; }
+    inline uint64_t getUndoBytes() const { return undoBytes; }
+
+    /* Stroke pixels dropped for being listed twice or off the
+     * canvas: each one a write and an undo entry saved */
+    inline uint64_t getStrokeDuplicates() const { return strokeDuplicates; }
+
+    /* History held deflated, and what it takes up inflated */
+    inline uint64_t getPackedBytes() const { return packedBytes; }
+    inline uint64_t getPackedRawBytes() const { return packedRawBytes; }
+
+    /*
+     * Fill, selectAll, paste, deleteSelection and resize
+     * poll 'job' for cancellation. A cancelled operation
+     * rolls its transaction back and leaves the buffer as
+     * it was. NULL (the default) never cancels.
+     */
+    inline void setJob(JobControl *job) { this->job = job; }
+
+    /*
+     * Rasterize large primitives on 'pool' (not owned).
+     * The buffer, history and dirty region come out
+     * bit-identical to a serial run.
+     */
+    inline void setPool(ThreadPool *pool) { this->pool = pool; }
+
+    /* Autosave every committed change to 'journal' (not owned) */
+    inline void setJournal(Journal *journal) { this->journal = journal; }
+    inline Journal *getJournal() const { return journal; }
+
+    /*
+     * Tiles (TILE_ROWS bands) written since the last
+     * clearModified(). Transient pixels count as well:
+     * selection borders, the stroke being drawn.
+     */
+    inline const std::vector<unsigned char> &getModified() const { return modified; }
+    void clearModified();
+
+    /*
+     * Replace the buffer with 'buffer', laid out like one
+     * from newBuffer() and freed through 'release' instead
+     * of free() (e.g. a mapped file).
+     * History, keyframes and selection are dropped, the
+     * whole canvas reports dirty and nothing is modified.
+     */
+    void adopt(uint32_t *buffer, unsigned int width, unsigned int height,
+        void (*release)(uint32_t *buffer, size_t size));
+
+    /*
+     * Replace the canvas with a width x height image read
+     * from 'source', straight into the new buffer. Rows show
+     * up as they arrive when a Worker runs this as a job. If
+     * the source fails or the job is cancelled the canvas is
+     * left as it was and false is returned; otherwise it is
+     * adopted like a new buffer.
+     */
+    bool import(unsigned int width, unsigned int height, const RowSource &source);
+
+    /* Hand the buffer to 'sink', 'rows' at a time. False if
+     * the sink failed or the job was cancelled. */
+    bool exportImage(const RowSink &sink, unsigned int rows = IMAGE_ROWS);
+
+    /* Committed transactions, oldest first. Only the first
+     * getHistoryStep() are on the canvas, see jumpTo(). */
+    inline const std::vector<Transaction> &getHistory() const { return transactions; }
+    inline size_t getHistoryStep() const { return applied; }
+    void setHistory(std::vector<Transaction> &history);
+
+    /*
+     * Show the canvas as it was after the first 'step'
+     * transactions (0 is before any), backwards or forwards
+     * again up to the newest one. Drops the selection. The
+     * next commit forgets the transactions past 'step'.
+     * Costs one keyframe restore and fewer than
+     * KEYFRAME_INTERVAL reverts. False if there is no such
+     * step. Not to be called in the middle of a stroke.
+     */
+    bool jumpTo(size_t step);
+
+    /*
+     * One step of idle work: deflate one transaction, or one
+     * keyframe band no recent keyframe shares, from more
+     * than HISTORY_HOT_STEPS before the step shown. False
+     * once there is nothing left to pack. Jumps inflate what
+     * they reach again.
+     */
+    bool packHistory();
+
+    /* Journal recovery: write 'after' and commit 'before' */
+    void applyCommit(Transaction &before, const std::vector<Pixel> &after);
+
+    /* FNV-1a hash of the pixels, for replay/batch verification.
+     * Opaque pixels hash as their RGB bytes only, so hashes
+     * recorded before the alpha channel still match. */
+    uint64_t hash() const;
+
+    /* Pointer input, in canvas coordinates */
+    void mouseDown(const wxPoint &p);
+    void mouseMoved(const wxPoint &p);
+    void mouseReleased(const wxPoint &p);
+
+    /* Several motion samples rasterized in one pass */
+    void mouseMoved(const std::vector<wxPoint> &samples);
+
+    /* Keyboard commands; undo is a jump one step back */
+    bool undo();
+    void selectAll();
+    bool deleteSelection();
+
+    /*
+     * Clipboard payloads. The caller owns the
+     * clipboard itself; the engine only consumes and
+     * produces raw packed RGB (+ optional alpha) images.
+     */
+    bool paste(const unsigned char *data, const unsigned char *alpha,
+        unsigned int M, unsigned int N);
+    bool copy(unsigned char **data, unsigned char **alpha, int &M, int &N);
+
+    void resize(unsigned int width, unsigned int height);
+};
+
+#endif //PAINT_RASTER_H
@@ -0,0 +1,358 @@
+#include <wx/gdicmn.h>
+
+#include <string.h>
+
+#include "recorder.h"
+
+/* Large buffer: recording must not stall input handling */
+#define RECORD_BUFFER_SIZE (1 << 16)
+
+/************** Recorder ****************/
+Recorder::~Recorder() {
+  if (file != NULL)
+    fclose(file);
+}
+
+bool Recorder::open(const char *path, unsigned int width, unsigned int height) {
+  file = fopen(path, "wb");
+  if (file == NULL)
+    return false;
+
+  setvbuf(file, NULL, _IOFBF, RECORD_BUFFER_SIZE);
+  fwrite(RECORD_MAGIC, 1, 4, file);
+  putByte(RECORD_VERSION);
+  putVarint(width);
+  putVarint(height);
+
+  last = wxPoint(0, 0);
+  prev = std::chrono::steady_clock::now();
+  return true;
+}
+
+/*
+ * Write the final buffer hash and close the file.
+ * Nothing is recorded afterwards.
+ */
+void Recorder::finish(const Raster &raster) {
+  if (file == NULL)
+    return;
+
+  begin(REC_END);
+  uint64_t hash = raster.hash();
+  int i;
+  for (i=0; i < 8; i++) {
+    putByte((hash >> (8*i)) & 0xff);
+  }
+  putVarint(raster.getWidth());
+  putVarint(raster.getHeight());
+
+  fclose(file);
+  file = NULL;
+}
+
+void Recorder::putByte(unsigned char b) {
+  putc(b, file);
+}
+
+void Recorder::putVarint(uint64_t v) {
+  while (v >= 0x80) {
+    putByte((v & 0x7f) | 0x80);
+    v >>= 7;
+  }
+  putByte(v);
+}
+
+void Recorder::putSigned(int64_t v) {
+  putVarint(((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+void Recorder::putPoint(const wxPoint &p) {
+  putSigned(p.x - last.x);
+  putSigned(p.y - last.y);
+  last = p;
+}
+
+/* Record header: type and time since the previous record */
+void Recorder::begin(RecordType type) {
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  putByte(type);
+  putVarint(std::chrono::duration_cast<std::chrono::microseconds>(
+        now - prev).count());
+  prev = now;
+}
+
+void Recorder::mouseDown(const wxPoint &p) {
+  if (file == NULL)
+    return;
+  begin(REC_MOUSE_DOWN);
+  putPoint(p);
+}
+
+void Recorder::mouseMoved(const wxPoint &p) {
+  if (file == NULL)
+    return;
+  begin(REC_MOUSE_MOVE);
+  putPoint(p);
+}
+
+void Recorder::mouseReleased(const wxPoint &p) {
+  if (file == NULL)
+    return;
+  begin(REC_MOUSE_UP);
+  putPoint(p);
+}
+
+void Recorder::keyDown(int key, bool ctrl) {
+  if (file == NULL)
+    return;
+  begin(REC_KEY_DOWN);
+  putVarint(key);
+  putByte(ctrl ? 1 : 0);
+}
+
+void Recorder::keyUp(int key) {
+  if (file == NULL)
+    return;
+  begin(REC_KEY_UP);
+  putVarint(key);
+}
+
+void Recorder::tool(ToolType tool) {
+  if (file == NULL)
+    return;
+  begin(REC_TOOL);
+  putByte(tool);
+}
+
+void Recorder::color(const Color &color) {
+  if (file == NULL)
+    return;
+  begin(REC_COLOR);
+  putByte(color.r);
+  putByte(color.g);
+  putByte(color.b);
+}
+
+void Recorder::thiccness(int thiccness) {
+  if (file == NULL)
+    return;
+  begin(REC_THICC);
+  putVarint(thiccness);
+}
+
+void Recorder::brush(bool antialias, int softness) {
+  if (file == NULL)
+    return;
+  begin(REC_BRUSH);
+  putByte(antialias);
+  putVarint(softness);
+}
+
+void Recorder::jump(size_t step) {
+  if (file == NULL)
+    return;
+  begin(REC_JUMP);
+  putVarint(step);
+}
+
+void Recorder::tolerance(int tolerance, ColorDistance distance) {
+  if (file == NULL)
+    return;
+  begin(REC_TOLERANCE);
+  putVarint(tolerance);
+  putByte(distance);
+}
+
+void Recorder::contiguous(bool contiguous) {
+  if (file == NULL)
+    return;
+  begin(REC_CONTIGUOUS);
+  putByte(contiguous);
+}
+
+void Recorder::clipboard(const std::vector<unsigned char> &rgb,
+    const std::vector<unsigned char> &alpha,
+    unsigned int M, unsigned int N) {
+  if (file == NULL)
+    return;
+  begin(REC_CLIPBOARD);
+  putVarint(M);
+  putVarint(N);
+  putByte(alpha.empty() ? 0 : 1);
+  fwrite(&rgb[0], 1, 3*M*N, file);
+  if (!alpha.empty())
+    fwrite(&alpha[0], 1, M*N, file);
+}
+
+void Recorder::cancel() {
+  if (file == NULL)
+    return;
+  begin(REC_CANCEL);
+}
+
+/************** RecordReader ****************/
+RecordReader::~RecordReader() {
+  if (file != NULL)
+    fclose(file);
+}
+
+bool RecordReader::open(const char *path,
+    unsigned int &width, unsigned int &height) {
+  file = fopen(path, "rb");
+  if (file == NULL)
+    return false;
+
+  setvbuf(file, NULL, _IOFBF, RECORD_BUFFER_SIZE);
+  char magic[4];
+  unsigned char version;
+  uint64_t w, h;
+  if (fread(magic, 1, 4, file) != 4 || memcmp(magic, RECORD_MAGIC, 4) != 0
+      || !getByte(version) || version < 1 || version > RECORD_VERSION
+      || !getVarint(w) || !getVarint(h))
+    return false;
+
+  width = w;
+  height = h;
+  last = wxPoint(0, 0);
+  time = 0;
+  return true;
+}
+
+bool RecordReader::getByte(unsigned char &b) {
+  int c = getc(file);
+  if (c == EOF)
+    return false;
+  b = c;
+  return true;
+}
+
+bool RecordReader::getVarint(uint64_t &v) {
+  unsigned char b;
+  int shift = 0;
+  v = 0;
+  do {
+    if (!getByte(b) || shift > 63)
+      return false;
+    v |= (uint64_t)(b & 0x7f) << shift;
+    shift += 7;
+  } while (b & 0x80);
+  return true;
+}
+
+bool RecordReader::getSigned(int64_t &v) {
+  uint64_t u;
+  if (!getVarint(u))
+    return false;
+  v = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+  return true;
+}
+
+bool RecordReader::getPoint(wxPoint &p) {
+  int64_t dx, dy;
+  if (!getSigned(dx) || !getSigned(dy))
+    return false;
+  p = wxPoint(last.x + dx, last.y + dy);
+  last = p;
+  return true;
+}
+
+bool RecordReader::next(Record &rec) {
+  unsigned char type, b;
+  uint64_t dt, v, w;
+  if (!getByte(type) || !getVarint(dt))
+    return false;
+
+  time += dt;
+  rec.type = (RecordType)type;
+  rec.time = time;
+
+  switch (rec.type) {
+    case REC_MOUSE_DOWN:
+    case REC_MOUSE_MOVE:
+    case REC_MOUSE_UP:
+      return getPoint(rec.p);
+    case REC_KEY_DOWN:
+      if (!getVarint(v) || !getByte(b))
+        return false;
+      rec.key = v;
+      rec.ctrl = b != 0;
+      return true;
+    case REC_KEY_UP:
+      if (!getVarint(v))
+        return false;
+      rec.key = v;
+      return true;
+    case REC_TOOL:
+      if (!getByte(b))
+        return false;
+      rec.tool = (ToolType)b;
+      return true;
+    case REC_COLOR:
+      {
+        unsigned char r, g;
+        if (!getByte(r) || !getByte(g) || !getByte(b))
+          return false;
+        rec.color = Color(r, g, b);
+      }
+      return true;
+    case REC_THICC:
+      if (!getVarint(v))
+        return false;
+      rec.thiccness = v;
+      return true;
+    case REC_BRUSH:
+      if (!getByte(b) || !getVarint(v))
+        return false;
+      rec.antialias = b != 0;
+      rec.softness = v;
+      return true;
+    case REC_JUMP:
+      if (!getVarint(v))
+        return false;
+      rec.step = v;
+      return true;
+    case REC_TOLERANCE:
+      if (!getVarint(v) || !getByte(b))
+        return false;
+      rec.tolerance = v;
+      rec.distance = (ColorDistance)b;
+      return true;
+    case REC_CONTIGUOUS:
+      if (!getByte(b))
+        return false;
+      rec.contiguous = b != 0;
+      return true;
+    case REC_CLIPBOARD:
+      if (!getVarint(v) || !getVarint(w) || !getByte(b))
+        return false;
+      rec.M = v;
+      rec.N = w;
+      rec.rgb.resize(3*rec.M*rec.N);
+      rec.alpha.resize(b ? rec.M*rec.N : 0);
+      if (fread(&rec.rgb[0], 1, rec.rgb.size(), file) != rec.rgb.size())
+        return false;
+      if (b && fread(&rec.alpha[0], 1, rec.alpha.size(), file)
+          != rec.alpha.size())
+        return false;
+      return true;
+    case REC_CANCEL:
+      return true;
+    case REC_END:
+      {
+        int i;
+        rec.hash = 0;
+        for (i=0; i < 8; i++) {
+          if (!getByte(b))
+            return false;
+          rec.hash |= (uint64_t)b << (8*i);
+        }
+        if (!getVarint(v) || !getVarint(w))
+          return false;
+        rec.width = v;
+        rec.height = w;
+      }
+      return true;
+    default:
+      return false;
+  }
+}
@@ -0,0 +1,146 @@
+#ifndef PAINT_RECORDER_H
+#define PAINT_RECORDER_H
+
+/*
+ * Input recording for deterministic replays.
+ *
+ * A recording is the raw input stream seen by Controller
+ * plus the tool/colour/thickness changes and any clipboard
+ * image that was pasted. It ends with a hash of the final
+ * buffer so a replay can check it produced the same pixels.
+ *
+ * File layout (all integers are LEB128 varints, signed
+ * values zigzag encoded):
+ *
+ *   "PREC" u8 version  width  height
+ *   { u8 type  dt_us  payload }*
+ *
+ *   MOUSE_*    dx dy            (relative to the previous point)
+ *   KEY_DOWN   key u8 ctrl
+ *   KEY_UP     key
+ *   TOOL       u8 tool
+ *   COLOR      u8 r u8 g u8 b
+ *   THICC      thiccness
+ *   CLIPBOARD  M N u8 hasAlpha rgb[3*M*N] [alpha[M*N]]
+ *   CANCEL                      (the job started by the previous
+ *                                record was cancelled, version 2+)
+ *   BRUSH      u8 antialias softness        (version 3+)
+ *   JUMP       step                         (version 4+)
+ *   TOLERANCE  tolerance u8 distance        (version 5+)
+ *   CONTIGUOUS u8 contiguous                (version 6+)
+ *   END        u64 hash  width height
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <chrono>
+#include <vector>
+
+#include "raster.h"
+
+#define RECORD_MAGIC "PREC"
+#define RECORD_VERSION 6
+
+enum RecordType
+{
+  REC_MOUSE_DOWN = 1,
+  REC_MOUSE_MOVE,
+  REC_MOUSE_UP,
+  REC_KEY_DOWN,
+  REC_KEY_UP,
+  REC_TOOL,
+  REC_COLOR,
+  REC_THICC,
+  REC_CLIPBOARD,
+  REC_END,
+  REC_CANCEL,
+  REC_BRUSH,
+  REC_JUMP,
+  REC_TOLERANCE,
+  REC_CONTIGUOUS
+};
+
+/* One decoded record. Only the fields for 'type' are set. */
+struct Record {
+  RecordType type;
+  uint64_t time; /* microseconds since the recording started */
+
+  wxPoint p;
+  int key;
+  bool ctrl;
+  ToolType tool;
+  Color color;
+  int thiccness;
+  bool antialias;
+  int softness;
+  size_t step;
+  int tolerance;
+  ColorDistance distance;
+  bool contiguous;
+
+  std::vector<unsigned char> rgb;
+  std::vector<unsigned char> alpha;
+  unsigned int M;
+  unsigned int N;
+
+  uint64_t hash;
+  unsigned int width;
+  unsigned int height;
+};
+
+class Recorder {
+  private:
+    FILE *file = NULL;
+    wxPoint last;
+    std::chrono::steady_clock::time_point prev;
+
+    void begin(RecordType type);
+    void putByte(unsigned char b);
+    void putVarint(uint64_t v);
+    void putSigned(int64_t v);
+    void putPoint(const wxPoint &p);
+
+  public:
+    ~Recorder();
+
+    bool open(const char *path, unsigned int width, unsigned int height);
+    void finish(const Raster &raster);
+
+    void mouseDown(const wxPoint &p);
+    void mouseMoved(const wxPoint &p);
+    void mouseReleased(const wxPoint &p);
+    void keyDown(int key, bool ctrl);
+    void keyUp(int key);
+    void tool(ToolType tool);
+    void color(const Color &color);
+    void thiccness(int thiccness);
+    void brush(bool antialias, int softness);
+    void jump(size_t step);
+    void tolerance(int tolerance, ColorDistance distance);
+    void contiguous(bool contiguous);
+    void clipboard(const std::vector<unsigned char> &rgb,
+        const std::vector<unsigned char> &alpha,
+        unsigned int M, unsigned int N);
+    void cancel();
+};
+
+class RecordReader {
+  private:
+    FILE *file = NULL;
+    wxPoint last;
+    uint64_t time = 0;
+
+    bool getByte(unsigned char &b);
+    bool getVarint(uint64_t &v);
+    bool getSigned(int64_t &v);
+    bool getPoint(wxPoint &p);
+
+  public:
+    ~RecordReader();
+
+    bool open(const char *path, unsigned int &width, unsigned int &height);
+
+    /* Returns false at end of file or on a truncated record */
+    bool next(Record &rec);
+};
+
+#endif //PAINT_RECORDER_H
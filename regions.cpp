@@ -0,0 +1,315 @@
+#include <chrono>
+
+#include "regions.h"
+
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+/************** RegionIndex ****************/
+size_t RegionIndex::Tile::bytes() const {
+  return runs.capacity() * sizeof(Run)
+    + (labelStart.capacity() + colors.capacity() + adjStart.capacity()
+        + adj.capacity() + byRow.capacity() + rowStart.capacity()
+        + seen.capacity()) * sizeof(uint32_t);
+}
+
+void RegionIndex::reset(unsigned int width, unsigned int height,
+    unsigned int rows) {
+  this->width = width;
+  this->height = height;
+  tileRows = MAX(rows, 1u);
+  tiles.clear();
+  tiles.resize((height + tileRows - 1) / tileRows);
+  found.clear();
+  bytes = 0;
+}
+
+void RegionIndex::release() {
+  size_t t;
+  for (t=0; t < tiles.size(); t++) {
+    tiles[t] = Tile();
+  }
+  std::vector<Run>().swap(scratch);
+  std::vector<uint32_t>().swap(parent);
+  std::vector<std::pair<uint32_t, uint32_t> >().swap(edges);
+  found.clear();
+  bytes = 0;
+}
+
+void RegionIndex::setWrites(Writes writes) {
+  /* Covered tiles read the same as when built again */
+  if (this->writes == WRITES_RESTORE) {
+    size_t t;
+    for (t=0; t < tiles.size(); t++) {
+      tiles[t].covered = false;
+    }
+  }
+  this->writes = writes;
+}
+
+uint32_t RegionIndex::find(uint32_t i) {
+  while (parent[i] != i) {
+    parent[i] = parent[parent[i]];
+    i = parent[i];
+  }
+  return i;
+}
+
+/*
+ * (1) Cut each row into runs of one colour, kept in
+ *     'scratch' with the colour in 'label' for now.
+ * (2) Join same-coloured runs that overlap the run above,
+ *     walking both rows' runs in x order, and note the
+ *     others as touching, with the runs beside each other.
+ *     The root of a set is its first run.
+ * (3) Number the sets in order of their first run, and
+ *     sort the runs by label, which keeps row order.
+ * (4) List the labels each label touches, once each.
+ */
+void RegionIndex::build(size_t t, const uint32_t *buffer, size_t stride) {
+  auto start = std::chrono::steady_clock::now();
+  Tile &tile = tiles[t];
+  unsigned int y0 = t * tileRows;
+  unsigned int rows = MIN(tileRows, height - y0);
+
+  // (1)
+  scratch.clear();
+  tile.rowStart.resize(rows + 1);
+  unsigned int r;
+  for (r=0; r < rows; r++) {
+    tile.rowStart[r] = scratch.size();
+    const uint32_t *row = buffer + (size_t)(y0 + r) * stride;
+    unsigned int x = 0;
+    while (x < width) {
+      uint32_t c = row[x];
+      unsigned int x1 = x + 1;
+      while (x1 < width && row[x1] == c) {
+        x1++;
+      }
+      Run run = { x, x1, r, c };
+      scratch.push_back(run);
+      x = x1;
+    }
+  }
+  uint32_t n = scratch.size();
+  tile.rowStart[rows] = n;
+
+  // (2)
+  parent.resize(n);
+  uint32_t i;
+  for (i=0; i < n; i++) {
+    parent[i] = i;
+  }
+  edges.clear();
+  for (r=0; r < rows; r++) {
+    for (i=tile.rowStart[r] + 1; i < tile.rowStart[r + 1]; i++) {
+      edges.push_back(std::make_pair(i - 1, i));
+    }
+  }
+  for (r=1; r < rows; r++) {
+    uint32_t a = tile.rowStart[r - 1], aEnd = tile.rowStart[r];
+    uint32_t b = tile.rowStart[r], bEnd = tile.rowStart[r + 1];
+    while (a < aEnd && b < bEnd) {
+      if (scratch[a].label == scratch[b].label) {
+        uint32_t ra = find(a), rb = find(b);
+        if (ra < rb)
+          parent[rb] = ra;
+        else if (rb < ra)
+          parent[ra] = rb;
+      } else {
+        edges.push_back(std::make_pair(a, b));
+      }
+      uint32_t ax = scratch[a].x1, bx = scratch[b].x1;
+      if (ax <= bx)
+        a++;
+      if (bx <= ax)
+        b++;
+    }
+  }
+
+  // (3)
+  /* A parent always comes before its runs, so in one pass
+   * in order each run's parent already points at the root,
+   * whose label is already set */
+  uint32_t labels = 0;
+  tile.colors.clear();
+  for (i=0; i < n; i++) {
+    if (parent[i] == i) {
+      tile.colors.push_back(scratch[i].label);
+      scratch[i].label = labels++;
+    } else {
+      parent[i] = parent[parent[i]];
+      scratch[i].label = scratch[parent[i]].label;
+    }
+  }
+  tile.labelStart.assign(labels + 1, 0);
+  for (i=0; i < n; i++) {
+    tile.labelStart[scratch[i].label + 1]++;
+  }
+  uint32_t l;
+  for (l=0; l < labels; l++) {
+    tile.labelStart[l + 1] += tile.labelStart[l];
+  }
+  tile.runs.resize(n);
+  tile.byRow.resize(n);
+  tile.seen.assign(labels, 0);
+  std::vector<uint32_t> &next = tile.seen;
+  for (i=0; i < n; i++) {
+    uint32_t label = scratch[i].label;
+    uint32_t at = tile.labelStart[label] + next[label]++;
+    tile.runs[at] = scratch[i];
+    tile.byRow[i] = at;
+  }
+  next.assign(labels, 0);
+
+  // (4)
+  /* Counted into place both ways round, then each label's
+   * list is deduplicated with 'seen' as the marks */
+  tile.adjStart.assign(labels + 1, 0);
+  size_t e;
+  for (e=0; e < edges.size(); e++) {
+    tile.adjStart[scratch[edges[e].first].label + 1]++;
+    tile.adjStart[scratch[edges[e].second].label + 1]++;
+  }
+  for (l=0; l < labels; l++) {
+    tile.adjStart[l + 1] += tile.adjStart[l];
+  }
+  tile.adj.resize(tile.adjStart[labels]);
+  for (e=0; e < edges.size(); e++) {
+    uint32_t a = scratch[edges[e].first].label;
+    uint32_t b = scratch[edges[e].second].label;
+    tile.adj[tile.adjStart[a] + next[a]++] = b;
+    tile.adj[tile.adjStart[b] + next[b]++] = a;
+  }
+  next.assign(labels, 0);
+  uint32_t kept = 0;
+  for (l=0; l < labels; l++) {
+    uint32_t k, from = tile.adjStart[l], end = tile.adjStart[l + 1];
+    tile.adjStart[l] = kept;
+    for (k=from; k < end; k++) {
+      uint32_t m = tile.adj[k];
+      if (next[m] == l + 1)
+        continue;
+      next[m] = l + 1;
+      tile.adj[kept++] = m;
+    }
+  }
+  tile.adjStart[labels] = kept;
+  tile.adj.resize(kept);
+  next.assign(labels, 0);
+  tile.stale = false;
+
+  bytes += tile.bytes();
+  tilesBuilt++;
+  buildNs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+inline RegionIndex::Tile &RegionIndex::fresh(size_t t,
+    const uint32_t *buffer, size_t stride) {
+  Tile &tile = tiles[t];
+  if (tile.stale) {
+    bytes -= tile.bytes();
+    build(t, buffer, stride);
+  }
+  return tile;
+}
+
+inline void RegionIndex::take(size_t t, uint32_t label) {
+  uint32_t &seen = tiles[t].seen[label];
+  if (seen == generation)
+    return;
+  seen = generation;
+  pending.push_back(std::make_pair((uint32_t)t, label));
+}
+
+/* Take the runs of tile t's 'row' under 'run' that have its colour */
+void RegionIndex::join(size_t t, uint32_t row, const Run &run,
+    uint32_t color, const uint32_t *buffer, size_t stride) {
+  Tile &tile = fresh(t, buffer, stride);
+  uint32_t lo = tile.rowStart[row], hi = tile.rowStart[row + 1];
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (tile.runs[tile.byRow[mid]].x1 <= run.x0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (; lo < tile.rowStart[row + 1]; lo++) {
+    const Run &other = tile.runs[tile.byRow[lo]];
+    if (other.x0 >= run.x1)
+      break;
+    if (tile.colors[other.label] == color)
+      take(t, other.label);
+  }
+}
+
+bool RegionIndex::search(const uint32_t *buffer, size_t stride,
+    unsigned int x, unsigned int y) {
+  found.clear();
+  if (x >= width || y >= height)
+    return false;
+
+  /* An overlay still on the canvas is part of it */
+  size_t t;
+  for (t=0; t < tiles.size(); t++) {
+    if (tiles[t].covered) {
+      tiles[t].stale = true;
+      tiles[t].covered = false;
+    }
+  }
+
+  /* Generations wrap after 2^32 searches */
+  if (++generation == 0) {
+    for (t=0; t < tiles.size(); t++) {
+      tiles[t].seen.assign(tiles[t].seen.size(), 0);
+    }
+    generation = 1;
+  }
+
+  t = y / tileRows;
+  Run point = { x, x + 1, 0, 0 };
+  join(t, y - t * tileRows, point,
+      buffer[(size_t)y * stride + x], buffer, stride);
+
+  while (!pending.empty()) {
+    std::pair<uint32_t, uint32_t> at = pending.back();
+    pending.pop_back();
+    found.push_back(at);
+
+    t = at.first;
+    const Tile &tile = tiles[t];
+    uint32_t label = at.second, color = tile.colors[label];
+    uint32_t first = tile.labelStart[label], end = tile.labelStart[label + 1];
+    uint32_t last = tile.rowStart.size() - 2;
+    uint32_t r;
+
+    for (r=tile.adjStart[label]; r < tile.adjStart[label + 1]; r++) {
+      if (tile.colors[tile.adj[r]] == color)
+        take(t, tile.adj[r]);
+    }
+
+    /* The label's runs on the tile's top and bottom rows
+     * lead into the tiles above and below */
+    if (t > 0) {
+      for (r=first; r < end && tile.runs[r].row == 0; r++) {
+        join(t - 1, tileRows - 1, tile.runs[r], color, buffer, stride);
+      }
+    }
+    if (t + 1 < tiles.size()) {
+      for (r=end; r > first && tile.runs[r - 1].row == last; r--) {
+        join(t + 1, 0, tile.runs[r - 1], color, buffer, stride);
+      }
+    }
+  }
+  return true;
+}
+
+void RegionIndex::recolor(uint32_t color) {
+  size_t i;
+  for (i=0; i < found.size(); i++) {
+    Tile &tile = tiles[found[i].first];
+    tile.colors[found[i].second] = color;
+    tile.stale = false;
+  }
+}
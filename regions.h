@@ -0,0 +1,173 @@
+#ifndef PAINT_REGIONS_H
+#define PAINT_REGIONS_H
+
+/*
+ * Connected-component index of the canvas.
+ *
+ * The canvas is cut into tiles of full rows. Each tile keeps
+ * its rows as runs of one colour, and labels them by
+ * component: same-coloured runs touching across a row edge
+ * in the tile share a label. Each label also lists the
+ * labels it touches, and regions that cross tiles are
+ * followed through the rows neighbouring tiles share. Once
+ * the tiles under a region are built, finding the region
+ * costs about one step per run, not per pixel.
+ *
+ * Components are 4-connected exact colour matches, the
+ * region floodFill() would fill. Edits only mark their
+ * tiles stale, and a stale tile is rebuilt the next time a
+ * search reaches it. A fill of a found region is the one
+ * exception: it recolours whole labels, so recolor() keeps
+ * its tiles as they are, and touching labels that now have
+ * the same colour are joined by the next search. The wand's
+ * selection border is the other: drawing it only covers its
+ * tiles, which the next search rebuilds if the border is
+ * still there, and taking it off uncovers them again.
+ */
+#include <stdint.h>
+#include <stddef.h>
+
+#include <utility>
+#include <vector>
+
+class RegionIndex {
+  public:
+    /* The kinds of write touch() is told of */
+    enum Writes {
+      WRITES_EDIT,    /* edits */
+      WRITES_OVERLAY, /* a border drawn over the canvas */
+      WRITES_RESTORE  /* the border taken off again */
+    };
+
+  private:
+    /* Pixels [x0, x1) of row 'row' of a tile */
+    struct Run {
+      uint32_t x0;
+      uint32_t x1;
+      uint32_t row;
+      uint32_t label;
+    };
+
+    struct Tile {
+      bool stale = true;
+
+      /* Built, then drawn over by an overlay */
+      bool covered = false;
+
+      /* Runs by label, in row order within each label:
+       * label l's are [labelStart[l], labelStart[l + 1]) */
+      std::vector<Run> runs;
+      std::vector<uint32_t> labelStart;
+      std::vector<uint32_t> colors; /* per label */
+
+      /* Labels touching label l: [adjStart[l], adjStart[l + 1]) */
+      std::vector<uint32_t> adjStart;
+      std::vector<uint32_t> adj;
+
+      /* Indices into 'runs' in row and x order: row r's
+       * are [rowStart[r], rowStart[r + 1]) */
+      std::vector<uint32_t> byRow;
+      std::vector<uint32_t> rowStart;
+
+      /* Search generation that last took each label */
+      std::vector<uint32_t> seen;
+
+      size_t bytes() const;
+    };
+
+    unsigned int width = 0;
+    unsigned int height = 0;
+    unsigned int tileRows = 1;
+    std::vector<Tile> tiles;
+    Writes writes = WRITES_EDIT;
+
+    /* Build scratch: a tile's runs in row order, and their
+     * union-find parents */
+    std::vector<Run> scratch;
+    std::vector<uint32_t> parent;
+
+    /* Build scratch: touching runs of different colours */
+    std::vector<std::pair<uint32_t, uint32_t> > edges;
+
+    /* The last search's (tile, label) pairs */
+    uint32_t generation = 0;
+    std::vector<std::pair<uint32_t, uint32_t> > found;
+    std::vector<std::pair<uint32_t, uint32_t> > pending;
+
+    uint64_t bytes = 0;
+    uint64_t tilesBuilt = 0;
+    uint64_t buildNs = 0;
+
+    void build(size_t t, const uint32_t *buffer, size_t stride);
+    inline Tile &fresh(size_t t, const uint32_t *buffer, size_t stride);
+    uint32_t find(uint32_t i);
+    inline void take(size_t t, uint32_t label);
+    void join(size_t t, uint32_t row, const Run &run, uint32_t color,
+        const uint32_t *buffer, size_t stride);
+
+  public:
+    /* A width x height canvas in tiles of 'rows' rows, none
+     * of them built */
+    void reset(unsigned int width, unsigned int height, unsigned int rows);
+
+    /* Free every tile's index, leaving them all stale */
+    void release();
+
+    /* Rows of tile 't' were written */
+    inline void touch(size_t t) {
+      Tile &tile = tiles[t];
+      if (writes == WRITES_EDIT)
+        tile.stale = true;
+      else if (writes == WRITES_OVERLAY)
+        tile.covered = tile.covered || !tile.stale;
+      else if (!tile.covered)
+        tile.stale = true;
+    }
+
+    /* Say what the writes that follow are. An overlay must
+     * be restored before anything else is drawn over it,
+     * and with the same pixels; edits in between are fine */
+    void setWrites(Writes writes);
+
+    /*
+     * Find the component of (x, y) on the canvas in 'buffer',
+     * building the stale tiles it reaches. The buffer must
+     * not change until its runs have been read back with
+     * forEach(). False when (x, y) is off the canvas.
+     */
+    bool search(const uint32_t *buffer, size_t stride,
+        unsigned int x, unsigned int y);
+
+    /* span(y, x0, x1) for each run of the last search, a
+     * tile at a time; stops at the first false */
+    template <typename Span>
+    bool forEach(const Span &span) const;
+
+    /* The last search's region was filled with 'color' and
+     * nothing else written since */
+    void recolor(uint32_t color);
+
+    /* Memory held by the index, and how many tile builds
+     * took how long so far */
+    inline uint64_t getBytes() const { return bytes; }
+    inline uint64_t getTilesBuilt() const { return tilesBuilt; }
+    inline uint64_t getBuildNs() const { return buildNs; }
+};
+
+template <typename Span>
+bool RegionIndex::forEach(const Span &span) const {
+  size_t i;
+  for (i=0; i < found.size(); i++) {
+    const Tile &tile = tiles[found[i].first];
+    unsigned int y0 = found[i].first * tileRows;
+    uint32_t label = found[i].second, r;
+    for (r=tile.labelStart[label]; r < tile.labelStart[label + 1]; r++) {
+      const Run &run = tile.runs[r];
+      if (!span(y0 + run.row, run.x0, run.x1))
+        return false;
+    }
+  }
+  return true;
+}
+
+#endif
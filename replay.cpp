@@ -0,0 +1,166 @@
+/*
+ * Headless replayer for input recordings (paint --record).
+ *
+ *   ./build/replay session.rec
+ *
+ * Re-executes the recorded stream through the same
+ * Controller/Raster code path the GUI uses, prints
+ * per-event-type latency and checks that the final
+ * buffer hash matches the one stored in the recording.
+ *
+ * Exit status: 0 on match, 1 on mismatch, 2 if the file
+ * can't be read or has no END record.
+ */
+#include <wx/gdicmn.h>
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "raster.h"
+#include "controller.h"
+#include "recorder.h"
+#include "worker.h"
+
+static const char *EVENT_NAMES[] = {
+  "", "mouseDown", "mouseMoved", "mouseReleased", "keyDown", "keyUp"
+};
+
+static void report(const char *name, std::vector<double> &ns) {
+  if (ns.empty())
+    return;
+
+  std::sort(ns.begin(), ns.end());
+  double total = 0;
+  size_t i;
+  for (i=0; i < ns.size(); i++) {
+    total += ns[i];
+  }
+  printf("%-14s %8zu %10.1f %10.1f %10.1f %10.1f\n", name, ns.size(),
+      total / ns.size() / 1000,
+      ns[ns.size() / 2] / 1000,
+      ns[std::min(ns.size() - 1, ns.size() * 99 / 100)] / 1000,
+      ns.back() / 1000);
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <recording>\n", argv[0]);
+    return 2;
+  }
+
+  RecordReader reader;
+  unsigned int width, height;
+  if (!reader.open(argv[1], width, height)) {
+    fprintf(stderr, "%s: not a recording\n", argv[1]);
+    return 2;
+  }
+
+  Raster raster(width, height);
+  MemoryClipboard clipboard;
+  Controller controller(&raster, &clipboard);
+
+  /* Latencies in ns, indexed by RecordType */
+  std::vector<double> latency[REC_KEY_UP + 1];
+  bool ended = false;
+  Record rec, ahead;
+  uint64_t duration = 0;
+  bool hasAhead = reader.next(ahead);
+  while (!ended && hasAhead) {
+    std::swap(rec, ahead);
+    hasAhead = reader.next(ahead);
+    duration = rec.time;
+
+    /*
+     * A job cancelled during the session is replayed
+     * pre-cancelled: it rolls back at its first checkpoint,
+     * which leaves the same pixels as a later cancel.
+     */
+    JobControl control;
+    if (hasAhead && ahead.type == REC_CANCEL) {
+      control.cancel();
+      raster.setJob(&control);
+    }
+
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    switch (rec.type) {
+      case REC_MOUSE_DOWN:
+        controller.mouseDown(rec.p);
+        break;
+      case REC_MOUSE_MOVE:
+        controller.mouseMoved(rec.p);
+        break;
+      case REC_MOUSE_UP:
+        controller.mouseReleased(rec.p);
+        break;
+      case REC_KEY_DOWN:
+        controller.keyDown(rec.key, rec.ctrl);
+        break;
+      case REC_KEY_UP:
+        controller.keyUp(rec.key);
+        break;
+      case REC_TOOL:
+        controller.setTool(rec.tool);
+        break;
+      case REC_COLOR:
+        controller.setColor(rec.color);
+        break;
+      case REC_THICC:
+        controller.setThiccness(rec.thiccness);
+        break;
+      case REC_BRUSH:
+        controller.setBrush(rec.antialias, rec.softness);
+        break;
+      case REC_TOLERANCE:
+        controller.setTolerance(rec.tolerance, rec.distance);
+        break;
+      case REC_CONTIGUOUS:
+        controller.setContiguous(rec.contiguous);
+        break;
+      case REC_JUMP:
+        controller.jumpTo(rec.step);
+        break;
+      case REC_CLIPBOARD:
+        clipboard.rgb.swap(rec.rgb);
+        clipboard.alpha.swap(rec.alpha);
+        clipboard.M = rec.M;
+        clipboard.N = rec.N;
+        break;
+      case REC_CANCEL:
+        break;
+      case REC_END:
+        ended = true;
+        break;
+    }
+    std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+    raster.setJob(NULL);
+
+    if (rec.type <= REC_KEY_UP) {
+      latency[rec.type].push_back(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+    }
+  }
+
+  printf("recorded session: %.3f s, canvas %ux%u\n",
+      duration / 1e6, width, height);
+  printf("%-14s %8s %10s %10s %10s %10s\n",
+      "event", "count", "mean_us", "p50_us", "p99_us", "max_us");
+  int t;
+  for (t=REC_MOUSE_DOWN; t <= REC_KEY_UP; t++) {
+    report(EVENT_NAMES[t], latency[t]);
+  }
+
+  if (!ended) {
+    fprintf(stderr, "recording has no END record (truncated?)\n");
+    return 2;
+  }
+
+  uint64_t hash = raster.hash();
+  bool match = hash == rec.hash
+    && raster.getWidth() == rec.width && raster.getHeight() == rec.height;
+  printf("buffer hash: recorded %016" PRIx64 " replayed %016" PRIx64 " %s\n",
+      rec.hash, hash, match ? "OK" : "MISMATCH");
+  return match ? 0 : 1;
+}
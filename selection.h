@@ -6,6 +6,8 @@
 #define PAINT_SELECTION_H
 
 #include <limits>
+#include <string.h>
+#include <stdint.h>
 
 #include "pixel.h"
 #include "helper.h"
@@ -26,6 +28,9 @@ public:
 
   inline virtual bool isWithinBounds(wxPoint &point);
 
+  /* Deleted through the base, and some own storage */
+  inline virtual ~Selection() {}
+
   inline int getHeight() {
     return (int)(maxY - minY) + 1;
   }
@@ -38,7 +43,7 @@ public:
 /*
  * Derived classes
  * One for each type of selection:
- *    Rectangle, Circle, Lasso (freehand)
+ *    Rectangle, Circle, Lasso (freehand), Mask (magic wand)
  * Each class contains shape specific
  * information about the selection.
  * As per above, all classes override
@@ -73,6 +78,29 @@ public:
   inline bool isWithinBounds(wxPoint &point);
 };
 
+/*
+ * Any set of pixels, as a byte per canvas pixel (1 inside),
+ * built a span at a time by the magic wand. The bounds
+ * grow with the spans; an empty mask has minX > maxX.
+ */
+class MaskSelection : public Selection {
+public:
+  unsigned int width;
+  unsigned int height;
+  std::vector<unsigned char> mask;
+  size_t count; /* pixels set */
+
+  inline MaskSelection(unsigned int width, unsigned int height);
+
+  /* Set [x0, x1) of row y, none of it set yet */
+  inline void add(unsigned int y, unsigned int x0, unsigned int x1);
+
+  inline bool isWithinBounds(wxPoint &point);
+
+  /* The pixels with a side on the outside, in row order */
+  inline void getBorder(std::vector<wxPoint> &border);
+};
+
 /************** Selection ****************/
 /* Never actually used, just return true */
 inline bool Selection::isWithinBounds(wxPoint &point) {
@@ -162,4 +190,76 @@ inline bool LassoSelection::isWithinBounds(wxPoint &point) {
   return c;
 }
 
+/************** MaskSelection ****************/
+inline MaskSelection::MaskSelection(unsigned int width, unsigned int height)
+  : width(width), height(height), mask((size_t)width * height, 0),
+    count(0)
+{
+  minX = width;
+  minY = height;
+  maxX = -1;
+  maxY = -1;
+}
+
+inline void MaskSelection::add(unsigned int y, unsigned int x0,
+    unsigned int x1) {
+  memset(&mask[(size_t)y * width + x0], 1, x1 - x0);
+  count += x1 - x0;
+  minX = std::min(minX, (wxCoord)x0);
+  maxX = std::max(maxX, (wxCoord)x1 - 1);
+  minY = std::min(minY, (wxCoord)y);
+  maxY = std::max(maxY, (wxCoord)y);
+}
+
+inline bool MaskSelection::isWithinBounds(wxPoint &point) {
+  if (point.x < minX || point.x > maxX
+    || point.y < minY || point.y > maxY)
+    return false;
+  return mask[(size_t)point.y * width + point.x] != 0;
+}
+
+inline void MaskSelection::getBorder(std::vector<wxPoint> &border) {
+  border.clear();
+  if (minX > maxX)
+    return;
+
+  /* Eight pixels at a time are skipped when all are outside,
+   * or all are inside along with their neighbours */
+  const uint64_t ones = 0x0101010101010101ULL;
+  auto word = [](const unsigned char *m) {
+    uint64_t v;
+    memcpy(&v, m, 8);
+    return v;
+  };
+  int x, y;
+  for (y=minY; y <= maxY; y++) {
+    const unsigned char *m = &mask[(size_t)y * width];
+    const unsigned char *up = y > 0 ? m - width : NULL;
+    const unsigned char *down = y + 1 < (int)height ? m + width : NULL;
+    x = minX;
+    while (x <= maxX) {
+      if (x + 8 <= maxX + 1) {
+        uint64_t v = word(m + x);
+        if (v == 0) {
+          x += 8;
+          continue;
+        }
+        if (v == ones && up != NULL && down != NULL
+            && x > 0 && x + 8 < (int)width
+            && m[x - 1] && m[x + 8]
+            && word(up + x) == ones && word(down + x) == ones) {
+          x += 8;
+          continue;
+        }
+      }
+      if (m[x] && (x == 0 || !m[x - 1]
+            || x + 1 == (int)width || !m[x + 1]
+            || up == NULL || !up[x]
+            || down == NULL || !down[x]))
+        border.push_back(wxPoint(x, y));
+      x++;
+    }
+  }
+}
+
 #endif //PAINT_SELECTION_H
@@ -0,0 +1,63 @@
+#ifndef PAINT_SPSC_H
+#define PAINT_SPSC_H
+
+/*
+ * Bounded lock-free single-producer/single-consumer queue.
+ *
+ * One thread may push, one (other) thread may pop. Slots
+ * are reused in place, so items holding heap memory keep
+ * their capacity across laps of the ring. Holds N-1 items.
+ */
+#include <stddef.h>
+#include <atomic>
+#include <utility>
+
+template <typename T, size_t N>
+class SpscQueue {
+  private:
+    T slots[N];
+
+    /* Next slot to pop (consumer owned) and to push
+     * (producer owned), padded onto separate cache lines.
+     * Padding rather than alignas: C++11 new doesn't honour
+     * extended alignment. */
+    char padHead[64];
+    std::atomic<size_t> head;
+    char padTail[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> tail;
+    char padEnd[64 - sizeof(std::atomic<size_t>)];
+
+  public:
+    SpscQueue() : head(0), tail(0) {}
+
+    /* Producer. Moves from 'item'; returns false when full */
+    bool push(T &item) {
+      size_t t = tail.load(std::memory_order_relaxed);
+      size_t next = (t + 1) % N;
+      if (next == head.load(std::memory_order_acquire))
+        return false;
+
+      slots[t] = std::move(item);
+      tail.store(next, std::memory_order_seq_cst);
+      return true;
+    }
+
+    /* Consumer. Returns false when empty */
+    bool pop(T &item) {
+      size_t h = head.load(std::memory_order_relaxed);
+      if (h == tail.load(std::memory_order_acquire))
+        return false;
+
+      std::swap(item, slots[h]);
+      head.store((h + 1) % N, std::memory_order_release);
+      return true;
+    }
+
+    /* Either side; only a hint for the other one */
+    bool empty() const {
+      return head.load(std::memory_order_seq_cst)
+        == tail.load(std::memory_order_seq_cst);
+    }
+};
+
+#endif //PAINT_SPSC_H
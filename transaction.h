@@ -1,19 +1,90 @@
 #ifndef TRANSACTION_H
 #define TRANSACTION_H
 
+#include <stdint.h>
 #include <vector>
 #include "pixel.h"
 
+/*
+ * What a colour replace over a whole area wrote (see
+ * Raster::replaceColor), kept instead of a Pixel for each
+ * change: a bit per pixel of the rectangle at (x, y), set
+ * where the pixel was written, and what those held before,
+ * one colour for all of them or one per set bit in row
+ * order. Bit i of a row is bit i % 64 of its word i / 64.
+ */
+struct ChangeMask {
+  int x = 0;
+  int y = 0;
+  unsigned int width = 0;
+  unsigned int height = 0;
+  size_t words = 0; /* per row */
+  size_t count = 0; /* bits set */
+  std::vector<uint64_t> bits;
+  std::vector<uint32_t> before;
+
+  inline size_t bytes() const {
+    return bits.size() * sizeof(uint64_t) + before.size() * sizeof(uint32_t);
+  }
+
+  /* visit(x, y, before) for each pixel written, in row order */
+  template <typename Visit>
+  inline void forEach(const Visit &visit) const {
+    size_t k = 0, w;
+    unsigned int r;
+    for (r=0; r < height; r++) {
+      const uint64_t *row = &bits[r * words];
+      for (w=0; w < words; w++) {
+        uint64_t m = row[w];
+        while (m != 0) {
+          int b = __builtin_ctzll(m);
+          m &= m - 1;
+          visit(x + (int)(w * 64 + b), y + (int)r,
+              before[before.size() == 1 ? 0 : k++]);
+        }
+      }
+    }
+  }
+
+  inline void clear() {
+    x = y = 0;
+    width = height = 0;
+    words = count = 0;
+    bits.clear();
+    before.clear();
+  }
+};
+
 class Transaction {
   private:
 
   public:
     std::vector<Pixel> pixels;
 
+    /* Old history only: 'pixels' deflated by Raster's idle
+     * packing (see pack.h), which leaves 'pixels' empty.
+     * 'packedCount' is the number of pixels in 'packed'. */
+    std::vector<unsigned char> packed;
+    size_t packedCount = 0;
+
+    inline bool isPacked() const { return !packed.empty(); }
+
+    /* A colour replace keeps its pixels here instead, with
+     * 'pixels' empty */
+    ChangeMask changes;
+
+    inline bool isMasked() const { return changes.count != 0; }
+
+    /* The pixels of 'changes' as a list, into 'out' */
+    inline void expand(std::vector<Pixel> &out) const;
+
     inline Transaction();
     inline void update(Pixel &p); 
     inline void update(Pixel &&p);
     inline void insert(Transaction &txn);
+
+    /* Empty, keeping the storage for the next use */
+    inline void clear();
 };
 
 inline Transaction::Transaction() {}
@@ -31,4 +102,19 @@ inline void Transaction::insert(Transaction &txn) {
     txn.pixels.begin(), txn.pixels.end());
 }
 
+inline void Transaction::expand(std::vector<Pixel> &out) const {
+  out.clear();
+  out.reserve(changes.count);
+  changes.forEach([&out](int x, int y, uint32_t before) {
+    out.push_back(Pixel(Color::fromValue(before), wxPoint(x, y)));
+  });
+}
+
+inline void Transaction::clear() {
+  pixels.clear();
+  packed.clear();
+  packedCount = 0;
+  changes.clear();
+}
+
 #endif /* TRANSACTION_H */
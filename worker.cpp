@@ -0,0 +1,364 @@
+#include <wx/gdicmn.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "worker.h"
+#include "perf.h"
+#include "document.h"
+#include "journal.h"
+#include "image.h"
+#include "format.h"
+
+/************** JobControl ****************/
+JobControl::JobControl() {
+  reset();
+}
+
+void JobControl::reset() {
+  cancelRequested = false;
+  cancelled = false;
+  progress = 0;
+}
+
+bool JobControl::checkpoint(size_t done, size_t total) {
+  if (total > 0)
+    progress = (int)((double)done / total * JOB_PROGRESS_MAX);
+
+  if (cancelRequested) {
+    cancelled = true;
+    return false;
+  }
+  return true;
+}
+
+void JobControl::preview() {
+  uint64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  if (!present || now - lastPreview < JOB_PREVIEW_MS)
+    return;
+  lastPreview = now;
+  present();
+}
+
+/************** Command ****************/
+void Command::run(Raster &raster) {
+  switch (type) {
+    case CMD_MOUSE_DOWN:
+      raster.mouseDown(p);
+      break;
+    case CMD_MOUSE_MOVE:
+      raster.mouseMoved(samples);
+      break;
+    case CMD_MOUSE_UP:
+      raster.mouseReleased(p);
+      break;
+    case CMD_TOOL:
+      raster.toolType = tool;
+      break;
+    case CMD_COLOR:
+      raster.color = color;
+      break;
+    case CMD_THICC:
+      raster.thiccness = thiccness;
+      break;
+    case CMD_BRUSH:
+      raster.antialias = antialias;
+      raster.softness = softness;
+      break;
+    case CMD_TOLERANCE:
+      raster.tolerance = tolerance;
+      raster.distance = distance;
+      break;
+    case CMD_CONTIGUOUS:
+      raster.contiguous = contiguous;
+      break;
+    case CMD_REGION_INDEX:
+      raster.setRegionIndex(regionIndex);
+      break;
+    case CMD_UNDO:
+      raster.undo();
+      break;
+    case CMD_JUMP:
+      raster.jumpTo(step);
+      break;
+    case CMD_SELECT_ALL:
+      raster.selectAll();
+      break;
+    case CMD_DELETE:
+      raster.deleteSelection();
+      break;
+    case CMD_PASTE:
+      raster.paste(&rgb[0], alpha.empty() ? NULL : &alpha[0], M, N);
+      break;
+    case CMD_RESIZE:
+      raster.resize(M, N);
+      break;
+    case CMD_LOAD:
+      document->load(raster);
+      break;
+    case CMD_RECOVER:
+      if (document != NULL)
+        document->load(raster);
+      journal->replay(raster, document ? document->getPath() : NULL);
+      break;
+    case CMD_IMPORT:
+      if (image->load(raster) && journal != NULL)
+        journal->replay(raster, image->getPath());
+      break;
+    case CMD_EXPORT:
+      writer->save(raster);
+      break;
+  }
+}
+
+/* Checkerboard shown through transparent pixels */
+static inline unsigned char checker(int x, int y) {
+  return ((x ^ y) >> PRESENT_CHECKER_SHIFT) & 1 ? 204 : 255;
+}
+
+/*
+ * Copy 'r' of the canvas into a w-pixel wide RGB frame.
+ * This is the only place canvas pixels are converted to
+ * the display format; transparency is composited over
+ * a checkerboard.
+ */
+static void copyRect(char *dst, const uint32_t *src, size_t stride,
+    unsigned int w, const wxRect &r) {
+  const int cell = 1 << PRESENT_CHECKER_SHIFT;
+  int x, y, end;
+  for (y=r.GetTop(); y <= r.GetBottom(); y++) {
+    const uint32_t *in = src + (size_t)y*stride + r.GetLeft();
+    Rgb24::Unit *out = (Rgb24::Unit *)dst + (size_t)y*w;
+
+    /* Lay the checkerboard a cell at a time, then the
+     * canvas over it */
+    for (x=r.GetLeft(); x <= r.GetRight(); x = end) {
+      end = std::min((x | (cell - 1)) + 1, r.GetRight() + 1);
+      unsigned char g = checker(x, y);
+      fillSpan<Rgb24>(out + x, end - x, Color(g, g, g));
+    }
+    blendSpan<Rgba32, Rgb24>(in, out + r.GetLeft(), r.GetWidth());
+  }
+}
+
+/************** Worker ****************/
+Worker::Worker(Raster *raster, Presented presented, Done done) :
+  sleeping(false), packing(false), holdPacking(false), executed(0),
+  presentPending(false) {
+  this->raster = raster;
+  isStale[0] = isStale[1] = false;
+
+  /* Both frames start out complete */
+  publish();
+  publish();
+
+  this->presented = presented;
+  this->done = done;
+  control.setPresent([this]() { publish(); });
+
+  thread = std::thread(&Worker::loop, this);
+}
+
+Worker::~Worker() {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+  }
+  control.cancel();
+  wake.notify_one();
+  thread.join();
+
+  free(frames[0].buffer);
+  free(frames[1].buffer);
+}
+
+void Worker::push(Command &cmd) {
+  /* Whatever sync() was for is over */
+  holdPacking = false;
+  if (cmd.heavy)
+    control.reset();
+
+  /* Full means the raster thread is far behind; it only
+   * ever holds COMMAND_QUEUE_SIZE commands, so wait */
+  while (!queue.push(cmd)) {
+    std::this_thread::yield();
+  }
+  pushed++;
+
+  /* Pairs with the fence in loop(): either the worker
+   * sees the command or we see it going to sleep */
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleeping) {
+    std::lock_guard<std::mutex> guard(lock);
+    wake.notify_one();
+  }
+}
+
+void Worker::reclaim(std::vector<wxPoint> &samples) {
+  if (samples.capacity() == 0)
+    spares.pop(samples);
+}
+
+void Worker::sync() {
+  holdPacking = true;
+  std::unique_lock<std::mutex> guard(lock);
+  idle.wait(guard, [this]() { return executed == pushed && !packing; });
+}
+
+Frame &Worker::lockFront() {
+  frameLock.lock();
+  return frames[front];
+}
+
+void Worker::unlockFront() {
+  presentPending = false;
+  frameLock.unlock();
+}
+
+void Worker::loop() {
+  Command cmd;
+  for (;;) {
+    if (!queue.pop(cmd)) {
+      /*
+       * Drained: show the result, then pack old history a
+       * step at a time until input comes in or sync() wants
+       * the engine to itself, then sleep. Both sides write
+       * their flag before reading the other's.
+       */
+      publish();
+      packing = true;
+      bool packed = false, more = false;
+      while (!holdPacking && queue.empty()
+          && (more = raster->packHistory())) {
+        packed = true;
+      }
+#ifdef __GLIBC__
+      /* The inflated entries were freed in small pieces that
+       * glibc keeps around; give them back once it is done */
+      if (packed && !more)
+        malloc_trim(0);
+#endif
+      if (packed)
+        publish();
+      packing = false;
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        idle.notify_all();
+      }
+
+      sleeping = true;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      std::unique_lock<std::mutex> guard(lock);
+      wake.wait(guard, [this]() { return stopping || !queue.empty(); });
+      sleeping = false;
+      if (stopping)
+        return;
+      continue;
+    }
+
+    PerfTimer work;
+    ToolType tool = raster->toolType;
+    if (cmd.heavy)
+      raster->setJob(&control);
+    cmd.run(*raster);
+    raster->setJob(NULL);
+    timings.push_back(std::make_pair(tool, work.elapsed()));
+
+    /* A full ring of spares just lets this one go */
+    if (cmd.samples.capacity() > 0) {
+      cmd.samples.clear();
+      spares.push(cmd.samples);
+    }
+
+    /* Heavy commands are followed by deferred input
+     * only, so their result is published right away */
+    if (cmd.heavy) {
+      publish();
+      if (done)
+        done(control.wasCancelled());
+    }
+    executed++;
+  }
+}
+
+/*
+ * Bring the back frame up to date and swap it to the
+ * front. Only the rows of the changed region are copied,
+ * plus whatever the back frame missed while it was the
+ * front one.
+ */
+void Worker::publish() {
+  unsigned int width = raster->getWidth();
+  unsigned int height = raster->getHeight();
+  wxRect dirty;
+  bool isDirty = raster->takeDirty(dirty);
+
+  int back = 1 - front;
+  Frame &frame = frames[back];
+  bool resized = frame.width != width || frame.height != height;
+  if (!isDirty && !resized && timings.empty())
+    return;
+
+  if (resized) {
+    frame.buffer = (char *)realloc(frame.buffer, 3*width*height);
+    frame.width = width;
+    frame.height = height;
+    copyRect(frame.buffer, raster->getBuffer(), raster->getStride(), width,
+        wxRect(0, 0, width, height));
+    isStale[back] = false;
+  } else {
+    if (isDirty) {
+      stale[back] = isStale[back] ? stale[back].Union(dirty) : dirty;
+      isStale[back] = true;
+    }
+    if (isStale[back]) {
+      copyRect(frame.buffer, raster->getBuffer(), raster->getStride(), width,
+          stale[back]);
+      isStale[back] = false;
+    }
+  }
+
+  /* The other frame now misses this region */
+  if (isDirty) {
+    stale[front] = isStale[front] ? stale[front].Union(dirty) : dirty;
+    isStale[front] = true;
+  }
+
+  frame.pixelsWritten = raster->getPixelsWritten();
+  frame.undoBytes = raster->getUndoBytes();
+  frame.strokeDuplicates = raster->getStrokeDuplicates();
+  frame.historySize = raster->getHistory().size();
+  frame.historyStep = raster->getHistoryStep();
+  frame.packedBytes = raster->getPackedBytes();
+  frame.packedRawBytes = raster->getPackedRawBytes();
+  frame.regionBytes = raster->getRegionIndex().getBytes();
+  frame.regionTiles = raster->getRegionIndex().getTilesBuilt();
+  frame.regionNs = raster->getRegionIndex().getBuildNs();
+  {
+    std::lock_guard<std::mutex> guard(frameLock);
+
+    /* Carry over what the UI has not consumed yet */
+    Frame &prev = frames[front];
+    frame.isDirty = prev.isDirty || isDirty;
+    if (prev.isDirty && isDirty)
+      frame.dirty = prev.dirty.Union(dirty);
+    else
+      frame.dirty = prev.isDirty ? prev.dirty : dirty;
+    prev.isDirty = false;
+    frame.timings.clear();
+    frame.timings.swap(prev.timings);
+    frame.timings.insert(frame.timings.end(), timings.begin(), timings.end());
+    timings.clear();
+
+    front = back;
+  }
+
+  if (presented && !presentPending.exchange(true))
+    presented();
+}
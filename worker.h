@@ -0,0 +1,261 @@
+#ifndef PAINT_WORKER_H
+#define PAINT_WORKER_H
+
+/*
+ * Raster thread.
+ *
+ * The Worker owns the engine while it runs: the UI thread
+ * never calls into Raster, it only pushes Commands onto a
+ * lock-free SPSC queue and paints the front Frame. The
+ * worker drains the queue, then copies what changed into
+ * the back frame and swaps it to the front, so the UI
+ * always shows the most recently completed state and input
+ * handling never waits for rasterization.
+ *
+ * Heavy commands (fill, select-all, paste, delete, resize,
+ * load, recover, import, export) additionally report
+ * progress and poll for cancellation through a JobControl;
+ * a cancelled command rolls its transaction back and leaves
+ * the buffer as it was. Imports also preview their rows.
+ * Headless, like Raster.
+ */
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "raster.h"
+#include "spsc.h"
+
+/* Progress is reported in thousandths */
+#define JOB_PROGRESS_MAX 1000
+
+/* Partial results of a job are shown at most this often */
+#define JOB_PREVIEW_MS 100
+
+/* Commands in flight between the UI and the raster thread */
+#define COMMAND_QUEUE_SIZE 1024
+
+/* Transparency shows a checkerboard of 8x8 squares */
+#define PRESENT_CHECKER_SHIFT 3
+
+class Document;
+class JournalReader;
+class ImageReader;
+class ImageWriter;
+
+class JobControl {
+  private:
+    std::atomic<bool> cancelRequested;
+    std::atomic<bool> cancelled;
+    std::atomic<int> progress;
+
+    /* Raster thread: publishes a frame, see preview() */
+    std::function<void()> present;
+    uint64_t lastPreview = 0;
+
+  public:
+    JobControl();
+
+    /* Reset before a job starts */
+    void reset();
+
+    /* Any thread */
+    inline void cancel() { cancelRequested = true; }
+    inline bool wasCancelled() const { return cancelled; }
+    inline int getProgress() const { return progress; }
+
+    /*
+     * Called by the running job. Returns false if the job
+     * must stop; the job then rolls back and the control
+     * remembers that it was cancelled.
+     */
+    bool checkpoint(size_t done, size_t total);
+
+    /* Set once by the Worker */
+    inline void setPresent(std::function<void()> present) { this->present = present; }
+
+    /* Called by the running job once part of its result is
+     * in the buffer; shown at most every JOB_PREVIEW_MS */
+    void preview();
+};
+
+enum CommandType
+{
+  CMD_MOUSE_DOWN,
+  CMD_MOUSE_MOVE,
+  CMD_MOUSE_UP,
+  CMD_TOOL,
+  CMD_COLOR,
+  CMD_THICC,
+  CMD_BRUSH,
+  CMD_TOLERANCE,
+  CMD_CONTIGUOUS,
+  CMD_REGION_INDEX,
+  CMD_UNDO,
+  CMD_JUMP,
+  CMD_SELECT_ALL,
+  CMD_DELETE,
+  CMD_PASTE,
+  CMD_RESIZE,
+  CMD_LOAD,
+  CMD_RECOVER,
+  CMD_IMPORT,
+  CMD_EXPORT
+};
+
+/* One Raster call. Only the fields for 'type' are set. */
+struct Command {
+  CommandType type;
+
+  /* Runs as a cancellable job */
+  bool heavy = false;
+
+  wxPoint p;
+  std::vector<wxPoint> samples; /* CMD_MOUSE_MOVE */
+  ToolType tool;
+  Color color;
+  int thiccness;
+  bool antialias; /* CMD_BRUSH */
+  int softness;
+  int tolerance; /* CMD_TOLERANCE */
+  ColorDistance distance;
+  bool contiguous; /* CMD_CONTIGUOUS */
+  bool regionIndex; /* CMD_REGION_INDEX */
+  size_t step; /* CMD_JUMP */
+
+  /* CMD_PASTE image, CMD_RESIZE dimensions */
+  std::vector<unsigned char> rgb;
+  std::vector<unsigned char> alpha;
+  unsigned int M;
+  unsigned int N;
+
+  /* CMD_LOAD, CMD_RECOVER: opened but not loaded yet;
+   * NULL recovers onto a blank canvas */
+  Document *document;
+  JournalReader *journal; /* CMD_RECOVER, CMD_IMPORT */
+
+  /* CMD_IMPORT (plus an optional journal), CMD_EXPORT */
+  ImageReader *image;
+  ImageWriter *writer;
+
+  void run(Raster &raster);
+};
+
+/*
+ * A published copy of the engine buffer, in the display's
+ * RGB (3*width bytes per row). Besides the pixels it
+ * carries what the UI has not consumed yet:
+ * the region changed since the last takeDirty() and the
+ * raster time of every command that went into it.
+ */
+struct Frame {
+  char *buffer = NULL;
+  unsigned int width = 0;
+  unsigned int height = 0;
+
+  uint64_t pixelsWritten = 0;
+  uint64_t undoBytes = 0;
+  uint64_t strokeDuplicates = 0;
+
+  /* History length, and the step the canvas shows */
+  size_t historySize = 0;
+  size_t historyStep = 0;
+  uint64_t packedBytes = 0;
+  uint64_t packedRawBytes = 0;
+
+  /* Region index size, and its tile builds so far */
+  uint64_t regionBytes = 0;
+  uint64_t regionTiles = 0;
+  uint64_t regionNs = 0;
+
+  bool isDirty = false;
+  wxRect dirty;
+  std::vector<std::pair<ToolType, uint64_t> > timings;
+};
+
+class Worker {
+  public:
+    /* Run on the raster thread */
+    typedef std::function<void()> Presented;
+    typedef std::function<void(bool cancelled)> Done;
+
+  private:
+    Raster *raster;
+    Presented presented;
+    Done done;
+
+    std::thread thread;
+    SpscQueue<Command, COMMAND_QUEUE_SIZE> queue;
+
+    /* Emptied CMD_MOUSE_MOVE sample lists on their way back
+     * to the UI thread, which refills them; see reclaim() */
+    SpscQueue<std::vector<wxPoint>, COMMAND_QUEUE_SIZE> spares;
+
+    /* Sleeping/waking only, the queue itself is lock-free */
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    std::atomic<bool> sleeping;
+    bool stopping = false;
+
+    /* Idle history packing, and sync() holding it off so
+     * that the UI can read the engine */
+    std::atomic<bool> packing;
+    std::atomic<bool> holdPacking;
+
+    /* Commands pushed (UI side) and run (raster side) */
+    uint64_t pushed = 0;
+    std::atomic<uint64_t> executed;
+
+    JobControl control;
+
+    /* Double buffer. 'stale' is the region each frame
+     * still misses; guarded by the worker thread alone. */
+    std::mutex frameLock;
+    Frame frames[2];
+    wxRect stale[2];
+    bool isStale[2];
+    int front = 0;
+    std::atomic<bool> presentPending;
+    std::vector<std::pair<ToolType, uint64_t> > timings;
+
+    void loop();
+    void publish();
+
+  public:
+    /* Takes over 'raster' until destroyed */
+    Worker(Raster *raster, Presented presented, Done done);
+
+    /* Cancels the running job, if any, and joins */
+    ~Worker();
+
+    /* UI thread. Moves from 'cmd'. 'done' follows a heavy one */
+    void push(Command &cmd);
+
+    /* UI thread. Gives the empty 'samples' the storage of a
+     * motion command's samples that have been run, if any */
+    void reclaim(std::vector<wxPoint> &samples);
+
+    /* UI thread. Blocks until every pushed command has run;
+     * the engine may then be read until the next push() */
+    void sync();
+
+    inline void cancel() { control.cancel(); }
+    inline int getProgress() const { return control.getProgress(); }
+    inline JobControl *getControl() { return &control; }
+
+    /*
+     * The most recently completed frame. Held locked
+     * until unlockFront(); the UI may consume its dirty
+     * region and timings meanwhile.
+     */
+    Frame &lockFront();
+    void unlockFront();
+};
+
+#endif //PAINT_WORKER_H